@@ -18,26 +18,52 @@
 
 #define PY_SSIZE_T_CLEAN
 #include "platform.h"
+#include "qfactor.h"
 #include "qgate.h"
+#include "qhamiltonian.h"
 #include "qops.h"
+#include "qshard.h"
 #include "qstate.h"
 #include <Python.h>
 #include <complex.h>
 #include <errno.h>
 #include <numpy/arrayobject.h>
 #include <omp.h>
+#include <string.h>
 
 static PyObject *DokiError;
 
+/* NumPy types with the same layout as REAL_TYPE and COMPLEX_TYPE */
+#if PRECISION == 1
+#define NPY_REAL_TYPE NPY_FLOAT
+#define NPY_COMPLEX_TYPE NPY_CFLOAT
+#elif PRECISION == 2
+#define NPY_REAL_TYPE NPY_DOUBLE
+#define NPY_COMPLEX_TYPE NPY_CDOUBLE
+#else
+#define NPY_REAL_TYPE NPY_LONGDOUBLE
+#define NPY_COMPLEX_TYPE NPY_CLONGDOUBLE
+#endif
+
 void doki_registry_destroy(PyObject *capsule);
 
 void doki_gate_destroy(PyObject *capsule);
 
 void doki_funmatrix_destroy(PyObject *capsule);
 
+void doki_shard_destroy(PyObject *capsule);
+
+void doki_factor_destroy(PyObject *capsule);
+
+void doki_hamiltonian_destroy(PyObject *capsule);
+
+void doki_fmprogram_destroy(PyObject *capsule);
+
 static PyObject *doki_registry_new(PyObject *self, PyObject *args);
 
 static PyObject *doki_registry_clone(PyObject *self, PyObject *args);
+static PyObject *doki_registry_share(PyObject *self, PyObject *args);
+static PyObject *doki_registry_attach(PyObject *self, PyObject *args);
 
 static PyObject *doki_registry_del(PyObject *self, PyObject *args);
 
@@ -47,9 +73,16 @@ static PyObject *doki_gate_get(PyObject *self, PyObject *args);
 
 static PyObject *doki_registry_get(PyObject *self, PyObject *args);
 
+static PyObject *doki_registry_get_many(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_topk(PyObject *self, PyObject *args);
+
 void custom_state_init_py(PyObject *values, struct state_vector *state);
 
 void custom_state_init_np(PyArrayObject *values, struct state_vector *state);
+static int get_qubit_ids(PyObject *obj, unsigned int num_qubits,
+			 unsigned int **ids, unsigned int *num_ids,
+			 NATURAL_TYPE *mask, bool *used, const char *name);
 
 static PyObject *doki_registry_new_data(PyObject *self, PyObject *args);
 
@@ -57,14 +90,72 @@ static PyObject *doki_registry_apply(PyObject *self, PyObject *args);
 
 static PyObject *doki_registry_join(PyObject *self, PyObject *args);
 
+static PyObject *doki_registry_join_many(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_try_split(PyObject *self, PyObject *args);
+
 static PyObject *doki_registry_measure(PyObject *self, PyObject *args);
 
 static PyObject *doki_registry_prob(PyObject *self, PyObject *args);
 
+static PyObject *doki_registry_normalize(PyObject *self, PyObject *args);
+static PyObject *doki_registry_sample(PyObject *self, PyObject *args);
+static PyObject *doki_registry_measure_inplace(PyObject *self,
+					       PyObject *args);
+static PyObject *doki_registry_reset(PyObject *self, PyObject *args);
+static PyObject *doki_registry_probabilities(PyObject *self, PyObject *args);
+static PyObject *doki_registry_joint_prob(PyObject *self, PyObject *args);
+static PyObject *doki_registry_expectation_pauli(PyObject *self,
+						 PyObject *args);
+static PyObject *doki_hamiltonian_new(PyObject *self, PyObject *args);
+static PyObject *doki_hamiltonian_info(PyObject *self, PyObject *args);
+static PyObject *doki_registry_expectation_hamiltonian(PyObject *self,
+						       PyObject *args);
+
 static PyObject *doki_registry_density(PyObject *self, PyObject *args);
 
+static PyObject *doki_registry_density_dense(PyObject *self,
+					     PyObject *args);
+
 static PyObject *doki_registry_mem(PyObject *self, PyObject *args);
 
+static PyObject *doki_parallel_config_set(PyObject *self, PyObject *args);
+
+static PyObject *doki_parallel_config_get(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_shard_new(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_shard_apply(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_shard_get(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_shard_prob(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_shard_measure(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_shard_gather(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_shard_layout(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_new(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_apply(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_get(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_prob(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_measure(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_gather(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_layout(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_mem(PyObject *self, PyObject *args);
+
+static PyObject *doki_registry_factor_autosplit(PyObject *self,
+						PyObject *args);
+
 static PyObject *doki_funmatrix_create(PyObject *self, PyObject *args);
 
 static PyObject *doki_funmatrix_identity(PyObject *self, PyObject *args);
@@ -79,6 +170,9 @@ static PyObject *doki_funmatrix_addcontrol(PyObject *self, PyObject *args);
 
 static PyObject *doki_funmatrix_get(PyObject *self, PyObject *args);
 
+static PyObject *doki_funmatrix_materialize(PyObject *self,
+					    PyObject *args);
+
 static PyObject *doki_funmatrix_add(PyObject *self, PyObject *args);
 
 static PyObject *doki_funmatrix_sub(PyObject *self, PyObject *args);
@@ -99,6 +193,8 @@ static PyObject *doki_funmatrix_transpose(PyObject *self, PyObject *args);
 
 static PyObject *doki_funmatrix_dagger(PyObject *self, PyObject *args);
 
+static PyObject *doki_funmatrix_optimize(PyObject *self, PyObject *args);
+
 static PyObject *doki_funmatrix_projection(PyObject *self, PyObject *args);
 
 static PyObject *doki_funmatrix_shape(PyObject *self, PyObject *args);
@@ -111,6 +207,18 @@ static PyObject *doki_funmatrix_apply(PyObject *self, PyObject *args);
 
 static PyObject *doki_funmatrix_mem(PyObject *self, PyObject *args);
 
+static PyObject *doki_funmatrix_cache(PyObject *self, PyObject *args);
+
+static PyObject *doki_funmatrix_cache_stats(PyObject *self, PyObject *args);
+
+static PyObject *doki_funmatrix_compile(PyObject *self, PyObject *args);
+
+static PyObject *doki_funmatrix_eval(PyObject *self, PyObject *args);
+
+static PyObject *doki_funmatrix_csr(PyObject *self, PyObject *args);
+
+static PyObject *doki_funmatrix_coo(PyObject *self, PyObject *args);
+
 static PyMethodDef DokiMethods[] = {
 	{ "gate_new", doki_gate_new, METH_VARARGS, "Create new gate" },
 	{ "gate_get", doki_gate_get, METH_VARARGS,
@@ -121,21 +229,99 @@ static PyMethodDef DokiMethods[] = {
 	  "Create new registry initialized with the specified values" },
 	{ "registry_clone", doki_registry_clone, METH_VARARGS,
 	  "Clone a registry" },
+	{ "registry_share", doki_registry_share, METH_VARARGS,
+	  "Clone a registry into a named shared memory segment" },
+	{ "registry_attach", doki_registry_attach, METH_VARARGS,
+	  "Use a registry stored in a named shared memory segment" },
 	{ "registry_del", doki_registry_del, METH_VARARGS,
 	  "Destroy a registry" },
 	{ "registry_get", doki_registry_get, METH_VARARGS,
 	  "Get value from registry" },
+	{ "registry_get_many", doki_registry_get_many, METH_VARARGS,
+	  "Get several values from registry as a numpy array" },
+	{ "registry_topk", doki_registry_topk, METH_VARARGS,
+	  "Get the most probable basis states of a registry" },
 	{ "registry_apply", doki_registry_apply, METH_VARARGS, "Apply a gate" },
 	{ "registry_join", doki_registry_join, METH_VARARGS,
 	  "Merges two registries" },
+	{ "registry_join_many", doki_registry_join_many, METH_VARARGS,
+	  "Merges several registries in a single pass" },
+	{ "registry_try_split", doki_registry_try_split, METH_VARARGS,
+	  "Splits a registry in two if a subset of qubits is separable" },
 	{ "registry_measure", doki_registry_measure, METH_VARARGS,
 	  "Measures and collapses specified qubits" },
+	{ "registry_measure_inplace", doki_registry_measure_inplace,
+	  METH_VARARGS,
+	  "Measures and collapses specified qubits reusing the registry" },
+	{ "registry_reset", doki_registry_reset, METH_VARARGS,
+	  "Measures specified qubits and resets them to |0>" },
 	{ "registry_prob", doki_registry_prob, METH_VARARGS,
 	  "Get the chances of obtaining 1 when measuring a certain qubit" },
+	{ "registry_normalize", doki_registry_normalize, METH_VARARGS,
+	  "Recompute the normalization constant of a registry" },
+	{ "registry_sample", doki_registry_sample, METH_VARARGS,
+	  "Draw measurement outcomes without collapsing the registry" },
+	{ "registry_probabilities", doki_registry_probabilities, METH_VARARGS,
+	  "Get the chances of every outcome when measuring some qubits" },
+	{ "registry_joint_prob", doki_registry_joint_prob, METH_VARARGS,
+	  "Get the joint distribution of a list of qubits, in that order" },
+	{ "registry_expectation_pauli", doki_registry_expectation_pauli,
+	  METH_VARARGS, "Get the expectation value of a Pauli string" },
+	{ "hamiltonian_new", doki_hamiltonian_new, METH_VARARGS,
+	  "Create a hamiltonian from a list of weighted Pauli strings" },
+	{ "hamiltonian_info", doki_hamiltonian_info, METH_VARARGS,
+	  "Get the number of qubits, terms and X mask groups of a hamiltonian" },
+	{ "registry_expectation_hamiltonian",
+	  doki_registry_expectation_hamiltonian, METH_VARARGS,
+	  "Get the expectation value of a hamiltonian" },
 	{ "registry_density", doki_registry_density, METH_VARARGS,
 	  "Get the density matrix" },
+	{ "registry_density_dense", doki_registry_density_dense,
+	  METH_VARARGS,
+	  "Get the (reduced) density matrix as a numpy array" },
 	{ "registry_mem", doki_registry_mem, METH_VARARGS,
 	  "Get the memory allocated by this registry in bytes" },
+	{ "parallel_config_set", doki_parallel_config_set, METH_VARARGS,
+	  "Set the default number of threads, schedule and serial threshold "
+	  "used by the kernels" },
+	{ "parallel_config_get", doki_parallel_config_get, METH_VARARGS,
+	  "Get the default number of threads, schedule and serial threshold "
+	  "used by the kernels" },
+	{ "registry_shard_new", doki_registry_shard_new, METH_VARARGS,
+	  "Create new registry split in shards" },
+	{ "registry_shard_apply", doki_registry_shard_apply, METH_VARARGS,
+	  "Apply a gate to a sharded registry (in place)" },
+	{ "registry_shard_get", doki_registry_shard_get, METH_VARARGS,
+	  "Get value from sharded registry" },
+	{ "registry_shard_prob", doki_registry_shard_prob, METH_VARARGS,
+	  "Get the chances of obtaining 1 when measuring a certain qubit of a "
+	  "sharded registry" },
+	{ "registry_shard_measure", doki_registry_shard_measure, METH_VARARGS,
+	  "Measure and collapse a qubit of a sharded registry (in place)" },
+	{ "registry_shard_gather", doki_registry_shard_gather, METH_VARARGS,
+	  "Copy a sharded registry into a regular one" },
+	{ "registry_shard_layout", doki_registry_shard_layout, METH_VARARGS,
+	  "Get the number of shards and the physical position of each qubit" },
+	{ "registry_factor_new", doki_registry_factor_new, METH_VARARGS,
+	  "Create a registry stored as independent clusters of qubits" },
+	{ "registry_factor_apply", doki_registry_factor_apply, METH_VARARGS,
+	  "Apply a gate to a factorized registry in place" },
+	{ "registry_factor_get", doki_registry_factor_get, METH_VARARGS,
+	  "Get value from a factorized registry" },
+	{ "registry_factor_prob", doki_registry_factor_prob, METH_VARARGS,
+	  "Get the chances of obtaining 1 when measuring a qubit of a "
+	  "factorized registry" },
+	{ "registry_factor_measure", doki_registry_factor_measure,
+	  METH_VARARGS, "Measure qubits of a factorized registry in place" },
+	{ "registry_factor_gather", doki_registry_factor_gather, METH_VARARGS,
+	  "Copy a factorized registry into a regular one" },
+	{ "registry_factor_layout", doki_registry_factor_layout, METH_VARARGS,
+	  "Get the qubits of each cluster of a factorized registry" },
+	{ "registry_factor_mem", doki_registry_factor_mem, METH_VARARGS,
+	  "Get the bytes used by a factorized registry" },
+	{ "registry_factor_autosplit", doki_registry_factor_autosplit,
+	  METH_VARARGS,
+	  "Set the tolerance used to split clusters after measuring them" },
 	{ "funmatrix_create", doki_funmatrix_create, METH_VARARGS,
 	  "Create a functional matrix from a matrix" },
 	{ "funmatrix_identity", doki_funmatrix_identity, METH_VARARGS,
@@ -155,6 +341,8 @@ static PyMethodDef DokiMethods[] = {
 	  "qubit" },
 	{ "funmatrix_get", doki_funmatrix_get, METH_VARARGS,
 	  "Get a value from a functional matrix" },
+	{ "funmatrix_materialize", doki_funmatrix_materialize, METH_VARARGS,
+	  "Evaluate a block of a functional matrix into a dense array" },
 	{ "funmatrix_add", doki_funmatrix_add, METH_VARARGS,
 	  "Get the addition of two functional matrices" },
 	{ "funmatrix_sub", doki_funmatrix_sub, METH_VARARGS,
@@ -175,6 +363,8 @@ static PyMethodDef DokiMethods[] = {
 	  "Get the transpose of a functional matrix" },
 	{ "funmatrix_dagger", doki_funmatrix_dagger, METH_VARARGS,
 	  "Get the conjugate-transpose of a functional matrix" },
+	{ "funmatrix_optimize", doki_funmatrix_optimize, METH_VARARGS,
+	  "Get an equivalent functional matrix that is cheaper to evaluate" },
 	{ "funmatrix_projection", doki_funmatrix_projection, METH_VARARGS,
 	  "Get the result of a projection over a column vector" },
 	{ "funmatrix_shape", doki_funmatrix_shape, METH_VARARGS,
@@ -188,6 +378,21 @@ static PyMethodDef DokiMethods[] = {
 	  "vector" },
 	{ "funmatrix_mem", doki_funmatrix_mem, METH_VARARGS,
 	  "Get the memory allocated by this FMatrix in bytes" },
+	{ "funmatrix_cache", doki_funmatrix_cache, METH_VARARGS,
+	  "Set the bytes of evaluated blocks cached by each node of a "
+	  "functional matrix" },
+	{ "funmatrix_cache_stats", doki_funmatrix_cache_stats, METH_VARARGS,
+	  "Get the hits, misses, evictions, blocks and bytes of the caches of "
+	  "a functional matrix" },
+	{ "funmatrix_compile", doki_funmatrix_compile, METH_VARARGS,
+	  "Compile a functional matrix into a flat evaluation program" },
+	{ "funmatrix_eval", doki_funmatrix_eval, METH_VARARGS,
+	  "Evaluate a list of elements of a compiled (or plain) functional "
+	  "matrix" },
+	{ "funmatrix_csr", doki_funmatrix_csr, METH_VARARGS,
+	  "Create a sparse functional matrix from CSR arrays" },
+	{ "funmatrix_coo", doki_funmatrix_coo, METH_VARARGS,
+	  "Create a sparse functional matrix from COO triplets" },
 	{ NULL, NULL, 0, NULL } /* Sentinel */
 };
 
@@ -263,8 +468,7 @@ void doki_registry_destroy(PyObject *capsule)
 
 	if (raw_state != NULL) {
 		state = (struct state_vector *)raw_state;
-		state_clear(state);
-		free(state);
+		state_unref(state);
 	}
 }
 
@@ -299,6 +503,16 @@ void doki_funmatrix_destroy(PyObject *capsule)
 	}
 }
 
+void doki_fmprogram_destroy(PyObject *capsule)
+{
+	void *raw_program;
+
+	raw_program = PyCapsule_GetPointer(capsule, "qsimov.doki.fmprogram");
+	if (raw_program != NULL) {
+		fm_program_destroy((struct FMProgram *)raw_program);
+	}
+}
+
 static PyObject *doki_registry_new(PyObject *self, PyObject *args)
 {
 	unsigned int num_qubits;
@@ -378,11 +592,13 @@ static PyObject *doki_registry_clone(PyObject *self, PyObject *args)
 		return NULL;
 	}
 
-	if (num_threads != -1) {
-		omp_set_num_threads(num_threads);
-	}
-
-	result = state_clone(dest, source);
+	state_ref(source);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(source->lock);
+	result = state_clone(dest, source, num_threads);
+	RWLOCK_UNLOCK(source->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(source);
 	if (result == 1) {
 		PyErr_SetString(DokiError, "Failed to allocate state vector");
 		return NULL;
@@ -397,6 +613,130 @@ static PyObject *doki_registry_clone(PyObject *self, PyObject *args)
 			     &doki_registry_destroy);
 }
 
+static void set_shm_error(unsigned char result)
+{
+	switch (result) {
+	case 3:
+		PyErr_SetString(DokiError,
+				"Registry too big to be stored in shared memory");
+		break;
+	case 4:
+		PyErr_SetString(DokiError, "Failed to allocate memory");
+		break;
+	case 8:
+		PyErr_SetString(DokiError,
+				"Shared memory registries are not supported on "
+				"this platform");
+		break;
+	case 9:
+		PyErr_SetString(DokiError,
+				"A shared memory segment with that name already "
+				"exists");
+		break;
+	case 10:
+		PyErr_SetString(DokiError,
+				"Failed to open or map the shared memory segment");
+		break;
+	case 11:
+		PyErr_SetString(DokiError,
+				"The shared memory segment does not hold a "
+				"registry");
+		break;
+	case 12:
+		PyErr_SetString(DokiError,
+				"The shared memory segment is being destroyed");
+		break;
+	default:
+		PyErr_SetString(DokiError,
+				"Unknown error when sharing registry");
+	}
+}
+
+static PyObject *doki_registry_share(PyObject *self, PyObject *args)
+{
+	PyObject *source_capsule;
+	unsigned char result;
+	void *raw_source;
+	const char *name;
+	struct state_vector *source, *dest;
+	int num_threads, debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Osip", &source_capsule, &name,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_share(registry, name, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_source = PyCapsule_GetPointer(source_capsule,
+					  "qsimov.doki.state_vector");
+	if (raw_source == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to source registry");
+		return NULL;
+	}
+	source = (struct state_vector *)raw_source;
+
+	dest = MALLOC_TYPE(1, struct state_vector);
+	if (dest == NULL) {
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state structure");
+		return NULL;
+	}
+
+	state_ref(source);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(source->lock);
+	result = state_share(dest, source, name, num_threads);
+	RWLOCK_UNLOCK(source->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(source);
+	if (result != 0) {
+		free(dest);
+		set_shm_error(result);
+		return NULL;
+	}
+	return PyCapsule_New((void *)dest, "qsimov.doki.state_vector",
+			     &doki_registry_destroy);
+}
+
+static PyObject *doki_registry_attach(PyObject *self, PyObject *args)
+{
+	unsigned char result;
+	const char *name;
+	struct state_vector *dest;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "sp", &name, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_attach(name, verbose)");
+		return NULL;
+	}
+
+	dest = MALLOC_TYPE(1, struct state_vector);
+	if (dest == NULL) {
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state structure");
+		return NULL;
+	}
+
+	result = state_attach(dest, name);
+	if (result != 0) {
+		free(dest);
+		set_shm_error(result);
+		return NULL;
+	}
+	return PyCapsule_New((void *)dest, "qsimov.doki.state_vector",
+			     &doki_registry_destroy);
+}
+
 static PyObject *doki_registry_del(PyObject *self, PyObject *args)
 {
 	PyObject *capsule;
@@ -503,6 +843,10 @@ static PyObject *doki_gate_new(PyObject *self, PyObject *args)
 			gate->matrix[i][j] = val;
 		}
 	}
+	gate->unitary = gate_is_unitary(gate, UNITARY_TOLERANCE);
+	if (debug_enabled && !gate->unitary) {
+		printf("[DEBUG] Gate is not unitary\n");
+	}
 
 	return PyCapsule_New((void *)gate, "qsimov.doki.gate",
 			     &doki_gate_destroy);
@@ -551,6 +895,7 @@ static PyObject *doki_registry_get(PyObject *self, PyObject *args)
 	NATURAL_TYPE id;
 	COMPLEX_TYPE val, aux;
 	REAL_TYPE phase;
+	bool cached;
 	int canonical, debug_enabled;
 
 	if (!PyArg_ParseTuple(args, "OKpp", &capsule, &id, &canonical,
@@ -567,7 +912,25 @@ static PyObject *doki_registry_get(PyObject *self, PyObject *args)
 		return NULL;
 	}
 	state = (struct state_vector *)raw_state;
+	if (id >= state->size) {
+		PyErr_SetString(DokiError, "id out of range");
+		return NULL;
+	}
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
 	val = state_get(state, id);
+	phase = state->fcarg;
+	cached = state->fcarg_init;
+	RWLOCK_UNLOCK(state->lock);
+	if (canonical && !cached) {
+		// Searching the phase fills a cache, so we need exclusive access
+		RWLOCK_WRLOCK(state->lock);
+		phase = get_global_phase(state, -1);
+		RWLOCK_UNLOCK(state->lock);
+	}
+	Py_END_ALLOW_THREADS
+	state_unref(state);
 	/*
 	if (debug_enabled) {
 		printf("[DEBUG] raw = " COMPLEX_STRING_FORMAT "\n",
@@ -579,7 +942,6 @@ static PyObject *doki_registry_get(PyObject *self, PyObject *args)
 	}
 	*/
 	if (canonical) {
-		phase = get_global_phase(state);
 		/*
 		if (debug_enabled) {
 			printf("[DEBUG] phase = " REAL_STRING_FORMAT "\n",
@@ -594,6 +956,233 @@ static PyObject *doki_registry_get(PyObject *self, PyObject *args)
 	return result;
 }
 
+/* Read the start, step and length of a range, checking its bounds */
+static int read_range(PyObject *range, NATURAL_TYPE size, NATURAL_TYPE *start,
+		      NATURAL_TYPE *step, NATURAL_TYPE *count)
+{
+	PyObject *aux;
+	long long first, stride, last;
+	Py_ssize_t length;
+
+	length = PyObject_Length(range);
+	if (length < 0) {
+		return 1;
+	}
+	aux = PyObject_GetAttrString(range, "start");
+	first = aux != NULL ? PyLong_AsLongLong(aux) : -1;
+	Py_XDECREF(aux);
+	aux = PyObject_GetAttrString(range, "step");
+	stride = aux != NULL ? PyLong_AsLongLong(aux) : -1;
+	Py_XDECREF(aux);
+	if (PyErr_Occurred()) {
+		return 1;
+	}
+	*start = (NATURAL_TYPE)first;
+	*step = (NATURAL_TYPE)stride;
+	*count = (NATURAL_TYPE)length;
+	if (length == 0) {
+		return 0;
+	}
+	last = first + (long long)(length - 1) * stride;
+	if (first < 0 || last < 0 || first >= size || last >= size) {
+		PyErr_SetString(DokiError, "id out of range");
+		return 1;
+	}
+
+	return 0;
+}
+
+static PyObject *doki_registry_get_many(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *indices;
+	PyArrayObject *ids, *values;
+	void *raw_state;
+	struct state_vector *state;
+	NATURAL_TYPE *ids_data, start, step, count, k;
+	REAL_TYPE phase;
+	npy_intp dims[1];
+	int canonical, debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OOpip", &capsule, &indices, &canonical,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_get_many(registry, "
+				"indices_or_range, canonical, num_threads, "
+				"verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+
+	ids = NULL;
+	ids_data = NULL;
+	start = 0;
+	step = 0;
+	if (PyRange_Check(indices)) {
+		if (read_range(indices, state->size, &start, &step, &count) !=
+		    0) {
+			return NULL;
+		}
+	} else {
+		ids = (PyArrayObject *)PyArray_FROMANY(indices, NPY_INT64, 1, 1,
+						       NPY_ARRAY_IN_ARRAY);
+		if (ids == NULL) {
+			PyErr_SetString(DokiError,
+					"indices_or_range must be a range or a "
+					"one-dimensional list of integers");
+			return NULL;
+		}
+		ids_data = (NATURAL_TYPE *)PyArray_DATA(ids);
+		count = (NATURAL_TYPE)PyArray_SIZE(ids);
+		for (k = 0; k < count; k++) {
+			if (ids_data[k] < 0 || ids_data[k] >= state->size) {
+				Py_DECREF(ids);
+				PyErr_SetString(DokiError, "id out of range");
+				return NULL;
+			}
+		}
+	}
+
+	dims[0] = (npy_intp)count;
+	values = (PyArrayObject *)PyArray_SimpleNew(1, dims, NPY_COMPLEX_TYPE);
+	if (values == NULL) {
+		Py_XDECREF(ids);
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	if (!canonical || state->fcarg_init) {
+		phase = canonical ? state->fcarg : 0.0;
+		get_amplitudes(state, ids_data, start, step, count, phase,
+			       (COMPLEX_TYPE *)PyArray_DATA(values),
+			       num_threads);
+		RWLOCK_UNLOCK(state->lock);
+	} else {
+		// Searching the phase fills a cache, so we need exclusive access
+		RWLOCK_UNLOCK(state->lock);
+		RWLOCK_WRLOCK(state->lock);
+		phase = get_global_phase(state, num_threads);
+		get_amplitudes(state, ids_data, start, step, count, phase,
+			       (COMPLEX_TYPE *)PyArray_DATA(values),
+			       num_threads);
+		RWLOCK_UNLOCK(state->lock);
+	}
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+	Py_XDECREF(ids);
+
+	return (PyObject *)values;
+}
+
+static PyObject *doki_registry_topk(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *threshold_obj;
+	PyArrayObject *indices, *amplitudes, *probs;
+	void *raw_state;
+	struct state_vector *state;
+	struct basis_entry *entries;
+	NATURAL_TYPE i, num_entries, count, *indices_data;
+	COMPLEX_TYPE *amplitudes_data;
+	REAL_TYPE threshold, *probs_data;
+	long long k;
+	npy_intp dims[1];
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OLOip", &capsule, &k, &threshold_obj,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_topk(registry, k, threshold, "
+				"num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	if (k < -1) {
+		PyErr_SetString(DokiError,
+				"k must be at least 0 (or -1 for no limit)");
+		return NULL;
+	}
+
+	threshold = -1;
+	if (threshold_obj != Py_None) {
+		threshold = PyFloat_AsDouble(threshold_obj);
+		if (PyErr_Occurred() || threshold < 0) {
+			PyErr_Clear();
+			PyErr_SetString(DokiError,
+					"threshold must be None or a "
+					"non-negative number");
+			return NULL;
+		}
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	exit_code = top_k(state, k, threshold, &entries, &num_entries, &count,
+			  num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+
+	if (exit_code != 0) {
+		PyErr_SetString(DokiError, "Failed to allocate memory");
+		return NULL;
+	}
+
+	dims[0] = (npy_intp)num_entries;
+	indices = (PyArrayObject *)PyArray_SimpleNew(1, dims, NPY_INT64);
+	amplitudes =
+		(PyArrayObject *)PyArray_SimpleNew(1, dims, NPY_COMPLEX_TYPE);
+	probs = (PyArrayObject *)PyArray_SimpleNew(1, dims, NPY_REAL_TYPE);
+	if (indices == NULL || amplitudes == NULL || probs == NULL) {
+		free(entries);
+		Py_XDECREF(indices);
+		Py_XDECREF(amplitudes);
+		Py_XDECREF(probs);
+		return NULL;
+	}
+	indices_data = (NATURAL_TYPE *)PyArray_DATA(indices);
+	amplitudes_data = (COMPLEX_TYPE *)PyArray_DATA(amplitudes);
+	probs_data = (REAL_TYPE *)PyArray_DATA(probs);
+	for (i = 0; i < num_entries; i++) {
+		indices_data[i] = entries[i].index;
+		amplitudes_data[i] = entries[i].amplitude;
+		probs_data[i] = entries[i].prob;
+	}
+	free(entries);
+
+	return Py_BuildValue("(NNNL)", indices, amplitudes, probs,
+			     (long long)count);
+}
+
 void custom_state_init_py(PyObject *values, struct state_vector *state)
 {
 	NATURAL_TYPE i;
@@ -893,14 +1482,24 @@ static PyObject *doki_registry_apply(PyObject *self, PyObject *args)
 				"Failed to allocate new state structure");
 		return NULL;
 	}
-	if (num_threads != -1) {
-		omp_set_num_threads(num_threads);
-	}
 	// printf("[DEBUG] nums: %u, %u, %u\n", num_targets, num_controls,
 	// num_anticontrols);
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
 	exit_code = apply_gate(state, gate, targets, num_targets, controls,
 			       num_controls, anticontrols, num_anticontrols,
-			       new_state);
+			       new_state, num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+	free(targets);
+	if (num_controls > 0) {
+		free(controls);
+	}
+	if (num_anticontrols > 0) {
+		free(anticontrols);
+	}
 
 	if (exit_code == 1) {
 		PyErr_SetString(DokiError,
@@ -926,13 +1525,6 @@ static PyObject *doki_registry_apply(PyObject *self, PyObject *args)
 	}
 
 	if (exit_code > 0) {
-		free(targets);
-		if (num_controls > 0) {
-			free(controls);
-		}
-		if (num_anticontrols > 0) {
-			free(anticontrols);
-		}
 		return NULL;
 	}
 
@@ -944,7 +1536,7 @@ static PyObject *doki_registry_join(PyObject *self, PyObject *args)
 {
 	PyObject *capsule1, *capsule2;
 	void *raw_state1, *raw_state2;
-	struct state_vector *state1, *state2, *result;
+	struct state_vector *state1, *state2, *first, *second, *result;
 	unsigned char exit_code;
 	int num_threads, debug_enabled;
 
@@ -982,10 +1574,24 @@ static PyObject *doki_registry_join(PyObject *self, PyObject *args)
 				"Failed to allocate new state structure");
 		return NULL;
 	}
-	if (num_threads != -1) {
-		omp_set_num_threads(num_threads);
-	}
-	exit_code = join(result, state1, state2);
+	state_ref(state1);
+	state_ref(state2);
+	// Always lock in the same order to avoid deadlocks with waiting writers
+	first = state1 < state2 ? state1 : state2;
+	second = state1 < state2 ? state2 : state1;
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(first->lock);
+	if (second != first) {
+		RWLOCK_RDLOCK(second->lock);
+	}
+	exit_code = join(result, state1, state2, num_threads);
+	if (second != first) {
+		RWLOCK_UNLOCK(second->lock);
+	}
+	RWLOCK_UNLOCK(first->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state2);
+	state_unref(state1);
 	if (exit_code != 0) {
 		switch (exit_code) {
 		case 1:
@@ -1020,24 +1626,33 @@ static PyObject *doki_registry_join(PyObject *self, PyObject *args)
 			     &doki_registry_destroy);
 }
 
-static PyObject *doki_registry_measure(PyObject *self, PyObject *args)
+static int _state_address_cmp(const void *a, const void *b)
+{
+	uintptr_t pa, pb;
+
+	pa = (uintptr_t)(*(struct state_vector *const *)a);
+	pb = (uintptr_t)(*(struct state_vector *const *)b);
+
+	return (pa > pb) - (pa < pb);
+}
+
+static PyObject *doki_registry_try_split(PyObject *self, PyObject *args)
 {
-	PyObject *capsule, *py_measured_val, *result, *new_capsule, *roll_list;
-	Py_ssize_t roll_id;
+	PyObject *capsule, *subset, *capsule_a, *capsule_b;
 	void *raw_state;
-	struct state_vector *state, *new_state, *aux;
+	struct state_vector *state, *a, *b;
 	NATURAL_TYPE mask;
-	REAL_TYPE roll;
-	unsigned int i, curr_id, initial_num_qubits, measured_qty;
-	_Bool measure_id, measured_val;
+	unsigned int *ids, num_ids;
+	double tolerance;
 	unsigned char exit_code;
+	bool separable;
 	int debug_enabled, num_threads;
 
-	if (!PyArg_ParseTuple(args, "OKOip", &capsule, &mask, &roll_list,
+	if (!PyArg_ParseTuple(args, "OOdip", &capsule, &subset, &tolerance,
 			      &num_threads, &debug_enabled)) {
 		PyErr_SetString(DokiError,
-				"Syntax: registry_measure(registry, mask, "
-				"roll_list, num_threads, verbose)");
+				"Syntax: registry_try_split(registry, "
+				"qubit_subset, tol, num_threads, verbose)");
 		return NULL;
 	}
 
@@ -1047,128 +1662,2206 @@ static PyObject *doki_registry_measure(PyObject *self, PyObject *args)
 			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
 		return NULL;
 	}
+	if (tolerance < 0) {
+		PyErr_SetString(DokiError, "tol can't be negative");
+		return NULL;
+	}
 
 	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
 	if (raw_state == NULL) {
 		PyErr_SetString(DokiError, "NULL pointer to registry");
 		return NULL;
 	}
-	if (!PyList_Check(roll_list)) {
-		PyErr_SetString(
-			DokiError,
-			"roll_list must be a list of real numbers in [0, 1)!");
+	state = (struct state_vector *)raw_state;
+
+	mask = 0;
+	if (get_qubit_ids(subset, state->num_qubits, &ids, &num_ids, &mask,
+			  NULL, "qubit_subset") != 0) {
+		return NULL;
+	}
+	free(ids);
+	if (mask == 0 || mask == state->size - 1) {
+		PyErr_SetString(DokiError,
+				"qubit_subset must leave qubits on both sides");
 		return NULL;
 	}
-	state = (struct state_vector *)raw_state;
-	initial_num_qubits = state->num_qubits;
-	result = PyList_New(initial_num_qubits);
 
-	new_state = MALLOC_TYPE(1, struct state_vector);
-	if (new_state == NULL) {
+	a = MALLOC_TYPE(1, struct state_vector);
+	b = MALLOC_TYPE(1, struct state_vector);
+	if (a == NULL || b == NULL) {
+		free(a);
+		free(b);
 		PyErr_SetString(DokiError,
 				"Failed to allocate new state structure");
 		return NULL;
 	}
 
-	if (num_threads != -1) {
-		omp_set_num_threads(num_threads);
-	}
-	exit_code = state_clone(new_state, state);
-	if (exit_code == 1) {
-		PyErr_SetString(DokiError, "Failed to allocate state vector");
-		return NULL;
-	} else if (exit_code == 2) {
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	exit_code = split(state, mask, (REAL_TYPE)tolerance, a, b, &separable,
+			  num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+
+	if (exit_code != 0 || !separable) {
+		free(a);
+		free(b);
+		switch (exit_code) {
+		case 0:
+			Py_RETURN_NONE;
+		case 1:
+			PyErr_SetString(DokiError,
+					"Failed to allocate new state vector");
+			break;
+		case 2:
+			PyErr_SetString(DokiError,
+					"Failed to allocate new state chunk");
+			break;
+		default:
+			PyErr_SetString(DokiError,
+					"Unknown error when splitting state");
+		}
+		return NULL;
+	}
+
+	capsule_a = PyCapsule_New((void *)a, "qsimov.doki.state_vector",
+				  &doki_registry_destroy);
+	capsule_b = PyCapsule_New((void *)b, "qsimov.doki.state_vector",
+				  &doki_registry_destroy);
+
+	return Py_BuildValue("(NN)", capsule_a, capsule_b);
+}
+
+static PyObject *doki_registry_join_many(PyObject *self, PyObject *args)
+{
+	PyObject *capsules, *capsule;
+	void *raw_state;
+	struct state_vector **states, **locked, *result;
+	Py_ssize_t num_states, k, num_locked;
+	unsigned char exit_code;
+	int num_threads, debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Oip", &capsules, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_join_many(registries, "
+				"num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	if (!PyList_Check(capsules) || PyList_GET_SIZE(capsules) == 0) {
+		PyErr_SetString(DokiError,
+				"registries must be a non empty list");
+		return NULL;
+	}
+	num_states = PyList_GET_SIZE(capsules);
+	states = MALLOC_TYPE(2 * num_states, struct state_vector *);
+	result = MALLOC_TYPE(1, struct state_vector);
+	if (states == NULL || result == NULL) {
+		free(states);
+		free(result);
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state structure");
+		return NULL;
+	}
+	locked = states + num_states;
+	for (k = 0; k < num_states; k++) {
+		capsule = PyList_GET_ITEM(capsules, k);
+		raw_state = PyCapsule_GetPointer(capsule,
+						 "qsimov.doki.state_vector");
+		if (raw_state == NULL) {
+			free(states);
+			free(result);
+			PyErr_SetString(DokiError, "NULL pointer to registry");
+			return NULL;
+		}
+		states[k] = (struct state_vector *)raw_state;
+		locked[k] = states[k];
+	}
+	// Always lock in the same order to avoid deadlocks with waiting writers
+	qsort(locked, num_states, sizeof(struct state_vector *),
+	      _state_address_cmp);
+	num_locked = 1;
+	for (k = 1; k < num_states; k++) {
+		if (locked[k] != locked[num_locked - 1]) {
+			locked[num_locked++] = locked[k];
+		}
+	}
+	for (k = 0; k < num_locked; k++) {
+		state_ref(locked[k]);
+	}
+	Py_BEGIN_ALLOW_THREADS
+	for (k = 0; k < num_locked; k++) {
+		RWLOCK_RDLOCK(locked[k]->lock);
+	}
+	exit_code = join_many(result, states, num_states, num_threads);
+	for (k = num_locked; k-- > 0;) {
+		RWLOCK_UNLOCK(locked[k]->lock);
+	}
+	Py_END_ALLOW_THREADS
+	for (k = 0; k < num_locked; k++) {
+		state_unref(locked[k]);
+	}
+	free(states);
+	if (exit_code != 0) {
+		free(result);
+		switch (exit_code) {
+		case 1:
+			PyErr_SetString(DokiError,
+					"Failed to allocate new state vector");
+			break;
+		case 2:
+			PyErr_SetString(DokiError,
+					"Failed to allocate new state chunk");
+			break;
+		case 3:
+			PyErr_SetString(DokiError, "Too many qubits");
+			break;
+		default:
+			PyErr_SetString(DokiError,
+					"Unknown error when joining states");
+		}
+		return NULL;
+	}
+
+	return PyCapsule_New((void *)result, "qsimov.doki.state_vector",
+			     &doki_registry_destroy);
+}
+
+/* Read one roll per measured qubit, from the highest to the lowest */
+static REAL_TYPE *read_rolls(PyObject *roll_list, unsigned int count)
+{
+	REAL_TYPE *rolls;
+	unsigned int i;
+
+	if (!PyList_Check(roll_list)) {
+		PyErr_SetString(
+			DokiError,
+			"roll_list must be a list of real numbers in [0, 1)!");
+		return NULL;
+	}
+	rolls = MALLOC_TYPE(count + 1, REAL_TYPE);
+	if (rolls == NULL) {
+		PyErr_SetString(DokiError, "Failed to allocate roll array");
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		rolls[i] = PyFloat_AsDouble(PyList_GetItem(roll_list, i));
+		if (rolls[i] < 0 || rolls[i] >= 1) {
+			free(rolls);
+			PyErr_SetString(DokiError,
+					"roll not in interval [0, 1)!");
+			return NULL;
+		}
+	}
+
+	return rolls;
+}
+
+/* List with the result of each qubit (None if not measured), from the
+ * highest qubit to the lowest */
+static PyObject *outcome_list(unsigned int num_qubits, NATURAL_TYPE mask,
+			      NATURAL_TYPE outcome)
+{
+	PyObject *result, *py_measured_val;
+	unsigned int i, curr_id, bit;
+
+	result = PyList_New(num_qubits);
+	if (result == NULL) {
+		return NULL;
+	}
+	bit = POPCOUNT(mask);
+	for (i = 0; i < num_qubits; i++) {
+		curr_id = num_qubits - i - 1;
+		py_measured_val = Py_None;
+		if (mask & (NATURAL_ONE << curr_id)) {
+			bit--;
+			py_measured_val = (outcome >> bit) & 1 ? Py_True :
+								 Py_False;
+		}
+		Py_INCREF(py_measured_val);
+		PyList_SET_ITEM(result, i, py_measured_val);
+	}
+
+	return result;
+}
+
+static PyObject *doki_registry_measure(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *result, *new_capsule, *roll_list;
+	void *raw_state;
+	struct state_vector *state, *new_state;
+	NATURAL_TYPE mask, outcome;
+	REAL_TYPE *rolls;
+	unsigned int initial_num_qubits, measured_qty;
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OKOip", &capsule, &mask, &roll_list,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_measure(registry, mask, "
+				"roll_list, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+	initial_num_qubits = state->num_qubits;
+	mask &= state->size - 1;
+	measured_qty = POPCOUNT(mask);
+
+	rolls = read_rolls(roll_list, measured_qty);
+	if (rolls == NULL) {
+		return NULL;
+	}
+
+	new_state = MALLOC_TYPE(1, struct state_vector);
+	if (new_state == NULL) {
+		free(rolls);
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state structure");
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	exit_code = measure_mask(state, mask, rolls, &outcome, new_state,
+				 num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+	free(rolls);
+
+	if (exit_code == 0 && new_state->num_qubits > 0 &&
+	    new_state->norm_const == 0.0) {
+		state_clear(new_state);
+		exit_code = 22;
+	}
+	if (exit_code != 0) {
+		free(new_state);
+		switch (exit_code) {
+		case 1:
+			PyErr_SetString(DokiError,
+					"Failed to allocate state vector");
+			break;
+		case 2:
+			PyErr_SetString(DokiError,
+					"Failed to allocate state chunk");
+			break;
+		case 4:
+			PyErr_SetString(DokiError,
+					"Failed to allocate probability array");
+			break;
+		case 22:
+			PyErr_SetString(
+				DokiError,
+				"New normalization constant is 0. Please report "
+				"this error with the steps to reproduce it.");
+			break;
+		default:
+			PyErr_SetString(DokiError,
+					"Unknown error while collapsing state");
+		}
+		return NULL;
+	}
+
+	result = outcome_list(initial_num_qubits, mask, outcome);
+
+	if (initial_num_qubits - measured_qty > 0) {
+		new_capsule = PyCapsule_New((void *)new_state,
+					    "qsimov.doki.state_vector",
+					    &doki_registry_destroy);
+	} else {
+		free(new_state);
+		new_capsule = Py_None;
+	}
+	return PyTuple_Pack(2, new_capsule, result);
+}
+
+static PyObject *doki_registry_measure_inplace(PyObject *self,
+					       PyObject *args)
+{
+	PyObject *capsule, *roll_list;
+	void *raw_state;
+	struct state_vector *state;
+	NATURAL_TYPE mask, outcome;
+	REAL_TYPE *rolls;
+	unsigned int initial_num_qubits;
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OKOip", &capsule, &mask, &roll_list,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_measure_inplace(registry, "
+				"mask, roll_list, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+	if (state->shared != NULL) {
+		PyErr_SetString(DokiError,
+				"Shared memory registries can not be modified");
+		return NULL;
+	}
+	initial_num_qubits = state->num_qubits;
+	mask &= state->size - 1;
+
+	rolls = read_rolls(roll_list, POPCOUNT(mask));
+	if (rolls == NULL) {
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_WRLOCK(state->lock);
+	exit_code = measure_mask_inplace(state, mask, rolls, &outcome,
+					 num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+	free(rolls);
+
+	switch (exit_code) {
+	case 0:
+		return outcome_list(initial_num_qubits, mask, outcome);
+	case 4:
+		PyErr_SetString(DokiError, "Failed to allocate memory");
+		break;
+	case 5:
+		PyErr_SetString(DokiError,
+				"New normalization constant is 0. Please report "
+				"this error with the steps to reproduce it.");
+		break;
+	default:
+		PyErr_SetString(DokiError,
+				"Unknown error while collapsing state");
+	}
+	return NULL;
+}
+
+static PyObject *doki_registry_reset(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *roll_list;
+	void *raw_state;
+	struct state_vector *state;
+	NATURAL_TYPE mask, outcome;
+	REAL_TYPE *rolls;
+	unsigned int num_qubits;
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OKOip", &capsule, &mask, &roll_list,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_reset(registry, mask, "
+				"roll_list, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+	if (state->shared != NULL) {
+		PyErr_SetString(DokiError,
+				"Shared memory registries can not be modified");
+		return NULL;
+	}
+	num_qubits = state->num_qubits;
+	mask &= state->size - 1;
+
+	rolls = read_rolls(roll_list, POPCOUNT(mask));
+	if (rolls == NULL) {
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_WRLOCK(state->lock);
+	exit_code = reset(state, mask, rolls, &outcome, num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+	free(rolls);
+
+	switch (exit_code) {
+	case 0:
+		return outcome_list(num_qubits, mask, outcome);
+	case 4:
+		PyErr_SetString(DokiError, "Failed to allocate memory");
+		break;
+	case 5:
+		PyErr_SetString(DokiError,
+				"New normalization constant is 0. Please report "
+				"this error with the steps to reproduce it.");
+		break;
+	default:
+		PyErr_SetString(DokiError,
+				"Unknown error while resetting state");
+	}
+	return NULL;
+}
+
+static PyObject *doki_registry_prob(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	void *raw_state;
+	struct state_vector *state;
+	unsigned int id;
+	REAL_TYPE prob;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OIip", &capsule, &id, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_prob(registry, qubit_id, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+	if (id >= state->num_qubits) {
+		PyErr_SetString(DokiError, "qubit_id out of range");
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	prob = probability(state, id, num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+
+	return PyFloat_FromDouble(prob);
+}
+
+static PyObject *doki_registry_normalize(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	void *raw_state;
+	struct state_vector *state;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "Oip", &capsule, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_normalize(registry, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+
+	state = (struct state_vector *)raw_state;
+	if (state->shared != NULL) {
+		PyErr_SetString(DokiError,
+				"Shared memory registries can not be modified");
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_WRLOCK(state->lock);
+	state_renormalize(state, num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+
+	Py_RETURN_NONE;
+}
+
+/* Outcomes are written straight into int64 arrays */
+_Static_assert(sizeof(NATURAL_TYPE) == sizeof(npy_int64),
+	       "NATURAL_TYPE must be a 64 bit integer");
+
+static PyObject *doki_registry_sample(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	PyArrayObject *outcomes;
+	void *raw_state;
+	struct state_vector *state;
+	NATURAL_TYPE mask;
+	long long shots;
+	unsigned long long seed;
+	npy_intp dims[1];
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OKLKip", &capsule, &mask, &shots, &seed,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_sample(registry, mask, shots, "
+				"seed, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	if (shots < 0) {
+		PyErr_SetString(DokiError, "shots can not be negative");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+	if (mask & ~(state->size - 1)) {
+		PyErr_SetString(DokiError, "mask has qubits out of range");
+		return NULL;
+	}
+
+	dims[0] = (npy_intp)shots;
+	outcomes = (PyArrayObject *)PyArray_SimpleNew(1, dims, NPY_INT64);
+	if (outcomes == NULL) {
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	exit_code = sample(state, mask, (NATURAL_TYPE)shots, (uint64_t)seed,
+			   (NATURAL_TYPE *)PyArray_DATA(outcomes), num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+
+	if (exit_code != 0) {
+		Py_DECREF(outcomes);
+		if (exit_code == 4) {
+			PyErr_SetString(DokiError,
+					"Failed to allocate probability array");
+		} else {
+			PyErr_SetString(DokiError,
+					"Unknown error while sampling");
+		}
+		return NULL;
+	}
+
+	return (PyObject *)outcomes;
+}
+
+static PyObject *doki_registry_probabilities(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *subset;
+	PyArrayObject *probs;
+	void *raw_state;
+	struct state_vector *state;
+	NATURAL_TYPE mask;
+	unsigned int *ids, num_ids;
+	npy_intp dims[1];
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OOip", &capsule, &subset, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_probabilities(registry, "
+				"qubit_subset, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+
+	mask = 0;
+	if (get_qubit_ids(subset, state->num_qubits, &ids, &num_ids, &mask,
+			  NULL, "qubit_subset") != 0) {
+		return NULL;
+	}
+	free(ids);
+	if (subset == Py_None) {
+		mask = state->size - 1;
+	}
+
+	dims[0] = (npy_intp)(NATURAL_ONE << POPCOUNT(mask));
+	probs = (PyArrayObject *)PyArray_SimpleNew(1, dims, NPY_REAL_TYPE);
+	if (probs == NULL) {
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	exit_code = marginal_probabilities(state, mask,
+					   (REAL_TYPE *)PyArray_DATA(probs),
+					   num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+
+	if (exit_code != 0) {
+		Py_DECREF(probs);
+		PyErr_SetString(DokiError, "Failed to allocate histograms");
+		return NULL;
+	}
+
+	return (PyObject *)probs;
+}
+
+static PyObject *doki_registry_joint_prob(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *qubits;
+	PyArrayObject *probs;
+	void *raw_state;
+	struct state_vector *state;
+	NATURAL_TYPE mask;
+	unsigned int *ids, num_ids;
+	npy_intp dims[1];
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OOip", &capsule, &qubits, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_joint_prob(registry, qubits, "
+				"num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+
+	if (!PyList_Check(qubits)) {
+		PyErr_SetString(DokiError, "qubits must be a list");
+		return NULL;
+	}
+	mask = 0;
+	if (get_qubit_ids(qubits, state->num_qubits, &ids, &num_ids, &mask,
+			  NULL, "qubits") != 0) {
+		return NULL;
+	}
+
+	dims[0] = (npy_intp)(NATURAL_ONE << num_ids);
+	probs = (PyArrayObject *)PyArray_SimpleNew(1, dims, NPY_REAL_TYPE);
+	if (probs == NULL) {
+		free(ids);
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	exit_code = joint_probabilities(state, ids, num_ids,
+					(REAL_TYPE *)PyArray_DATA(probs),
+					num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+	free(ids);
+
+	if (exit_code != 0) {
+		Py_DECREF(probs);
+		PyErr_SetString(DokiError, "Failed to allocate histograms");
+		return NULL;
+	}
+
+	return (PyObject *)probs;
+}
+
+static PyObject *doki_registry_expectation_pauli(PyObject *self,
+						 PyObject *args)
+{
+	PyObject *capsule;
+	void *raw_state;
+	struct state_vector *state;
+	NATURAL_TYPE x_mask, z_mask;
+	Py_complex coeff;
+	COMPLEX_TYPE value;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OKKDip", &capsule, &x_mask, &z_mask,
+			      &coeff, &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_expectation_pauli(registry, "
+				"x_mask, z_mask, coeff, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+	if ((x_mask | z_mask) & ~(state->size - 1)) {
+		PyErr_SetString(DokiError, "masks have qubits out of range");
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	value = pauli_expectation(state, x_mask, z_mask, num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+
+	value = COMPLEX_MULT(value, COMPLEX_INIT(coeff.real, coeff.imag));
+	return PyComplex_FromDoubles(RE(value), IM(value));
+}
+
+void doki_hamiltonian_destroy(PyObject *capsule)
+{
+	struct hamiltonian *ham;
+	void *raw_ham;
+
+	raw_ham = PyCapsule_GetPointer(capsule, "qsimov.doki.hamiltonian");
+	if (raw_ham != NULL) {
+		ham = (struct hamiltonian *)raw_ham;
+		hamiltonian_clear(ham);
+		free(ham);
+	}
+}
+
+static PyObject *doki_hamiltonian_new(PyObject *self, PyObject *args)
+{
+	PyObject *list, *item;
+	struct hamiltonian *ham;
+	NATURAL_TYPE *x_masks, *z_masks, i, num_terms;
+	COMPLEX_TYPE *coeffs;
+	Py_complex coeff;
+	unsigned long long x_mask, z_mask;
+	unsigned int num_qubits;
+	unsigned char exit_code;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "IOp", &num_qubits, &list,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: hamiltonian_new(num_qubits, terms, "
+				"verbose)");
+		return NULL;
+	}
+	if (!PyList_Check(list)) {
+		PyErr_SetString(DokiError,
+				"terms must be a list of (x_mask, z_mask, "
+				"coeff) tuples");
+		return NULL;
+	}
+
+	num_terms = PyList_GET_SIZE(list);
+	x_masks = MALLOC_TYPE(num_terms + 1, NATURAL_TYPE);
+	z_masks = MALLOC_TYPE(num_terms + 1, NATURAL_TYPE);
+	coeffs = MALLOC_TYPE(num_terms + 1, COMPLEX_TYPE);
+	ham = MALLOC_TYPE(1, struct hamiltonian);
+	if (x_masks == NULL || z_masks == NULL || coeffs == NULL ||
+	    ham == NULL) {
+		free(x_masks);
+		free(z_masks);
+		free(coeffs);
+		free(ham);
+		PyErr_SetString(DokiError, "Failed to allocate hamiltonian");
+		return NULL;
+	}
+	for (i = 0; i < num_terms; i++) {
+		item = PyList_GET_ITEM(list, i);
+		if (!PyTuple_Check(item) ||
+		    !PyArg_ParseTuple(item, "KKD", &x_mask, &z_mask, &coeff)) {
+			break;
+		}
+		x_masks[i] = (NATURAL_TYPE)x_mask;
+		z_masks[i] = (NATURAL_TYPE)z_mask;
+		coeffs[i] = COMPLEX_INIT(coeff.real, coeff.imag);
+	}
+	exit_code = i < num_terms ? 6 :
+				    hamiltonian_init(ham, num_qubits, num_terms,
+						     x_masks, z_masks, coeffs);
+	free(x_masks);
+	free(z_masks);
+	free(coeffs);
+	if (exit_code != 0) {
+		free(ham);
+		PyErr_Clear();
+		switch (exit_code) {
+		case 4:
+			PyErr_SetString(DokiError,
+					"Failed to allocate hamiltonian");
+			break;
+		case 5:
+			PyErr_SetString(DokiError,
+					"masks have qubits out of range");
+			break;
+		default:
+			PyErr_SetString(DokiError,
+					"terms must be a list of (x_mask, "
+					"z_mask, coeff) tuples");
+		}
+		return NULL;
+	}
+	if (debug_enabled) {
+		printf("[DEBUG] %lld terms in %lld groups\n",
+		       (long long)ham->num_terms, (long long)ham->num_groups);
+	}
+
+	return PyCapsule_New((void *)ham, "qsimov.doki.hamiltonian",
+			     &doki_hamiltonian_destroy);
+}
+
+static PyObject *doki_hamiltonian_info(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	void *raw_ham;
+	struct hamiltonian *ham;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Op", &capsule, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: hamiltonian_info(hamiltonian, verbose)");
+		return NULL;
+	}
+
+	raw_ham = PyCapsule_GetPointer(capsule, "qsimov.doki.hamiltonian");
+	if (raw_ham == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to hamiltonian");
+		return NULL;
+	}
+	ham = (struct hamiltonian *)raw_ham;
+
+	return Py_BuildValue("ILL", ham->num_qubits,
+			     (long long)ham->num_terms,
+			     (long long)ham->num_groups);
+}
+
+static PyObject *doki_registry_expectation_hamiltonian(PyObject *self,
+						       PyObject *args)
+{
+	PyObject *state_capsule, *ham_capsule, *result;
+	PyArrayObject *values;
+	void *raw_state, *raw_ham;
+	struct state_vector *state;
+	struct hamiltonian *ham;
+	COMPLEX_TYPE energy, *values_data;
+	npy_intp dims[1];
+	unsigned char exit_code;
+	int per_term, debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OOpip", &state_capsule, &ham_capsule,
+			      &per_term, &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_expectation_hamiltonian("
+				"registry, hamiltonian, per_term, num_threads, "
+				"verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(state_capsule,
+					 "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+	raw_ham = PyCapsule_GetPointer(ham_capsule, "qsimov.doki.hamiltonian");
+	if (raw_ham == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to hamiltonian");
+		return NULL;
+	}
+	ham = (struct hamiltonian *)raw_ham;
+	if (ham->num_qubits != state->num_qubits) {
+		PyErr_SetString(DokiError,
+				"The hamiltonian and the registry have a "
+				"different number of qubits");
+		return NULL;
+	}
+
+	values = NULL;
+	values_data = NULL;
+	if (per_term) {
+		dims[0] = (npy_intp)ham->num_terms;
+		values = (PyArrayObject *)PyArray_SimpleNew(1, dims,
+							    NPY_COMPLEX_TYPE);
+		if (values == NULL) {
+			return NULL;
+		}
+		values_data = (COMPLEX_TYPE *)PyArray_DATA(values);
+	}
+
+	// The capsule keeps the hamiltonian alive while we hold a reference
+	Py_INCREF(ham_capsule);
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	exit_code = hamiltonian_expectation(ham, state, &energy, values_data,
+					    num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+	Py_DECREF(ham_capsule);
+
+	if (exit_code != 0) {
+		Py_XDECREF(values);
+		PyErr_SetString(DokiError, "Failed to allocate accumulators");
+		return NULL;
+	}
+
+	result = Py_BuildValue("(NO)",
+			       PyComplex_FromDoubles(RE(energy), IM(energy)),
+			       values != NULL ? (PyObject *)values : Py_None);
+	Py_XDECREF(values);
+	return result;
+}
+
+static PyObject *doki_registry_density_dense(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *subset;
+	PyArrayObject *rho;
+	void *raw_state;
+	struct state_vector *state;
+	NATURAL_TYPE mask;
+	unsigned int *ids, num_ids;
+	npy_intp dims[2];
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OOip", &capsule, &subset, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_density_dense(registry, "
+				"qubit_subset, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+	state = (struct state_vector *)raw_state;
+
+	mask = 0;
+	if (get_qubit_ids(subset, state->num_qubits, &ids, &num_ids, &mask,
+			  NULL, "qubit_subset") != 0) {
+		return NULL;
+	}
+	free(ids);
+	if (subset == Py_None) {
+		mask = state->size - 1;
+	}
+
+	dims[0] = (npy_intp)(NATURAL_ONE << POPCOUNT(mask));
+	dims[1] = dims[0];
+	rho = (PyArrayObject *)PyArray_SimpleNew(2, dims, NPY_COMPLEX_TYPE);
+	if (rho == NULL) {
+		return NULL;
+	}
+
+	state_ref(state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(state->lock);
+	exit_code = density_dense(state, mask,
+				  (COMPLEX_TYPE *)PyArray_DATA(rho),
+				  num_threads);
+	RWLOCK_UNLOCK(state->lock);
+	Py_END_ALLOW_THREADS
+	state_unref(state);
+
+	if (exit_code != 0) {
+		Py_DECREF(rho);
+		PyErr_SetString(DokiError, "Failed to allocate thread buffers");
+		return NULL;
+	}
+
+	return (PyObject *)rho;
+}
+
+static PyObject *doki_registry_density(PyObject *self, PyObject *args)
+{
+	PyObject *state_capsule;
+	void *raw_state;
+	struct FMatrix *densityMatrix;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Op", &state_capsule, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_density(state, verbose)");
+		return NULL;
+	}
+
+	raw_state =
+		PyCapsule_GetPointer(state_capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+
+	densityMatrix = density_matrix(state_capsule);
+	if (densityMatrix == NULL) {
+		switch (errno) {
+		case 1:
+			PyErr_SetString(
+				DokiError,
+				"[DENSITY] Failed to allocate density matrix");
+			break;
+		case 2:
+			PyErr_SetString(DokiError,
+					"[DENSITY] The state is NULL");
+			break;
+		default:
+			PyErr_SetString(DokiError, "[DENSITY] Unknown error");
+		}
+		return NULL;
+	}
+
+	return PyCapsule_New((void *)densityMatrix, "qsimov.doki.funmatrix",
+			     &doki_funmatrix_destroy);
+}
+
+static PyObject *doki_registry_mem(PyObject *self, PyObject *args)
+{
+	PyObject *state_capsule;
+	void *raw_state;
+	size_t size;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Op", &state_capsule, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_mem(state, verbose)");
+		return NULL;
+	}
+
+	raw_state =
+		PyCapsule_GetPointer(state_capsule, "qsimov.doki.state_vector");
+	if (raw_state == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+
+	size = state_mem_size((struct state_vector *)raw_state);
+
+	return PyLong_FromSize_t(size);
+}
+
+static const char *const schedule_names[] = { NULL, "static", "dynamic",
+					      "guided", "auto" };
+
+static PyObject *doki_parallel_config_set(PyObject *self, PyObject *args)
+{
+	const char *schedule;
+	int num_threads, chunk_size, debug_enabled, kind;
+	long long threshold;
+
+	if (!PyArg_ParseTuple(args, "isiLp", &num_threads, &schedule,
+			      &chunk_size, &threshold, &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: parallel_config_set(num_threads, schedule, "
+			"chunk_size, serial_threshold, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	if (threshold < 0) {
+		PyErr_SetString(DokiError,
+				"serial_threshold must be a natural number");
+		return NULL;
+	}
+
+	for (kind = omp_sched_static; kind <= omp_sched_auto; kind++) {
+		if (strcmp(schedule, schedule_names[kind]) == 0) {
+			break;
+		}
+	}
+	if (kind > omp_sched_auto) {
+		PyErr_SetString(
+			DokiError,
+			"schedule must be static, dynamic, guided or auto");
+		return NULL;
+	}
+
+	doki_parallel_config.num_threads = num_threads;
+	doki_parallel_config.schedule = kind;
+	doki_parallel_config.chunk_size = chunk_size;
+	doki_parallel_config.serial_threshold = (NATURAL_TYPE)threshold;
+	if (debug_enabled) {
+		printf("[DEBUG] threads: %d, schedule: %s, chunk: %d, "
+		       "threshold: %lld\n",
+		       num_threads, schedule, chunk_size, threshold);
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *doki_parallel_config_get(PyObject *self, PyObject *args)
+{
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "p", &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: parallel_config_get(verbose)");
+		return NULL;
+	}
+
+	return Py_BuildValue("(isiL)", doki_parallel_config.num_threads,
+			     schedule_names[doki_parallel_config.schedule],
+			     doki_parallel_config.chunk_size,
+			     (long long)doki_parallel_config.serial_threshold);
+}
+
+void doki_shard_destroy(PyObject *capsule)
+{
+	struct shard_state *shard;
+	void *raw_shard;
+
+	raw_shard = PyCapsule_GetPointer(capsule,
+					 "qsimov.doki.shard_state_vector");
+	if (raw_shard != NULL) {
+		shard = (struct shard_state *)raw_shard;
+		shard_clear(shard);
+		free(shard);
+	}
+}
+
+static struct shard_state *get_shard(PyObject *capsule)
+{
+	struct shard_state *shard;
+
+	shard = (struct shard_state *)PyCapsule_GetPointer(
+		capsule, "qsimov.doki.shard_state_vector");
+	if (shard == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+
+	return shard;
+}
+
+/* Measurements remove qubits, so the ids in used (parsed without the lock)
+ * are checked again with the lock held. Returns 0 if they are in range, 8 if
+ * every qubit has been measured or 9 if some id is out of range */
+static unsigned char shard_check_qubits(struct shard_state *shard,
+					NATURAL_TYPE used)
+{
+	if (shard->num_qubits == 0) {
+		return 8;
+	}
+	if (shard->num_qubits < NATURAL_BITS && used >> shard->num_qubits != 0) {
+		return 9;
+	}
+
+	return 0;
+}
+
+static void shard_qubits_error(unsigned char exit_code)
+{
+	if (exit_code == 8) {
+		PyErr_SetString(DokiError, "Every qubit has been measured");
+	} else {
+		PyErr_SetString(DokiError, "qubit ids out of range");
+	}
+}
+
+/* Read a list or set of qubit ids (or None) into a new array. Repeated ids
+ * are tracked in mask, or in used when the registry may have more than
+ * NATURAL_BITS qubits */
+static int get_qubit_ids(PyObject *obj, unsigned int num_qubits,
+			 unsigned int **ids, unsigned int *num_ids,
+			 NATURAL_TYPE *mask, bool *used, const char *name)
+{
+	PyObject *seq, *item;
+	Py_ssize_t i, size;
+	long id;
+	char msg[96];
+
+	*ids = NULL;
+	*num_ids = 0;
+	if (obj == Py_None) {
+		return 0;
+	}
+	if (!PyList_Check(obj) && !PyAnySet_Check(obj)) {
+		snprintf(msg, sizeof(msg), "%s must be a list, a set or None",
+			 name);
+		PyErr_SetString(DokiError, msg);
+		return -1;
+	}
+	seq = PySequence_List(obj);
+	if (seq == NULL) {
+		return -1;
+	}
+	size = PyList_GET_SIZE(seq);
+	*ids = MALLOC_TYPE(size + 1, unsigned int);
+	if (*ids == NULL) {
+		Py_DECREF(seq);
+		PyErr_SetString(DokiError, "Failed to allocate qubit array");
+		return -1;
+	}
+	for (i = 0; i < size; i++) {
+		item = PyList_GET_ITEM(seq, i);
+		id = PyLong_Check(item) ? PyLong_AsLong(item) : -1;
+		if (id < 0 || (unsigned long)id >= num_qubits) {
+			snprintf(msg, sizeof(msg),
+				 "%s must contain qubit ids in range", name);
+			break;
+		}
+		if (used != NULL ? used[id] : *mask & (NATURAL_ONE << id)) {
+			snprintf(msg, sizeof(msg),
+				 "Qubit %ld in %s is used more than once", id,
+				 name);
+			break;
+		}
+		if (used != NULL) {
+			used[id] = true;
+		} else {
+			*mask |= NATURAL_ONE << id;
+		}
+		(*ids)[i] = (unsigned int)id;
+	}
+	Py_DECREF(seq);
+	if (i < size) {
+		free(*ids);
+		*ids = NULL;
+		PyErr_SetString(DokiError, msg);
+		return -1;
+	}
+	*num_ids = (unsigned int)size;
+
+	return 0;
+}
+
+static PyObject *doki_registry_shard_new(PyObject *self, PyObject *args)
+{
+	unsigned int num_qubits, num_global;
+	unsigned char result;
+	struct shard_state *shard;
+	struct shard_transport *transport;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "IIp", &num_qubits, &num_global,
+			      &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_shard_new(num_qubits, num_global, verbose)");
+		return NULL;
+	}
+	if (num_qubits == 0) {
+		PyErr_SetString(DokiError, "num_qubits can't be zero");
+		return NULL;
+	}
+	if (num_global >= num_qubits) {
+		PyErr_SetString(DokiError,
+				"num_global must be lower than num_qubits");
+		return NULL;
+	}
+
+	shard = MALLOC_TYPE(1, struct shard_state);
+	transport = shard_transport_local(1u << num_global);
+	if (shard == NULL || transport == NULL) {
+		free(shard);
+		if (transport != NULL) {
+			transport->destroy(transport);
+		}
+		PyErr_SetString(DokiError, "Failed to allocate sharded state");
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	result = shard_init(shard, num_qubits, num_global, transport);
+	Py_END_ALLOW_THREADS
+	if (result != 0) {
+		free(shard);
+	}
+	switch (result) {
+	case 0:
+		break;
+	case 1:
+		PyErr_SetString(DokiError, "Failed to allocate state vector");
+		return NULL;
+	case 2:
+		PyErr_SetString(DokiError, "Failed to allocate state chunk");
+		return NULL;
+	case 3:
+		PyErr_SetString(DokiError, "Number of qubits exceeds maximum");
+		return NULL;
+	case 4:
+		PyErr_SetString(DokiError, "Failed to allocate shard slices");
+		return NULL;
+	case 6:
+		PyErr_SetString(DokiError,
+				"num_global must be lower than num_qubits");
+		return NULL;
+	default:
+		PyErr_SetString(DokiError, "Unknown error when creating state");
+		return NULL;
+	}
+	if (debug_enabled) {
+		printf("[DEBUG] %u shards with %u local qubits\n",
+		       shard->num_shards, num_qubits - num_global);
+	}
+
+	return PyCapsule_New((void *)shard, "qsimov.doki.shard_state_vector",
+			     &doki_shard_destroy);
+}
+
+static PyObject *doki_registry_shard_apply(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *gate_capsule, *target_list, *control_set,
+		*acontrol_set;
+	struct shard_state *shard;
+	struct qgate *gate;
+	NATURAL_TYPE used;
+	unsigned int *targets, *controls, *anticontrols;
+	unsigned int num_targets, num_controls, num_anticontrols;
+	unsigned char exit_code;
+	int num_threads, debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "OOOOOip", &capsule, &gate_capsule,
+			      &target_list, &control_set, &acontrol_set,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_shard_apply(registry, gate, target_list, "
+			"control_set, anticontrol_set, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	shard = get_shard(capsule);
+	if (shard == NULL) {
+		return NULL;
+	}
+	gate = (struct qgate *)PyCapsule_GetPointer(gate_capsule,
+						    "qsimov.doki.gate");
+	if (gate == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to gate");
+		return NULL;
+	}
+	if (!PyList_Check(target_list)) {
+		PyErr_SetString(DokiError, "target_list must be a list");
+		return NULL;
+	}
+
+	used = 0;
+	if (get_qubit_ids(target_list, NATURAL_BITS, &targets,
+			  &num_targets, &used, NULL, "target_list")) {
+		return NULL;
+	}
+	if (num_targets != gate->num_qubits) {
+		free(targets);
+		PyErr_SetString(
+			DokiError,
+			"Wrong number of targets specified for that gate");
+		return NULL;
+	}
+	if (get_qubit_ids(control_set, NATURAL_BITS, &controls,
+			  &num_controls, &used, NULL, "control_set")) {
+		free(targets);
+		return NULL;
+	}
+	if (get_qubit_ids(acontrol_set, NATURAL_BITS, &anticontrols,
+			  &num_anticontrols, &used, NULL, "anticontrol_set")) {
+		free(targets);
+		free(controls);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_WRLOCK(shard->lock);
+	exit_code = shard_check_qubits(shard, used);
+	if (exit_code == 0) {
+		exit_code = shard_apply_gate(shard, gate, targets, num_targets,
+					     controls, num_controls,
+					     anticontrols, num_anticontrols,
+					     num_threads);
+	}
+	RWLOCK_UNLOCK(shard->lock);
+	Py_END_ALLOW_THREADS
+	free(targets);
+	free(controls);
+	free(anticontrols);
+
+	switch (exit_code) {
+	case 0:
+		Py_RETURN_NONE;
+	case 1:
+		PyErr_SetString(DokiError,
+				"Failed to initialize new state chunk");
+		break;
+	case 2:
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state chunk");
+		break;
+	case 4:
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state vector structure");
+		break;
+	case 7:
+		PyErr_SetString(DokiError,
+				"The gate has more targets than local qubits");
+		break;
+	case 8:
+	case 9:
+		shard_qubits_error(exit_code);
+		break;
+	default:
+		PyErr_SetString(DokiError, "Unknown error when applying gate");
+	}
+
+	return NULL;
+}
+
+static PyObject *doki_registry_shard_get(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	struct shard_state *shard;
+	NATURAL_TYPE id;
+	COMPLEX_TYPE val;
+	bool in_range;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "OKp", &capsule, &id, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_shard_get(registry, id, verbose)");
+		return NULL;
+	}
+
+	shard = get_shard(capsule);
+	if (shard == NULL) {
+		return NULL;
+	}
+	if (id < 0) {
+		PyErr_SetString(DokiError, "id out of range");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(shard->lock);
+	in_range = shard->num_qubits > 0 &&
+		   id < NATURAL_ONE << shard->num_qubits;
+	if (in_range) {
+		val = shard_get(shard, id);
+	}
+	RWLOCK_UNLOCK(shard->lock);
+	Py_END_ALLOW_THREADS
+	if (!in_range) {
+		PyErr_SetString(DokiError, "id out of range");
+		return NULL;
+	}
+
+	return PyComplex_FromDoubles(RE(val), IM(val));
+}
+
+static PyObject *doki_registry_shard_prob(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	struct shard_state *shard;
+	unsigned int id;
+	REAL_TYPE prob;
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OIip", &capsule, &id, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_shard_prob(registry, qubit_id, "
+				"num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	shard = get_shard(capsule);
+	if (shard == NULL) {
+		return NULL;
+	}
+	if (id >= NATURAL_BITS) {
+		PyErr_SetString(DokiError, "qubit ids out of range");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(shard->lock);
+	exit_code = shard_check_qubits(shard, NATURAL_ONE << id);
+	if (exit_code == 0) {
+		prob = shard_probability(shard, id, num_threads);
+	}
+	RWLOCK_UNLOCK(shard->lock);
+	Py_END_ALLOW_THREADS
+	if (exit_code != 0) {
+		shard_qubits_error(exit_code);
+		return NULL;
+	}
+	if (isnan(prob)) {
+		PyErr_SetString(DokiError, "Failed to allocate partial sums");
+		return NULL;
+	}
+
+	return PyFloat_FromDouble(prob);
+}
+
+static PyObject *doki_registry_shard_measure(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	struct shard_state *shard;
+	unsigned int id;
+	REAL_TYPE roll;
+	bool result;
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OIdip", &capsule, &id, &roll,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_shard_measure(registry, qubit_id, "
+				"roll, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+	if (roll < 0 || roll >= 1) {
+		PyErr_SetString(DokiError, "roll not in interval [0, 1)!");
+		return NULL;
+	}
+
+	shard = get_shard(capsule);
+	if (shard == NULL) {
+		return NULL;
+	}
+	if (id >= NATURAL_BITS) {
+		PyErr_SetString(DokiError, "qubit ids out of range");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_WRLOCK(shard->lock);
+	exit_code = shard_check_qubits(shard, NATURAL_ONE << id);
+	if (exit_code == 0) {
+		exit_code = shard_measure(shard, id, roll, &result,
+					  num_threads);
+	}
+	RWLOCK_UNLOCK(shard->lock);
+	Py_END_ALLOW_THREADS
+
+	switch (exit_code) {
+	case 0:
+		return PyBool_FromLong(result);
+	case 1:
+		PyErr_SetString(DokiError, "Failed to allocate state vector");
+		break;
+	case 2:
 		PyErr_SetString(DokiError, "Failed to allocate state chunk");
+		break;
+	case 4:
+		PyErr_SetString(DokiError, "Failed to allocate shard slices");
+		break;
+	case 8:
+	case 9:
+		shard_qubits_error(exit_code);
+		break;
+	default:
+		PyErr_SetString(DokiError,
+				"Unknown error while collapsing state");
+	}
+
+	return NULL;
+}
+
+static PyObject *doki_registry_shard_gather(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	struct shard_state *shard;
+	struct state_vector *state;
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "Oip", &capsule, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_shard_gather(registry, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	shard = get_shard(capsule);
+	if (shard == NULL) {
+		return NULL;
+	}
+	state = MALLOC_TYPE(1, struct state_vector);
+	if (state == NULL) {
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state structure");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(shard->lock);
+	exit_code = shard_check_qubits(shard, 0);
+	if (exit_code == 0) {
+		exit_code = shard_gather(shard, state, num_threads);
+	}
+	RWLOCK_UNLOCK(shard->lock);
+	Py_END_ALLOW_THREADS
+
+	if (exit_code == 8) {
+		free(state);
+		shard_qubits_error(exit_code);
+		return NULL;
+	}
+	if (exit_code != 0) {
+		free(state);
+		PyErr_SetString(DokiError, "Failed to allocate state vector");
+		return NULL;
+	}
+
+	return PyCapsule_New((void *)state, "qsimov.doki.state_vector",
+			     &doki_registry_destroy);
+}
+
+static PyObject *doki_registry_shard_layout(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *qubit_map;
+	struct shard_state *shard;
+	unsigned int i, num_qubits, num_shards, *map;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Op", &capsule, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_shard_layout(registry, verbose)");
+		return NULL;
+	}
+
+	shard = get_shard(capsule);
+	if (shard == NULL) {
+		return NULL;
+	}
+
+	/* the lock is not held while the lists are built */
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(shard->lock);
+	num_qubits = shard->num_qubits;
+	num_shards = shard->num_shards;
+	map = MALLOC_TYPE(num_qubits + 1, unsigned int);
+	if (map != NULL) {
+		memcpy(map, shard->qubit_map,
+		       num_qubits * sizeof(unsigned int));
+	}
+	RWLOCK_UNLOCK(shard->lock);
+	Py_END_ALLOW_THREADS
+	if (map == NULL) {
+		PyErr_SetString(DokiError, "Failed to allocate qubit map");
+		return NULL;
+	}
+	if (num_qubits == 0) {
+		free(map);
+		shard_qubits_error(8);
+		return NULL;
+	}
+
+	qubit_map = PyList_New(num_qubits);
+	if (qubit_map == NULL) {
+		free(map);
+		return NULL;
+	}
+	for (i = 0; i < num_qubits; i++) {
+		PyList_SET_ITEM(qubit_map, i, PyLong_FromUnsignedLong(map[i]));
+	}
+	free(map);
+
+	return Py_BuildValue("(IN)", num_shards, qubit_map);
+}
+
+void doki_factor_destroy(PyObject *capsule)
+{
+	struct factor_state *factor;
+	void *raw_factor;
+
+	raw_factor = PyCapsule_GetPointer(capsule,
+					  "qsimov.doki.factor_state_vector");
+	if (raw_factor != NULL) {
+		factor = (struct factor_state *)raw_factor;
+		factor_clear(factor);
+		free(factor);
+	}
+}
+
+static struct factor_state *get_factor(PyObject *capsule)
+{
+	struct factor_state *factor;
+
+	factor = (struct factor_state *)PyCapsule_GetPointer(
+		capsule, "qsimov.doki.factor_state_vector");
+	if (factor == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to registry");
+		return NULL;
+	}
+
+	return factor;
+}
+
+static PyObject *doki_registry_factor_new(PyObject *self, PyObject *args)
+{
+	unsigned int num_qubits;
+	unsigned char result;
+	struct factor_state *factor;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Ip", &num_qubits, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_factor_new(num_qubits, verbose)");
+		return NULL;
+	}
+	if (num_qubits == 0) {
+		PyErr_SetString(DokiError, "num_qubits can't be zero");
+		return NULL;
+	}
+
+	factor = MALLOC_TYPE(1, struct factor_state);
+	if (factor == NULL) {
+		PyErr_SetString(DokiError,
+				"Failed to allocate factorized state structure");
+		return NULL;
+	}
+	result = factor_init(factor, num_qubits);
+	if (result != 0) {
+		free(factor);
+		switch (result) {
+		case 1:
+			PyErr_SetString(DokiError,
+					"Failed to allocate cluster vector");
+			break;
+		case 2:
+			PyErr_SetString(DokiError,
+					"Failed to allocate cluster chunk");
+			break;
+		case 4:
+			PyErr_SetString(DokiError,
+					"Failed to allocate cluster structures");
+			break;
+		default:
+			PyErr_SetString(
+				DokiError,
+				"Unknown error while creating factorized registry");
+		}
+		return NULL;
+	}
+
+	return PyCapsule_New((void *)factor, "qsimov.doki.factor_state_vector",
+			     &doki_factor_destroy);
+}
+
+static PyObject *doki_registry_factor_apply(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *gate_capsule, *target_list, *control_set,
+		*acontrol_set;
+	struct factor_state *factor;
+	struct qgate *gate;
+	bool *used;
+	unsigned int *targets, *controls, *anticontrols;
+	unsigned int num_targets, num_controls, num_anticontrols;
+	unsigned char exit_code;
+	int num_threads, debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "OOOOOip", &capsule, &gate_capsule,
+			      &target_list, &control_set, &acontrol_set,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_factor_apply(registry, gate, "
+			"target_list, control_set, anticontrol_set, "
+			"num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	factor = get_factor(capsule);
+	if (factor == NULL) {
+		return NULL;
+	}
+	gate = (struct qgate *)PyCapsule_GetPointer(gate_capsule,
+						    "qsimov.doki.gate");
+	if (gate == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to gate");
+		return NULL;
+	}
+	if (!PyList_Check(target_list)) {
+		PyErr_SetString(DokiError, "target_list must be a list");
+		return NULL;
+	}
+
+	used = CALLOC_TYPE(factor->num_qubits, bool);
+	if (used == NULL) {
+		PyErr_SetString(DokiError, "Failed to allocate qubit array");
+		return NULL;
+	}
+	targets = NULL;
+	controls = NULL;
+	anticontrols = NULL;
+	if (get_qubit_ids(target_list, factor->num_qubits, &targets,
+			  &num_targets, NULL, used, "target_list") ||
+	    get_qubit_ids(control_set, factor->num_qubits, &controls,
+			  &num_controls, NULL, used, "control_set") ||
+	    get_qubit_ids(acontrol_set, factor->num_qubits, &anticontrols,
+			  &num_anticontrols, NULL, used, "anticontrol_set")) {
+		free(used);
+		free(targets);
+		free(controls);
+		return NULL;
+	}
+	free(used);
+	if (num_targets != gate->num_qubits) {
+		free(targets);
+		free(controls);
+		free(anticontrols);
+		PyErr_SetString(
+			DokiError,
+			"Wrong number of targets specified for that gate");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_WRLOCK(factor->lock);
+	exit_code = factor_apply_gate(factor, gate, targets, num_targets,
+				      controls, num_controls, anticontrols,
+				      num_anticontrols, num_threads);
+	RWLOCK_UNLOCK(factor->lock);
+	Py_END_ALLOW_THREADS
+	free(targets);
+	free(controls);
+	free(anticontrols);
+
+	switch (exit_code) {
+	case 0:
+		Py_RETURN_NONE;
+	case 1:
+		PyErr_SetString(DokiError,
+				"Failed to initialize new state chunk");
+		break;
+	case 2:
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state chunk");
+		break;
+	case 3:
+		PyErr_SetString(DokiError,
+				"Too many entangled qubits in a cluster");
+		break;
+	case 4:
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state vector structure");
+		break;
+	default:
+		PyErr_SetString(DokiError, "Unknown error when applying gate");
+	}
+
+	return NULL;
+}
+
+static PyObject *doki_registry_factor_get(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	struct factor_state *factor;
+	NATURAL_TYPE id;
+	COMPLEX_TYPE val;
+	unsigned char exit_code;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "OKp", &capsule, &id, &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_factor_get(registry, id, verbose)");
+		return NULL;
+	}
+
+	factor = get_factor(capsule);
+	if (factor == NULL) {
+		return NULL;
+	}
+	if (factor->num_qubits >= NATURAL_BITS) {
+		PyErr_SetString(DokiError,
+				"Too many qubits to address single amplitudes");
+		return NULL;
+	}
+	if (id < 0 || id >= NATURAL_ONE << factor->num_qubits) {
+		PyErr_SetString(DokiError, "id out of range");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(factor->lock);
+	exit_code = factor_get(factor, id, &val);
+	RWLOCK_UNLOCK(factor->lock);
+	Py_END_ALLOW_THREADS
+	if (exit_code != 0) {
+		PyErr_SetString(DokiError, "Failed to allocate cluster indices");
+		return NULL;
+	}
+
+	return PyComplex_FromDoubles(RE(val), IM(val));
+}
+
+static PyObject *doki_registry_factor_prob(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	struct factor_state *factor;
+	unsigned int id;
+	REAL_TYPE prob;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OIip", &capsule, &id, &num_threads,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_factor_prob(registry, "
+				"qubit_id, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	factor = get_factor(capsule);
+	if (factor == NULL) {
+		return NULL;
+	}
+	if (id >= factor->num_qubits) {
+		PyErr_SetString(DokiError, "qubit_id out of range");
 		return NULL;
-	} else if (exit_code == 3) {
-		if (debug_enabled) {
-			printf("[DEBUG] %u", state->num_qubits);
-		}
-		PyErr_SetString(DokiError, "Wrong number of qubits");
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(factor->lock);
+	prob = factor_probability(factor, id, num_threads);
+	RWLOCK_UNLOCK(factor->lock);
+	Py_END_ALLOW_THREADS
+
+	return PyFloat_FromDouble(prob);
+}
+
+static PyObject *doki_registry_factor_measure(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *qubits, *roll_list, *result;
+	struct factor_state *factor;
+	REAL_TYPE *rolls;
+	bool *used, *values;
+	unsigned int *ids, num_ids, k;
+	unsigned char exit_code;
+	int debug_enabled, num_threads;
+
+	if (!PyArg_ParseTuple(args, "OOOip", &capsule, &qubits, &roll_list,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_factor_measure(registry, "
+				"qubits, roll_list, num_threads, verbose)");
 		return NULL;
-	} else if (exit_code != 0) {
-		PyErr_SetString(DokiError, "Unknown error when cloning state");
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
 		return NULL;
 	}
 
-	measured_qty = 0;
-	roll_id = 0;
-	aux = NULL;
-	for (i = 0; i < initial_num_qubits; i++) {
-		curr_id = initial_num_qubits - i - 1;
-		measure_id = mask & (NATURAL_ONE << curr_id);
-		py_measured_val = Py_None;
-		if (measure_id) {
-			if (new_state == NULL || new_state->num_qubits == 0) {
-				if (new_state != NULL) {
-					state_clear(new_state);
-					free(new_state);
-				}
-				PyErr_SetString(
-					DokiError,
-					"Could not measure non_existant qubits");
-				return NULL;
-			}
-			roll = PyFloat_AsDouble(
-				PyList_GetItem(roll_list, roll_id));
-			if (roll < 0 || roll >= 1) {
-				state_clear(new_state);
-				free(new_state);
-				PyErr_SetString(DokiError,
-						"roll not in interval [0, 1)!");
-				return NULL;
-			}
-			roll_id++;
-			aux = MALLOC_TYPE(1, struct state_vector);
-			if (aux == NULL) {
-				state_clear(new_state);
-				free(new_state);
-				PyErr_SetString(
-					DokiError,
-					"Failed to allocate aux state structure");
-				return NULL;
-			}
-			exit_code = measure(new_state, &measured_val, curr_id,
-					    aux, roll);
-			if (exit_code != 0) {
-				state_clear(aux);
-				free(aux);
-				aux = NULL;
-				break;
-			}
-			if (aux->num_qubits > 0 && aux->norm_const == 0.0) {
-				state_clear(aux);
-				free(aux);
-				state_clear(new_state);
-				free(new_state);
-				PyErr_SetString(
-					DokiError,
-					"New normalization constant is 0. Please report "
-					"this error with the steps to reproduce it.");
-				return NULL;
-			}
-			measured_qty++;
-			py_measured_val = measured_val ? Py_True : Py_False;
-			state_clear(new_state);
-			free(new_state);
-			new_state = aux;
-			aux = NULL;
-		}
-		PyList_SET_ITEM(result, i, py_measured_val);
+	factor = get_factor(capsule);
+	if (factor == NULL) {
+		return NULL;
+	}
+	if (!PyList_Check(qubits)) {
+		PyErr_SetString(DokiError, "qubits must be a list");
+		return NULL;
+	}
+	used = CALLOC_TYPE(factor->num_qubits, bool);
+	if (used == NULL) {
+		PyErr_SetString(DokiError, "Failed to allocate qubit array");
+		return NULL;
 	}
+	exit_code = get_qubit_ids(qubits, factor->num_qubits, &ids, &num_ids,
+				  NULL, used, "qubits");
+	free(used);
 	if (exit_code != 0) {
-		if (new_state != NULL) {
-			state_clear(new_state);
-			free(new_state);
-		}
+		return NULL;
+	}
+	rolls = read_rolls(roll_list, num_ids);
+	if (rolls == NULL) {
+		free(ids);
+		return NULL;
+	}
+	values = MALLOC_TYPE(num_ids + 1, bool);
+	if (values == NULL) {
+		free(ids);
+		free(rolls);
+		PyErr_SetString(DokiError, "Failed to allocate result array");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_WRLOCK(factor->lock);
+	exit_code = factor_measure(factor, ids, num_ids, rolls, values,
+				   num_threads);
+	RWLOCK_UNLOCK(factor->lock);
+	Py_END_ALLOW_THREADS
+	free(ids);
+	free(rolls);
+
+	if (exit_code != 0) {
+		free(values);
 		switch (exit_code) {
 		case 1:
+		case 2:
 			PyErr_SetString(DokiError,
 					"Failed to allocate state vector");
 			break;
-		case 2:
-			PyErr_SetString(DokiError,
-					"Failed to allocate state chunk");
+		case 4:
+			PyErr_SetString(DokiError, "Failed to allocate memory");
+			break;
+		case 5:
+			PyErr_SetString(
+				DokiError,
+				"New normalization constant is 0. Please report "
+				"this error with the steps to reproduce it.");
 			break;
 		default:
 			PyErr_SetString(DokiError,
@@ -1177,33 +3870,32 @@ static PyObject *doki_registry_measure(PyObject *self, PyObject *args)
 		return NULL;
 	}
 
-	if (state->num_qubits - measured_qty > 0) {
-		new_capsule = PyCapsule_New((void *)new_state,
-					    "qsimov.doki.state_vector",
-					    &doki_registry_destroy);
-	} else {
-		if (new_state != NULL) {
-			state_clear(new_state);
-			free(new_state);
-		}
-		new_capsule = Py_None;
+	result = PyList_New(num_ids);
+	if (result == NULL) {
+		free(values);
+		return NULL;
 	}
-	return PyTuple_Pack(2, new_capsule, result);
+	for (k = 0; k < num_ids; k++) {
+		PyList_SET_ITEM(result, k, PyBool_FromLong(values[k]));
+	}
+	free(values);
+
+	return result;
 }
 
-static PyObject *doki_registry_prob(PyObject *self, PyObject *args)
+static PyObject *doki_registry_factor_gather(PyObject *self, PyObject *args)
 {
 	PyObject *capsule;
-	void *raw_state;
+	struct factor_state *factor;
 	struct state_vector *state;
-	unsigned int id;
+	unsigned char exit_code;
 	int debug_enabled, num_threads;
 
-	if (!PyArg_ParseTuple(args, "OIip", &capsule, &id, &num_threads,
+	if (!PyArg_ParseTuple(args, "Oip", &capsule, &num_threads,
 			      &debug_enabled)) {
-		PyErr_SetString(
-			DokiError,
-			"Syntax: registry_prob(registry, qubit_id, num_threads, verbose)");
+		PyErr_SetString(DokiError,
+				"Syntax: registry_factor_gather(registry, "
+				"num_threads, verbose)");
 		return NULL;
 	}
 
@@ -1214,86 +3906,167 @@ static PyObject *doki_registry_prob(PyObject *self, PyObject *args)
 		return NULL;
 	}
 
-	raw_state = PyCapsule_GetPointer(capsule, "qsimov.doki.state_vector");
-	if (raw_state == NULL) {
-		PyErr_SetString(DokiError, "NULL pointer to registry");
+	factor = get_factor(capsule);
+	if (factor == NULL) {
 		return NULL;
 	}
-	state = (struct state_vector *)raw_state;
+	state = MALLOC_TYPE(1, struct state_vector);
+	if (state == NULL) {
+		PyErr_SetString(DokiError,
+				"Failed to allocate new state structure");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(factor->lock);
+	exit_code = factor_gather(factor, state, num_threads);
+	RWLOCK_UNLOCK(factor->lock);
+	Py_END_ALLOW_THREADS
 
-	if (num_threads != -1) {
-		omp_set_num_threads(num_threads);
+	if (exit_code != 0) {
+		free(state);
+		if (exit_code == 3) {
+			PyErr_SetString(DokiError,
+					"Too many qubits to gather the state");
+		} else {
+			PyErr_SetString(DokiError,
+					"Failed to allocate state vector");
+		}
+		return NULL;
 	}
-	return PyFloat_FromDouble(probability(state, id));
+
+	return PyCapsule_New((void *)state, "qsimov.doki.state_vector",
+			     &doki_registry_destroy);
 }
 
-static PyObject *doki_registry_density(PyObject *self, PyObject *args)
+static PyObject *doki_registry_factor_layout(PyObject *self, PyObject *args)
 {
-	PyObject *state_capsule;
-	void *raw_state;
-	struct FMatrix *densityMatrix;
+	PyObject *capsule, *clusters, *qubits;
+	struct factor_state *factor;
+	unsigned int q, c, num_qubits, num_clusters, *copy, *cluster_of,
+		*position, *sizes;
 	int debug_enabled;
 
-	if (!PyArg_ParseTuple(args, "Op", &state_capsule, &debug_enabled)) {
-		PyErr_SetString(DokiError,
-				"Syntax: registry_density(state, verbose)");
+	if (!PyArg_ParseTuple(args, "Op", &capsule, &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: registry_factor_layout(registry, verbose)");
 		return NULL;
 	}
 
-	raw_state =
-		PyCapsule_GetPointer(state_capsule, "qsimov.doki.state_vector");
-	if (raw_state == NULL) {
-		PyErr_SetString(DokiError, "NULL pointer to registry");
+	factor = get_factor(capsule);
+	if (factor == NULL) {
 		return NULL;
 	}
 
-	densityMatrix = density_matrix(state_capsule);
-	if (densityMatrix == NULL) {
-		switch (errno) {
-		case 1:
-			PyErr_SetString(
-				DokiError,
-				"[DENSITY] Failed to allocate density matrix");
-			break;
-		case 2:
-			PyErr_SetString(DokiError,
-					"[DENSITY] The state is NULL");
-			break;
-		default:
-			PyErr_SetString(DokiError, "[DENSITY] Unknown error");
+	/* the lock is not held while the lists are built */
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(factor->lock);
+	num_qubits = factor->num_qubits;
+	num_clusters = factor->num_clusters;
+	copy = MALLOC_TYPE(3 * num_qubits + 1, unsigned int);
+	if (copy != NULL) {
+		memcpy(copy, factor->cluster_of,
+		       num_qubits * sizeof(unsigned int));
+		memcpy(copy + num_qubits, factor->position,
+		       num_qubits * sizeof(unsigned int));
+		for (c = 0; c < num_clusters; c++) {
+			copy[2 * num_qubits + c] =
+				factor->clusters[c]->num_qubits;
 		}
+	}
+	RWLOCK_UNLOCK(factor->lock);
+	Py_END_ALLOW_THREADS
+	if (copy == NULL) {
+		PyErr_SetString(DokiError, "Failed to allocate qubit layout");
 		return NULL;
 	}
+	cluster_of = copy;
+	position = copy + num_qubits;
+	sizes = copy + 2 * num_qubits;
 
-	return PyCapsule_New((void *)densityMatrix, "qsimov.doki.funmatrix",
-			     &doki_funmatrix_destroy);
+	clusters = PyList_New(num_clusters);
+	if (clusters == NULL) {
+		free(copy);
+		return NULL;
+	}
+	for (c = 0; c < num_clusters; c++) {
+		qubits = PyList_New(sizes[c]);
+		if (qubits == NULL) {
+			Py_DECREF(clusters);
+			free(copy);
+			return NULL;
+		}
+		for (q = 0; q < num_qubits; q++) {
+			if (cluster_of[q] == c) {
+				PyList_SET_ITEM(qubits, position[q],
+						PyLong_FromUnsignedLong(q));
+			}
+		}
+		PyList_SET_ITEM(clusters, c, qubits);
+	}
+	free(copy);
+
+	return clusters;
 }
 
-static PyObject *doki_registry_mem(PyObject *self, PyObject *args)
+static PyObject *doki_registry_factor_mem(PyObject *self, PyObject *args)
 {
-	PyObject *state_capsule;
-	void *raw_state;
+	PyObject *capsule;
+	struct factor_state *factor;
 	size_t size;
 	int debug_enabled;
 
-	if (!PyArg_ParseTuple(args, "Op", &state_capsule, &debug_enabled)) {
+	if (!PyArg_ParseTuple(args, "Op", &capsule, &debug_enabled)) {
 		PyErr_SetString(DokiError,
-				"Syntax: registry_mem(state, verbose)");
+				"Syntax: registry_factor_mem(registry, verbose)");
 		return NULL;
 	}
 
-	raw_state =
-		PyCapsule_GetPointer(state_capsule, "qsimov.doki.state_vector");
-	if (raw_state == NULL) {
-		PyErr_SetString(DokiError, "NULL pointer to registry");
+	factor = get_factor(capsule);
+	if (factor == NULL) {
 		return NULL;
 	}
 
-	size = state_mem_size((struct state_vector *)raw_state);
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_RDLOCK(factor->lock);
+	size = factor_mem_size(factor);
+	RWLOCK_UNLOCK(factor->lock);
+	Py_END_ALLOW_THREADS
 
 	return PyLong_FromSize_t(size);
 }
 
+static PyObject *doki_registry_factor_autosplit(PyObject *self,
+						PyObject *args)
+{
+	PyObject *capsule;
+	struct factor_state *factor;
+	double tolerance;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Odp", &capsule, &tolerance,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: registry_factor_autosplit(registry, "
+				"tol, verbose)");
+		return NULL;
+	}
+
+	factor = get_factor(capsule);
+	if (factor == NULL) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	RWLOCK_WRLOCK(factor->lock);
+	factor->split_tol = (REAL_TYPE)tolerance;
+	RWLOCK_UNLOCK(factor->lock);
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
 static PyObject *doki_funmatrix_create(PyObject *self, PyObject *args)
 {
 	PyObject *list, *row, *raw_val;
@@ -1578,6 +4351,135 @@ static PyObject *doki_funmatrix_get(PyObject *self, PyObject *args)
 	return PyComplex_FromDoubles(RE(val), IM(val));
 }
 
+static PyObject *doki_funmatrix_materialize(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *row_range, *col_range;
+	PyArrayObject *values;
+	void *raw_matrix;
+	struct FMatrix *matrix;
+	NATURAL_TYPE row_start, row_step, num_rows, col_start, col_step,
+		num_cols;
+	npy_intp dims[2];
+	int debug_enabled, num_threads, res;
+
+	if (!PyArg_ParseTuple(args, "OOOip", &capsule, &row_range, &col_range,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: funmatrix_materialize(funmatrix, "
+				"row_range, col_range, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	raw_matrix = PyCapsule_GetPointer(capsule, "qsimov.doki.funmatrix");
+	if (raw_matrix == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to matrix");
+		return NULL;
+	}
+	matrix = (struct FMatrix *)raw_matrix;
+
+	row_start = 0;
+	row_step = 1;
+	num_rows = matrix->r;
+	if (row_range != Py_None &&
+	    (!PyRange_Check(row_range) ||
+	     read_range(row_range, matrix->r, &row_start, &row_step,
+			&num_rows) != 0)) {
+		if (!PyErr_Occurred()) {
+			PyErr_SetString(DokiError,
+					"row_range must be a range or None");
+		}
+		return NULL;
+	}
+	col_start = 0;
+	col_step = 1;
+	num_cols = matrix->c;
+	if (col_range != Py_None &&
+	    (!PyRange_Check(col_range) ||
+	     read_range(col_range, matrix->c, &col_start, &col_step,
+			&num_cols) != 0)) {
+		if (!PyErr_Occurred()) {
+			PyErr_SetString(DokiError,
+					"col_range must be a range or None");
+		}
+		return NULL;
+	}
+
+	dims[0] = (npy_intp)num_rows;
+	dims[1] = (npy_intp)num_cols;
+	values = (PyArrayObject *)PyArray_SimpleNew(2, dims, NPY_COMPLEX_TYPE);
+	if (values == NULL) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	res = materialize(matrix, row_start, row_step, num_rows, col_start,
+			  col_step, num_cols,
+			  (COMPLEX_TYPE *)PyArray_DATA(values), num_threads);
+	Py_END_ALLOW_THREADS
+
+	if (res != 0) {
+		Py_DECREF(values);
+		switch (res) {
+		case 1:
+			PyErr_SetString(
+				DokiError,
+				"[MATERIALIZE] Error adding parent matrices");
+			break;
+		case 2:
+			PyErr_SetString(
+				DokiError,
+				"[MATERIALIZE] Error substracting parent matrices");
+			break;
+		case 3:
+			PyErr_SetString(
+				DokiError,
+				"[MATERIALIZE] Error multiplying parent matrices");
+			break;
+		case 4:
+			PyErr_SetString(
+				DokiError,
+				"[MATERIALIZE] Error multiplying entity-wise parent matrices");
+			break;
+		case 5:
+			PyErr_SetString(
+				DokiError,
+				"[MATERIALIZE] Error calculating Kronecker product of parent matrices");
+			break;
+		case 6:
+			PyErr_SetString(
+				DokiError,
+				"[MATERIALIZE] Unknown operation between parent matrices");
+			break;
+		case 7:
+			PyErr_SetString(DokiError,
+					"[MATERIALIZE] Element out of bounds");
+			break;
+		case 8:
+			PyErr_SetString(DokiError,
+					"[MATERIALIZE] f returned NAN");
+			break;
+		case 9:
+			PyErr_SetString(
+				DokiError,
+				"[MATERIALIZE] Failed to allocate tile buffers");
+			break;
+		default:
+			PyErr_SetString(DokiError,
+					"[MATERIALIZE] Unknown error code");
+		}
+		return NULL;
+	}
+
+	return (PyObject *)values;
+}
+
 static PyObject *doki_funmatrix_add(PyObject *self, PyObject *args)
 {
 	PyObject *capsule1, *capsule2;
@@ -2013,6 +4915,45 @@ static PyObject *doki_funmatrix_dagger(PyObject *self, PyObject *args)
 			     &doki_funmatrix_destroy);
 }
 
+static PyObject *doki_funmatrix_optimize(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	void *raw_matrix;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Op", &capsule, &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: funmatrix_optimize(funmatrix, verbose)");
+		return NULL;
+	}
+
+	raw_matrix = (void *)optimize(capsule);
+	if (raw_matrix == NULL) {
+		switch (errno) {
+		case 1:
+			PyErr_SetString(
+				DokiError,
+				"[OPTIMIZE] Failed to allocate result matrix");
+			break;
+		case 3:
+			PyErr_SetString(DokiError,
+					"[OPTIMIZE] The matrix is NULL");
+			break;
+		case 6:
+			PyErr_SetString(DokiError,
+					"[OPTIMIZE] Unknown operation");
+			break;
+		default:
+			PyErr_SetString(DokiError, "[OPTIMIZE] Unknown error");
+		}
+		return NULL;
+	}
+
+	return PyCapsule_New(raw_matrix, "qsimov.doki.funmatrix",
+			     &doki_funmatrix_destroy);
+}
+
 static PyObject *doki_funmatrix_projection(PyObject *self, PyObject *args)
 {
 	PyObject *capsule;
@@ -2435,6 +5376,64 @@ static PyObject *doki_funmatrix_apply(PyObject *self, PyObject *args)
 			     &doki_funmatrix_destroy);
 }
 
+static PyObject *doki_funmatrix_cache(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	void *raw_matrix;
+	unsigned long long budget;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "OKp", &capsule, &budget,
+			      &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: funmatrix_cache(funmatrix, budget, verbose)");
+		return NULL;
+	}
+
+	raw_matrix = PyCapsule_GetPointer(capsule, "qsimov.doki.funmatrix");
+	if (raw_matrix == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to matrix");
+		return NULL;
+	}
+
+	if (set_cache((struct FMatrix *)raw_matrix, (size_t)budget) != 0) {
+		PyErr_SetString(DokiError, "[CACHE] Failed to allocate cache");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *doki_funmatrix_cache_stats(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	void *raw_matrix;
+	size_t stats[5] = { 0 };
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Op", &capsule, &debug_enabled)) {
+		PyErr_SetString(
+			DokiError,
+			"Syntax: funmatrix_cache_stats(funmatrix, verbose)");
+		return NULL;
+	}
+
+	raw_matrix = PyCapsule_GetPointer(capsule, "qsimov.doki.funmatrix");
+	if (raw_matrix == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to matrix");
+		return NULL;
+	}
+
+	cache_stats((struct FMatrix *)raw_matrix, stats);
+
+	return Py_BuildValue("(KKKKK)", (unsigned long long)stats[0],
+			     (unsigned long long)stats[1],
+			     (unsigned long long)stats[2],
+			     (unsigned long long)stats[3],
+			     (unsigned long long)stats[4]);
+}
+
 static PyObject *doki_funmatrix_mem(PyObject *self, PyObject *args)
 {
 	PyObject *fmat_capsule;
@@ -2458,3 +5457,371 @@ static PyObject *doki_funmatrix_mem(PyObject *self, PyObject *args)
 
 	return PyLong_FromSize_t(size);
 }
+
+static PyObject *doki_funmatrix_compile(PyObject *self, PyObject *args)
+{
+	PyObject *capsule;
+	struct FMProgram *program;
+	size_t info[3];
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "Op", &capsule, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: funmatrix_compile(funmatrix, verbose)");
+		return NULL;
+	}
+
+	program = fm_compile(capsule);
+	if (program == NULL) {
+		switch (errno) {
+		case 1:
+			PyErr_SetString(
+				DokiError,
+				"[COMPILE] Failed to allocate the program");
+			break;
+		case 3:
+			PyErr_SetString(DokiError,
+					"[COMPILE] The matrix is NULL");
+			break;
+		default:
+			PyErr_SetString(DokiError,
+					"[COMPILE] Unknown error code");
+		}
+		return NULL;
+	}
+	if (debug_enabled) {
+		fm_program_info(program, info);
+		printf("[DEBUG] %zu instructions, %zu registers, %zu getitem "
+		       "calls\n",
+		       info[0], info[1], info[2]);
+	}
+
+	return PyCapsule_New((void *)program, "qsimov.doki.fmprogram",
+			     &doki_fmprogram_destroy);
+}
+
+static PyObject *doki_funmatrix_eval(PyObject *self, PyObject *args)
+{
+	PyObject *capsule, *raw_rows, *raw_cols;
+	PyArrayObject *ids_rows, *ids_cols, *values;
+	struct FMProgram *program;
+	struct FMatrix *matrix;
+	NATURAL_TYPE *rows, *cols, num, k;
+	COMPLEX_TYPE *out;
+	npy_intp dims[1];
+	int debug_enabled, num_threads, res;
+
+	if (!PyArg_ParseTuple(args, "OOOip", &capsule, &raw_rows, &raw_cols,
+			      &num_threads, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: funmatrix_eval(program_or_funmatrix, "
+				"rows, cols, num_threads, verbose)");
+		return NULL;
+	}
+
+	if (num_threads <= 0 && num_threads != -1) {
+		PyErr_SetString(
+			DokiError,
+			"num_threads must be at least 1 (or -1 to let OpenMP choose)");
+		return NULL;
+	}
+
+	program = NULL;
+	matrix = NULL;
+	if (PyCapsule_IsValid(capsule, "qsimov.doki.fmprogram")) {
+		program = PyCapsule_GetPointer(capsule,
+					       "qsimov.doki.fmprogram");
+	} else if (PyCapsule_IsValid(capsule, "qsimov.doki.funmatrix")) {
+		matrix = PyCapsule_GetPointer(capsule,
+					      "qsimov.doki.funmatrix");
+	}
+	if (program == NULL && matrix == NULL) {
+		PyErr_SetString(DokiError, "NULL pointer to program or matrix");
+		return NULL;
+	}
+
+	ids_rows = (PyArrayObject *)PyArray_FROMANY(raw_rows, NPY_INT64, 1, 1,
+						    NPY_ARRAY_IN_ARRAY);
+	ids_cols = (PyArrayObject *)PyArray_FROMANY(raw_cols, NPY_INT64, 1, 1,
+						    NPY_ARRAY_IN_ARRAY);
+	if (ids_rows == NULL || ids_cols == NULL ||
+	    PyArray_SIZE(ids_rows) != PyArray_SIZE(ids_cols)) {
+		Py_XDECREF(ids_rows);
+		Py_XDECREF(ids_cols);
+		PyErr_SetString(DokiError,
+				"rows and cols must be one-dimensional lists "
+				"of integers with the same length");
+		return NULL;
+	}
+	rows = (NATURAL_TYPE *)PyArray_DATA(ids_rows);
+	cols = (NATURAL_TYPE *)PyArray_DATA(ids_cols);
+	num = (NATURAL_TYPE)PyArray_SIZE(ids_rows);
+
+	dims[0] = (npy_intp)num;
+	values = (PyArrayObject *)PyArray_SimpleNew(1, dims, NPY_COMPLEX_TYPE);
+	if (values == NULL) {
+		Py_DECREF(ids_rows);
+		Py_DECREF(ids_cols);
+		return NULL;
+	}
+	out = (COMPLEX_TYPE *)PyArray_DATA(values);
+
+	Py_BEGIN_ALLOW_THREADS
+	if (program != NULL) {
+		res = fm_eval(program, rows, cols, num, out, num_threads);
+	} else {
+		/* plain matrices go through the recursive interpreter */
+		res = 0;
+		for (k = 0; k < num && res == 0; k++) {
+			res = rows[k] < 0 || cols[k] < 0
+				      ? 7
+				      : getitem(matrix, rows[k], cols[k],
+						out + k);
+		}
+	}
+	Py_END_ALLOW_THREADS
+	Py_DECREF(ids_rows);
+	Py_DECREF(ids_cols);
+
+	if (res != 0) {
+		Py_DECREF(values);
+		switch (res) {
+		case 1:
+			PyErr_SetString(DokiError,
+					"[EVAL] Error adding parent matrices");
+			break;
+		case 2:
+			PyErr_SetString(
+				DokiError,
+				"[EVAL] Error substracting parent matrices");
+			break;
+		case 3:
+			PyErr_SetString(
+				DokiError,
+				"[EVAL] Error multiplying parent matrices");
+			break;
+		case 4:
+			PyErr_SetString(
+				DokiError,
+				"[EVAL] Error multiplying entity-wise parent matrices");
+			break;
+		case 5:
+			PyErr_SetString(
+				DokiError,
+				"[EVAL] Error calculating Kronecker product of parent matrices");
+			break;
+		case 6:
+			PyErr_SetString(
+				DokiError,
+				"[EVAL] Unknown operation between parent matrices");
+			break;
+		case 7:
+			PyErr_SetString(DokiError,
+					"[EVAL] Element out of bounds");
+			break;
+		case 8:
+			PyErr_SetString(DokiError, "[EVAL] f returned NAN");
+			break;
+		case 9:
+			PyErr_SetString(DokiError,
+					"[EVAL] Failed to allocate registers");
+			break;
+		default:
+			PyErr_SetString(DokiError,
+					"[EVAL] Unknown error code");
+		}
+		return NULL;
+	}
+
+	return (PyObject *)values;
+}
+
+/* Convert obj into a read-only one-dimensional array of type. Arrays of the
+ * caller are only used as they are if they are read-only, otherwise they
+ * could be modified while a sparse matrix still reads them */
+static PyArrayObject *read_sparse_array(PyObject *obj, int type)
+{
+	PyArrayObject *arr, *copy;
+
+	arr = (PyArrayObject *)PyArray_FROMANY(obj, type, 1, 1,
+					       NPY_ARRAY_IN_ARRAY);
+	if (arr == NULL || !PyArray_ISWRITEABLE(arr)) {
+		return arr;
+	}
+	if ((PyObject *)arr == obj) {
+		copy = (PyArrayObject *)PyArray_NewCopy(arr, NPY_CORDER);
+		Py_DECREF(arr);
+		if (copy == NULL) {
+			return NULL;
+		}
+		arr = copy;
+	}
+	PyArray_CLEARFLAGS(arr, NPY_ARRAY_WRITEABLE);
+
+	return arr;
+}
+
+static PyObject *doki_funmatrix_csr(PyObject *self, PyObject *args)
+{
+	PyObject *raw_indptr, *raw_indices, *raw_data, *owner;
+	PyArrayObject *indptr, *indices, *data;
+	struct FMatrix *funmatrix;
+	NATURAL_TYPE num_rows, num_cols, nnz;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "LLOOOp", &num_rows, &num_cols,
+			      &raw_indptr, &raw_indices, &raw_data,
+			      &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: funmatrix_csr(num_rows, num_cols, "
+				"indptr, indices, data, verbose)");
+		return NULL;
+	}
+	if (num_rows <= 0 || num_cols <= 0) {
+		PyErr_SetString(DokiError,
+				"num_rows and num_cols must be positive");
+		return NULL;
+	}
+
+	/* read-only arrays that already have the right type are not copied */
+	indptr = read_sparse_array(raw_indptr, NPY_INT64);
+	indices = read_sparse_array(raw_indices, NPY_INT64);
+	data = read_sparse_array(raw_data, NPY_COMPLEX_TYPE);
+	if (indptr == NULL || indices == NULL || data == NULL ||
+	    (NATURAL_TYPE)PyArray_SIZE(indptr) != num_rows + 1) {
+		Py_XDECREF(indptr);
+		Py_XDECREF(indices);
+		Py_XDECREF(data);
+		PyErr_SetString(DokiError,
+				"indptr must be a list of num_rows + 1 "
+				"integers, indices a list of integers and "
+				"data a list of complex numbers");
+		return NULL;
+	}
+	nnz = ((NATURAL_TYPE *)PyArray_DATA(indptr))[num_rows];
+	if ((NATURAL_TYPE)PyArray_SIZE(indices) != nnz ||
+	    (NATURAL_TYPE)PyArray_SIZE(data) != nnz) {
+		Py_DECREF(indptr);
+		Py_DECREF(indices);
+		Py_DECREF(data);
+		PyErr_SetString(DokiError,
+				"indices and data must have indptr[num_rows] "
+				"elements");
+		return NULL;
+	}
+	if (debug_enabled) {
+		printf("[DEBUG] CSR matrix with %lld elements\n",
+		       (long long)nnz);
+	}
+	owner = PyTuple_Pack(3, indptr, indices, data);
+	Py_DECREF(indptr);
+	Py_DECREF(indices);
+	Py_DECREF(data);
+	if (owner == NULL) {
+		return NULL;
+	}
+
+	errno = 0;
+	funmatrix = SparseMat(num_rows, num_cols,
+			      (NATURAL_TYPE *)PyArray_DATA(indptr),
+			      (NATURAL_TYPE *)PyArray_DATA(indices),
+			      (COMPLEX_TYPE *)PyArray_DATA(data), owner);
+	Py_DECREF(owner);
+	if (funmatrix == NULL) {
+		switch (errno) {
+		case 1:
+			PyErr_SetString(DokiError,
+					"[CSR] Failed to allocate result matrix");
+			break;
+		case 2:
+			PyErr_SetString(
+				DokiError,
+				"[CSR] indptr must start at 0 and never decrease, "
+				"and indices must be columns of the matrix");
+			break;
+		case 5:
+			PyErr_SetString(DokiError,
+					"[CSR] Failed to allocate sparse data");
+			break;
+		default:
+			PyErr_SetString(DokiError, "[CSR] Unknown error code");
+		}
+		return NULL;
+	}
+
+	return PyCapsule_New((void *)funmatrix, "qsimov.doki.funmatrix",
+			     &doki_funmatrix_destroy);
+}
+
+static PyObject *doki_funmatrix_coo(PyObject *self, PyObject *args)
+{
+	PyObject *raw_rows, *raw_cols, *raw_data;
+	PyArrayObject *rows, *cols, *data;
+	struct FMatrix *funmatrix;
+	NATURAL_TYPE num_rows, num_cols, nnz;
+	int debug_enabled;
+
+	if (!PyArg_ParseTuple(args, "LLOOOp", &num_rows, &num_cols, &raw_rows,
+			      &raw_cols, &raw_data, &debug_enabled)) {
+		PyErr_SetString(DokiError,
+				"Syntax: funmatrix_coo(num_rows, num_cols, "
+				"rows, cols, data, verbose)");
+		return NULL;
+	}
+
+	rows = (PyArrayObject *)PyArray_FROMANY(raw_rows, NPY_INT64, 1, 1,
+						NPY_ARRAY_IN_ARRAY);
+	cols = (PyArrayObject *)PyArray_FROMANY(raw_cols, NPY_INT64, 1, 1,
+						NPY_ARRAY_IN_ARRAY);
+	data = (PyArrayObject *)PyArray_FROMANY(raw_data, NPY_COMPLEX_TYPE, 1,
+						1, NPY_ARRAY_IN_ARRAY);
+	if (rows == NULL || cols == NULL || data == NULL ||
+	    PyArray_SIZE(rows) != PyArray_SIZE(cols) ||
+	    PyArray_SIZE(rows) != PyArray_SIZE(data)) {
+		Py_XDECREF(rows);
+		Py_XDECREF(cols);
+		Py_XDECREF(data);
+		PyErr_SetString(DokiError,
+				"rows, cols and data must be one-dimensional "
+				"lists with the same length");
+		return NULL;
+	}
+	nnz = (NATURAL_TYPE)PyArray_SIZE(rows);
+	if (debug_enabled) {
+		printf("[DEBUG] COO matrix with %lld triplets\n",
+		       (long long)nnz);
+	}
+
+	errno = 0;
+	funmatrix = SparseMatCOO(num_rows, num_cols, nnz,
+				 (NATURAL_TYPE *)PyArray_DATA(rows),
+				 (NATURAL_TYPE *)PyArray_DATA(cols),
+				 (COMPLEX_TYPE *)PyArray_DATA(data));
+	Py_DECREF(rows);
+	Py_DECREF(cols);
+	Py_DECREF(data);
+	if (funmatrix == NULL) {
+		switch (errno) {
+		case 1:
+			PyErr_SetString(DokiError,
+					"[COO] Failed to allocate result matrix");
+			break;
+		case 2:
+			PyErr_SetString(
+				DokiError,
+				"[COO] num_rows and num_cols must be positive, "
+				"and every element must be inside the matrix");
+			break;
+		case 5:
+			PyErr_SetString(DokiError,
+					"[COO] Failed to allocate sparse data");
+			break;
+		default:
+			PyErr_SetString(DokiError, "[COO] Unknown error code");
+		}
+		return NULL;
+	}
+
+	return PyCapsule_New((void *)funmatrix, "qsimov.doki.funmatrix",
+			     &doki_funmatrix_destroy);
+}
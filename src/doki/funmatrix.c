@@ -62,6 +62,55 @@ struct Projection {
 	bool value;
 };
 
+/* Sparse matrix stored in CSR format */
+struct SparseMatrix {
+	/* The columns and values of the row i are in [indptr[i], indptr[i + 1])
+	 * of indices and data, sorted by column (repeated ones are added) */
+	const NATURAL_TYPE *indptr;
+	const NATURAL_TYPE *indices;
+	const COMPLEX_TYPE *data;
+	/* Object owning the arrays, or NULL if they were allocated here */
+	PyObject *owner;
+	NATURAL_TYPE num_rows;
+	NATURAL_TYPE nnz;
+	/* Number of matrices using this struct */
+	size_t refcount;
+};
+
+/* Column and value of a stored element, used to sort rows */
+struct SparseEntry {
+	NATURAL_TYPE col;
+	COMPLEX_TYPE val;
+};
+
+/* Rows and columns of the blocks kept by the node caches */
+#define CACHE_TILE 32
+
+struct CacheBlock {
+	/* Position of the block, in blocks */
+	NATURAL_TYPE bi, bj;
+	/* Next block in the same hash bucket */
+	struct CacheBlock *next_hash;
+	/* Neighbours in the list sorted from the most recently used block */
+	struct CacheBlock *newer, *older;
+	/* Elements of the block, row by row */
+	COMPLEX_TYPE values[CACHE_TILE * CACHE_TILE];
+};
+
+struct FMCache {
+	/* Hash table with the blocks (a power of two of buckets) */
+	struct CacheBlock **buckets;
+	size_t num_buckets;
+	/* Ends of the list of blocks sorted by last use */
+	struct CacheBlock *newest, *oldest;
+	/* Blocks stored and maximum allowed (0 when disabled) */
+	size_t num_blocks, max_blocks;
+	/* Statistics */
+	size_t hits, misses, evictions;
+	/* Lock protecting the whole cache (lookups reorder the list) */
+	RWLOCK_TYPE lock;
+};
+
 static void free_matrixelem(void *raw_me);
 
 static void *clone_matrixelem(void *raw_me);
@@ -94,6 +143,26 @@ static size_t size_fmat_capsule(void *raw_capsule);
 
 static struct FMatrix *_WalshHadamard(int n, bool isHadamard);
 
+static void _cache_free(struct FMCache *cache);
+
+static size_t _cache_mem_size(struct FMCache *cache);
+
+static int _getitem_node(struct FMatrix *a, NATURAL_TYPE i, NATURAL_TYPE j,
+			 COMPLEX_TYPE *sol);
+
+static int _cached_getitem(struct FMatrix *a, NATURAL_TYPE i, NATURAL_TYPE j,
+			   COMPLEX_TYPE *sol);
+
+static int _cached_gather(struct FMatrix *a, const NATURAL_TYPE *rows,
+			  NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			  NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			  NATURAL_TYPE cs);
+
+static int _gather_matmul(struct FMatrix *a, const NATURAL_TYPE *rows,
+			  NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			  NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			  NATURAL_TYPE cs);
+
 #ifndef _MSC_VER
 __attribute__((const))
 #endif
@@ -192,6 +261,20 @@ _CustomMat(NATURAL_TYPE i, NATURAL_TYPE j, NATURAL_TYPE nrows,
 #endif
 	   void *matrix_2d);
 
+static COMPLEX_TYPE _SparseFunction(NATURAL_TYPE i, NATURAL_TYPE j,
+#ifndef _MSC_VER
+				    NATURAL_TYPE unused1
+				    __attribute__((unused)),
+				    NATURAL_TYPE unused2
+				    __attribute__((unused)),
+#else
+				    NATURAL_TYPE unused1,
+				    NATURAL_TYPE unused2,
+#endif
+				    void *raw_sparse);
+
+static bool _is_sparse(struct FMatrix *m);
+
 /*
  * Calculates the number of bytes added to a string
  * using the result of the sprintf function.
@@ -229,6 +312,7 @@ new_FunctionalMatrix(NATURAL_TYPE n_rows, NATURAL_TYPE n_columns,
 		pFM->argv_free = argv_free;
 		pFM->argv_clone = argv_clone;
 		pFM->argv_size = argv_size;
+		pFM->cache = NULL;
 	}
 
 	return pFM;
@@ -238,7 +322,17 @@ new_FunctionalMatrix(NATURAL_TYPE n_rows, NATURAL_TYPE n_columns,
 int getitem(struct FMatrix *a, NATURAL_TYPE i, NATURAL_TYPE j,
 	    COMPLEX_TYPE *sol)
 {
-	unsigned int k;
+	if (a->cache != NULL && i >= 0 && j >= 0 && i < a->r && j < a->c) {
+		return _cached_getitem(a, i, j, sol);
+	}
+
+	return _getitem_node(a, i, j, sol);
+}
+
+/* Get the element (i, j) from the matrix a, without looking at its cache */
+static int _getitem_node(struct FMatrix *a, NATURAL_TYPE i, NATURAL_TYPE j,
+			 COMPLEX_TYPE *sol)
+{
 	NATURAL_TYPE aux;
 	int result = 0;
 	COMPLEX_TYPE aux1 = COMPLEX_ZERO, aux2 = COMPLEX_ZERO;
@@ -278,19 +372,12 @@ int getitem(struct FMatrix *a, NATURAL_TYPE i, NATURAL_TYPE j,
 				}
 				break;
 			case 2: /* Matrix multiplication    */
-				*sol = COMPLEX_ZERO;
-				for (k = 0; k < a->A->c; k++) {
-					res1 = getitem(a->A, i, k, &aux1);
-					res2 = getitem(a->B, k, j, &aux2);
-					if (res1 == 0 && res2 == 0) {
-						*sol = COMPLEX_ADD(
-							*sol,
-							COMPLEX_MULT(aux1,
-								     aux2));
-					} else {
-						result = 3;
-						break;
-					}
+				/* row i of A and column j of B are evaluated
+				 * by panels instead of one element at a time */
+				if (_gather_matmul(a, &i, 1, &j, 1, sol, 1,
+						   1) != 0) {
+					*sol = COMPLEX_NAN;
+					result = 3;
 				}
 				break;
 			case 3: /* Entity-wise multiplication */
@@ -339,6 +426,24 @@ int getitem(struct FMatrix *a, NATURAL_TYPE i, NATURAL_TYPE j,
 	return result;
 }
 
+static bool _is_identity(struct FMatrix *m)
+{
+	/* the identity is its own transpose and conjugate */
+	return m->simple && m->f == &_IdentityFunction;
+}
+
+/* Number of qubits of a 2^n size */
+static NATURAL_TYPE _num_qubits(NATURAL_TYPE size)
+{
+	NATURAL_TYPE n;
+
+	for (n = 0; size > 1; size >>= 1) {
+		n++;
+	}
+
+	return n;
+}
+
 /* Addition */
 struct FMatrix *madd(PyObject *raw_a, PyObject *raw_b)
 {
@@ -377,6 +482,7 @@ struct FMatrix *madd(PyObject *raw_a, PyObject *raw_b)
 			pFM->argv_free = NULL;
 			pFM->argv_clone = NULL;
 			pFM->argv_size = NULL;
+			pFM->cache = NULL;
 		} else {
 			errno = 1;
 		}
@@ -425,6 +531,7 @@ struct FMatrix *msub(PyObject *raw_a, PyObject *raw_b)
 			pFM->argv_free = NULL;
 			pFM->argv_clone = NULL;
 			pFM->argv_size = NULL;
+			pFM->cache = NULL;
 		} else {
 			errno = 1;
 		}
@@ -470,6 +577,7 @@ struct FMatrix *mprod(COMPLEX_TYPE r, PyObject *raw_m)
 		pFM->argv_free = m->argv_free;
 		pFM->argv_clone = m->argv_clone;
 		pFM->argv_size = m->argv_size;
+		pFM->cache = NULL;
 	} else {
 		errno = 1;
 	}
@@ -512,6 +620,7 @@ struct FMatrix *mdiv(COMPLEX_TYPE r, PyObject *raw_m)
 		pFM->argv_free = m->argv_free;
 		pFM->argv_clone = m->argv_clone;
 		pFM->argv_size = m->argv_size;
+		pFM->cache = NULL;
 	} else {
 		errno = 1;
 	}
@@ -535,7 +644,11 @@ struct FMatrix *matmul(PyObject *raw_a, PyObject *raw_b)
 		return NULL;
 	}
 	/* if the dimensions allign (uxv * vxw) */
-	if (a->c == b->r) {
+	if (a->c == b->r && _is_identity(a)) { /* I * B = B */
+		pFM = mprod(a->s, raw_b);
+	} else if (a->c == b->r && _is_identity(b)) { /* A * I = A */
+		pFM = mprod(b->s, raw_a);
+	} else if (a->c == b->r) {
 		pFM = MALLOC_TYPE(1, struct FMatrix);
 		if (pFM != NULL) {
 			pFM->r = a->r;
@@ -556,6 +669,7 @@ struct FMatrix *matmul(PyObject *raw_a, PyObject *raw_b)
 			pFM->argv_free = NULL;
 			pFM->argv_clone = NULL;
 			pFM->argv_size = NULL;
+			pFM->cache = NULL;
 		} else {
 			errno = 1;
 		}
@@ -605,6 +719,7 @@ struct FMatrix *ewmul(PyObject *raw_a, PyObject *raw_b)
 			pFM->argv_free = NULL;
 			pFM->argv_clone = NULL;
 			pFM->argv_size = NULL;
+			pFM->cache = NULL;
 		} else {
 			errno = 1;
 		}
@@ -635,6 +750,18 @@ struct FMatrix *kron(PyObject *raw_a, PyObject *raw_b)
 		return NULL;
 	}
 
+	/* I kron B and A kron I are evaluated faster as eyeKron */
+	if (_is_identity(a) || _is_identity(b)) {
+		pFM = _is_identity(a) ? eyeKron(raw_b, _num_qubits(a->r), 0)
+				      : eyeKron(raw_a, 0, _num_qubits(b->r));
+		if (pFM != NULL) {
+			pFM->s = _is_identity(a) ? a->s : b->s;
+		} else {
+			errno = 1;
+		}
+		return pFM;
+	}
+
 	pFM = MALLOC_TYPE(1, struct FMatrix);
 	if (pFM != NULL) {
 		pFM->r = a->r * b->r;
@@ -655,6 +782,7 @@ struct FMatrix *kron(PyObject *raw_a, PyObject *raw_b)
 		pFM->argv_free = NULL;
 		pFM->argv_clone = NULL;
 		pFM->argv_size = NULL;
+		pFM->cache = NULL;
 	} else {
 		errno = 1;
 	}
@@ -785,6 +913,7 @@ struct FMatrix *transpose(PyObject *raw_m)
 		pFM->argv_free = m->argv_free;
 		pFM->argv_clone = m->argv_clone;
 		pFM->argv_size = m->argv_size;
+		pFM->cache = NULL;
 	} else {
 		errno = 1;
 	}
@@ -814,7 +943,7 @@ struct FMatrix *dagger(PyObject *raw_m)
 		pFM->B = m->B;
 		Py_XINCREF(m->B_capsule);
 		pFM->B_capsule = m->B_capsule;
-		pFM->s = m->s;
+		pFM->s = conj(m->s);
 		pFM->op = m->op;
 		pFM->transpose = !(m->transpose);
 		pFM->conjugate = !(m->conjugate);
@@ -827,6 +956,7 @@ struct FMatrix *dagger(PyObject *raw_m)
 		pFM->argv_free = m->argv_free;
 		pFM->argv_clone = m->argv_clone;
 		pFM->argv_size = m->argv_size;
+		pFM->cache = NULL;
 	} else {
 		errno = 1;
 	}
@@ -1036,160 +1166,1600 @@ struct FMatrix *partial_trace(PyObject *raw_m, int elem)
 	return pt;
 }
 
-NATURAL_TYPE
-rows(struct FMatrix *m)
+/* Rows and columns of the output tiles evaluated by each task */
+#define MATERIALIZE_TILE 64
+/* Inner indexes of a matrix product evaluated at once */
+#define MATERIALIZE_DEPTH 64
+
+static int _gather(struct FMatrix *a, const NATURAL_TYPE *rows,
+		   NATURAL_TYPE nr, const NATURAL_TYPE *cols, NATURAL_TYPE nc,
+		   COMPLEX_TYPE *out, NATURAL_TYPE rs, NATURAL_TYPE cs);
+
+static int _gather_node(struct FMatrix *a, const NATURAL_TYPE *rows,
+			NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			NATURAL_TYPE cs);
+
+/* Distinct values of idx (all of them below dim) in uniq, and the place of
+ * each element of idx in uniq in pos. Only runs of repeated values are
+ * detected, unless idx is long enough to hold every value below dim. */
+static NATURAL_TYPE _distinct(const NATURAL_TYPE *idx, NATURAL_TYPE n,
+			      NATURAL_TYPE dim, NATURAL_TYPE *uniq,
+			      NATURAL_TYPE *pos)
 {
-	return m->r;
+	NATURAL_TYPE x, count;
+
+	if (n >= dim) {
+		for (x = 0; x < dim; x++) {
+			uniq[x] = x;
+		}
+		for (x = 0; x < n; x++) {
+			pos[x] = idx[x];
+		}
+		return dim;
+	}
+	count = 0;
+	for (x = 0; x < n; x++) {
+		if (count == 0 || uniq[count - 1] != idx[x]) {
+			uniq[count++] = idx[x];
+		}
+		pos[x] = count - 1;
+	}
+
+	return count;
 }
 
-NATURAL_TYPE
-columns(struct FMatrix *m)
+/* Both operands of an element-wise operation over the same elements */
+static int _gather_elementwise(struct FMatrix *a, const NATURAL_TYPE *rows,
+			       NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			       NATURAL_TYPE nc, COMPLEX_TYPE *out,
+			       NATURAL_TYPE rs, NATURAL_TYPE cs)
 {
-	return m->c;
+	NATURAL_TYPE x, y;
+	COMPLEX_TYPE *other, *val;
+
+	other = MALLOC_TYPE(nr * nc, COMPLEX_TYPE);
+	if (other == NULL) {
+		return 9;
+	}
+	if (_gather(a->A, rows, nr, cols, nc, out, rs, cs) != 0 ||
+	    _gather(a->B, rows, nr, cols, nc, other, nc, 1) != 0) {
+		free(other);
+		return a->op == 0 ? 1 : (a->op == 1 ? 2 : 4);
+	}
+	for (x = 0; x < nr; x++) {
+		for (y = 0; y < nc; y++) {
+			val = out + x * rs + y * cs;
+			switch (a->op) {
+			case 0:
+				*val = COMPLEX_ADD(*val, other[x * nc + y]);
+				break;
+			case 1:
+				*val = COMPLEX_SUB(*val, other[x * nc + y]);
+				break;
+			default:
+				*val = COMPLEX_MULT(*val, other[x * nc + y]);
+			}
+		}
+	}
+	free(other);
+
+	return 0;
 }
 
-static COMPLEX_TYPE _IdentityFunction(NATURAL_TYPE i, NATURAL_TYPE j,
-#ifndef _MSC_VER
-				      NATURAL_TYPE unused1
-				      __attribute__((unused)),
-				      NATURAL_TYPE unused2
-				      __attribute__((unused)),
-				      void *unused3 __attribute__((unused))
-#else
-				      NATURAL_TYPE unused1,
-				      NATURAL_TYPE unused2, void *unused3
-#endif
-)
+/* Kronecker product: every distinct element of each operand is only
+ * evaluated once */
+static int _gather_kron(struct FMatrix *a, const NATURAL_TYPE *rows,
+			NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			NATURAL_TYPE cs)
 {
-	return COMPLEX_INIT(i == j, 0);
+	NATURAL_TYPE *idx, *ar, *ac, *br, *bc, *par, *pac, *pbr, *pbc, nar,
+		nac, nbr, nbc, x, y;
+	COMPLEX_TYPE *val_a, *val_b;
+	int result;
+
+	idx = MALLOC_TYPE(6 * (nr + nc), NATURAL_TYPE);
+	val_a = MALLOC_TYPE(2 * nr * nc, COMPLEX_TYPE);
+	if (idx == NULL || val_a == NULL) {
+		free(idx);
+		free(val_a);
+		return 9;
+	}
+	val_b = val_a + nr * nc;
+	ar = idx + 2 * (nr + nc);
+	ac = ar + nr;
+	br = ac + nc;
+	bc = br + nr;
+	par = bc + nc;
+	pac = par + nr;
+	pbr = pac + nc;
+	pbc = pbr + nr;
+	result = 0;
+	for (x = 0; x < nr; x++) {
+		idx[x] = rows[x] / a->B->r;
+		idx[nr + x] = rows[x] % a->B->r;
+		if (idx[x] >= a->A->r) {
+			result = 5;
+		}
+	}
+	for (y = 0; y < nc; y++) {
+		idx[2 * nr + y] = cols[y] / a->B->c;
+		idx[2 * nr + nc + y] = cols[y] % a->B->c;
+		if (idx[2 * nr + y] >= a->A->c) {
+			result = 5;
+		}
+	}
+	if (result != 0) {
+		/* out of the bounds of a transposed product */
+		free(idx);
+		free(val_a);
+		return result;
+	}
+	nar = _distinct(idx, nr, a->A->r, ar, par);
+	nbr = _distinct(idx + nr, nr, a->B->r, br, pbr);
+	nac = _distinct(idx + 2 * nr, nc, a->A->c, ac, pac);
+	nbc = _distinct(idx + 2 * nr + nc, nc, a->B->c, bc, pbc);
+	result = _gather(a->A, ar, nar, ac, nac, val_a, nac, 1);
+	if (result == 0) {
+		result = _gather(a->B, br, nbr, bc, nbc, val_b, nbc, 1);
+	}
+	if (result == 0) {
+		for (x = 0; x < nr; x++) {
+			for (y = 0; y < nc; y++) {
+				out[x * rs + y * cs] = COMPLEX_MULT(
+					val_a[par[x] * nac + pac[y]],
+					val_b[pbr[x] * nbc + pbc[y]]);
+			}
+		}
+	}
+	free(idx);
+	free(val_a);
+
+	return result == 0 ? 0 : 5;
 }
 
-struct FMatrix *Identity(int n)
+static int _natural_cmp(const void *raw_a, const void *raw_b)
 {
-	struct FMatrix *pFM;
-	NATURAL_TYPE size;
+	NATURAL_TYPE a = *(const NATURAL_TYPE *)raw_a,
+		     b = *(const NATURAL_TYPE *)raw_b;
 
-	size = NATURAL_ONE << n; // 2^n
-	pFM = new_FunctionalMatrix(size, size, &_IdentityFunction, NULL, NULL,
-				   NULL, NULL);
-
-	return pFM;
+	return (a > b) - (a < b);
 }
 
-static COMPLEX_TYPE _StateZeroFunction(NATURAL_TYPE i, NATURAL_TYPE j,
-#ifndef _MSC_VER
-				       NATURAL_TYPE unused1
-				       __attribute__((unused)),
-				       NATURAL_TYPE unused2
-				       __attribute__((unused)),
-				       void *unused3 __attribute__((unused))
-#else
-				       NATURAL_TYPE unused1,
-				       NATURAL_TYPE unused2, void *unused3
-#endif
-)
+/* Sparse leaf: the requested columns are sorted once and merged with the
+ * stored elements of every row, so each row costs its nonzeros plus nc */
+static int _gather_sparse(struct FMatrix *a, const NATURAL_TYPE *rows,
+			  NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			  NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			  NATURAL_TYPE cs)
 {
-	return COMPLEX_INIT(i == 0, 0);
+	struct SparseMatrix *sparse;
+	NATURAL_TYPE *order, x, y, p, end, q, col;
+	COMPLEX_TYPE *val;
+
+	sparse = (struct SparseMatrix *)a->argv;
+	/* pairs of column and position in cols, sorted by column */
+	order = MALLOC_TYPE(2 * nc, NATURAL_TYPE);
+	if (order == NULL) {
+		return 9;
+	}
+	for (y = 0; y < nc; y++) {
+		order[2 * y] = cols[y];
+		order[2 * y + 1] = y;
+	}
+	qsort(order, nc, 2 * sizeof(NATURAL_TYPE), _natural_cmp);
+	for (x = 0; x < nr; x++) {
+		for (y = 0; y < nc; y++) {
+			out[x * rs + y * cs] = COMPLEX_ZERO;
+		}
+		end = sparse->indptr[rows[x] + 1];
+		q = 0;
+		for (p = sparse->indptr[rows[x]]; p < end && q < nc; p++) {
+			col = sparse->indices[p];
+			while (q < nc && order[2 * q] < col) {
+				q++;
+			}
+			for (y = q; y < nc && order[2 * y] == col; y++) {
+				val = out + x * rs + order[2 * y + 1] * cs;
+				*val = COMPLEX_ADD(*val, sparse->data[p]);
+			}
+		}
+	}
+	free(order);
+
+	return 0;
 }
 
-struct FMatrix *StateZero(int n)
+/* Product whose left operand is a sparse leaf: only the rows of B matching
+ * the nonzero columns of the requested rows of A are evaluated, and each
+ * nonzero is multiplied by its row of B. acc has nur x nuc elements. */
+static int _sparse_matmul(struct FMatrix *a, const NATURAL_TYPE *ur,
+			  NATURAL_TYPE nur, const NATURAL_TYPE *uc,
+			  NATURAL_TYPE nuc, COMPLEX_TYPE *acc)
 {
-	struct FMatrix *pFM;
-	NATURAL_TYPE size;
+	struct SparseMatrix *sparse;
+	NATURAL_TYPE *inner, *cursor, count, num_inner, k0, depth, x, y, p,
+		end, q;
+	COMPLEX_TYPE *val_b, *row, elem;
+	int result;
 
-	size = NATURAL_ONE << n; // 2^n
-	pFM = new_FunctionalMatrix(size, 1, &_StateZeroFunction, NULL, NULL,
-				   NULL, NULL);
+	sparse = (struct SparseMatrix *)a->A->argv;
+	count = 0;
+	for (x = 0; x < nur; x++) {
+		count += sparse->indptr[ur[x] + 1] - sparse->indptr[ur[x]];
+	}
+	inner = MALLOC_TYPE(count + nur + 1, NATURAL_TYPE);
+	val_b = MALLOC_TYPE(MATERIALIZE_DEPTH * nuc, COMPLEX_TYPE);
+	if (inner == NULL || val_b == NULL) {
+		free(inner);
+		free(val_b);
+		return 9;
+	}
+	cursor = inner + count;
+	/* sorted distinct columns of A (rows of B) that are needed */
+	count = 0;
+	for (x = 0; x < nur; x++) {
+		cursor[x] = sparse->indptr[ur[x]];
+		for (p = cursor[x]; p < sparse->indptr[ur[x] + 1]; p++) {
+			inner[count++] = sparse->indices[p];
+		}
+	}
+	qsort(inner, count, sizeof(NATURAL_TYPE), _natural_cmp);
+	num_inner = 0;
+	for (p = 0; p < count; p++) {
+		if (num_inner == 0 || inner[num_inner - 1] != inner[p]) {
+			inner[num_inner++] = inner[p];
+		}
+	}
+	result = 0;
+	for (k0 = 0; k0 < num_inner && result == 0; k0 += depth) {
+		depth = num_inner - k0 < MATERIALIZE_DEPTH ? num_inner - k0
+							   : MATERIALIZE_DEPTH;
+		result = _gather(a->B, inner + k0, depth, uc, nuc, val_b, nuc,
+				 1);
+		for (x = 0; x < nur && result == 0; x++) {
+			end = sparse->indptr[ur[x] + 1];
+			q = k0;
+			/* the rows are sorted, so every row continues where
+			 * the previous block left it */
+			for (p = cursor[x];
+			     p < end &&
+			     sparse->indices[p] <= inner[k0 + depth - 1];
+			     p++) {
+				while (inner[q] < sparse->indices[p]) {
+					q++;
+				}
+				elem = sparse->data[p];
+				if (a->A->conjugate) {
+					elem = conj(elem);
+				}
+				elem = COMPLEX_MULT(elem, a->A->s);
+				row = val_b + (q - k0) * nuc;
+				for (y = 0; y < nuc; y++) {
+					acc[x * nuc + y] = COMPLEX_ADD(
+						acc[x * nuc + y],
+						COMPLEX_MULT(elem, row[y]));
+				}
+			}
+			cursor[x] = p;
+		}
+	}
+	free(inner);
+	free(val_b);
 
-	return pFM;
+	return result;
 }
 
-static COMPLEX_TYPE _DensityZeroFunction(NATURAL_TYPE i, NATURAL_TYPE j,
-#ifndef _MSC_VER
-					 NATURAL_TYPE unused1
-					 __attribute__((unused)),
-					 NATURAL_TYPE unused2
-					 __attribute__((unused)),
-					 void *unused3 __attribute__((unused))
-#else
-					 NATURAL_TYPE unused1,
-					 NATURAL_TYPE unused2, void *unused3
-#endif
-)
+/* Number of columns of B whose products are kept in registers */
+#define GEMM_WIDTH 4
+
+/* acc[x * nc + y] += val_a[x * depth + k] * val_b[k * nc + y] for every k.
+ * Each step keeps a block of two rows by GEMM_WIDTH columns in registers for
+ * the whole panel, so every element of A and B that is loaded is used
+ * several times, and the complex products are written in terms of their
+ * real and imaginary parts so the compiler can vectorise them. */
+static void _gemm_kernel(NATURAL_TYPE nr, NATURAL_TYPE nc, NATURAL_TYPE depth,
+			 const COMPLEX_TYPE *val_a, const COMPLEX_TYPE *val_b,
+			 COMPLEX_TYPE *acc)
 {
-	return COMPLEX_INIT(i == 0 && j == 0, 0);
+	REAL_TYPE c_re[2][GEMM_WIDTH], c_im[2][GEMM_WIDTH], a_re[2], a_im[2],
+		b_re, b_im;
+	const COMPLEX_TYPE *row[2];
+	NATURAL_TYPE col[GEMM_WIDTH], x, y, k, nx, ny, i, j;
+
+	for (x = 0; x < nr; x += 2) {
+		nx = nr - x < 2 ? nr - x : 2;
+		for (y = 0; y < nc; y += GEMM_WIDTH) {
+			ny = nc - y < GEMM_WIDTH ? nc - y : GEMM_WIDTH;
+			/* missing rows and columns repeat the last ones */
+			for (i = 0; i < 2; i++) {
+				row[i] = val_a + (x + i % nx) * depth;
+			}
+			for (j = 0; j < GEMM_WIDTH; j++) {
+				col[j] = y + j % ny;
+			}
+			for (i = 0; i < 2; i++) {
+				for (j = 0; j < GEMM_WIDTH; j++) {
+					c_re[i][j] = 0;
+					c_im[i][j] = 0;
+				}
+			}
+			for (k = 0; k < depth; k++) {
+				for (i = 0; i < 2; i++) {
+					a_re[i] = RE(row[i][k]);
+					a_im[i] = IM(row[i][k]);
+				}
+				for (j = 0; j < GEMM_WIDTH; j++) {
+					b_re = RE(val_b[k * nc + col[j]]);
+					b_im = IM(val_b[k * nc + col[j]]);
+					for (i = 0; i < 2; i++) {
+						c_re[i][j] += a_re[i] * b_re -
+							      a_im[i] * b_im;
+						c_im[i][j] += a_re[i] * b_im +
+							      a_im[i] * b_re;
+					}
+				}
+			}
+			for (i = 0; i < nx; i++) {
+				for (j = 0; j < ny; j++) {
+					acc[(x + i) * nc + y + j] = COMPLEX_ADD(
+						acc[(x + i) * nc + y + j],
+						COMPLEX_INIT(c_re[i][j],
+							     c_im[i][j]));
+				}
+			}
+		}
+	}
 }
 
-struct FMatrix *DensityZero(int n)
+/* Matrix product: the inner dimension is split in blocks, and the rows of
+ * A and the columns of B of each block are evaluated once for the tile */
+static int _gather_matmul(struct FMatrix *a, const NATURAL_TYPE *rows,
+			  NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			  NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			  NATURAL_TYPE cs)
 {
-	struct FMatrix *pFM;
-	NATURAL_TYPE size;
+	NATURAL_TYPE *idx, *ur, *uc, *pr, *pc, *inner, nur, nuc, k0, depth, x,
+		y, k;
+	COMPLEX_TYPE *acc, *val_a, *val_b;
+	int result;
 
-	size = NATURAL_ONE << n; // 2^n
-	pFM = new_FunctionalMatrix(size, size, &_DensityZeroFunction, NULL,
-				   NULL, NULL, NULL);
+	/* transposed products keep their dimensions, so the indexes can be out
+	 * of the bounds of A and B even when they are in those of a */
+	for (x = 0; x < nr; x++) {
+		if (rows[x] >= a->A->r) {
+			return 3;
+		}
+	}
+	for (y = 0; y < nc; y++) {
+		if (cols[y] >= a->B->c) {
+			return 3;
+		}
+	}
+	idx = MALLOC_TYPE(2 * (nr + nc) + MATERIALIZE_DEPTH, NATURAL_TYPE);
+	acc = MALLOC_TYPE(nr * nc + MATERIALIZE_DEPTH * (nr + nc),
+			  COMPLEX_TYPE);
+	if (idx == NULL || acc == NULL) {
+		free(idx);
+		free(acc);
+		return 9;
+	}
+	ur = idx;
+	uc = ur + nr;
+	pr = uc + nc;
+	pc = pr + nr;
+	inner = pc + nc;
+	val_a = acc + nr * nc;
+	val_b = val_a + MATERIALIZE_DEPTH * nr;
+	nur = _distinct(rows, nr, a->A->r, ur, pr);
+	nuc = _distinct(cols, nc, a->B->c, uc, pc);
+	for (x = 0; x < nur * nuc; x++) {
+		acc[x] = COMPLEX_ZERO;
+	}
+	result = 0;
+	k0 = 0;
+	if (_is_sparse(a->A) && !a->A->transpose) {
+		result = _sparse_matmul(a, ur, nur, uc, nuc, acc);
+		/* every product has been added already */
+		k0 = a->A->c;
+	}
+	for (; k0 < a->A->c && result == 0; k0 += depth) {
+		depth = a->A->c - k0 < MATERIALIZE_DEPTH ? a->A->c - k0
+							 : MATERIALIZE_DEPTH;
+		for (k = 0; k < depth; k++) {
+			inner[k] = k0 + k;
+		}
+		result = _gather(a->A, ur, nur, inner, depth, val_a, depth, 1);
+		if (result == 0) {
+			result = _gather(a->B, inner, depth, uc, nuc, val_b,
+					 nuc, 1);
+		}
+		if (result == 0) {
+			_gemm_kernel(nur, nuc, depth, val_a, val_b, acc);
+		}
+	}
+	if (result == 0) {
+		for (x = 0; x < nr; x++) {
+			for (y = 0; y < nc; y++) {
+				out[x * rs + y * cs] = acc[pr[x] * nuc + pc[y]];
+			}
+		}
+	}
+	free(idx);
+	free(acc);
 
-	return pFM;
+	return result == 0 ? 0 : 3;
 }
 
-static COMPLEX_TYPE _WalshFunction(NATURAL_TYPE i, NATURAL_TYPE j,
-				   NATURAL_TYPE size,
-#ifndef _MSC_VER
-				   NATURAL_TYPE unused __attribute__((unused)),
-#else
-				   NATURAL_TYPE unused,
-#endif
-				   void *isHadamard)
+/* I(2^left) kron U kron I(2^right): only the distinct elements of U are
+ * evaluated, with the same values _eyeKronFunction gives */
+static int _gather_eyekron(struct FMatrix *a, const NATURAL_TYPE *rows,
+			   NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			   NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			   NATURAL_TYPE cs)
 {
-	REAL_TYPE number;
-	NATURAL_TYPE mid;
+	struct Matrix2D *kron_data;
+	struct FMatrix *U;
+	NATURAL_TYPE *idx, *block_r, *block_c, *u_r, *u_c, *ur, *uc, *pr, *pc,
+		right, nur, nuc, x, y;
+	COMPLEX_TYPE *val_u;
+	int result;
 
-	mid = size / 2;
-	number = 1;
-	if (size == 2) {
-		if (i == 1 && j == 1)
-			number = -1;
-	} else {
-		if (i >= mid && j >= mid) {
-			number = -RE(_WalshFunction(i - mid, j - mid, mid, 0,
-						    false));
-		} else {
-			if (i >= mid)
-				i = i - mid;
-			if (j >= mid)
-				j = j - mid;
-			number = RE(_WalshFunction(i, j, mid, 0, false));
+	kron_data = (struct Matrix2D *)a->argv;
+	U = PyCapsule_GetPointer(kron_data->fmat, "qsimov.doki.funmatrix");
+	if (U == NULL) {
+		return 8;
+	}
+	right = ((NATURAL_TYPE *)kron_data->matrix2d)[1];
+	idx = MALLOC_TYPE(4 * (nr + nc), NATURAL_TYPE);
+	val_u = MALLOC_TYPE(nr * nc, COMPLEX_TYPE);
+	if (idx == NULL || val_u == NULL) {
+		free(idx);
+		free(val_u);
+		return 9;
+	}
+	block_r = idx;
+	u_r = block_r + nr;
+	ur = u_r + nr;
+	pr = ur + nr;
+	block_c = pr + nr;
+	u_c = block_c + nc;
+	uc = u_c + nc;
+	pc = uc + nc;
+	for (x = 0; x < nr; x++) {
+		block_r[x] = rows[x] / right / U->r * right + rows[x] % right;
+		u_r[x] = rows[x] / right % U->r;
+	}
+	for (y = 0; y < nc; y++) {
+		block_c[y] = cols[y] / right / U->c * right + cols[y] % right;
+		u_c[y] = cols[y] / right % U->c;
+	}
+	nur = _distinct(u_r, nr, U->r, ur, pr);
+	nuc = _distinct(u_c, nc, U->c, uc, pc);
+	result = _gather(U, ur, nur, uc, nuc, val_u, nuc, 1);
+	if (result == 0) {
+		for (x = 0; x < nr; x++) {
+			for (y = 0; y < nc; y++) {
+				out[x * rs + y * cs] =
+					block_r[x] == block_c[y]
+						? val_u[pr[x] * nuc + pc[y]]
+						: COMPLEX_ZERO;
+			}
 		}
 	}
+	free(idx);
+	free(val_u);
 
-	if ((bool)isHadamard) {
-		number /= sqrt(size);
+	return result == 0 ? 0 : 8;
+}
+
+/* Partial trace: the two blocks of the traced matrix that are added are
+ * evaluated at once, with the same values _PartialTFunct gives */
+static int _gather_trace(struct FMatrix *a, const NATURAL_TYPE *rows,
+			 NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			 NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			 NATURAL_TYPE cs)
+{
+	struct DMatrixForTrace *me;
+	NATURAL_TYPE *idx, x, y;
+	COMPLEX_TYPE *val;
+	int result, value;
+
+	me = (struct DMatrixForTrace *)a->argv;
+	idx = MALLOC_TYPE(nr + nc, NATURAL_TYPE);
+	val = MALLOC_TYPE(2 * nr * nc, COMPLEX_TYPE);
+	if (idx == NULL || val == NULL) {
+		free(idx);
+		free(val);
+		return 9;
+	}
+	result = 0;
+	for (value = 0; value < 2 && result == 0; value++) {
+		for (x = 0; x < nr; x++) {
+			idx[x] = _GetElemIndex(value, rows[x], me->e);
+		}
+		for (y = 0; y < nc; y++) {
+			idx[nr + y] = _GetElemIndex(value, cols[y], me->e);
+		}
+		result = _gather(me->m, idx, nr, idx + nr, nc,
+				 val + value * nr * nc, nc, 1);
 	}
+	if (result == 0) {
+		for (x = 0; x < nr; x++) {
+			for (y = 0; y < nc; y++) {
+				out[x * rs + y * cs] =
+					COMPLEX_ADD(val[x * nc + y],
+						    val[(nr + x) * nc + y]);
+			}
+		}
+	}
+	free(idx);
+	free(val);
 
-	return COMPLEX_INIT(number, 0);
+	return result == 0 ? 0 : 8;
 }
 
-static struct FMatrix *_WalshHadamard(int n, bool isHadamard)
+/* Evaluate a(rows[x], cols[y]) for every x < nr and y < nc, storing it in
+ * out[x * rs + y * cs]. Same values and error codes as getitem, but every
+ * node of the tree is evaluated once for the whole block. */
+static int _gather(struct FMatrix *a, const NATURAL_TYPE *rows,
+		   NATURAL_TYPE nr, const NATURAL_TYPE *cols, NATURAL_TYPE nc,
+		   COMPLEX_TYPE *out, NATURAL_TYPE rs, NATURAL_TYPE cs)
 {
-	struct FMatrix *pFM;
-	NATURAL_TYPE size;
+	NATURAL_TYPE x, y;
 
-	size = NATURAL_ONE << n; // 2^n
-	pFM = new_FunctionalMatrix(size, size, &_WalshFunction,
-				   (void *)isHadamard, NULL, NULL, NULL);
+	for (x = 0; x < nr; x++) {
+		if (rows[x] < 0 || rows[x] >= a->r) {
+			return 7;
+		}
+	}
+	for (y = 0; y < nc; y++) {
+		if (cols[y] < 0 || cols[y] >= a->c) {
+			return 7;
+		}
+	}
+	if (a->cache != NULL) {
+		return _cached_gather(a, rows, nr, cols, nc, out, rs, cs);
+	}
 
-	return pFM;
+	return _gather_node(a, rows, nr, cols, nc, out, rs, cs);
 }
 
-struct FMatrix *Walsh(int n)
+/* _gather for indexes already checked, without looking at the cache of a */
+static int _gather_node(struct FMatrix *a, const NATURAL_TYPE *rows,
+			NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			NATURAL_TYPE cs)
 {
-	return _WalshHadamard(n, false);
-}
+	const NATURAL_TYPE *aux_idx;
+	NATURAL_TYPE x, y, aux;
+	COMPLEX_TYPE *val;
+	int result;
 
-struct FMatrix *Hadamard(int n)
-{
-	return _WalshHadamard(n, true);
-}
+	if (a->transpose) {
+		aux_idx = rows;
+		rows = cols;
+		cols = aux_idx;
+		aux = nr;
+		nr = nc;
+		nc = aux;
+		aux = rs;
+		rs = cs;
+		cs = aux;
+	}
+
+	result = 0;
+	if (a->simple && a->f == &_eyeKronFunction) {
+		result = _gather_eyekron(a, rows, nr, cols, nc, out, rs, cs);
+	} else if (a->simple && a->f == &_PartialTFunct && a->argv != NULL) {
+		result = _gather_trace(a, rows, nr, cols, nc, out, rs, cs);
+	} else if (_is_sparse(a)) {
+		result = _gather_sparse(a, rows, nr, cols, nc, out, rs, cs);
+	} else if (a->simple) {
+		for (x = 0; x < nr && result == 0; x++) {
+			for (y = 0; y < nc; y++) {
+				val = out + x * rs + y * cs;
+				*val = a->f(rows[x], cols[y], a->r, a->c,
+					    a->argv);
+				if (isnan(RE(*val)) || isnan(IM(*val))) {
+					result = 8;
+					break;
+				}
+			}
+		}
+	} else {
+		switch (a->op) {
+		case 0:
+		case 1:
+		case 3:
+			result = _gather_elementwise(a, rows, nr, cols, nc,
+						     out, rs, cs);
+			break;
+		case 2:
+			result = _gather_matmul(a, rows, nr, cols, nc, out, rs,
+						cs);
+			break;
+		case 4:
+			result = _gather_kron(a, rows, nr, cols, nc, out, rs,
+					      cs);
+			break;
+		default:
+			result = 6;
+		}
+	}
+	if (result != 0) {
+		return result;
+	}
+
+	for (x = 0; x < nr; x++) {
+		for (y = 0; y < nc; y++) {
+			val = out + x * rs + y * cs;
+			if (a->conjugate) {
+				*val = conj(*val);
+			}
+			*val = COMPLEX_MULT(*val, a->s);
+		}
+	}
+
+	return 0;
+}
+
+int materialize(struct FMatrix *a, NATURAL_TYPE row_start,
+		NATURAL_TYPE row_step, NATURAL_TYPE num_rows,
+		NATURAL_TYPE col_start, NATURAL_TYPE col_step,
+		NATURAL_TYPE num_cols, COMPLEX_TYPE *out, int num_threads)
+{
+	NATURAL_TYPE rows[MATERIALIZE_TILE], cols[MATERIALIZE_TILE],
+		num_row_tiles, num_col_tiles, tile, i0, j0, nr, nc, x;
+	struct parallel_region region;
+	int nt, result;
+
+	num_row_tiles = (num_rows + MATERIALIZE_TILE - 1) / MATERIALIZE_TILE;
+	num_col_tiles = (num_cols + MATERIALIZE_TILE - 1) / MATERIALIZE_TILE;
+	result = 0;
+	nt = parallel_begin(&region, num_threads, num_rows * num_cols);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	shared(a, row_start, row_step, num_rows, col_start, col_step, \
+	       num_cols, out, num_row_tiles, num_col_tiles) \
+	private(rows, cols, tile, i0, j0, nr, nc, x) reduction(max : result)
+	for (tile = 0; tile < num_row_tiles * num_col_tiles; tile++) {
+		/* the private copy of result starts at INT_MIN */
+		if (result > 0) {
+			continue;
+		}
+		i0 = tile / num_col_tiles * MATERIALIZE_TILE;
+		j0 = tile % num_col_tiles * MATERIALIZE_TILE;
+		nr = num_rows - i0 < MATERIALIZE_TILE ? num_rows - i0
+						      : MATERIALIZE_TILE;
+		nc = num_cols - j0 < MATERIALIZE_TILE ? num_cols - j0
+						      : MATERIALIZE_TILE;
+		for (x = 0; x < nr; x++) {
+			rows[x] = row_start + (i0 + x) * row_step;
+		}
+		for (x = 0; x < nc; x++) {
+			cols[x] = col_start + (j0 + x) * col_step;
+		}
+		result = _gather(a, rows, nr, cols, nc,
+				 out + i0 * num_cols + j0, num_cols, 1);
+	}
+	parallel_end(&region);
+
+	return result;
+}
+
+static struct FMCache *_cache_new(void)
+{
+	struct FMCache *cache;
+
+	cache = MALLOC_TYPE(1, struct FMCache);
+	if (cache != NULL) {
+		cache->buckets = NULL;
+		cache->num_buckets = 0;
+		cache->newest = NULL;
+		cache->oldest = NULL;
+		cache->num_blocks = 0;
+		cache->max_blocks = 0;
+		cache->hits = 0;
+		cache->misses = 0;
+		cache->evictions = 0;
+		RWLOCK_INIT(cache->lock);
+	}
+
+	return cache;
+}
+
+static size_t _cache_bucket(struct FMCache *cache, NATURAL_TYPE bi,
+			    NATURAL_TYPE bj)
+{
+	return ((size_t)bi * 0x9E3779B1u ^ (size_t)bj) &
+	       (cache->num_buckets - 1);
+}
+
+static struct CacheBlock *_cache_find(struct FMCache *cache, NATURAL_TYPE bi,
+				      NATURAL_TYPE bj)
+{
+	struct CacheBlock *block;
+
+	if (cache->num_buckets == 0) {
+		return NULL;
+	}
+	block = cache->buckets[_cache_bucket(cache, bi, bj)];
+	while (block != NULL && (block->bi != bi || block->bj != bj)) {
+		block = block->next_hash;
+	}
+
+	return block;
+}
+
+static void _cache_unlink(struct FMCache *cache, struct CacheBlock *block)
+{
+	if (block->newer != NULL) {
+		block->newer->older = block->older;
+	} else {
+		cache->newest = block->older;
+	}
+	if (block->older != NULL) {
+		block->older->newer = block->newer;
+	} else {
+		cache->oldest = block->newer;
+	}
+}
+
+static void _cache_push(struct FMCache *cache, struct CacheBlock *block)
+{
+	block->newer = NULL;
+	block->older = cache->newest;
+	if (cache->newest != NULL) {
+		cache->newest->newer = block;
+	} else {
+		cache->oldest = block;
+	}
+	cache->newest = block;
+}
+
+/* Remove the least recently used block */
+static void _cache_evict(struct FMCache *cache)
+{
+	struct CacheBlock *block, **link;
+
+	block = cache->oldest;
+	link = &cache->buckets[_cache_bucket(cache, block->bi, block->bj)];
+	while (*link != block) {
+		link = &(*link)->next_hash;
+	}
+	*link = block->next_hash;
+	_cache_unlink(cache, block);
+	free(block);
+	cache->num_blocks--;
+	cache->evictions++;
+}
+
+/* Change the maximum number of blocks, evicting the least recently used ones
+ * that do not fit and rehashing the rest. Returns 1 if the hash table could
+ * not be allocated (the cache is left as it was). */
+static int _cache_resize(struct FMCache *cache, size_t max_blocks)
+{
+	struct CacheBlock **buckets, *block;
+	size_t num_buckets, h;
+
+	num_buckets = 0;
+	buckets = NULL;
+	if (max_blocks > 0) {
+		num_buckets = 1;
+		while (num_buckets < max_blocks) {
+			num_buckets <<= 1;
+		}
+		buckets = CALLOC_TYPE(num_buckets, struct CacheBlock *);
+		if (buckets == NULL) {
+			return 1;
+		}
+	}
+	while (cache->num_blocks > max_blocks) {
+		_cache_evict(cache);
+	}
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->num_buckets = num_buckets;
+	cache->max_blocks = max_blocks;
+	for (block = cache->newest; block != NULL; block = block->older) {
+		h = _cache_bucket(cache, block->bi, block->bj);
+		block->next_hash = buckets[h];
+		buckets[h] = block;
+	}
+
+	return 0;
+}
+
+static void _cache_free(struct FMCache *cache)
+{
+	struct CacheBlock *block, *older;
+
+	for (block = cache->newest; block != NULL; block = older) {
+		older = block->older;
+		free(block);
+	}
+	free(cache->buckets);
+	RWLOCK_DESTROY(cache->lock);
+	free(cache);
+}
+
+static size_t _cache_mem_size(struct FMCache *cache)
+{
+	size_t size;
+
+	RWLOCK_RDLOCK(cache->lock);
+	size = sizeof(struct FMCache) +
+	       cache->num_buckets * sizeof(struct CacheBlock *) +
+	       cache->num_blocks * sizeof(struct CacheBlock);
+	RWLOCK_UNLOCK(cache->lock);
+
+	return size;
+}
+
+/* Copy the elements at offsets[k] of the block (bi, bj) of a to values[k],
+ * evaluating and storing the block on a miss. The lock is released while the
+ * block is evaluated, so other threads can keep using the cache. Returns -1
+ * if the cache can't be used (disabled or out of memory), or a getitem error
+ * code. */
+static int _cache_fetch(struct FMatrix *a, NATURAL_TYPE bi, NATURAL_TYPE bj,
+			NATURAL_TYPE num, const NATURAL_TYPE *offsets,
+			COMPLEX_TYPE *values)
+{
+	NATURAL_TYPE rows[CACHE_TILE], cols[CACHE_TILE], nr, nc, k;
+	struct FMCache *cache;
+	struct CacheBlock *block;
+	size_t h;
+	int result;
+
+	cache = a->cache;
+	RWLOCK_WRLOCK(cache->lock);
+	if (cache->max_blocks == 0) {
+		RWLOCK_UNLOCK(cache->lock);
+		return -1;
+	}
+	block = _cache_find(cache, bi, bj);
+	if (block != NULL) {
+		_cache_unlink(cache, block);
+		_cache_push(cache, block);
+		cache->hits++;
+		for (k = 0; k < num; k++) {
+			values[k] = block->values[offsets[k]];
+		}
+		RWLOCK_UNLOCK(cache->lock);
+		return 0;
+	}
+	cache->misses++;
+	RWLOCK_UNLOCK(cache->lock);
+
+	block = MALLOC_TYPE(1, struct CacheBlock);
+	if (block == NULL) {
+		return -1;
+	}
+	nr = a->r - bi * CACHE_TILE < CACHE_TILE ? a->r - bi * CACHE_TILE
+						 : CACHE_TILE;
+	nc = a->c - bj * CACHE_TILE < CACHE_TILE ? a->c - bj * CACHE_TILE
+						 : CACHE_TILE;
+	for (k = 0; k < nr; k++) {
+		rows[k] = bi * CACHE_TILE + k;
+	}
+	for (k = 0; k < nc; k++) {
+		cols[k] = bj * CACHE_TILE + k;
+	}
+	result = _gather_node(a, rows, nr, cols, nc, block->values, CACHE_TILE,
+			      1);
+	if (result != 0) {
+		free(block);
+		return result == 9 ? -1 : result;
+	}
+	for (k = 0; k < num; k++) {
+		values[k] = block->values[offsets[k]];
+	}
+
+	RWLOCK_WRLOCK(cache->lock);
+	if (cache->max_blocks == 0 || _cache_find(cache, bi, bj) != NULL) {
+		/* disabled or filled by another thread in the meantime */
+		free(block);
+	} else {
+		while (cache->num_blocks >= cache->max_blocks) {
+			_cache_evict(cache);
+		}
+		block->bi = bi;
+		block->bj = bj;
+		h = _cache_bucket(cache, bi, bj);
+		block->next_hash = cache->buckets[h];
+		cache->buckets[h] = block;
+		_cache_push(cache, block);
+		cache->num_blocks++;
+	}
+	RWLOCK_UNLOCK(cache->lock);
+
+	return 0;
+}
+
+static int _cached_getitem(struct FMatrix *a, NATURAL_TYPE i, NATURAL_TYPE j,
+			   COMPLEX_TYPE *sol)
+{
+	NATURAL_TYPE offset;
+	int result;
+
+	offset = i % CACHE_TILE * CACHE_TILE + j % CACHE_TILE;
+	result = _cache_fetch(a, i / CACHE_TILE, j / CACHE_TILE, 1, &offset,
+			      sol);
+	if (result == -1) {
+		result = _getitem_node(a, i, j, sol);
+	}
+
+	return result;
+}
+
+/* _gather through the cache of a, fetching each block touched once */
+static int _cached_gather(struct FMatrix *a, const NATURAL_TYPE *rows,
+			  NATURAL_TYPE nr, const NATURAL_TYPE *cols,
+			  NATURAL_TYPE nc, COMPLEX_TYPE *out, NATURAL_TYPE rs,
+			  NATURAL_TYPE cs)
+{
+	NATURAL_TYPE *offsets, *pos, *group_c, x0, y0, x, y, k, num,
+		num_group;
+	COMPLEX_TYPE *values;
+	bool *done;
+	int result;
+
+	offsets = MALLOC_TYPE(2 * nr * nc + nc, NATURAL_TYPE);
+	values = MALLOC_TYPE(nr * nc, COMPLEX_TYPE);
+	done = CALLOC_TYPE(nr * nc, bool);
+	if (offsets == NULL || values == NULL || done == NULL) {
+		free(offsets);
+		free(values);
+		free(done);
+		return _gather_node(a, rows, nr, cols, nc, out, rs, cs);
+	}
+	pos = offsets + nr * nc;
+	group_c = pos + nr * nc;
+	result = 0;
+	for (x0 = 0; x0 < nr && result == 0; x0++) {
+		for (y0 = 0; y0 < nc && result == 0; y0++) {
+			if (done[x0 * nc + y0]) {
+				continue;
+			}
+			/* every element in the same block as (x0, y0) */
+			num_group = 0;
+			for (y = y0; y < nc; y++) {
+				if (cols[y] / CACHE_TILE ==
+				    cols[y0] / CACHE_TILE) {
+					group_c[num_group++] = y;
+				}
+			}
+			num = 0;
+			for (x = x0; x < nr; x++) {
+				if (rows[x] / CACHE_TILE !=
+				    rows[x0] / CACHE_TILE) {
+					continue;
+				}
+				for (k = 0; k < num_group; k++) {
+					y = group_c[k];
+					done[x * nc + y] = true;
+					offsets[num] =
+						rows[x] % CACHE_TILE *
+							CACHE_TILE +
+						cols[y] % CACHE_TILE;
+					pos[num++] = x * rs + y * cs;
+				}
+			}
+			result = _cache_fetch(a, rows[x0] / CACHE_TILE,
+					      cols[y0] / CACHE_TILE, num,
+					      offsets, values);
+			for (k = 0; k < num && result == 0; k++) {
+				out[pos[k]] = values[k];
+			}
+		}
+	}
+	free(offsets);
+	free(values);
+	free(done);
+	if (result == -1) {
+		result = _gather_node(a, rows, nr, cols, nc, out, rs, cs);
+	}
+
+	return result;
+}
+
+static int _cache_enable(struct FMatrix *m, size_t max_blocks)
+{
+	int result;
+
+	if (m->cache == NULL && max_blocks == 0) {
+		return 0;
+	}
+	if (m->cache == NULL) {
+		m->cache = _cache_new();
+		if (m->cache == NULL) {
+			return 1;
+		}
+	}
+	RWLOCK_WRLOCK(m->cache->lock);
+	result = _cache_resize(m->cache, max_blocks);
+	RWLOCK_UNLOCK(m->cache->lock);
+
+	return result;
+}
+
+int set_cache(struct FMatrix *m, size_t budget)
+{
+	if (_cache_enable(m, budget / sizeof(struct CacheBlock)) != 0) {
+		return 1;
+	}
+	if (!m->simple) {
+		if ((!m->A->simple && set_cache(m->A, budget) != 0) ||
+		    (!m->B->simple && set_cache(m->B, budget) != 0)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void cache_stats(struct FMatrix *m, size_t *stats)
+{
+	struct FMCache *cache;
+
+	cache = m->cache;
+	if (cache != NULL) {
+		RWLOCK_RDLOCK(cache->lock);
+		stats[0] += cache->hits;
+		stats[1] += cache->misses;
+		stats[2] += cache->evictions;
+		stats[3] += cache->num_blocks;
+		stats[4] += cache->num_blocks * sizeof(struct CacheBlock);
+		RWLOCK_UNLOCK(cache->lock);
+	}
+	if (!m->simple) {
+		if (!m->A->simple) {
+			cache_stats(m->A, stats);
+		}
+		if (!m->B->simple) {
+			cache_stats(m->B, stats);
+		}
+	}
+}
+
+/* Elements evaluated at once by every instruction of a program */
+#define PROGRAM_CHUNK 256
+
+enum FMOpcode {
+	/* index registers */
+	FMI_ROOT, /* idx[dst] = (i, j) */
+	FMI_COPY, /* idx[dst] = swap?(idx[a]) */
+	FMI_DIV, /* idx[dst] = swap?(idx[a]) / (dr, dc) */
+	FMI_MOD, /* idx[dst] = swap?(idx[a]) % (dr, dc) */
+	FMI_SHIFT, /* idx[dst] = swap?(idx[a]) >> (dr, dc) */
+	FMI_MASK, /* idx[dst] = swap?(idx[a]) & (dr, dc) */
+	/* value registers, scaled by s after conjugating if needed */
+	FMI_LEAF, /* val[dst] = m->f(swap?(idx[a])) */
+	FMI_GETITEM, /* val[dst] = getitem(m, idx[a]), already scaled */
+	FMI_ADD, /* val[dst] = val[a] + val[b] */
+	FMI_SUB, /* val[dst] = val[a] - val[b] */
+	FMI_MUL /* val[dst] = val[a] * val[b] */
+};
+
+struct FMInstr {
+	enum FMOpcode op;
+	/* Whether the index pair read has to be swapped first */
+	bool swap;
+	bool conjugate;
+	/* Error code returned if this instruction fails (0 to return the one
+	 * given by getitem) */
+	int err;
+	/* Destination and operand registers */
+	unsigned int dst, a, b;
+	/* Bounds of the index pair computed (index instructions) */
+	NATURAL_TYPE r, c;
+	/* Divisors of the index pair (FMI_DIV and FMI_MOD), or their number of
+	 * bits (FMI_SHIFT) or masks (FMI_MASK) when they are powers of two */
+	NATURAL_TYPE dr, dc;
+	COMPLEX_TYPE s;
+	/* Node evaluated by FMI_LEAF and FMI_GETITEM */
+	struct FMatrix *m;
+};
+
+struct FMProgram {
+	struct FMInstr *code;
+	unsigned int num_instr;
+	/* Index pairs and values used. The index pair of a node is kept in
+	 * the register of its depth, and its value in the one of its depth and
+	 * side, so the register file only grows with the height of the tree. */
+	unsigned int num_regs;
+	/* Instructions that call getitem */
+	unsigned int num_getitem;
+	/* Capsule of the compiled matrix, kept alive by the program */
+	PyObject *m_capsule;
+};
+
+static unsigned int _program_size(struct FMatrix *m)
+{
+	if (m->simple || m->cache != NULL || m->op == 2 || m->op < 0 ||
+	    m->op > 4) {
+		return 2;
+	}
+
+	return 2 + _program_size(m->A) + _program_size(m->B);
+}
+
+/* Use shifts and masks instead of divisions by powers of two */
+static void _compile_divisor(struct FMInstr *index)
+{
+	if ((index->dr & (index->dr - 1)) != 0 ||
+	    (index->dc & (index->dc - 1)) != 0) {
+		return;
+	}
+	if (index->op == FMI_DIV) {
+		index->op = FMI_SHIFT;
+		index->dr = _num_qubits(index->dr);
+		index->dc = _num_qubits(index->dc);
+	} else {
+		index->op = FMI_MASK;
+		index->dr--;
+		index->dc--;
+	}
+}
+
+/* Append the instructions of the node m at the given depth, whose index
+ * pair is computed by the instruction index and whose value is stored in
+ * the register slot */
+static void _compile_node(struct FMProgram *p, struct FMatrix *m,
+			  struct FMInstr *index, int err, unsigned int depth,
+			  unsigned int slot)
+{
+	struct FMInstr *instr;
+
+	if (2 * depth + 2 > p->num_regs) {
+		p->num_regs = 2 * depth + 2;
+	}
+	index->dst = depth;
+	index->r = m->r;
+	index->c = m->c;
+	index->err = depth == 0 ? 7 : err;
+	p->code[p->num_instr++] = *index;
+
+	instr = p->code + p->num_instr;
+	memset(instr, 0, sizeof(struct FMInstr));
+	instr->dst = slot;
+	instr->a = depth;
+	instr->m = m;
+	instr->s = m->s;
+	instr->conjugate = m->conjugate;
+	instr->swap = m->transpose;
+	if (m->simple) {
+		instr->op = FMI_LEAF;
+		instr->err = depth == 0 ? 8 : err;
+		p->num_instr++;
+		return;
+	}
+	if (m->cache != NULL || m->op == 2 || m->op < 0 || m->op > 4) {
+		instr->op = FMI_GETITEM;
+		instr->err = depth == 0 ? 0 : err;
+		/* getitem applies the flags of m by itself */
+		instr->s = COMPLEX_ONE;
+		instr->conjugate = false;
+		instr->swap = false;
+		p->num_getitem++;
+		p->num_instr++;
+		return;
+	}
+	if (depth == 0) {
+		/* every error below the root gives the code of its operation */
+		err = m->op + 1;
+	}
+
+	memset(index, 0, sizeof(struct FMInstr));
+	index->op = m->op == 4 ? FMI_DIV : FMI_COPY;
+	index->a = depth;
+	index->swap = m->transpose;
+	index->dr = m->B->r;
+	index->dc = m->B->c;
+	if (m->op == 4) {
+		_compile_divisor(index);
+	}
+	_compile_node(p, m->A, index, err, depth + 1, 2 * depth + 2);
+	memset(index, 0, sizeof(struct FMInstr));
+	index->op = m->op == 4 ? FMI_MOD : FMI_COPY;
+	index->a = depth;
+	index->swap = m->transpose;
+	index->dr = m->B->r;
+	index->dc = m->B->c;
+	if (m->op == 4) {
+		_compile_divisor(index);
+	}
+	_compile_node(p, m->B, index, err, depth + 1, 2 * depth + 3);
+
+	instr = p->code + p->num_instr++;
+	memset(instr, 0, sizeof(struct FMInstr));
+	instr->op = m->op == 0 ? FMI_ADD : m->op == 1 ? FMI_SUB : FMI_MUL;
+	instr->dst = slot;
+	instr->a = 2 * depth + 2;
+	instr->b = 2 * depth + 3;
+	instr->s = m->s;
+	instr->conjugate = m->conjugate;
+	instr->err = err;
+	if (2 * depth + 4 > p->num_regs) {
+		p->num_regs = 2 * depth + 4;
+	}
+}
+
+struct FMProgram *fm_compile(PyObject *raw_m)
+{
+	struct FMatrix *m;
+	struct FMProgram *p;
+	struct FMInstr index;
+
+	m = PyCapsule_GetPointer(raw_m, "qsimov.doki.funmatrix");
+	if (m == NULL) {
+		errno = 3;
+		return NULL;
+	}
+	p = MALLOC_TYPE(1, struct FMProgram);
+	if (p == NULL) {
+		errno = 1;
+		return NULL;
+	}
+	p->code = MALLOC_TYPE(_program_size(m), struct FMInstr);
+	if (p->code == NULL) {
+		free(p);
+		errno = 1;
+		return NULL;
+	}
+	p->num_instr = 0;
+	p->num_regs = 0;
+	p->num_getitem = 0;
+	memset(&index, 0, sizeof(struct FMInstr));
+	index.op = FMI_ROOT;
+	_compile_node(p, m, &index, 0, 0, 0);
+	Py_INCREF(raw_m);
+	p->m_capsule = raw_m;
+
+	return p;
+}
+
+void fm_program_destroy(struct FMProgram *p)
+{
+	if (p == NULL) {
+		return;
+	}
+	Py_XDECREF(p->m_capsule);
+	free(p->code);
+	free(p);
+}
+
+void fm_program_info(struct FMProgram *p, size_t *info)
+{
+	info[0] = p->num_instr;
+	info[1] = p->num_regs;
+	info[2] = p->num_getitem;
+}
+
+/* Run the program over num < PROGRAM_CHUNK elements, instruction by
+ * instruction, with idx and val holding PROGRAM_CHUNK elements per
+ * register */
+static int _run_chunk(struct FMProgram *p, const NATURAL_TYPE *rows,
+		      const NATURAL_TYPE *cols, NATURAL_TYPE num,
+		      COMPLEX_TYPE *out, NATURAL_TYPE *idx, COMPLEX_TYPE *val)
+{
+	struct FMInstr *instr;
+	NATURAL_TYPE *di, *dj, *si, *sj, k, pc;
+	COMPLEX_TYPE *dv, *va, *vb;
+	int result;
+
+	for (pc = 0; pc < p->num_instr; pc++) {
+		instr = p->code + pc;
+		di = idx + 2 * instr->dst * PROGRAM_CHUNK;
+		dj = di + PROGRAM_CHUNK;
+		dv = val + instr->dst * PROGRAM_CHUNK;
+		si = idx + 2 * instr->a * PROGRAM_CHUNK;
+		sj = si + PROGRAM_CHUNK;
+		if (instr->swap) {
+			si = sj;
+			sj = idx + 2 * instr->a * PROGRAM_CHUNK;
+		}
+		va = val + instr->a * PROGRAM_CHUNK;
+		vb = val + instr->b * PROGRAM_CHUNK;
+		switch (instr->op) {
+		case FMI_ROOT:
+			for (k = 0; k < num; k++) {
+				di[k] = rows[k];
+				dj[k] = cols[k];
+			}
+			break;
+		case FMI_COPY:
+			for (k = 0; k < num; k++) {
+				di[k] = si[k];
+				dj[k] = sj[k];
+			}
+			break;
+		case FMI_DIV:
+			for (k = 0; k < num; k++) {
+				di[k] = si[k] / instr->dr;
+				dj[k] = sj[k] / instr->dc;
+			}
+			break;
+		case FMI_MOD:
+			for (k = 0; k < num; k++) {
+				di[k] = si[k] % instr->dr;
+				dj[k] = sj[k] % instr->dc;
+			}
+			break;
+		case FMI_SHIFT:
+			for (k = 0; k < num; k++) {
+				di[k] = si[k] >> instr->dr;
+				dj[k] = sj[k] >> instr->dc;
+			}
+			break;
+		case FMI_MASK:
+			for (k = 0; k < num; k++) {
+				di[k] = si[k] & instr->dr;
+				dj[k] = sj[k] & instr->dc;
+			}
+			break;
+		case FMI_LEAF:
+			/* si and sj are already swapped if needed */
+			for (k = 0; k < num; k++) {
+				dv[k] = instr->m->f(si[k], sj[k], instr->m->r,
+						    instr->m->c,
+						    instr->m->argv);
+				if (isnan(RE(dv[k])) || isnan(IM(dv[k]))) {
+					return instr->err;
+				}
+			}
+			break;
+		case FMI_GETITEM:
+			for (k = 0; k < num; k++) {
+				result = getitem(instr->m, si[k], sj[k],
+						 dv + k);
+				if (result != 0) {
+					return instr->err == 0 ? result
+							       : instr->err;
+				}
+			}
+			break;
+		case FMI_ADD:
+			for (k = 0; k < num; k++) {
+				dv[k] = COMPLEX_ADD(va[k], vb[k]);
+			}
+			break;
+		case FMI_SUB:
+			for (k = 0; k < num; k++) {
+				dv[k] = COMPLEX_SUB(va[k], vb[k]);
+			}
+			break;
+		case FMI_MUL:
+			for (k = 0; k < num; k++) {
+				dv[k] = COMPLEX_MULT(va[k], vb[k]);
+			}
+			break;
+		}
+		if (instr->op < FMI_LEAF) {
+			for (k = 0; k < num; k++) {
+				if (di[k] < 0 || di[k] >= instr->r ||
+				    dj[k] < 0 || dj[k] >= instr->c) {
+					return instr->err;
+				}
+			}
+			continue;
+		}
+		if (instr->conjugate) {
+			for (k = 0; k < num; k++) {
+				dv[k] = conj(dv[k]);
+			}
+		}
+		if (RE(instr->s) != 1 || IM(instr->s) != 0) {
+			for (k = 0; k < num; k++) {
+				dv[k] = COMPLEX_MULT(dv[k], instr->s);
+			}
+		}
+	}
+	/* the root is always the first register */
+	for (k = 0; k < num; k++) {
+		out[k] = val[k];
+	}
+
+	return 0;
+}
+
+int fm_eval(struct FMProgram *p, const NATURAL_TYPE *rows,
+	    const NATURAL_TYPE *cols, NATURAL_TYPE num, COMPLEX_TYPE *out,
+	    int num_threads)
+{
+	NATURAL_TYPE *idx, chunk, num_chunks, start, count;
+	COMPLEX_TYPE *val;
+	struct parallel_region region;
+	int nt, result;
+
+	num_chunks = (num + PROGRAM_CHUNK - 1) / PROGRAM_CHUNK;
+	result = 0;
+	nt = parallel_begin(&region, num_threads, num * p->num_instr);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) shared(p, rows, cols, num, out, num_chunks) \
+	private(idx, val, chunk, start, count) reduction(max : result)
+	for (chunk = 0; chunk < num_chunks; chunk++) {
+		/* the private copy of result starts at INT_MIN */
+		if (result > 0) {
+			continue;
+		}
+		start = chunk * PROGRAM_CHUNK;
+		count = num - start < PROGRAM_CHUNK ? num - start
+						    : PROGRAM_CHUNK;
+		idx = MALLOC_TYPE(2 * (size_t)p->num_regs * PROGRAM_CHUNK,
+				  NATURAL_TYPE);
+		val = MALLOC_TYPE((size_t)p->num_regs * PROGRAM_CHUNK,
+				  COMPLEX_TYPE);
+		if (idx == NULL || val == NULL) {
+			result = 9;
+		} else {
+			result = _run_chunk(p, rows + start, cols + start,
+					    count, out + start, idx, val);
+		}
+		free(idx);
+		free(val);
+	}
+	parallel_end(&region);
+
+	return result > 0 ? result : 0;
+}
+
+NATURAL_TYPE
+rows(struct FMatrix *m)
+{
+	return m->r;
+}
+
+NATURAL_TYPE
+columns(struct FMatrix *m)
+{
+	return m->c;
+}
+
+static COMPLEX_TYPE _IdentityFunction(NATURAL_TYPE i, NATURAL_TYPE j,
+#ifndef _MSC_VER
+				      NATURAL_TYPE unused1
+				      __attribute__((unused)),
+				      NATURAL_TYPE unused2
+				      __attribute__((unused)),
+				      void *unused3 __attribute__((unused))
+#else
+				      NATURAL_TYPE unused1,
+				      NATURAL_TYPE unused2, void *unused3
+#endif
+)
+{
+	return COMPLEX_INIT(i == j, 0);
+}
+
+struct FMatrix *Identity(int n)
+{
+	struct FMatrix *pFM;
+	NATURAL_TYPE size;
+
+	size = NATURAL_ONE << n; // 2^n
+	pFM = new_FunctionalMatrix(size, size, &_IdentityFunction, NULL, NULL,
+				   NULL, NULL);
+
+	return pFM;
+}
+
+static COMPLEX_TYPE _StateZeroFunction(NATURAL_TYPE i, NATURAL_TYPE j,
+#ifndef _MSC_VER
+				       NATURAL_TYPE unused1
+				       __attribute__((unused)),
+				       NATURAL_TYPE unused2
+				       __attribute__((unused)),
+				       void *unused3 __attribute__((unused))
+#else
+				       NATURAL_TYPE unused1,
+				       NATURAL_TYPE unused2, void *unused3
+#endif
+)
+{
+	return COMPLEX_INIT(i == 0, 0);
+}
+
+struct FMatrix *StateZero(int n)
+{
+	struct FMatrix *pFM;
+	NATURAL_TYPE size;
+
+	size = NATURAL_ONE << n; // 2^n
+	pFM = new_FunctionalMatrix(size, 1, &_StateZeroFunction, NULL, NULL,
+				   NULL, NULL);
+
+	return pFM;
+}
+
+static COMPLEX_TYPE _DensityZeroFunction(NATURAL_TYPE i, NATURAL_TYPE j,
+#ifndef _MSC_VER
+					 NATURAL_TYPE unused1
+					 __attribute__((unused)),
+					 NATURAL_TYPE unused2
+					 __attribute__((unused)),
+					 void *unused3 __attribute__((unused))
+#else
+					 NATURAL_TYPE unused1,
+					 NATURAL_TYPE unused2, void *unused3
+#endif
+)
+{
+	return COMPLEX_INIT(i == 0 && j == 0, 0);
+}
+
+struct FMatrix *DensityZero(int n)
+{
+	struct FMatrix *pFM;
+	NATURAL_TYPE size;
+
+	size = NATURAL_ONE << n; // 2^n
+	pFM = new_FunctionalMatrix(size, size, &_DensityZeroFunction, NULL,
+				   NULL, NULL, NULL);
+
+	return pFM;
+}
+
+static COMPLEX_TYPE _WalshFunction(NATURAL_TYPE i, NATURAL_TYPE j,
+				   NATURAL_TYPE size,
+#ifndef _MSC_VER
+				   NATURAL_TYPE unused __attribute__((unused)),
+#else
+				   NATURAL_TYPE unused,
+#endif
+				   void *isHadamard)
+{
+	REAL_TYPE number;
+	NATURAL_TYPE mid;
+
+	mid = size / 2;
+	number = 1;
+	if (size == 2) {
+		if (i == 1 && j == 1)
+			number = -1;
+	} else {
+		if (i >= mid && j >= mid) {
+			number = -RE(_WalshFunction(i - mid, j - mid, mid, 0,
+						    false));
+		} else {
+			if (i >= mid)
+				i = i - mid;
+			if (j >= mid)
+				j = j - mid;
+			number = RE(_WalshFunction(i, j, mid, 0, false));
+		}
+	}
+
+	if ((bool)isHadamard) {
+		number /= sqrt(size);
+	}
+
+	return COMPLEX_INIT(number, 0);
+}
+
+static struct FMatrix *_WalshHadamard(int n, bool isHadamard)
+{
+	struct FMatrix *pFM;
+	NATURAL_TYPE size;
+
+	size = NATURAL_ONE << n; // 2^n
+	pFM = new_FunctionalMatrix(size, size, &_WalshFunction,
+				   (void *)isHadamard, NULL, NULL, NULL);
+
+	return pFM;
+}
+
+struct FMatrix *Walsh(int n)
+{
+	return _WalshHadamard(n, false);
+}
+
+struct FMatrix *Hadamard(int n)
+{
+	return _WalshHadamard(n, true);
+}
 
 static COMPLEX_TYPE _CUFunction(NATURAL_TYPE i, NATURAL_TYPE j,
 #ifndef _MSC_VER
@@ -1333,8 +2903,10 @@ static size_t size_matrix2d(void *raw_mat)
 	}
 	size = sizeof(struct Matrix2D);
 
-	aux = PyCapsule_GetPointer(mat->fmat, "qsimov.doki.funmatrix");
-	size += FM_mem_size(aux);
+	if (mat->fmat != NULL) {
+		aux = PyCapsule_GetPointer(mat->fmat, "qsimov.doki.funmatrix");
+		size += FM_mem_size(aux);
+	}
 	size += mat->length * mat->elem_size;
 
 	return size;
@@ -1431,6 +3003,605 @@ struct FMatrix *CustomMat(COMPLEX_TYPE *matrix_2d, NATURAL_TYPE length,
 		free_matrix2d, clone_matrix2d, size_matrix2d);
 }
 
+static int _sparse_entry_cmp(const void *raw_a, const void *raw_b)
+{
+	const struct SparseEntry *a = raw_a, *b = raw_b;
+
+	return (a->col > b->col) - (a->col < b->col);
+}
+
+static COMPLEX_TYPE _SparseFunction(NATURAL_TYPE i, NATURAL_TYPE j,
+#ifndef _MSC_VER
+				    NATURAL_TYPE unused1
+				    __attribute__((unused)),
+				    NATURAL_TYPE unused2
+				    __attribute__((unused)),
+#else
+				    NATURAL_TYPE unused1,
+				    NATURAL_TYPE unused2,
+#endif
+				    void *raw_sparse)
+{
+	struct SparseMatrix *sparse;
+	NATURAL_TYPE low, high, mid;
+	COMPLEX_TYPE sol = COMPLEX_ZERO;
+
+	sparse = (struct SparseMatrix *)raw_sparse;
+	low = sparse->indptr[i];
+	high = sparse->indptr[i + 1];
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (sparse->indices[mid] < j) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	for (; low < sparse->indptr[i + 1] && sparse->indices[low] == j;
+	     low++) {
+		sol = COMPLEX_ADD(sol, sparse->data[low]);
+	}
+
+	return sol;
+}
+
+static void free_sparse(void *raw_sparse)
+{
+	struct SparseMatrix *sparse = (struct SparseMatrix *)raw_sparse;
+
+	if (sparse == NULL) {
+		return;
+	}
+
+	sparse->refcount--;
+	if (sparse->refcount == 0) {
+		if (sparse->owner != NULL) {
+			Py_DECREF(sparse->owner);
+		} else {
+			free((void *)sparse->indptr);
+			free((void *)sparse->indices);
+			free((void *)sparse->data);
+		}
+		free(sparse);
+	}
+}
+
+static void *clone_sparse(void *raw_sparse)
+{
+	struct SparseMatrix *sparse = (struct SparseMatrix *)raw_sparse;
+
+	if (sparse == NULL) {
+		return NULL;
+	}
+
+	sparse->refcount++;
+	return raw_sparse;
+}
+
+static size_t size_sparse(void *raw_sparse)
+{
+	struct SparseMatrix *sparse = (struct SparseMatrix *)raw_sparse;
+
+	if (sparse == NULL) {
+		return 0;
+	}
+
+	return sizeof(struct SparseMatrix) +
+	       (sparse->num_rows + 1 + sparse->nnz) * sizeof(NATURAL_TYPE) +
+	       sparse->nnz * sizeof(COMPLEX_TYPE);
+}
+
+static bool _is_sparse(struct FMatrix *m)
+{
+	return m->simple && m->f == &_SparseFunction;
+}
+
+/* Sort the elements of every row of owned CSR arrays by column */
+static int _sparse_sort_rows(NATURAL_TYPE num_rows, const NATURAL_TYPE *indptr,
+			     NATURAL_TYPE *indices, COMPLEX_TYPE *data)
+{
+	struct SparseEntry *entries;
+	NATURAL_TYPE i, k, len, max_len;
+
+	max_len = 0;
+	for (i = 0; i < num_rows; i++) {
+		len = indptr[i + 1] - indptr[i];
+		max_len = len > max_len ? len : max_len;
+	}
+	entries = MALLOC_TYPE(max_len + 1, struct SparseEntry);
+	if (entries == NULL) {
+		return 5;
+	}
+	for (i = 0; i < num_rows; i++) {
+		len = indptr[i + 1] - indptr[i];
+		for (k = 0; k < len; k++) {
+			entries[k].col = indices[indptr[i] + k];
+			entries[k].val = data[indptr[i] + k];
+		}
+		qsort(entries, len, sizeof(struct SparseEntry),
+		      _sparse_entry_cmp);
+		for (k = 0; k < len; k++) {
+			indices[indptr[i] + k] = entries[k].col;
+			data[indptr[i] + k] = entries[k].val;
+		}
+	}
+	free(entries);
+
+	return 0;
+}
+
+static struct FMatrix *_new_sparse(NATURAL_TYPE num_rows, NATURAL_TYPE num_cols,
+				   const NATURAL_TYPE *indptr,
+				   const NATURAL_TYPE *indices,
+				   const COMPLEX_TYPE *data, PyObject *owner)
+{
+	struct SparseMatrix *sparse;
+	struct FMatrix *pFM;
+
+	sparse = MALLOC_TYPE(1, struct SparseMatrix);
+	if (sparse == NULL) {
+		errno = 5;
+		return NULL;
+	}
+	sparse->indptr = indptr;
+	sparse->indices = indices;
+	sparse->data = data;
+	sparse->owner = owner;
+	sparse->num_rows = num_rows;
+	sparse->nnz = indptr[num_rows];
+	sparse->refcount = 1;
+	pFM = new_FunctionalMatrix(num_rows, num_cols, &_SparseFunction,
+				   sparse, free_sparse, clone_sparse,
+				   size_sparse);
+	if (pFM == NULL) {
+		free(sparse);
+		errno = 1;
+		return NULL;
+	}
+	if (owner != NULL) {
+		Py_INCREF(owner);
+	}
+
+	return pFM;
+}
+
+struct FMatrix *SparseMat(NATURAL_TYPE num_rows, NATURAL_TYPE num_cols,
+			  const NATURAL_TYPE *indptr,
+			  const NATURAL_TYPE *indices,
+			  const COMPLEX_TYPE *data, PyObject *owner)
+{
+	NATURAL_TYPE *own_indptr, *own_indices, nnz, i, k;
+	COMPLEX_TYPE *own_data;
+	struct FMatrix *pFM;
+	bool sorted;
+
+	if (num_rows <= 0 || num_cols <= 0 || indptr[0] != 0) {
+		errno = 2;
+		return NULL;
+	}
+	for (i = 0; i < num_rows; i++) {
+		if (indptr[i + 1] < indptr[i]) {
+			errno = 2;
+			return NULL;
+		}
+	}
+	sorted = true;
+	for (i = 0; i < num_rows; i++) {
+		for (k = indptr[i]; k < indptr[i + 1]; k++) {
+			if (indices[k] < 0 || indices[k] >= num_cols) {
+				errno = 2;
+				return NULL;
+			}
+			if (k > indptr[i] && indices[k - 1] > indices[k]) {
+				sorted = false;
+			}
+		}
+	}
+	if (sorted) {
+		return _new_sparse(num_rows, num_cols, indptr, indices, data,
+				   owner);
+	}
+
+	/* the rows have to be sorted in a copy */
+	nnz = indptr[num_rows];
+	own_indptr = MALLOC_TYPE(num_rows + 1, NATURAL_TYPE);
+	own_indices = MALLOC_TYPE(nnz + 1, NATURAL_TYPE);
+	own_data = MALLOC_TYPE(nnz + 1, COMPLEX_TYPE);
+	if (own_indptr == NULL || own_indices == NULL || own_data == NULL) {
+		free(own_indptr);
+		free(own_indices);
+		free(own_data);
+		errno = 5;
+		return NULL;
+	}
+	memcpy(own_indptr, indptr, (num_rows + 1) * sizeof(NATURAL_TYPE));
+	memcpy(own_indices, indices, nnz * sizeof(NATURAL_TYPE));
+	memcpy(own_data, data, nnz * sizeof(COMPLEX_TYPE));
+	errno = _sparse_sort_rows(num_rows, own_indptr, own_indices,
+				  own_data);
+	pFM = errno != 0 ? NULL :
+			   _new_sparse(num_rows, num_cols, own_indptr,
+				       own_indices, own_data, NULL);
+	if (pFM == NULL) {
+		free(own_indptr);
+		free(own_indices);
+		free(own_data);
+	}
+
+	return pFM;
+}
+
+struct FMatrix *SparseMatCOO(NATURAL_TYPE num_rows, NATURAL_TYPE num_cols,
+			     NATURAL_TYPE nnz, const NATURAL_TYPE *rows,
+			     const NATURAL_TYPE *cols,
+			     const COMPLEX_TYPE *data)
+{
+	NATURAL_TYPE *indptr, *indices, *next, k;
+	COMPLEX_TYPE *values;
+	struct FMatrix *pFM;
+
+	if (num_rows <= 0 || num_cols <= 0) {
+		errno = 2;
+		return NULL;
+	}
+	for (k = 0; k < nnz; k++) {
+		if (rows[k] < 0 || rows[k] >= num_rows || cols[k] < 0 ||
+		    cols[k] >= num_cols) {
+			errno = 2;
+			return NULL;
+		}
+	}
+	indptr = CALLOC_TYPE(num_rows + 1, NATURAL_TYPE);
+	next = MALLOC_TYPE(num_rows + 1, NATURAL_TYPE);
+	indices = MALLOC_TYPE(nnz + 1, NATURAL_TYPE);
+	values = MALLOC_TYPE(nnz + 1, COMPLEX_TYPE);
+	if (indptr == NULL || next == NULL || indices == NULL ||
+	    values == NULL) {
+		free(indptr);
+		free(next);
+		free(indices);
+		free(values);
+		errno = 5;
+		return NULL;
+	}
+	/* counting sort by row, then every row by column */
+	for (k = 0; k < nnz; k++) {
+		indptr[rows[k] + 1]++;
+	}
+	for (k = 0; k < num_rows; k++) {
+		indptr[k + 1] += indptr[k];
+		next[k] = indptr[k];
+	}
+	for (k = 0; k < nnz; k++) {
+		indices[next[rows[k]]] = cols[k];
+		values[next[rows[k]]] = data[k];
+		next[rows[k]]++;
+	}
+	free(next);
+	errno = _sparse_sort_rows(num_rows, indptr, indices, values);
+	pFM = errno != 0 ? NULL :
+			   _new_sparse(num_rows, num_cols, indptr, indices,
+				       values, NULL);
+	if (pFM == NULL) {
+		free(indptr);
+		free(indices);
+		free(values);
+	}
+
+	return pFM;
+}
+
+static void _optimized_destroy(PyObject *capsule)
+{
+	struct FMatrix *m;
+
+	m = PyCapsule_GetPointer(capsule, "qsimov.doki.funmatrix");
+	if (m != NULL) {
+		FM_destroy(m);
+	}
+}
+
+/* Capsule owning a new matrix (destroyed if the capsule can't be made) */
+static PyObject *_optimized_capsule(struct FMatrix *m)
+{
+	PyObject *capsule;
+
+	if (m == NULL) {
+		return NULL;
+	}
+	capsule = PyCapsule_New((void *)m, "qsimov.doki.funmatrix",
+				&_optimized_destroy);
+	if (capsule == NULL) {
+		FM_destroy(m);
+	}
+
+	return capsule;
+}
+
+/* Shallow copy of a node, sharing its operands and arguments */
+static struct FMatrix *_copy_node(struct FMatrix *m)
+{
+	struct FMatrix *pFM;
+
+	pFM = MALLOC_TYPE(1, struct FMatrix);
+	if (pFM != NULL) {
+		*pFM = *m;
+		pFM->cache = NULL;
+		Py_XINCREF(m->A_capsule);
+		Py_XINCREF(m->B_capsule);
+		if (m->argv_clone != NULL) {
+			pFM->argv = m->argv_clone(m->argv);
+		}
+	}
+
+	return pFM;
+}
+
+static bool _is_one(COMPLEX_TYPE s)
+{
+	return RE(s) == 1 && IM(s) == 0;
+}
+
+/* eyeKron leaf without flags that can be merged with its neighbours */
+static bool _is_plain_eyekron(struct FMatrix *m)
+{
+	return m->simple && m->f == &_eyeKronFunction && !m->transpose &&
+	       !m->conjugate && _is_one(m->s);
+}
+
+static struct FMatrix *_eyekron_of(PyObject *raw_u, NATURAL_TYPE left,
+				   NATURAL_TYPE right)
+{
+	struct FMatrix *pFM;
+
+	pFM = eyeKron(raw_u, _num_qubits(left), _num_qubits(right));
+	if (pFM == NULL) {
+		errno = 1;
+	}
+
+	return pFM;
+}
+
+/* I(2^left) kron m kron I(2^right), absorbing the identities of m if it is
+ * an eyeKron too */
+static struct FMatrix *_eyekron_extend(PyObject *raw_m, struct FMatrix *m,
+				       NATURAL_TYPE left, NATURAL_TYPE right)
+{
+	struct Matrix2D *data;
+	NATURAL_TYPE *sizes;
+
+	if (_is_plain_eyekron(m)) {
+		data = (struct Matrix2D *)m->argv;
+		sizes = (NATURAL_TYPE *)data->matrix2d;
+		return _eyekron_of(data->fmat, left * sizes[0],
+				   sizes[1] * right);
+	}
+	if (left == 1 && right == 1) {
+		return _copy_node(m);
+	}
+
+	return _eyekron_of(raw_m, left, right);
+}
+
+/* Whether a transpose can be moved to the operands of m. The shape of a
+ * transposed node is not swapped, so this only holds for square nodes with
+ * square operands. */
+static bool _transpose_pushable(struct FMatrix *m)
+{
+	if (m->r != m->c) {
+		return false;
+	}
+	if (m->op == 2 || m->op == 4) {
+		return m->A->r == m->A->c && m->B->r == m->B->c;
+	}
+
+	return true;
+}
+
+static PyObject *_rewrite(PyObject *raw_m, bool t, bool c,
+			  COMPLEX_TYPE *scale);
+
+/* Leaves keep their flags. Identities drop them, and eyeKron pushes them
+ * into its gate. */
+static PyObject *_rewrite_leaf(PyObject *raw_m, struct FMatrix *m, bool t,
+			       bool c, COMPLEX_TYPE *scale)
+{
+	struct Matrix2D *data;
+	struct FMatrix *U, *pFM;
+	PyObject *raw_u;
+	NATURAL_TYPE *sizes;
+	COMPLEX_TYPE u_scale;
+
+	if (m->f == &_IdentityFunction) {
+		t = false;
+		c = false;
+	} else if (m->f == &_eyeKronFunction) {
+		data = (struct Matrix2D *)m->argv;
+		U = PyCapsule_GetPointer(data->fmat, "qsimov.doki.funmatrix");
+		if (U != NULL && (!t || U->r == U->c)) {
+			raw_u = _rewrite(data->fmat, t, c, &u_scale);
+			if (raw_u == NULL) {
+				return NULL;
+			}
+			*scale = COMPLEX_MULT(*scale, u_scale);
+			sizes = (NATURAL_TYPE *)data->matrix2d;
+			pFM = _eyekron_of(raw_u, sizes[0], sizes[1]);
+			Py_DECREF(raw_u);
+			return _optimized_capsule(pFM);
+		}
+	}
+	if (t == m->transpose && c == m->conjugate && _is_one(m->s)) {
+		Py_INCREF(raw_m);
+		return raw_m;
+	}
+	pFM = _copy_node(m);
+	if (pFM == NULL) {
+		errno = 1;
+		return NULL;
+	}
+	pFM->transpose = t;
+	pFM->conjugate = c;
+	pFM->s = COMPLEX_ONE;
+
+	return _optimized_capsule(pFM);
+}
+
+/* Build op(A, B) from already rewritten operands with scalars sa and sb,
+ * multiplying scale by the factor left out of the result */
+static struct FMatrix *_rewrite_op(short op, PyObject *raw_a, COMPLEX_TYPE sa,
+				   PyObject *raw_b, COMPLEX_TYPE sb,
+				   COMPLEX_TYPE *scale)
+{
+	struct FMatrix *a, *b, *pFM;
+	struct Matrix2D *data_a, *data_b;
+	NATURAL_TYPE *sizes_a, *sizes_b;
+	PyObject *aux_a, *aux_b;
+
+	a = PyCapsule_GetPointer(raw_a, "qsimov.doki.funmatrix");
+	b = PyCapsule_GetPointer(raw_b, "qsimov.doki.funmatrix");
+	pFM = NULL;
+	switch (op) {
+	case 0:
+	case 1:
+		if (RE(sa) == RE(sb) && IM(sa) == IM(sb)) {
+			*scale = COMPLEX_MULT(*scale, sa);
+			pFM = op == 0 ? madd(raw_a, raw_b) : msub(raw_a, raw_b);
+			break;
+		}
+		aux_a = _optimized_capsule(mprod(sa, raw_a));
+		aux_b = _optimized_capsule(mprod(sb, raw_b));
+		if (aux_a != NULL && aux_b != NULL) {
+			pFM = op == 0 ? madd(aux_a, aux_b) : msub(aux_a, aux_b);
+		}
+		Py_XDECREF(aux_a);
+		Py_XDECREF(aux_b);
+		break;
+	case 2:
+		*scale = COMPLEX_MULT(*scale, COMPLEX_MULT(sa, sb));
+		if (_is_identity(a)) {
+			pFM = _copy_node(b);
+		} else if (_is_identity(b)) {
+			pFM = _copy_node(a);
+		} else if (_is_plain_eyekron(a) && _is_plain_eyekron(b)) {
+			data_a = (struct Matrix2D *)a->argv;
+			data_b = (struct Matrix2D *)b->argv;
+			sizes_a = (NATURAL_TYPE *)data_a->matrix2d;
+			sizes_b = (NATURAL_TYPE *)data_b->matrix2d;
+			if (sizes_a[0] != sizes_b[0] ||
+			    sizes_a[1] != sizes_b[1]) {
+				pFM = matmul(raw_a, raw_b);
+				break;
+			}
+			/* (I kron U kron I)(I kron V kron I) = I kron UV kron I
+			 */
+			aux_a = _optimized_capsule(
+				matmul(data_a->fmat, data_b->fmat));
+			if (aux_a != NULL) {
+				pFM = _eyekron_of(aux_a, sizes_a[0],
+						  sizes_a[1]);
+				Py_DECREF(aux_a);
+			}
+		} else {
+			pFM = matmul(raw_a, raw_b);
+		}
+		break;
+	case 3:
+		*scale = COMPLEX_MULT(*scale, COMPLEX_MULT(sa, sb));
+		pFM = ewmul(raw_a, raw_b);
+		break;
+	case 4:
+		*scale = COMPLEX_MULT(*scale, COMPLEX_MULT(sa, sb));
+		if (_is_identity(a)) {
+			pFM = _eyekron_extend(raw_b, b, a->r, 1);
+		} else if (_is_identity(b)) {
+			pFM = _eyekron_extend(raw_a, a, 1, b->r);
+		} else {
+			pFM = kron(raw_a, raw_b);
+		}
+		break;
+	default:
+		errno = 6;
+		return NULL;
+	}
+	if (pFM == NULL) {
+		errno = 1;
+	}
+
+	return pFM;
+}
+
+/* Rewrite m with a transpose (t) and a conjugation (c) applied on top. The
+ * returned matrix always has s = 1, and its scalar is stored in scale. */
+static PyObject *_rewrite(PyObject *raw_m, bool t, bool c,
+			  COMPLEX_TYPE *scale)
+{
+	struct FMatrix *m, *pFM;
+	PyObject *raw_a, *raw_b;
+	COMPLEX_TYPE sa, sb;
+	bool push_t;
+
+	m = PyCapsule_GetPointer(raw_m, "qsimov.doki.funmatrix");
+	if (m == NULL) {
+		errno = 3;
+		return NULL;
+	}
+	*scale = c ? conj(m->s) : m->s;
+	t = t != m->transpose;
+	c = c != m->conjugate;
+	if (m->simple) {
+		return _rewrite_leaf(raw_m, m, t, c, scale);
+	}
+
+	/* (AB)^T = B^T A^T, while conjugation distributes over every op */
+	push_t = t && _transpose_pushable(m);
+	if (push_t && m->op == 2) {
+		raw_a = _rewrite(m->B_capsule, true, c, &sa);
+		raw_b = _rewrite(m->A_capsule, true, c, &sb);
+	} else {
+		raw_a = _rewrite(m->A_capsule, push_t, c, &sa);
+		raw_b = _rewrite(m->B_capsule, push_t, c, &sb);
+	}
+	pFM = NULL;
+	if (raw_a != NULL && raw_b != NULL) {
+		pFM = _rewrite_op(m->op, raw_a, sa, raw_b, sb, scale);
+	}
+	Py_XDECREF(raw_a);
+	Py_XDECREF(raw_b);
+	if (pFM == NULL) {
+		return NULL;
+	}
+	pFM->s = COMPLEX_ONE;
+	/* the shape of the node was kept, so a transpose that could not be
+	 * pushed stays on it */
+	if (t && !push_t) {
+		pFM->transpose = !pFM->transpose;
+	}
+
+	return _optimized_capsule(pFM);
+}
+
+struct FMatrix *optimize(PyObject *raw_m)
+{
+	struct FMatrix *pFM;
+	PyObject *raw_res;
+	COMPLEX_TYPE scale;
+
+	raw_res = _rewrite(raw_m, false, false, &scale);
+	if (raw_res == NULL) {
+		return NULL;
+	}
+	pFM = _copy_node(
+		PyCapsule_GetPointer(raw_res, "qsimov.doki.funmatrix"));
+	Py_DECREF(raw_res);
+	if (pFM == NULL) {
+		errno = 1;
+		return NULL;
+	}
+	pFM->s = COMPLEX_MULT(pFM->s, scale);
+
+	return pFM;
+}
+
 static int _bytes_added(int sprintfRe)
 {
 	return (sprintfRe > 0) ? sprintfRe : 0;
@@ -1519,6 +3690,10 @@ char *FM_toString(struct FMatrix *a)
 
 void FM_destroy(struct FMatrix *src)
 {
+	if (src->cache != NULL) {
+		_cache_free(src->cache);
+		src->cache = NULL;
+	}
 	if (src->A_capsule != NULL) {
 		Py_DECREF(src->A_capsule);
 	}
@@ -1563,5 +3738,8 @@ size_t FM_mem_size(struct FMatrix *src)
 	if (src->argv_size != NULL) {
 		size += src->argv_size(src->argv);
 	}
+	if (src->cache != NULL) {
+		size += _cache_mem_size(src->cache);
+	}
 	return size;
 }
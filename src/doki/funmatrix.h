@@ -25,6 +25,12 @@
 #include <complex.h>
 #include <stdbool.h>
 
+/* Least recently used cache of evaluated blocks, private to funmatrix.c */
+struct FMCache;
+
+/* Functional matrix compiled into a flat program, private to funmatrix.c */
+struct FMProgram;
+
 struct FMatrix {
 	/* Scalar number s that will be multiplied by the result of f(i, j) or multiplied by A op B */
 	COMPLEX_TYPE s;
@@ -49,6 +55,8 @@ struct FMatrix {
 	void *(*argv_clone)(void *);
 	/* Function that returns the size of argv (if needed) */
 	size_t (*argv_size)(void *);
+	/* Blocks of the matrix already evaluated (NULL if never enabled) */
+	struct FMCache *cache;
 	/* Whether the matrix has to be transposed or not */
 	bool transpose;
 	/* Whether the matrix has to be complex conjugated or not */
@@ -94,6 +102,21 @@ new_FunctionalMatrix(NATURAL_TYPE n_rows, NATURAL_TYPE n_columns,
 int getitem(struct FMatrix *a, NATURAL_TYPE i, NATURAL_TYPE j,
 	    COMPLEX_TYPE *sol);
 
+/*
+ * Evaluate the elements (row_start + x * row_step, col_start + y * col_step)
+ * of the matrix a for every x < num_rows and y < num_cols, storing them in
+ * out[x * num_cols + y]. The output is split in tiles shared among the
+ * threads, and each tile evaluates the tree bottom-up once for all its
+ * elements, so matmul nodes do not recompute their inner products per
+ * element.
+ * Return values: the same ones as getitem, plus
+ * 9 -> Could not allocate the tile buffers
+ */
+int materialize(struct FMatrix *a, NATURAL_TYPE row_start,
+		NATURAL_TYPE row_step, NATURAL_TYPE num_rows,
+		NATURAL_TYPE col_start, NATURAL_TYPE col_step,
+		NATURAL_TYPE num_cols, COMPLEX_TYPE *out, int num_threads);
+
 /* Addition. Returns NULL on error.
  * errno values:
  * 1 -> Could not allocate result matrix
@@ -126,7 +149,8 @@ struct FMatrix *mprod(COMPLEX_TYPE r, PyObject *raw_m);
  */
 struct FMatrix *mdiv(COMPLEX_TYPE r, PyObject *raw_m);
 
-/* Matrix multiplication. Returns NULL on error.
+/* Matrix multiplication. Returns NULL on error. Products with an identity
+ * return a copy of the other operand.
  * errno values:
  * 1 -> Could not allocate result matrix
  * 2 -> Operands misalligned
@@ -144,7 +168,8 @@ struct FMatrix *matmul(PyObject *raw_a, PyObject *raw_b);
  */
 struct FMatrix *ewmul(PyObject *raw_a, PyObject *raw_b);
 
-/* Kronecker product. Returns NULL on error.
+/* Kronecker product. Returns NULL on error. Products with an identity are
+ * built as an eyeKron instead.
  * errno values:
  * 1 -> Could not allocate result matrix
  * 3 -> First operand is NULL
@@ -185,6 +210,67 @@ struct FMatrix *dagger(PyObject *raw_m);
  */
 struct FMatrix *projection(PyObject *raw_m, NATURAL_TYPE qubitId, bool value);
 
+/* Algebraic rewrite of m into a cheaper matrix with the same elements.
+ * Returns NULL on error. The following rewrites are applied bottom-up:
+ * - scalars of products are folded into a single s
+ * - transposes and conjugations are pushed down to the leaves
+ * - products with an identity are removed
+ * - Kronecker products with an identity become eyeKron, merging nested ones
+ * - products of eyeKron with the same identities multiply their gates
+ * errno values:
+ * 1 -> Could not allocate result matrix
+ * 3 -> Matrix operand is NULL
+ * 6 -> Unknown operation
+ */
+struct FMatrix *optimize(PyObject *raw_m);
+
+/*
+ * Keep up to budget bytes of evaluated blocks of 32x32 elements in m and
+ * in each of its operation nodes (budget per node), evicting the least
+ * recently used ones. Repeated accesses to the same elements (like the ones
+ * made by matrix products, traces and partial traces) are then served from
+ * the cache. A budget of 0 empties and disables the caches. The caches are
+ * shared by all threads, but this must not be called while the matrix is
+ * being evaluated.
+ * Return values:
+ * 0 -> OK
+ * 1 -> Could not allocate a cache
+ */
+int set_cache(struct FMatrix *m, size_t budget);
+
+/*
+ * Add the statistics of the caches of m and its operation nodes to stats:
+ * hits, misses, evictions, blocks stored and bytes used by those blocks.
+ */
+void cache_stats(struct FMatrix *m, size_t *stats);
+
+/*
+ * Compile the tree of m into a flat list of instructions over a register
+ * file with one index pair and one value per node, so that elements can be
+ * evaluated without recursion. Matrix products and nodes with a cache are
+ * not unrolled: their instructions call getitem on them.
+ * The program keeps a reference to m. Returns NULL on error.
+ * errno values:
+ * 1 -> Could not allocate the program
+ * 3 -> Matrix is NULL
+ */
+struct FMProgram *fm_compile(PyObject *raw_m);
+
+void fm_program_destroy(struct FMProgram *p);
+
+/* Number of instructions, registers and getitem calls of a program */
+void fm_program_info(struct FMProgram *p, size_t *info);
+
+/*
+ * Evaluate the elements (rows[k], cols[k]) for every k < num into out[k].
+ * The program is only read, so it can be run by several threads at once.
+ * Return values: the same ones as getitem, plus
+ * 9 -> Could not allocate the registers
+ */
+int fm_eval(struct FMProgram *p, const NATURAL_TYPE *rows,
+	    const NATURAL_TYPE *cols, NATURAL_TYPE num, COMPLEX_TYPE *out,
+	    int num_threads);
+
 NATURAL_TYPE
 rows(struct FMatrix *m);
 
@@ -216,6 +302,30 @@ struct FMatrix *CU(PyObject *raw_U);
 struct FMatrix *CustomMat(COMPLEX_TYPE *matrix_2d, NATURAL_TYPE length,
 			  NATURAL_TYPE nrows, NATURAL_TYPE ncols);
 
+/* Sparse matrix in CSR format: the columns and values of the row i are in
+ * [indptr[i], indptr[i + 1]) of indices and data. The arrays are used as
+ * they are, keeping a reference to owner (if not NULL) while the matrix
+ * exists, unless the columns of some row are not sorted, in which case a
+ * sorted copy is made. Repeated elements are added. Returns NULL on error.
+ * errno values:
+ * 1 -> Could not allocate result matrix
+ * 2 -> Wrong dimensions, indptr or indices
+ * 5 -> Could not allocate the sparse struct or the sorted copy
+ */
+struct FMatrix *SparseMat(NATURAL_TYPE num_rows, NATURAL_TYPE num_cols,
+			  const NATURAL_TYPE *indptr,
+			  const NATURAL_TYPE *indices,
+			  const COMPLEX_TYPE *data, PyObject *owner);
+
+/* Sparse matrix from nnz (rows[k], cols[k], data[k]) triplets, in any order,
+ * copied into CSR arrays. Repeated elements are added. Same errno values as
+ * SparseMat.
+ */
+struct FMatrix *SparseMatCOO(NATURAL_TYPE num_rows, NATURAL_TYPE num_cols,
+			     NATURAL_TYPE nnz, const NATURAL_TYPE *rows,
+			     const NATURAL_TYPE *cols,
+			     const COMPLEX_TYPE *data);
+
 /* Gets the size in memory */
 #ifndef _MSC_VER
 __attribute__((pure))
@@ -17,6 +17,7 @@
  */
 
 #include "platform.h"
+#include <omp.h>
 
 COMPLEX_TYPE fix_value(COMPLEX_TYPE a, REAL_TYPE min_r, REAL_TYPE min_i,
 		       REAL_TYPE max_r, REAL_TYPE max_i)
@@ -66,3 +67,36 @@ unsigned int log2_64(uint64_t value)
 	return tab64[((uint64_t)((value - (value >> 1)) * 0x07EDD5E59A4E28C2)) >>
 		     58];
 }
+
+struct parallel_config doki_parallel_config = {
+	-1, omp_sched_static, 0, PARALLEL_SERIAL_THRESHOLD
+};
+
+int parallel_begin(struct parallel_region *region, int num_threads,
+		   NATURAL_TYPE work)
+{
+	omp_sched_t kind;
+	int chunk_size;
+
+	omp_get_schedule(&kind, &chunk_size);
+	region->schedule = (int)kind;
+	region->chunk_size = chunk_size;
+	omp_set_schedule((omp_sched_t)doki_parallel_config.schedule,
+			 doki_parallel_config.chunk_size);
+
+	if (work < doki_parallel_config.serial_threshold) {
+		return 1;
+	}
+	if (num_threads > 0) {
+		return num_threads;
+	}
+	if (doki_parallel_config.num_threads > 0) {
+		return doki_parallel_config.num_threads;
+	}
+	return omp_get_max_threads();
+}
+
+void parallel_end(struct parallel_region *region)
+{
+	omp_set_schedule((omp_sched_t)region->schedule, region->chunk_size);
+}
@@ -158,16 +158,54 @@
  *  \return The log2 of value.
  */
 
+/** \def RWLOCK_TYPE
+ *  \brief Readers/writer lock type.
+ *
+ *  SRWLOCK on Windows, pthread_rwlock_t elsewhere. RWLOCK_INIT,
+ *  RWLOCK_DESTROY, RWLOCK_RDLOCK, RWLOCK_WRLOCK and RWLOCK_UNLOCK take the
+ *  lock itself (not a pointer to it).
+ */
+
+/** \fn int parallel_begin(struct parallel_region *region, int num_threads,
+ *                         NATURAL_TYPE work);
+ *  \brief Prepare the calling thread for a parallel kernel.
+ *  Stores the OpenMP schedule of the calling thread in region and replaces it
+ *  with the one in doki_parallel_config.
+ *  \param region Where the previous schedule will be stored.
+ *  \param num_threads Number of threads requested (-1 for the default).
+ *  \param work Number of iterations of the parallel loop.
+ *  \return The number of threads to use in the num_threads clause. 1 if the
+ *  work is below the serial threshold.
+ */
+
+/** \fn void parallel_end(struct parallel_region *region);
+ *  \brief Restore the OpenMP schedule saved by parallel_begin.
+ *  \param region The region previously passed to parallel_begin.
+ */
+
 #pragma once
 #ifndef PLATFORM_H_
 #define PLATFORM_H_
 
+/* pthread_rwlock_t is hidden in strict C11 mode */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <complex.h>
 #include <limits.h>
 #include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #if defined(_MSC_VER)
 #define ALIGNED_(x) __declspec(align(x))
 #else
@@ -176,6 +214,50 @@
 #endif
 #endif
 
+/* Bytes per cache line, used to keep per-thread data apart */
+#define CACHE_LINE_SIZE 64
+
+/* Number of bits set in a NATURAL_TYPE */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define POPCOUNT(x) ((unsigned int)__popcnt64((unsigned __int64)(x)))
+#else
+#define POPCOUNT(x) ((unsigned int)__builtin_popcountll((unsigned long long)(x)))
+#endif
+
+#ifdef _WIN32
+/* SRW locks remember whether they were taken in shared or exclusive mode */
+#define RWLOCK_TYPE      \
+	struct {         \
+		SRWLOCK srw; \
+		bool excl;   \
+	}
+#define RWLOCK_INIT(l) InitializeSRWLock(&(l).srw)
+#define RWLOCK_DESTROY(l) ((void)0)
+#define RWLOCK_RDLOCK(l) AcquireSRWLockShared(&(l).srw)
+#define RWLOCK_WRLOCK(l)                          \
+	do {                                      \
+		AcquireSRWLockExclusive(&(l).srw); \
+		(l).excl = true;                  \
+	} while (0)
+#define RWLOCK_UNLOCK(l)                                  \
+	do {                                              \
+		if ((l).excl) {                           \
+			(l).excl = false;                 \
+			ReleaseSRWLockExclusive(&(l).srw); \
+		} else {                                  \
+			ReleaseSRWLockShared(&(l).srw);    \
+		}                                         \
+	} while (0)
+#else
+#define RWLOCK_TYPE pthread_rwlock_t
+#define RWLOCK_INIT(l) pthread_rwlock_init(&(l), NULL)
+#define RWLOCK_DESTROY(l) pthread_rwlock_destroy(&(l))
+#define RWLOCK_RDLOCK(l) pthread_rwlock_rdlock(&(l))
+#define RWLOCK_WRLOCK(l) pthread_rwlock_wrlock(&(l))
+#define RWLOCK_UNLOCK(l) pthread_rwlock_unlock(&(l))
+#endif
+
 #define MALLOC_TYPE(n, type) ((type *)malloc((n) * sizeof(type)))
 #define CALLOC_TYPE(n, type) ((type *)calloc((n), sizeof(type)))
 #define REALLOC_TYPE(p, n, type) ((type *)realloc((p), (n) * sizeof(type)))
@@ -352,4 +434,32 @@ fix_value(COMPLEX_TYPE a, REAL_TYPE min_r, REAL_TYPE min_i, REAL_TYPE max_r,
 
 unsigned int log2_64(uint64_t value);
 
+/* Default number of iterations under which kernels run serially */
+#define PARALLEL_SERIAL_THRESHOLD (NATURAL_ONE << 12)
+
+struct parallel_config {
+	/* threads used when a call asks for -1 (-1 -> let OpenMP choose) */
+	int num_threads;
+	/* OpenMP schedule kind used by the kernels (omp_sched_t) */
+	int schedule;
+	/* chunk size of the schedule (<= 0 -> OpenMP default) */
+	int chunk_size;
+	/* loops with fewer iterations than this run serially */
+	NATURAL_TYPE serial_threshold;
+};
+
+struct parallel_region {
+	/* schedule kind of the calling thread before the kernel */
+	int schedule;
+	/* chunk size of the calling thread before the kernel */
+	int chunk_size;
+};
+
+extern struct parallel_config doki_parallel_config;
+
+int parallel_begin(struct parallel_region *region, int num_threads,
+		   NATURAL_TYPE work);
+
+void parallel_end(struct parallel_region *region);
+
 #endif /* PLATFORM_H_ */
@@ -0,0 +1,591 @@
+/*
+ * Doki: Quantum Computer simulator, using state vectors. QSimov core.
+ * Copyright (C) 2021  Hernán Indíbil de la Cruz Calvo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "platform.h"
+#include "qfactor.h"
+#include "qgate.h"
+#include "qops.h"
+#include "qstate.h"
+
+/* New state of a single qubit with the specified value */
+static struct state_vector *_basis_qubit(bool value, unsigned char *exit_code)
+{
+	struct state_vector *state;
+
+	state = MALLOC_TYPE(1, struct state_vector);
+	if (state == NULL) {
+		*exit_code = 4;
+		return NULL;
+	}
+	*exit_code = state_init(state, 1, true);
+	if (*exit_code != 0) {
+		free(state);
+		return NULL;
+	}
+	if (value) {
+		state_set(state, 0, COMPLEX_ZERO);
+		state_set(state, 1, COMPLEX_ONE);
+	}
+
+	return state;
+}
+
+unsigned char factor_init(struct factor_state *this, unsigned int num_qubits)
+{
+	unsigned int q;
+	unsigned char exit_code;
+
+	this->num_qubits = num_qubits;
+	this->num_clusters = 0;
+	this->split_tol = -1;
+	this->clusters = CALLOC_TYPE(num_qubits + 1, struct state_vector *);
+	this->cluster_of = MALLOC_TYPE(num_qubits, unsigned int);
+	this->position = MALLOC_TYPE(num_qubits, unsigned int);
+	if (this->clusters == NULL || this->cluster_of == NULL ||
+	    this->position == NULL) {
+		free(this->clusters);
+		free(this->cluster_of);
+		free(this->position);
+		this->clusters = NULL;
+		return 4;
+	}
+	RWLOCK_INIT(this->lock);
+	for (q = 0; q < num_qubits; q++) {
+		this->clusters[q] = _basis_qubit(false, &exit_code);
+		if (this->clusters[q] == NULL) {
+			factor_clear(this);
+			return exit_code;
+		}
+		this->num_clusters++;
+		this->cluster_of[q] = q;
+		this->position[q] = 0;
+	}
+
+	return 0;
+}
+
+void factor_clear(struct factor_state *this)
+{
+	unsigned int c;
+
+	if (this->clusters != NULL) {
+		for (c = 0; c < this->num_clusters; c++) {
+			state_clear(this->clusters[c]);
+			free(this->clusters[c]);
+		}
+		free(this->clusters);
+		free(this->cluster_of);
+		free(this->position);
+		RWLOCK_DESTROY(this->lock);
+	}
+	this->clusters = NULL;
+	this->cluster_of = NULL;
+	this->position = NULL;
+	this->num_qubits = 0;
+	this->num_clusters = 0;
+}
+
+/* Move the last cluster to an empty slot */
+static void _factor_fill_slot(struct factor_state *this, unsigned int slot)
+{
+	unsigned int q, last;
+
+	last = this->num_clusters - 1;
+	if (slot != last) {
+		this->clusters[slot] = this->clusters[last];
+		for (q = 0; q < this->num_qubits; q++) {
+			if (this->cluster_of[q] == last) {
+				this->cluster_of[q] = slot;
+			}
+		}
+	}
+	this->clusters[last] = NULL;
+	this->num_clusters--;
+}
+
+/* Join the clusters of the specified qubits into a single one */
+static unsigned char _factor_merge(struct factor_state *this,
+				   unsigned int *qubits, unsigned int count,
+				   int num_threads)
+{
+	struct state_vector **states, *joined;
+	unsigned int *rank, *offset, q, c, k, num_states, total;
+	unsigned char exit_code;
+
+	// rank[c] is 1 + the place of cluster c in the join (0 if not joined)
+	rank = CALLOC_TYPE(this->num_clusters, unsigned int);
+	if (rank == NULL) {
+		return 4;
+	}
+	num_states = 0;
+	for (k = 0; k < count; k++) {
+		c = this->cluster_of[qubits[k]];
+		if (rank[c] == 0) {
+			rank[c] = ++num_states;
+		}
+	}
+	if (num_states == 1) {
+		free(rank);
+		return 0;
+	}
+
+	states = MALLOC_TYPE(num_states, struct state_vector *);
+	offset = MALLOC_TYPE(num_states, unsigned int);
+	joined = MALLOC_TYPE(1, struct state_vector);
+	if (states == NULL || offset == NULL || joined == NULL) {
+		free(rank);
+		free(states);
+		free(offset);
+		free(joined);
+		return 4;
+	}
+	total = 0;
+	for (c = 0; c < this->num_clusters; c++) {
+		if (rank[c] != 0) {
+			states[rank[c] - 1] = this->clusters[c];
+			total += this->clusters[c]->num_qubits;
+		}
+	}
+	if (total > MAX_NUM_QUBITS) {
+		exit_code = 3;
+	} else {
+		exit_code = join_many(joined, states, num_states, num_threads);
+	}
+	if (exit_code != 0) {
+		free(rank);
+		free(states);
+		free(offset);
+		free(joined);
+		return exit_code;
+	}
+
+	// The first state of the join holds the most significant qubits
+	offset[num_states - 1] = 0;
+	for (k = num_states - 1; k > 0; k--) {
+		offset[k - 1] = offset[k] + states[k]->num_qubits;
+	}
+	for (q = 0; q < this->num_qubits; q++) {
+		c = this->cluster_of[q];
+		if (rank[c] != 0) {
+			this->position[q] += offset[rank[c] - 1];
+			this->cluster_of[q] = this->num_clusters;
+		}
+	}
+	for (k = 0; k < num_states; k++) {
+		state_clear(states[k]);
+		free(states[k]);
+	}
+	// The joined cluster is appended and the empty slots are filled from
+	// the end (in decreasing order, so no moved cluster is left behind)
+	this->clusters[this->num_clusters] = joined;
+	this->num_clusters++;
+	for (c = this->num_clusters - 1; c-- > 0;) {
+		if (rank[c] != 0) {
+			this->clusters[c] = NULL;
+			_factor_fill_slot(this, c);
+		}
+	}
+	free(rank);
+	free(states);
+	free(offset);
+
+	return 0;
+}
+
+unsigned char factor_apply_gate(struct factor_state *this, struct qgate *gate,
+				unsigned int *targets, unsigned int num_targets,
+				unsigned int *controls,
+				unsigned int num_controls,
+				unsigned int *anticontrols,
+				unsigned int num_anticontrols, int num_threads)
+{
+	struct state_vector *cluster, *new_state;
+	unsigned int *qubits, *local, count, k, c;
+	unsigned char exit_code;
+
+	count = num_targets + num_controls + num_anticontrols;
+	qubits = MALLOC_TYPE(2 * count, unsigned int);
+	new_state = MALLOC_TYPE(1, struct state_vector);
+	if (qubits == NULL || new_state == NULL) {
+		free(qubits);
+		free(new_state);
+		return 4;
+	}
+	for (k = 0; k < num_targets; k++) {
+		qubits[k] = targets[k];
+	}
+	for (k = 0; k < num_controls; k++) {
+		qubits[num_targets + k] = controls[k];
+	}
+	for (k = 0; k < num_anticontrols; k++) {
+		qubits[num_targets + num_controls + k] = anticontrols[k];
+	}
+	exit_code = _factor_merge(this, qubits, count, num_threads);
+	if (exit_code != 0) {
+		free(qubits);
+		free(new_state);
+		return exit_code;
+	}
+
+	local = qubits + count;
+	for (k = 0; k < count; k++) {
+		local[k] = this->position[qubits[k]];
+	}
+	c = this->cluster_of[qubits[0]];
+	cluster = this->clusters[c];
+	// apply_gate frees new_state when it fails
+	exit_code = apply_gate(cluster, gate, local, num_targets,
+			       local + num_targets, num_controls,
+			       local + num_targets + num_controls,
+			       num_anticontrols, new_state, num_threads);
+	free(qubits);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	state_clear(cluster);
+	free(cluster);
+	this->clusters[c] = new_state;
+
+	return 0;
+}
+
+REAL_TYPE factor_probability(struct factor_state *this, unsigned int target_id,
+			     int num_threads)
+{
+	return probability(this->clusters[this->cluster_of[target_id]],
+			   this->position[target_id], num_threads);
+}
+
+/* Move every qubit of a cluster that is separable from the rest of it to
+ * its own cluster. Failures just leave the cluster as it is. */
+static void _factor_peel(struct factor_state *this, unsigned int c,
+			 int num_threads)
+{
+	struct state_vector *single, *rest;
+	unsigned int q, p, qubit;
+	unsigned char exit_code;
+	bool separable;
+
+	single = MALLOC_TYPE(1, struct state_vector);
+	rest = MALLOC_TYPE(1, struct state_vector);
+	p = 0;
+	while (single != NULL && rest != NULL &&
+	       p < this->clusters[c]->num_qubits &&
+	       this->clusters[c]->num_qubits > 1) {
+		exit_code = split(this->clusters[c], NATURAL_ONE << p,
+				  this->split_tol, single, rest, &separable,
+				  num_threads);
+		if (exit_code != 0) {
+			break;
+		}
+		if (!separable) {
+			p++;
+			continue;
+		}
+		qubit = this->num_qubits;
+		for (q = 0; q < this->num_qubits; q++) {
+			if (this->cluster_of[q] != c) {
+				continue;
+			}
+			if (this->position[q] == p) {
+				qubit = q;
+			} else if (this->position[q] > p) {
+				this->position[q]--;
+			}
+		}
+		state_clear(this->clusters[c]);
+		free(this->clusters[c]);
+		this->clusters[c] = rest;
+		this->clusters[this->num_clusters] = single;
+		this->cluster_of[qubit] = this->num_clusters;
+		this->position[qubit] = 0;
+		this->num_clusters++;
+		single = MALLOC_TYPE(1, struct state_vector);
+		rest = MALLOC_TYPE(1, struct state_vector);
+	}
+	free(single);
+	free(rest);
+}
+
+unsigned char factor_measure(struct factor_state *this, unsigned int *ids,
+			     unsigned int num_ids, REAL_TYPE *rolls,
+			     bool *results, int num_threads)
+{
+	struct state_vector **collapsed, **singles, *cluster;
+	NATURAL_TYPE *masks, outcome;
+	REAL_TYPE *local_rolls;
+	unsigned int *roll_of, q, c, k, p, j, slot, num_clusters;
+	unsigned char exit_code;
+
+	num_clusters = this->num_clusters;
+	collapsed = CALLOC_TYPE(num_clusters, struct state_vector *);
+	singles = CALLOC_TYPE(num_ids, struct state_vector *);
+	masks = CALLOC_TYPE(num_clusters, NATURAL_TYPE);
+	roll_of = MALLOC_TYPE(this->num_qubits, unsigned int);
+	local_rolls = MALLOC_TYPE(num_ids, REAL_TYPE);
+	exit_code = 0;
+	if (collapsed == NULL || singles == NULL || masks == NULL ||
+	    roll_of == NULL || local_rolls == NULL) {
+		exit_code = 4;
+		goto cleanup;
+	}
+	for (k = 0; k < num_ids; k++) {
+		q = ids[k];
+		masks[this->cluster_of[q]] |= NATURAL_ONE << this->position[q];
+		roll_of[q] = k;
+	}
+
+	// Every cluster is measured on its own, deciding its qubits from the
+	// highest position to the lowest. The qubits of different clusters
+	// are independent, so the order between clusters does not matter.
+	for (c = 0; c < num_clusters && exit_code == 0; c++) {
+		if (masks[c] == 0) {
+			continue;
+		}
+		cluster = this->clusters[c];
+		j = 0;
+		for (p = cluster->num_qubits; p-- > 0;) {
+			if (!(masks[c] & (NATURAL_ONE << p))) {
+				continue;
+			}
+			for (q = 0; q < this->num_qubits; q++) {
+				if (this->cluster_of[q] == c &&
+				    this->position[q] == p) {
+					break;
+				}
+			}
+			local_rolls[j++] = rolls[roll_of[q]];
+		}
+		collapsed[c] = MALLOC_TYPE(1, struct state_vector);
+		if (collapsed[c] == NULL) {
+			exit_code = 4;
+			break;
+		}
+		exit_code = measure_mask(cluster, masks[c], local_rolls,
+					 &outcome, collapsed[c], num_threads);
+		if (exit_code != 0) {
+			free(collapsed[c]);
+			collapsed[c] = NULL;
+			break;
+		}
+		if (collapsed[c]->num_qubits > 0 &&
+		    collapsed[c]->norm_const == 0.0) {
+			exit_code = 5;
+			break;
+		}
+		// Bit j of outcome is the j-th lowest measured position
+		j = 0;
+		for (p = 0; p < cluster->num_qubits; p++) {
+			if (!(masks[c] & (NATURAL_ONE << p))) {
+				continue;
+			}
+			for (q = 0; q < this->num_qubits; q++) {
+				if (this->cluster_of[q] == c &&
+				    this->position[q] == p) {
+					break;
+				}
+			}
+			results[roll_of[q]] = (outcome >> j) & 1;
+			j++;
+		}
+	}
+	for (k = 0; k < num_ids && exit_code == 0; k++) {
+		singles[k] = _basis_qubit(results[k], &exit_code);
+	}
+	if (exit_code != 0) {
+		goto cleanup;
+	}
+
+	// Nothing can fail from here on
+	for (c = 0; c < num_clusters; c++) {
+		if (masks[c] == 0) {
+			continue;
+		}
+		state_clear(this->clusters[c]);
+		free(this->clusters[c]);
+		this->clusters[c] = NULL;
+		if (collapsed[c]->num_qubits > 0) {
+			this->clusters[c] = collapsed[c];
+		} else {
+			free(collapsed[c]);
+		}
+		collapsed[c] = NULL;
+		// The qubits left keep their order inside the cluster
+		for (q = 0; q < this->num_qubits; q++) {
+			if (this->cluster_of[q] == c &&
+			    !(masks[c] & (NATURAL_ONE << this->position[q]))) {
+				this->position[q] = POPCOUNT(
+					~masks[c] &
+					((NATURAL_ONE << this->position[q]) - 1));
+			}
+		}
+	}
+	// Measured qubits fill the slots of fully measured clusters first
+	slot = 0;
+	for (k = 0; k < num_ids; k++) {
+		while (slot < this->num_clusters &&
+		       this->clusters[slot] != NULL) {
+			slot++;
+		}
+		if (slot == this->num_clusters) {
+			this->num_clusters++;
+		}
+		this->clusters[slot] = singles[k];
+		singles[k] = NULL;
+		this->cluster_of[ids[k]] = slot;
+		this->position[ids[k]] = 0;
+	}
+	if (this->split_tol >= 0) {
+		for (c = 0; c < num_clusters; c++) {
+			if (masks[c] != 0) {
+				_factor_peel(this, c, num_threads);
+			}
+		}
+	}
+
+cleanup:
+	if (collapsed != NULL) {
+		for (c = 0; c < num_clusters; c++) {
+			if (collapsed[c] != NULL &&
+			    collapsed[c]->num_qubits > 0) {
+				state_clear(collapsed[c]);
+			}
+			free(collapsed[c]);
+		}
+	}
+	if (singles != NULL) {
+		for (k = 0; k < num_ids; k++) {
+			if (singles[k] != NULL) {
+				state_clear(singles[k]);
+				free(singles[k]);
+			}
+		}
+	}
+	free(collapsed);
+	free(singles);
+	free(masks);
+	free(roll_of);
+	free(local_rolls);
+
+	return exit_code;
+}
+
+unsigned char factor_get(struct factor_state *this, NATURAL_TYPE index,
+			 COMPLEX_TYPE *value)
+{
+	NATURAL_TYPE *local;
+	unsigned int q, c;
+
+	local = CALLOC_TYPE(this->num_clusters, NATURAL_TYPE);
+	if (local == NULL) {
+		return 4;
+	}
+	for (q = 0; q < this->num_qubits; q++) {
+		local[this->cluster_of[q]] |= ((index >> q) & 1)
+					      << this->position[q];
+	}
+	*value = COMPLEX_ONE;
+	for (c = 0; c < this->num_clusters; c++) {
+		*value = COMPLEX_MULT(*value,
+				      state_get(this->clusters[c], local[c]));
+	}
+	free(local);
+
+	return 0;
+}
+
+unsigned char factor_gather(struct factor_state *this,
+			    struct state_vector *dest, int num_threads)
+{
+	struct state_vector joined;
+	NATURAL_TYPE i, src;
+	unsigned int *offset, *bit, q, c, num_qubits;
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	num_qubits = this->num_qubits;
+	offset = MALLOC_TYPE(this->num_clusters, unsigned int);
+	bit = MALLOC_TYPE(num_qubits, unsigned int);
+	if (offset == NULL || bit == NULL) {
+		free(offset);
+		free(bit);
+		return 4;
+	}
+	exit_code = state_init(dest, num_qubits, false);
+	if (exit_code == 0) {
+		exit_code = join_many(&joined, this->clusters,
+				      this->num_clusters, num_threads);
+		if (exit_code != 0) {
+			state_clear(dest);
+		}
+	}
+	if (exit_code != 0) {
+		free(offset);
+		free(bit);
+		return exit_code;
+	}
+
+	// Position of each qubit in the joined state
+	offset[this->num_clusters - 1] = 0;
+	for (c = this->num_clusters - 1; c > 0; c--) {
+		offset[c - 1] = offset[c] + this->clusters[c]->num_qubits;
+	}
+	for (q = 0; q < num_qubits; q++) {
+		bit[q] = offset[this->cluster_of[q]] + this->position[q];
+	}
+	nt = parallel_begin(&region, num_threads, dest->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	shared(dest, joined, bit, num_qubits, COMPLEX_ARRAY_SIZE) \
+	private(i, q, src)
+	for (i = 0; i < dest->size; i++) {
+		src = 0;
+		for (q = 0; q < num_qubits; q++) {
+			src |= ((i >> q) & 1) << bit[q];
+		}
+		state_set(dest, i, state_get(&joined, src));
+	}
+	parallel_end(&region);
+	state_clear(&joined);
+	free(offset);
+	free(bit);
+
+	return 0;
+}
+
+size_t factor_mem_size(struct factor_state *this)
+{
+	size_t size;
+	unsigned int c;
+
+	size = sizeof(struct factor_state);
+	size += (this->num_qubits + 1) * sizeof(struct state_vector *);
+	size += 2 * this->num_qubits * sizeof(unsigned int);
+	for (c = 0; c < this->num_clusters; c++) {
+		size += state_mem_size(this->clusters[c]);
+	}
+
+	return size;
+}
@@ -0,0 +1,139 @@
+/*
+ * Doki: Quantum Computer simulator, using state vectors. QSimov core.
+ * Copyright (C) 2021  Hernán Indíbil de la Cruz Calvo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** \file qfactor.h
+ *  \brief Quantum states stored as the tensor product of independent
+ *  clusters of qubits.
+ *
+ *  Every qubit belongs to exactly one cluster, which is a regular state
+ *  vector. Gates only touch the clusters of their qubits, joining them first
+ *  when there is more than one, so the memory used is the sum of the sizes
+ *  of the clusters instead of their product.
+ */
+
+#pragma once
+#ifndef QFACTOR_H_
+#define QFACTOR_H_
+
+#include "platform.h"
+#include "qgate.h"
+#include "qstate.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+struct factor_state {
+	/* number of qubits of the whole system */
+	unsigned int num_qubits;
+	/* number of independent clusters */
+	unsigned int num_clusters;
+	/* state of each cluster (room for one more than num_qubits, used while
+	 * merging) */
+	struct state_vector **clusters;
+	/* cluster holding each qubit */
+	unsigned int *cluster_of;
+	/* position of each qubit inside the state of its cluster */
+	unsigned int *position;
+	/* tolerance used to split the clusters left by a measurement (negative
+	 * to keep them as they are) */
+	REAL_TYPE split_tol;
+	/* readers/writer lock protecting the whole registry */
+	RWLOCK_TYPE lock;
+};
+
+/** \fn unsigned char factor_init(struct factor_state *this, unsigned int
+ * num_qubits);
+ *  \brief Initialize a factorized state to |0...0>, with one cluster per
+ *  qubit.
+ *  \param this Pointer to an already allocated factor_state structure.
+ *  \param num_qubits Number of qubits of the system (at least 1).
+ *  \return 0 if ok, 1 or 2 if failed to allocate a cluster, 4 if failed to
+ *  allocate the cluster structures.
+ */
+unsigned char factor_init(struct factor_state *this, unsigned int num_qubits);
+
+void factor_clear(struct factor_state *this);
+
+/** \fn unsigned char factor_apply_gate(struct factor_state *this, struct
+ * qgate *gate, unsigned int *targets, unsigned int num_targets, unsigned int
+ * *controls, unsigned int num_controls, unsigned int *anticontrols, unsigned
+ * int num_anticontrols, int num_threads);
+ *  \brief Apply a gate in place. The clusters of the targets and controls
+ *  are joined first if they are not the same one.
+ *  \return 0 if ok, 3 if the joined cluster would have more than
+ *  MAX_NUM_QUBITS, 4 if failed to allocate memory, or a join_many or
+ *  apply_gate error code.
+ */
+unsigned char factor_apply_gate(struct factor_state *this, struct qgate *gate,
+				unsigned int *targets, unsigned int num_targets,
+				unsigned int *controls,
+				unsigned int num_controls,
+				unsigned int *anticontrols,
+				unsigned int num_anticontrols, int num_threads);
+
+/** \fn REAL_TYPE factor_probability(struct factor_state *this, unsigned int
+ * target_id, int num_threads);
+ *  \brief Chances of obtaining 1 when measuring a qubit. Only its cluster
+ *  is read.
+ */
+REAL_TYPE factor_probability(struct factor_state *this, unsigned int target_id,
+			     int num_threads);
+
+/** \fn unsigned char factor_measure(struct factor_state *this, unsigned int
+ * *ids, unsigned int num_ids, REAL_TYPE *rolls, bool *results, int
+ * num_threads);
+ *  \brief Measure some qubits. Only their clusters are touched, and every
+ *  measured qubit is left in its own cluster with the value obtained.
+ *  \param ids Qubits to measure (without repetitions).
+ *  \param rolls One roll in [0, 1) per qubit in ids.
+ *  \param results Where the value of each qubit in ids is stored.
+ *  If split_tol is not negative, the qubits that are left in the measured
+ *  clusters and are no longer entangled with the rest are moved to their
+ *  own clusters too.
+ *  \return 0 if ok, 4 if failed to allocate memory, 5 if an outcome had no
+ *  chances of happening, or a state_init error code. The state is only
+ *  modified when 0 is returned.
+ */
+unsigned char factor_measure(struct factor_state *this, unsigned int *ids,
+			     unsigned int num_ids, REAL_TYPE *rolls,
+			     bool *results, int num_threads);
+
+/** \fn unsigned char factor_get(struct factor_state *this, NATURAL_TYPE
+ * index, COMPLEX_TYPE *value);
+ *  \brief Amplitude of a basis state, as the product of the amplitudes of
+ *  each cluster. Only for systems with less than NATURAL_BITS qubits.
+ *  \return 0 if ok, 4 if failed to allocate memory.
+ */
+unsigned char factor_get(struct factor_state *this, NATURAL_TYPE index,
+			 COMPLEX_TYPE *value);
+
+/** \fn unsigned char factor_gather(struct factor_state *this, struct
+ * state_vector *dest, int num_threads);
+ *  \brief Join every cluster into a regular state vector, with the qubits
+ *  in their original order.
+ *  \return 0 if ok, 4 if failed to allocate memory, or a state_init error
+ *  code.
+ */
+unsigned char factor_gather(struct factor_state *this,
+			    struct state_vector *dest, int num_threads);
+
+/** \fn size_t factor_mem_size(struct factor_state *this);
+ *  \brief Bytes used by the structures and every cluster.
+ */
+size_t factor_mem_size(struct factor_state *this);
+
+#endif /* QFACTOR_H_ */
@@ -21,6 +21,11 @@
 #define QGATE_H_
 
 #include "qstate.h"
+#include <stdbool.h>
+
+/* Maximum deviation from the identity allowed in U * U^dagger for a gate
+ * to be flagged as unitary */
+#define UNITARY_TOLERANCE 1e-10
 
 struct qgate {
 	/* number of qubits affected by this gate */
@@ -29,6 +34,8 @@ struct qgate {
 	NATURAL_TYPE size;
 	/* matrix that represents the gate */
 	COMPLEX_TYPE **matrix;
+	/* whether the matrix has been verified to be unitary */
+	bool unitary;
 };
 
 #endif /* QGATE_H_ */
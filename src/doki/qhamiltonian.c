@@ -0,0 +1,234 @@
+/*
+ * Doki: Quantum Computer simulator, using state vectors. QSimov core.
+ * Copyright (C) 2021  Hernán Indíbil de la Cruz Calvo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "qhamiltonian.h"
+#include "platform.h"
+#include <omp.h>
+#include <stdlib.h>
+
+struct _term {
+	NATURAL_TYPE x_mask;
+	NATURAL_TYPE z_mask;
+	COMPLEX_TYPE coeff;
+	NATURAL_TYPE index;
+};
+
+static int _term_cmp(const void *a, const void *b)
+{
+	const struct _term *ta = a, *tb = b;
+
+	if (ta->x_mask != tb->x_mask) {
+		return ta->x_mask < tb->x_mask ? -1 : 1;
+	}
+	return (ta->index > tb->index) - (ta->index < tb->index);
+}
+
+unsigned char hamiltonian_init(struct hamiltonian *this,
+			       unsigned int num_qubits, NATURAL_TYPE num_terms,
+			       NATURAL_TYPE *x_masks, NATURAL_TYPE *z_masks,
+			       COMPLEX_TYPE *coeffs)
+{
+	NATURAL_TYPE t, g, valid;
+	struct _term *terms;
+
+	if (num_qubits > MAX_NUM_QUBITS) {
+		return 5;
+	}
+	valid = (NATURAL_ONE << num_qubits) - 1;
+	for (t = 0; t < num_terms; t++) {
+		if ((x_masks[t] | z_masks[t]) & ~valid) {
+			return 5;
+		}
+	}
+
+	terms = MALLOC_TYPE(num_terms + 1, struct _term);
+	this->x_masks = MALLOC_TYPE(num_terms + 1, NATURAL_TYPE);
+	this->group_start = MALLOC_TYPE(num_terms + 1, NATURAL_TYPE);
+	this->z_masks = MALLOC_TYPE(num_terms + 1, NATURAL_TYPE);
+	this->coeffs = MALLOC_TYPE(num_terms + 1, COMPLEX_TYPE);
+	this->order = MALLOC_TYPE(num_terms + 1, NATURAL_TYPE);
+	if (terms == NULL || this->x_masks == NULL ||
+	    this->group_start == NULL || this->z_masks == NULL ||
+	    this->coeffs == NULL || this->order == NULL) {
+		free(terms);
+		hamiltonian_clear(this);
+		return 4;
+	}
+
+	for (t = 0; t < num_terms; t++) {
+		terms[t].x_mask = x_masks[t];
+		terms[t].z_mask = z_masks[t];
+		terms[t].coeff = coeffs[t];
+		terms[t].index = t;
+	}
+	qsort(terms, num_terms, sizeof(struct _term), _term_cmp);
+
+	g = 0;
+	for (t = 0; t < num_terms; t++) {
+		if (t == 0 || terms[t].x_mask != terms[t - 1].x_mask) {
+			this->x_masks[g] = terms[t].x_mask;
+			this->group_start[g] = t;
+			g++;
+		}
+		this->z_masks[t] = terms[t].z_mask;
+		this->order[t] = terms[t].index;
+		// Each Y is i * X * Z
+		switch (POPCOUNT(terms[t].x_mask & terms[t].z_mask) & 3) {
+		case 1:
+			this->coeffs[t] = COMPLEX_MULT(terms[t].coeff,
+						       COMPLEX_INIT(0, 1));
+			break;
+		case 2:
+			this->coeffs[t] = COMPLEX_MULT_R(terms[t].coeff, -1);
+			break;
+		case 3:
+			this->coeffs[t] = COMPLEX_MULT(terms[t].coeff,
+						       COMPLEX_INIT(0, -1));
+			break;
+		default:
+			this->coeffs[t] = terms[t].coeff;
+		}
+	}
+	this->group_start[g] = num_terms;
+	this->num_groups = g;
+	this->num_terms = num_terms;
+	this->num_qubits = num_qubits;
+	free(terms);
+
+	return 0;
+}
+
+void hamiltonian_clear(struct hamiltonian *this)
+{
+	free(this->x_masks);
+	free(this->group_start);
+	free(this->z_masks);
+	free(this->coeffs);
+	free(this->order);
+	this->x_masks = NULL;
+	this->group_start = NULL;
+	this->z_masks = NULL;
+	this->coeffs = NULL;
+	this->order = NULL;
+}
+
+/* Add sum_i conj(psi[i ^ x]) (-1)^|i & z_t| psi[i] to sums[t] for every
+ * term t of a group, reading each pair of amplitudes once */
+static unsigned char _group_sums(struct state_vector *state, NATURAL_TYPE x,
+				 NATURAL_TYPE *z_masks, NATURAL_TYPE num_terms,
+				 REAL_TYPE *sums, int num_threads)
+{
+	NATURAL_TYPE i, k, t, z, len, stride;
+	REAL_TYPE *acc, *local, sr, si, sign;
+	REAL_TYPE pr[HAMILTONIAN_BLOCK], pi[HAMILTONIAN_BLOCK];
+	COMPLEX_TYPE a, b;
+	struct parallel_region region;
+	int tid, nt;
+
+	// Real and imaginary parts of every term, a cache line apart per thread
+	stride = (2 * num_terms * sizeof(REAL_TYPE) + CACHE_LINE_SIZE - 1) /
+		 CACHE_LINE_SIZE * CACHE_LINE_SIZE / sizeof(REAL_TYPE);
+	nt = parallel_begin(&region, num_threads, state->size);
+	acc = calloc((size_t)nt * stride, sizeof(REAL_TYPE));
+	if (acc == NULL) {
+		parallel_end(&region);
+		return 4;
+	}
+#pragma omp parallel if (nt > 1) num_threads(nt) default(none) \
+	shared(state, x, z_masks, num_terms, acc, stride, COMPLEX_ARRAY_SIZE) \
+	private(i, k, t, z, len, local, sr, si, sign, pr, pi, a, b)
+	{
+		local = acc + omp_get_thread_num() * stride;
+#pragma omp for schedule(runtime)
+		for (i = 0; i < state->size; i += HAMILTONIAN_BLOCK) {
+			len = state->size - i;
+			if (len > HAMILTONIAN_BLOCK) {
+				len = HAMILTONIAN_BLOCK;
+			}
+			for (k = 0; k < len; k++) {
+				a = state_get(state, (i + k) ^ x);
+				b = state_get(state, i + k);
+				pr[k] = RE(a) * RE(b) + IM(a) * IM(b);
+				pi[k] = RE(a) * IM(b) - IM(a) * RE(b);
+			}
+			for (t = 0; t < num_terms; t++) {
+				z = z_masks[t];
+				sr = 0;
+				si = 0;
+				for (k = 0; k < len; k++) {
+					sign = POPCOUNT((i + k) & z) & 1 ? -1 : 1;
+					sr += sign * pr[k];
+					si += sign * pi[k];
+				}
+				local[2 * t] += sr;
+				local[2 * t + 1] += si;
+			}
+		}
+	}
+	for (t = 0; t < 2 * num_terms; t++) {
+		for (tid = 0; tid < nt; tid++) {
+			sums[t] += acc[tid * stride + t];
+		}
+	}
+	parallel_end(&region);
+	free(acc);
+
+	return 0;
+}
+
+unsigned char hamiltonian_expectation(struct hamiltonian *this,
+				      struct state_vector *state,
+				      COMPLEX_TYPE *energy, COMPLEX_TYPE *values,
+				      int num_threads)
+{
+	NATURAL_TYPE g, t, first;
+	REAL_TYPE *sums;
+	COMPLEX_TYPE value, total;
+	unsigned char exit_code;
+
+	sums = calloc(2 * this->num_terms + 1, sizeof(REAL_TYPE));
+	if (sums == NULL) {
+		return 4;
+	}
+	exit_code = 0;
+	for (g = 0; exit_code == 0 && g < this->num_groups; g++) {
+		first = this->group_start[g];
+		exit_code = _group_sums(state, this->x_masks[g],
+					this->z_masks + first,
+					this->group_start[g + 1] - first,
+					sums + 2 * first, num_threads);
+	}
+	if (exit_code != 0) {
+		free(sums);
+		return exit_code;
+	}
+
+	total = COMPLEX_ZERO;
+	for (t = 0; t < this->num_terms; t++) {
+		value = COMPLEX_MULT(this->coeffs[t],
+				     COMPLEX_INIT(sums[2 * t], sums[2 * t + 1]));
+		total = COMPLEX_ADD(total, value);
+		if (values != NULL) {
+			values[this->order[t]] = value;
+		}
+	}
+	*energy = total;
+	free(sums);
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Doki: Quantum Computer simulator, using state vectors. QSimov core.
+ * Copyright (C) 2021  Hernán Indíbil de la Cruz Calvo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** \file qhamiltonian.h
+ *  \brief Hamiltonians written as a sum of weighted Pauli strings.
+ *
+ *  Terms are grouped by the qubits they flip (their X mask). Every term of
+ *  a group pairs the same amplitudes, so the expectation value of the whole
+ *  group is obtained in a single pass over the state.
+ */
+
+#pragma once
+#ifndef QHAMILTONIAN_H_
+#define QHAMILTONIAN_H_
+
+#include "platform.h"
+#include "qstate.h"
+
+/* Amplitudes read at once before going through the terms of a group */
+#define HAMILTONIAN_BLOCK 256
+
+struct hamiltonian {
+	/* number of qubits the hamiltonian acts on */
+	unsigned int num_qubits;
+	/* number of Pauli strings */
+	NATURAL_TYPE num_terms;
+	/* number of different X masks */
+	NATURAL_TYPE num_groups;
+	/* X mask of each group */
+	NATURAL_TYPE *x_masks;
+	/* first term of each group (num_groups + 1 elements) */
+	NATURAL_TYPE *group_start;
+	/* Z mask of each term, sorted by group */
+	NATURAL_TYPE *z_masks;
+	/* coefficient of each term times i^|x & z|, sorted by group */
+	COMPLEX_TYPE *coeffs;
+	/* position of each sorted term in the list it was created from */
+	NATURAL_TYPE *order;
+};
+
+/** \fn unsigned char hamiltonian_init(struct hamiltonian *this, unsigned
+ * int num_qubits, NATURAL_TYPE num_terms, NATURAL_TYPE *x_masks,
+ * NATURAL_TYPE *z_masks, COMPLEX_TYPE *coeffs);
+ *  \brief Group the terms coeffs[t] * P(x_masks[t], z_masks[t]), where P
+ *  has an X on the qubits only in x_mask, a Z on the ones only in z_mask and
+ *  a Y on the ones in both.
+ *  \return 0 if ok, 4 if failed to allocate memory, 5 if a mask has qubits
+ *  out of range.
+ */
+unsigned char hamiltonian_init(struct hamiltonian *this,
+			       unsigned int num_qubits, NATURAL_TYPE num_terms,
+			       NATURAL_TYPE *x_masks, NATURAL_TYPE *z_masks,
+			       COMPLEX_TYPE *coeffs);
+
+void hamiltonian_clear(struct hamiltonian *this);
+
+/** \fn unsigned char hamiltonian_expectation(struct hamiltonian *this,
+ * struct state_vector *state, COMPLEX_TYPE *energy, COMPLEX_TYPE *values,
+ * int num_threads);
+ *  \brief Expectation value of a hamiltonian, with one pass per group.
+ *  \param energy Where the expectation value is stored.
+ *  \param values NULL or an array of num_terms elements where the value of
+ *  each term is stored, in the order they were given.
+ *  \return 0 if ok, 4 if failed to allocate memory.
+ */
+unsigned char hamiltonian_expectation(struct hamiltonian *this,
+				      struct state_vector *state,
+				      COMPLEX_TYPE *energy, COMPLEX_TYPE *values,
+				      int num_threads);
+
+#endif /* QHAMILTONIAN_H_ */
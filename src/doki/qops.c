@@ -43,24 +43,49 @@ _densityFun(NATURAL_TYPE i, NATURAL_TYPE j,
 #endif
 	    void *rawstate);
 
-REAL_TYPE get_global_phase(struct state_vector *state)
+/* Amplitudes scanned per step when looking for the global phase */
+#define PHASE_BLOCK (NATURAL_ONE << 16)
+
+REAL_TYPE get_global_phase(struct state_vector *state, int num_threads)
 {
-	NATURAL_TYPE i;
+	NATURAL_TYPE i, start, end, first;
 	REAL_TYPE phase;
 	COMPLEX_TYPE val;
+	struct parallel_region region;
+	int nt;
 
 	if (state->fcarg_init) {
 		return state->fcarg;
 	}
 
-	phase = 0.0;
-	for (i = 0; i < state->size; i++) {
-		val = state_get(state, i);
-		if (RE(val) != 0. || IM(val) != 0.) {
-			if (IM(val) != 0.) {
-				phase = ARG(val);
+	// The first non-zero amplitude is usually near the start, so the
+	// vector is scanned in blocks and each block is a parallel min
+	// reduction over the indices of its non-zero amplitudes.
+	first = state->size;
+	for (start = 0; start < state->size && first == state->size;
+	     start = end) {
+		end = state->size - start < PHASE_BLOCK ? state->size
+							 : start + PHASE_BLOCK;
+		nt = parallel_begin(&region, num_threads, end - start);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(static) \
+	default(none) firstprivate(state, start, end, COMPLEX_ARRAY_SIZE) \
+	private(i, val) reduction(min : first)
+		for (i = start; i < end; i++) {
+			if (i < first) {
+				val = state_get_raw(state, i);
+				if (RE(val) != 0. || IM(val) != 0.) {
+					first = i;
+				}
 			}
-			break;
+		}
+		parallel_end(&region);
+	}
+
+	phase = 0.0;
+	if (first < state->size) {
+		val = state_get_raw(state, first);
+		if (IM(val) != 0.) {
+			phase = ARG(val);
 		}
 	}
 	state->fcarg = phase;
@@ -69,11 +94,286 @@ REAL_TYPE get_global_phase(struct state_vector *state)
 	return phase;
 }
 
-REAL_TYPE probability(struct state_vector *state, unsigned int target_id)
+void get_amplitudes(struct state_vector *state, NATURAL_TYPE *ids,
+		    NATURAL_TYPE start, NATURAL_TYPE step, NATURAL_TYPE count,
+		    REAL_TYPE phase, COMPLEX_TYPE *values, int num_threads)
+{
+	NATURAL_TYPE k, id;
+	COMPLEX_TYPE factor;
+	struct parallel_region region;
+	int nt;
+
+	// Normalization and phase correction folded into one factor
+	factor = COMPLEX_INIT(COS(phase) / state->norm_const,
+			      -SIN(phase) / state->norm_const);
+	nt = parallel_begin(&region, num_threads, count);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	firstprivate(state, ids, start, step, count, factor, values, \
+		     COMPLEX_ARRAY_SIZE) private(k, id)
+	for (k = 0; k < count; k++) {
+		id = ids != NULL ? ids[k] : start + k * step;
+		values[k] = COMPLEX_MULT(state_get_raw(state, id), factor);
+	}
+	parallel_end(&region);
+}
+
+/* Whether entry a goes before entry b in a top-k result */
+static inline bool _entry_before(const struct basis_entry *a,
+				 const struct basis_entry *b)
+{
+	return a->prob > b->prob || (a->prob == b->prob && a->index < b->index);
+}
+
+static int _entry_cmp(const void *a, const void *b)
+{
+	if (_entry_before(a, b)) {
+		return -1;
+	}
+	return _entry_before(b, a) ? 1 : 0;
+}
+
+/* Put entry in place of the root of a heap whose root is its last entry in
+ * top-k order, and restore the heap */
+static void _heap_replace_root(struct basis_entry *heap, NATURAL_TYPE size,
+			       struct basis_entry entry)
+{
+	NATURAL_TYPE i, child;
+
+	i = 0;
+	while ((child = 2 * i + 1) < size) {
+		if (child + 1 < size &&
+		    _entry_before(&heap[child], &heap[child + 1])) {
+			child++;
+		}
+		if (!_entry_before(&entry, &heap[child])) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = entry;
+}
+
+static void _heap_push(struct basis_entry *heap, NATURAL_TYPE size,
+		       struct basis_entry entry)
+{
+	NATURAL_TYPE i, parent;
+
+	i = size;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!_entry_before(&heap[parent], &entry)) {
+			break;
+		}
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = entry;
+}
+
+/* Number of basis states with chances above threshold */
+static NATURAL_TYPE _count_above(struct state_vector *state,
+				 REAL_TYPE threshold, int nt)
+{
+	NATURAL_TYPE i, total;
+	COMPLEX_TYPE amplitude;
+
+	total = 0;
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) shared(state, threshold, COMPLEX_ARRAY_SIZE) \
+	private(i, amplitude) reduction(+ : total)
+	for (i = 0; i < state->size; i++) {
+		amplitude = state_get(state, i);
+		if (RE(amplitude) * RE(amplitude) +
+			    IM(amplitude) * IM(amplitude) >
+		    threshold) {
+			total++;
+		}
+	}
+
+	return total;
+}
+
+/* Keep the k best entries of each thread in a heap and merge them */
+static unsigned char _top_k_heaps(struct state_vector *state, NATURAL_TYPE k,
+				  REAL_TYPE threshold,
+				  struct basis_entry **entries,
+				  NATURAL_TYPE *num_entries,
+				  NATURAL_TYPE *count, int nt)
+{
+	NATURAL_TYPE i, total, *sizes, local_size;
+	struct basis_entry *heaps, *local, entry;
+	int t;
+
+	heaps = MALLOC_TYPE((size_t)nt * k, struct basis_entry);
+	sizes = calloc(nt, sizeof(NATURAL_TYPE));
+	if (heaps == NULL || sizes == NULL) {
+		free(heaps);
+		free(sizes);
+		return 4;
+	}
+	total = 0;
+#pragma omp parallel if (nt > 1) num_threads(nt) default(none) \
+	shared(state, k, threshold, heaps, sizes, COMPLEX_ARRAY_SIZE) \
+	private(i, t, local, local_size, entry) reduction(+ : total)
+	{
+		t = omp_get_thread_num();
+		local = heaps + t * k;
+		local_size = 0;
+#pragma omp for schedule(runtime)
+		for (i = 0; i < state->size; i++) {
+			entry.amplitude = state_get(state, i);
+			entry.prob = RE(entry.amplitude) * RE(entry.amplitude) +
+				     IM(entry.amplitude) * IM(entry.amplitude);
+			if (entry.prob <= threshold) {
+				continue;
+			}
+			total++;
+			entry.index = i;
+			if (local_size < k) {
+				_heap_push(local, local_size, entry);
+				local_size++;
+			} else if (_entry_before(&entry, &local[0])) {
+				_heap_replace_root(local, k, entry);
+			}
+		}
+		sizes[t] = local_size;
+	}
+
+	// Gather the heaps at the start of the array before sorting them
+	*num_entries = sizes[0];
+	for (t = 1; t < nt; t++) {
+		for (i = 0; i < sizes[t]; i++) {
+			heaps[*num_entries + i] = heaps[t * k + i];
+		}
+		*num_entries += sizes[t];
+	}
+	free(sizes);
+	qsort(heaps, *num_entries, sizeof(struct basis_entry), _entry_cmp);
+	if (*num_entries > k) {
+		*num_entries = k;
+	}
+	*entries = heaps;
+	*count = total;
+
+	return 0;
+}
+
+/* Gather every entry above threshold in index order, without a limit */
+static unsigned char _top_k_all(struct state_vector *state,
+				REAL_TYPE threshold,
+				struct basis_entry **entries,
+				NATURAL_TYPE *num_entries, int nt)
+{
+	NATURAL_TYPE i, pos, *offsets;
+	struct basis_entry *result, entry;
+	int t;
+
+	offsets = calloc((size_t)nt + 1, sizeof(NATURAL_TYPE));
+	if (offsets == NULL) {
+		return 4;
+	}
+	result = NULL;
+	// Both loops use the same static schedule, so every thread writes the
+	// entries it counted after the ones of the previous threads.
+#pragma omp parallel if (nt > 1) num_threads(nt) default(none) \
+	shared(state, threshold, offsets, result, nt, COMPLEX_ARRAY_SIZE) \
+	private(i, t, pos, entry)
+	{
+		t = omp_get_thread_num();
+#pragma omp for schedule(static)
+		for (i = 0; i < state->size; i++) {
+			entry.amplitude = state_get(state, i);
+			if (RE(entry.amplitude) * RE(entry.amplitude) +
+				    IM(entry.amplitude) * IM(entry.amplitude) >
+			    threshold) {
+				offsets[t + 1]++;
+			}
+		}
+#pragma omp single
+		{
+			for (i = 0; i < (NATURAL_TYPE)nt; i++) {
+				offsets[i + 1] += offsets[i];
+			}
+			result = MALLOC_TYPE(offsets[nt] > 0 ? offsets[nt] : 1,
+					     struct basis_entry);
+		}
+		pos = offsets[t];
+#pragma omp for schedule(static)
+		for (i = 0; i < state->size; i++) {
+			if (result == NULL) {
+				continue;
+			}
+			entry.amplitude = state_get(state, i);
+			entry.prob = RE(entry.amplitude) * RE(entry.amplitude) +
+				     IM(entry.amplitude) * IM(entry.amplitude);
+			if (entry.prob > threshold) {
+				entry.index = i;
+				result[pos++] = entry;
+			}
+		}
+	}
+	*num_entries = offsets[nt];
+	free(offsets);
+	if (result == NULL) {
+		return 4;
+	}
+	qsort(result, *num_entries, sizeof(struct basis_entry), _entry_cmp);
+	*entries = result;
+
+	return 0;
+}
+
+unsigned char top_k(struct state_vector *state, NATURAL_TYPE k,
+		    REAL_TYPE threshold, struct basis_entry **entries,
+		    NATURAL_TYPE *num_entries, NATURAL_TYPE *count,
+		    int num_threads)
+{
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	nt = parallel_begin(&region, num_threads, state->size);
+	if (k == 0) {
+		*entries = MALLOC_TYPE(1, struct basis_entry);
+		if (*entries == NULL) {
+			parallel_end(&region);
+			return 4;
+		}
+		*num_entries = 0;
+		*count = _count_above(state, threshold, nt);
+		parallel_end(&region);
+		return 0;
+	}
+	// Heaps are only worth it when they hold fewer entries than the state
+	if (k > 0 && k < state->size / nt) {
+		exit_code = _top_k_heaps(state, k, threshold, entries,
+					 num_entries, count, nt);
+		parallel_end(&region);
+		return exit_code;
+	}
+	exit_code = _top_k_all(state, threshold, entries, num_entries, nt);
+	parallel_end(&region);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	*count = *num_entries;
+	if (k >= 0 && *num_entries > k) {
+		*num_entries = k;
+	}
+
+	return 0;
+}
+
+REAL_TYPE probability(struct state_vector *state, unsigned int target_id,
+		      int num_threads)
 {
 	NATURAL_TYPE i, index, qty, low, high, target;
 	REAL_TYPE value;
 	COMPLEX_TYPE val;
+	struct parallel_region region;
+	int nt;
 
 	qty = state->size >> 1;
 	target = NATURAL_ONE << target_id;
@@ -81,7 +381,9 @@ REAL_TYPE probability(struct state_vector *state, unsigned int target_id)
 	high = ~low;
 
 	value = 0;
-#pragma omp parallel for reduction (+:value) \
+	nt = parallel_begin(&region, num_threads, qty);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+                             reduction (+:value) \
                              default (none) \
                              firstprivate (state, qty, low, high, target, COMPLEX_ARRAY_SIZE) \
                              private (i, index, val)
@@ -90,57 +392,755 @@ REAL_TYPE probability(struct state_vector *state, unsigned int target_id)
 		val = state_get(state, index);
 		value += RE(val) * RE(val) + IM(val) * IM(val);
 	}
+	parallel_end(&region);
 
 	return value;
 }
 
+/* Gather the bits of index selected by mask into the lowest positions */
+static inline NATURAL_TYPE _bits_compact(NATURAL_TYPE index,
+					 NATURAL_TYPE mask)
+{
+	NATURAL_TYPE result, bit;
+
+	result = 0;
+	for (bit = 1; mask != 0; bit <<= 1) {
+		if (index & mask & -mask) {
+			result |= bit;
+		}
+		mask &= mask - 1;
+	}
+
+	return result;
+}
+
+/* Insert a 0 in value at every position selected by mask */
+static inline NATURAL_TYPE _bits_spread(NATURAL_TYPE value, NATURAL_TYPE mask)
+{
+	NATURAL_TYPE low;
+
+	for (; mask != 0; mask &= mask - 1) {
+		low = (mask & -mask) - 1;
+		value = ((value & ~low) << 1) | (value & low);
+	}
+
+	return value;
+}
+
+/* Scatter the lowest bits of value to the positions selected by mask */
+static inline NATURAL_TYPE _bits_deposit(NATURAL_TYPE value,
+					 NATURAL_TYPE mask)
+{
+	NATURAL_TYPE result, bit;
+
+	result = 0;
+	for (bit = 1; mask != 0; bit <<= 1) {
+		if (value & bit) {
+			result |= mask & -mask;
+		}
+		mask &= mask - 1;
+	}
+
+	return result;
+}
+
+unsigned char marginal_probabilities(struct state_vector *state,
+				     NATURAL_TYPE mask, REAL_TYPE *probs,
+				     int num_threads)
+{
+	NATURAL_TYPE i, j, index, num_outcomes, rest_mask, rest_size, run,
+		stride;
+	REAL_TYPE value, *hist, *local;
+	COMPLEX_TYPE val;
+	struct parallel_region region;
+	int t, nt;
+
+	mask &= state->size - 1;
+	num_outcomes = NATURAL_ONE << POPCOUNT(mask);
+	rest_mask = (state->size - 1) & ~mask;
+	rest_size = state->size / num_outcomes;
+
+	nt = parallel_begin(&region, num_threads, state->size);
+	if (rest_mask == 0) {
+		// Every qubit is in the mask
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) shared(state, probs, COMPLEX_ARRAY_SIZE) private(i, val)
+		for (i = 0; i < state->size; i++) {
+			val = state_get(state, i);
+			probs[i] = RE(val) * RE(val) + IM(val) * IM(val);
+		}
+	} else if ((NATURAL_TYPE)nt * num_outcomes <= rest_size) {
+		// Few outcomes: one histogram per thread, merged at the end. The
+		// amplitudes below the lowest measured qubit share the outcome,
+		// so each run of them is added up before touching the histogram.
+		// Runs are split in blocks so that a mask with only high qubits
+		// still gives every thread several blocks.
+		run = mask != 0 ? mask & -mask : state->size;
+		while (run > 1 && state->size / run < 4 * (NATURAL_TYPE)nt) {
+			run >>= 1;
+		}
+		stride = (num_outcomes * sizeof(REAL_TYPE) + CACHE_LINE_SIZE - 1) /
+			 CACHE_LINE_SIZE * CACHE_LINE_SIZE / sizeof(REAL_TYPE);
+		hist = calloc((size_t)nt * stride, sizeof(REAL_TYPE));
+		if (hist == NULL) {
+			parallel_end(&region);
+			return 4;
+		}
+#pragma omp parallel if (nt > 1) num_threads(nt) default(none) \
+	shared(state, hist, mask, run, stride, COMPLEX_ARRAY_SIZE) \
+	private(i, j, val, value, local)
+		{
+			local = hist + omp_get_thread_num() * stride;
+#pragma omp for schedule(runtime)
+			for (i = 0; i < state->size; i += run) {
+				value = 0;
+				for (j = i; j < i + run; j++) {
+					val = state_get(state, j);
+					value += RE(val) * RE(val) +
+						 IM(val) * IM(val);
+				}
+				local[_bits_compact(i, mask)] += value;
+			}
+		}
+		for (j = 0; j < num_outcomes; j++) {
+			value = 0;
+			for (t = 0; t < nt; t++) {
+				value += hist[t * stride + j];
+			}
+			probs[j] = value;
+		}
+		free(hist);
+	} else {
+		// Many outcomes: each one adds up its own amplitudes
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	shared(state, probs, mask, num_outcomes, rest_size, \
+		       COMPLEX_ARRAY_SIZE) private(i, j, index, value, val)
+		for (j = 0; j < num_outcomes; j++) {
+			index = _bits_deposit(j, mask);
+			value = 0;
+			for (i = 0; i < rest_size; i++) {
+				val = state_get(state,
+						index | _bits_spread(i, mask));
+				value += RE(val) * RE(val) + IM(val) * IM(val);
+			}
+			probs[j] = value;
+		}
+	}
+	parallel_end(&region);
+
+	return 0;
+}
+
+unsigned char joint_probabilities(struct state_vector *state,
+				  unsigned int *ids, unsigned int num_ids,
+				  REAL_TYPE *probs, int num_threads)
+{
+	NATURAL_TYPE i, j, mask, outcome;
+	REAL_TYPE *sorted;
+	unsigned int k, *rank;
+	unsigned char exit_code;
+
+	mask = 0;
+	for (k = 0; k < num_ids; k++) {
+		mask |= NATURAL_ONE << ids[k];
+	}
+	sorted = MALLOC_TYPE(NATURAL_ONE << num_ids, REAL_TYPE);
+	rank = MALLOC_TYPE(num_ids + 1, unsigned int);
+	if (sorted == NULL || rank == NULL) {
+		free(sorted);
+		free(rank);
+		return 4;
+	}
+	exit_code = marginal_probabilities(state, mask, sorted, num_threads);
+	if (exit_code == 0) {
+		// Position of each qubit in the mask order
+		for (k = 0; k < num_ids; k++) {
+			rank[k] = POPCOUNT(mask & ((NATURAL_ONE << ids[k]) - 1));
+		}
+		for (i = 0; i < (NATURAL_ONE << num_ids); i++) {
+			outcome = 0;
+			for (k = 0; k < num_ids; k++) {
+				j = (i >> rank[k]) & 1;
+				outcome |= j << k;
+			}
+			probs[outcome] = sorted[i];
+		}
+	}
+	free(sorted);
+	free(rank);
+
+	return exit_code;
+}
+
+/* Inclusive prefix sum: every thread scans a block and then adds the sum of
+ * the blocks before it */
+static unsigned char _prefix_sum(REAL_TYPE *values, NATURAL_TYPE size,
+				 int num_threads)
+{
+	NATURAL_TYPE i, start, end;
+	REAL_TYPE sum, *offsets;
+	struct parallel_region region;
+	int t, tid, team, nt;
+
+	nt = parallel_begin(&region, num_threads, size);
+	offsets = MALLOC_TYPE(nt + 1, REAL_TYPE);
+	if (offsets == NULL) {
+		parallel_end(&region);
+		return 4;
+	}
+#pragma omp parallel if (nt > 1) num_threads(nt) default(none) \
+	shared(values, size, offsets) \
+	private(i, start, end, sum, t, tid, team)
+	{
+		tid = omp_get_thread_num();
+		team = omp_get_num_threads();
+		start = size * tid / team;
+		end = size * (tid + 1) / team;
+		sum = 0;
+		for (i = start; i < end; i++) {
+			sum += values[i];
+			values[i] = sum;
+		}
+		offsets[tid + 1] = sum;
+#pragma omp barrier
+#pragma omp single
+		{
+			offsets[0] = 0;
+			for (t = 1; t <= team; t++) {
+				offsets[t] += offsets[t - 1];
+			}
+		}
+		for (i = start; i < end; i++) {
+			values[i] += offsets[tid];
+		}
+	}
+	parallel_end(&region);
+	free(offsets);
+
+	return 0;
+}
+
+/* Number in [0, 1) obtained from the counter-th output of a splitmix64
+ * generator started at seed */
+static inline REAL_TYPE _uniform(uint64_t seed, uint64_t counter)
+{
+	uint64_t z;
+
+	z = seed + (counter + 1) * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+
+	return (REAL_TYPE)(z >> 11) * 0x1.0p-53;
+}
+
+unsigned char sample(struct state_vector *state, NATURAL_TYPE mask,
+		     NATURAL_TYPE shots, uint64_t seed, NATURAL_TYPE *outcomes,
+		     int num_threads)
+{
+	NATURAL_TYPE s, low, high, middle, num_outcomes;
+	REAL_TYPE *cdf, total, roll;
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	mask &= state->size - 1;
+	num_outcomes = NATURAL_ONE << POPCOUNT(mask);
+	cdf = MALLOC_TYPE(num_outcomes, REAL_TYPE);
+	if (cdf == NULL) {
+		return 4;
+	}
+	exit_code = marginal_probabilities(state, mask, cdf, num_threads);
+	if (exit_code == 0) {
+		exit_code = _prefix_sum(cdf, num_outcomes, num_threads);
+	}
+	if (exit_code != 0) {
+		free(cdf);
+		return exit_code;
+	}
+	total = cdf[num_outcomes - 1];
+
+	// Shot s always uses the s-th random number, whatever the threads
+	nt = parallel_begin(&region, num_threads, shots);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) shared(cdf, outcomes, shots, seed, total, num_outcomes) \
+	private(s, low, high, middle, roll)
+	for (s = 0; s < shots; s++) {
+		roll = _uniform(seed, s) * total;
+		low = 0;
+		high = num_outcomes - 1;
+		while (low < high) {
+			middle = low + (high - low) / 2;
+			if (cdf[middle] > roll) {
+				high = middle;
+			} else {
+				low = middle + 1;
+			}
+		}
+		outcomes[s] = low;
+	}
+	parallel_end(&region);
+	free(cdf);
+
+	return 0;
+}
+
+COMPLEX_TYPE pauli_expectation(struct state_vector *state,
+			       NATURAL_TYPE x_mask, NATURAL_TYPE z_mask,
+			       int num_threads)
+{
+	NATURAL_TYPE i;
+	REAL_TYPE re, im, sign;
+	COMPLEX_TYPE a, b;
+	struct parallel_region region;
+	int nt;
+
+	// <psi|P|psi> = i^|x & z| sum_i conj(psi[i ^ x]) (-1)^|i & z| psi[i]
+	re = 0;
+	im = 0;
+	nt = parallel_begin(&region, num_threads, state->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	reduction(+:re, im) default(none) \
+	shared(state, x_mask, z_mask, COMPLEX_ARRAY_SIZE) private(i, a, b, sign)
+	for (i = 0; i < state->size; i++) {
+		a = state_get(state, i ^ x_mask);
+		b = state_get(state, i);
+		sign = POPCOUNT(i & z_mask) & 1 ? -1 : 1;
+		re += sign * (RE(a) * RE(b) + IM(a) * IM(b));
+		im += sign * (RE(a) * IM(b) - IM(a) * RE(b));
+	}
+	parallel_end(&region);
+
+	switch (POPCOUNT(x_mask & z_mask) & 3) {
+	case 1:
+		return COMPLEX_INIT(-im, re);
+	case 2:
+		return COMPLEX_INIT(-re, -im);
+	case 3:
+		return COMPLEX_INIT(im, -re);
+	default:
+		return COMPLEX_INIT(re, im);
+	}
+}
+
+static REAL_TYPE _sum_range(REAL_TYPE *values, NATURAL_TYPE start,
+			    NATURAL_TYPE end, int num_threads)
+{
+	NATURAL_TYPE i;
+	REAL_TYPE sum;
+	struct parallel_region region;
+	int nt;
+
+	sum = 0;
+	nt = parallel_begin(&region, num_threads, end - start);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	reduction(+:sum) default(none) shared(values, start, end) private(i)
+	for (i = start; i < end; i++) {
+		sum += values[i];
+	}
+	parallel_end(&region);
+
+	return sum;
+}
+
+/* Decide the outcome of the qubits in mask. norm2 gets its probability */
+static unsigned char _choose_outcome(struct state_vector *state,
+				     NATURAL_TYPE mask, REAL_TYPE *rolls,
+				     NATURAL_TYPE *outcome, REAL_TYPE *norm2,
+				     int num_threads)
+{
+	NATURAL_TYPE base, half;
+	REAL_TYPE *probs, prob_one;
+	unsigned int b, num_measured;
+	unsigned char exit_code;
+
+	num_measured = POPCOUNT(mask);
+	probs = MALLOC_TYPE(NATURAL_ONE << num_measured, REAL_TYPE);
+	if (probs == NULL) {
+		return 4;
+	}
+	exit_code = marginal_probabilities(state, mask, probs, num_threads);
+	if (exit_code != 0) {
+		free(probs);
+		return exit_code;
+	}
+
+	// Qubits are decided from the highest to the lowest, each one with the
+	// chances conditioned to the previous results. The candidates left are
+	// always the block [base, base + 2 * half) of probs.
+	base = 0;
+	*norm2 = 1;
+	for (b = num_measured; b > 0; b--) {
+		half = NATURAL_ONE << (b - 1);
+		prob_one = _sum_range(probs, base + half, base + 2 * half,
+				      num_threads) /
+			   *norm2;
+		if (prob_one > rolls[num_measured - b]) {
+			base += half;
+			*norm2 *= prob_one;
+		} else {
+			*norm2 *= 1 - prob_one;
+		}
+	}
+	free(probs);
+	*outcome = base;
+
+	return 0;
+}
+
+unsigned char measure_mask(struct state_vector *state, NATURAL_TYPE mask,
+			   REAL_TYPE *rolls, NATURAL_TYPE *outcome,
+			   struct state_vector *new_state, int num_threads)
+{
+	NATURAL_TYPE i, j, offset;
+	REAL_TYPE norm2;
+	unsigned int num_measured;
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	mask &= state->size - 1;
+	num_measured = POPCOUNT(mask);
+	exit_code = _choose_outcome(state, mask, rolls, outcome, &norm2,
+				    num_threads);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+
+	if (num_measured == state->num_qubits) {
+		new_state->vector = NULL;
+		new_state->num_qubits = 0;
+		return 0;
+	}
+	exit_code = state_init(new_state, state->num_qubits - num_measured,
+			       false);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+
+	// Single compaction pass with the surviving amplitudes
+	offset = _bits_deposit(*outcome, mask);
+	nt = parallel_begin(&region, num_threads, new_state->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	firstprivate(state, new_state, mask, offset, COMPLEX_ARRAY_SIZE) \
+	private(i, j)
+	for (j = 0; j < new_state->size; j++) {
+		i = _bits_spread(j, mask) | offset;
+		state_set(new_state, j, state_get(state, i));
+	}
+	parallel_end(&region);
+	new_state->norm_const = sqrt(norm2);
+
+	return 0;
+}
+
+unsigned char measure_mask_inplace(struct state_vector *state,
+				   NATURAL_TYPE mask, REAL_TYPE *rolls,
+				   NATURAL_TYPE *outcome, int num_threads)
+{
+	NATURAL_TYPE i, offset;
+	REAL_TYPE norm2;
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	mask &= state->size - 1;
+	*outcome = 0;
+	if (mask == 0) {
+		return 0;
+	}
+	exit_code = _choose_outcome(state, mask, rolls, outcome, &norm2,
+				    num_threads);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	if (norm2 == 0) {
+		return 5;
+	}
+
+	// The measured qubits stay in the registry as classical bits, so the
+	// size never changes and a single pass clears the rejected branches
+	offset = _bits_deposit(*outcome, mask);
+	nt = parallel_begin(&region, num_threads, state->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) firstprivate(state, mask, offset, COMPLEX_ARRAY_SIZE) \
+	private(i)
+	for (i = 0; i < state->size; i++) {
+		if ((i & mask) != offset) {
+			state_set(state, i, COMPLEX_ZERO);
+		}
+	}
+	parallel_end(&region);
+
+	state->norm_const *= sqrt(norm2);
+	state->fcarg_init = 0;
+
+	return 0;
+}
+
+unsigned char reset(struct state_vector *state, NATURAL_TYPE mask,
+		    REAL_TYPE *rolls, NATURAL_TYPE *outcome, int num_threads)
+{
+	NATURAL_TYPE j, m, base, offset, num_bases;
+	REAL_TYPE norm2;
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	mask &= state->size - 1;
+	*outcome = 0;
+	if (mask == 0) {
+		return 0;
+	}
+	exit_code = _choose_outcome(state, mask, rolls, outcome, &norm2,
+				    num_threads);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	if (norm2 == 0) {
+		return 5;
+	}
+
+	// Every base index (reset qubits at 0) takes the amplitude of the
+	// measured branch and clears the rest of its group, so each
+	// amplitude is visited once and groups are independent.
+	offset = _bits_deposit(*outcome, mask);
+	num_bases = state->size >> POPCOUNT(mask);
+	nt = parallel_begin(&region, num_threads, state->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	firstprivate(state, mask, offset, num_bases, COMPLEX_ARRAY_SIZE) \
+	private(j, m, base)
+	for (j = 0; j < num_bases; j++) {
+		base = _bits_spread(j, mask);
+		if (offset != 0) {
+			state_set(state, base,
+				  state_get_raw(state, base | offset));
+		}
+		for (m = mask; m != 0; m = (m - 1) & mask) {
+			state_set(state, base | m, COMPLEX_ZERO);
+		}
+	}
+	parallel_end(&region);
+
+	state->norm_const *= sqrt(norm2);
+	state->fcarg_init = 0;
+
+	return 0;
+}
+
 unsigned char join(struct state_vector *r, struct state_vector *s1,
-		   struct state_vector *s2)
+		   struct state_vector *s2, int num_threads)
+{
+	struct state_vector *states[2];
+
+	states[0] = s1;
+	states[1] = s2;
+
+	return join_many(r, states, 2, num_threads);
+}
+
+unsigned char join_many(struct state_vector *r, struct state_vector **states,
+			unsigned int num_states, int num_threads)
 {
-	NATURAL_TYPE i, j, new_index;
-	COMPLEX_TYPE o1, o2;
+	NATURAL_TYPE i, high, cached_high, low_size;
+	COMPLEX_TYPE prefix, val;
+	REAL_TYPE norm_const;
+	unsigned int k, num_qubits, low_qubits;
 	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	num_qubits = 0;
+	norm_const = 1;
+	for (k = 0; k < num_states; k++) {
+		num_qubits += states[k]->num_qubits;
+		norm_const *= states[k]->norm_const;
+	}
+	exit_code = state_init(r, num_qubits, false);
+	if (exit_code != 0) {
+		return exit_code;
+	}
 
-	exit_code = state_init(r, s1->num_qubits + s2->num_qubits, false);
+	// The output index space is split among the threads, no matter how
+	// small the registries are. The last registry holds the lowest qubits,
+	// so the product of the others is only recomputed when a thread moves
+	// to a new run of its amplitudes. The raw values are multiplied and the
+	// normalization constants are folded into the one of r.
+	low_qubits = states[num_states - 1]->num_qubits;
+	low_size = states[num_states - 1]->size;
+	cached_high = -1;
+	prefix = COMPLEX_ONE;
+	nt = parallel_begin(&region, num_threads, r->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	firstprivate(r, states, num_states, low_qubits, low_size, \
+		     cached_high, prefix, COMPLEX_ARRAY_SIZE) \
+	private(i, k, high, val)
+	for (i = 0; i < r->size; i++) {
+		high = i >> low_qubits;
+		if (high != cached_high) {
+			cached_high = high;
+			prefix = COMPLEX_ONE;
+			for (k = num_states - 1; k-- > 0;) {
+				prefix = COMPLEX_MULT(
+					prefix,
+					state_get_raw(states[k],
+						      high & (states[k]->size -
+							      1)));
+				high >>= states[k]->num_qubits;
+			}
+		}
+		val = state_get_raw(states[num_states - 1], i & (low_size - 1));
+		state_set(r, i, COMPLEX_MULT(prefix, val));
+	}
+	parallel_end(&region);
+	r->norm_const = norm_const;
+
+	return 0;
+}
+
+unsigned char split(struct state_vector *state, NATURAL_TYPE mask,
+		    REAL_TYPE tolerance, struct state_vector *a,
+		    struct state_vector *b, bool *separable, int num_threads)
+{
+	NATURAL_TYPE i, pivot, rest, a_fixed, b_fixed;
+	REAL_TYPE max_prob, prob, residual, a_norm2, b_norm2;
+	COMPLEX_TYPE val, pivot_val, diff;
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	*separable = false;
+	mask &= state->size - 1;
+	rest = ~mask & (state->size - 1);
+	exit_code = state_init(a, POPCOUNT(mask), false);
 	if (exit_code != 0) {
 		return exit_code;
 	}
+	exit_code = state_init(b, POPCOUNT(rest), false);
+	if (exit_code != 0) {
+		state_clear(a);
+		return exit_code;
+	}
 
-#pragma omp parallel for default(none) \
-	firstprivate(r, s1, s2, exit_code, COMPLEX_ARRAY_SIZE) \
-	private(i, j, o1, o2, new_index)
-	for (i = 0; i < s1->size; i++) {
-		o1 = state_get(s1, i);
-		for (j = 0; j < s2->size; j++) {
-			new_index = i * s2->size + j;
-			o2 = state_get(s2, j);
-			state_set(r, new_index, COMPLEX_MULT(o1, o2));
+	// The amplitudes are a matrix with the basis states of mask as rows
+	// and the ones of the other qubits as columns. It has rank 1 if and
+	// only if every entry is the product of its row and column entries
+	// through the largest amplitude, which is used as pivot.
+	max_prob = 0;
+	nt = parallel_begin(&region, num_threads, state->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(static) \
+	default(none) firstprivate(state, COMPLEX_ARRAY_SIZE) \
+	private(i, val, prob) reduction(max : max_prob)
+	for (i = 0; i < state->size; i++) {
+		val = state_get_raw(state, i);
+		prob = RE(val) * RE(val) + IM(val) * IM(val);
+		if (prob > max_prob) {
+			max_prob = prob;
 		}
 	}
+	pivot = state->size;
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(static) \
+	default(none) firstprivate(state, max_prob, COMPLEX_ARRAY_SIZE) \
+	private(i, val) reduction(min : pivot)
+	for (i = 0; i < state->size; i++) {
+		if (i < pivot) {
+			val = state_get_raw(state, i);
+			if (RE(val) * RE(val) + IM(val) * IM(val) == max_prob) {
+				pivot = i;
+			}
+		}
+	}
+	parallel_end(&region);
+	pivot_val = state_get_raw(state, pivot);
+
+	// Row and column through the pivot, with the pivot divided out of b
+	a_fixed = pivot & rest;
+	b_fixed = pivot & mask;
+	a_norm2 = 0;
+	nt = parallel_begin(&region, num_threads, a->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) firstprivate(state, a, mask, a_fixed, COMPLEX_ARRAY_SIZE) \
+	private(i, val) reduction(+ : a_norm2)
+	for (i = 0; i < a->size; i++) {
+		val = state_get_raw(state, _bits_deposit(i, mask) | a_fixed);
+		state_set(a, i, val);
+		a_norm2 += RE(val) * RE(val) + IM(val) * IM(val);
+	}
+	parallel_end(&region);
+	b_norm2 = 0;
+	nt = parallel_begin(&region, num_threads, b->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	firstprivate(state, b, rest, b_fixed, pivot_val, COMPLEX_ARRAY_SIZE) \
+	private(i, val) reduction(+ : b_norm2)
+	for (i = 0; i < b->size; i++) {
+		COMPLEX_DIV(val,
+			    state_get_raw(state,
+					  _bits_deposit(i, rest) | b_fixed),
+			    pivot_val);
+		state_set(b, i, val);
+		b_norm2 += RE(val) * RE(val) + IM(val) * IM(val);
+	}
+	parallel_end(&region);
+
+	// Largest distance between the state and the product of a and b
+	residual = 0;
+	nt = parallel_begin(&region, num_threads, state->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) firstprivate(state, a, b, mask, rest, COMPLEX_ARRAY_SIZE) \
+	private(i, diff, prob) reduction(max : residual)
+	for (i = 0; i < state->size; i++) {
+		diff = COMPLEX_SUB(
+			state_get_raw(state, i),
+			COMPLEX_MULT(state_get_raw(a, _bits_compact(i, mask)),
+				     state_get_raw(b, _bits_compact(i, rest))));
+		prob = RE(diff) * RE(diff) + IM(diff) * IM(diff);
+		if (prob > residual) {
+			residual = prob;
+		}
+	}
+	parallel_end(&region);
+
+	if (max_prob == 0 ||
+	    sqrt(residual) > tolerance * state->norm_const) {
+		state_clear(a);
+		state_clear(b);
+		return 0;
+	}
+	a->norm_const = sqrt(a_norm2);
+	b->norm_const = sqrt(b_norm2);
+	*separable = true;
 
 	return 0;
 }
 
 unsigned char measure(struct state_vector *state, bool *result,
 		      unsigned int target, struct state_vector *new_state,
-		      REAL_TYPE roll)
+		      REAL_TYPE roll, int num_threads)
 {
 	REAL_TYPE sum;
 	unsigned char exit_code;
 
-	sum = probability(state, target);
+	sum = probability(state, target, num_threads);
 	*result = sum > roll;
-	exit_code = collapse(state, target, *result, sum, new_state);
+	exit_code =
+		collapse(state, target, *result, sum, new_state, num_threads);
 
 	return exit_code;
 }
 
 unsigned char collapse(struct state_vector *state, unsigned int target_id,
 		       bool value, REAL_TYPE prob_one,
-		       struct state_vector *new_state)
+		       struct state_vector *new_state, int num_threads)
 {
 	unsigned char exit_code;
 	NATURAL_TYPE i, j, low, high, val;
+	struct parallel_region region;
+	int nt;
 
 	if (state->num_qubits == 1) {
 		new_state->vector = NULL;
@@ -150,7 +1150,6 @@ unsigned char collapse(struct state_vector *state, unsigned int target_id,
 
 	exit_code = state_init(new_state, state->num_qubits - 1, false);
 	if (exit_code != 0) {
-		free(new_state);
 		return exit_code;
 	}
 	val = NATURAL_ONE << target_id;
@@ -161,30 +1160,95 @@ unsigned char collapse(struct state_vector *state, unsigned int target_id,
 		val = 0;
 	}
 
-#pragma omp parallel for default(none) \
+	nt = parallel_begin(&region, num_threads, new_state->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
 	firstprivate(state, new_state, low, high, val, COMPLEX_ARRAY_SIZE) \
 	private(i, j)
 	for (j = 0; j < new_state->size; j++) {
 		i = ((j & high) << 1) + val + (j & low);
 		state_set(new_state, j, state_get(state, i));
 	}
+	parallel_end(&region);
 	new_state->norm_const = sqrt(prob_one);
 
 	return 0;
 }
 
+bool gate_is_unitary(struct qgate *gate, REAL_TYPE tolerance)
+{
+	NATURAL_TYPE i, j, k;
+	COMPLEX_TYPE sum;
+
+	for (i = 0; i < gate->size; i++) {
+		for (j = 0; j < gate->size; j++) {
+			sum = COMPLEX_ZERO;
+			for (k = 0; k < gate->size; k++) {
+				sum = COMPLEX_ADD(
+					sum,
+					COMPLEX_MULT(gate->matrix[i][k],
+						     conj(gate->matrix[j][k])));
+			}
+			if (i == j) {
+				sum = COMPLEX_SUB(sum, COMPLEX_ONE);
+			}
+			if (fabs(RE(sum)) > tolerance ||
+			    fabs(IM(sum)) > tolerance) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static inline COMPLEX_TYPE _gate_row(struct state_vector *state,
+				     struct qgate *gate, unsigned int *targets,
+				     unsigned int num_targets, NATURAL_TYPE i)
+{
+	NATURAL_TYPE reg_index;
+	unsigned int j, k, row;
+	COMPLEX_TYPE sum;
+
+	sum = COMPLEX_ZERO;
+	reg_index = i;
+	// We have gate->size elements to add in sum
+	for (j = 0; j < gate->size; j++) {
+		// We get the value of each target qubit id on the current new state
+		// element and we store it in rowbits following the same order as the
+		// one in targets
+		row = 0;
+		for (k = 0; k < num_targets; k++) {
+			row += ((i & (NATURAL_ONE << targets[k])) != 0) << k;
+			// We check the value of the kth bit of j
+			// and set the value of the kth target bit to it
+			if ((j & (NATURAL_ONE << k)) != 0)
+				reg_index |= NATURAL_ONE << targets[k];
+			else
+				reg_index &= ~(NATURAL_ONE << targets[k]);
+		}
+		sum = COMPLEX_ADD(sum,
+				  COMPLEX_MULT(state_get_raw(state, reg_index),
+					       gate->matrix[row][j]));
+	}
+
+	return sum;
+}
+
 unsigned char apply_gate(struct state_vector *state, struct qgate *gate,
 			 unsigned int *targets, unsigned int num_targets,
 			 unsigned int *controls, unsigned int num_controls,
 			 unsigned int *anticontrols,
 			 unsigned int num_anticontrols,
-			 struct state_vector *new_state)
+			 struct state_vector *new_state, int num_threads)
 {
 	REAL_TYPE norm_const;
 	unsigned char exit_code;
-	NATURAL_TYPE control_mask, anticontrol_mask, i, reg_index;
-	unsigned int j, k, row;
+	NATURAL_TYPE control_mask, anticontrol_mask, i;
+	unsigned int j;
 	COMPLEX_TYPE sum;
+	struct parallel_region region;
+	int nt;
 
 	if (new_state == NULL)
 		return 10;
@@ -207,54 +1271,52 @@ unsigned char apply_gate(struct state_vector *state, struct qgate *gate,
 	for (j = 0; j < num_anticontrols; j++)
 		anticontrol_mask |= NATURAL_ONE << anticontrols[j];
 
+	// The stored amplitudes are not divided by the normalization constant.
+	// A unitary gate preserves the norm, so we can reuse the old constant
+	// instead of reducing over the whole new state.
+	nt = parallel_begin(&region, num_threads, state->size);
+	if (gate->unitary) {
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) \
+	firstprivate(state, new_state, gate, targets, num_targets, \
+		     control_mask, anticontrol_mask, COMPLEX_ARRAY_SIZE) \
+	private(sum, i)
+		for (i = 0; i < state->size; i++) {
+			if ((i & control_mask) == control_mask &&
+			    (i & anticontrol_mask) == 0) {
+				sum = _gate_row(state, gate, targets,
+						num_targets, i);
+			} else {
+				sum = state_get_raw(state, i);
+			}
+			state_set(new_state, i, sum);
+		}
+		parallel_end(&region);
+		new_state->norm_const = state->norm_const;
+		return 0;
+	}
+
 	norm_const = 0;
-#pragma omp parallel for reduction (+:norm_const) \
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+                                     reduction (+:norm_const) \
                                      default(none) \
                                      firstprivate (state, new_state, gate, \
                         			   targets, num_targets, \
-                        			   controls, num_controls, \
-                        			   anticontrols, num_anticontrols, \
                         			   control_mask, anticontrol_mask, \
-                        			   COMPLEX_ZERO, COMPLEX_ARRAY_SIZE) \
-                                     private (sum, row, reg_index, i, j, k)
+                        			   COMPLEX_ARRAY_SIZE) \
+                                     private (sum, i)
 	for (i = 0; i < state->size; i++) {
 		if ((i & control_mask) == control_mask &&
 		    (i & anticontrol_mask) == 0) {
-			// Calculate
-			sum = COMPLEX_ZERO;
-			reg_index = i;
-			// We have gate->size elements to add in sum
-			for (j = 0; j < gate->size; j++) {
-				// We get the value of each target qubit id on the current new state
-				// element and we store it in rowbits following the same order as the
-				// one in targets
-				row = 0;
-				for (k = 0; k < num_targets; k++) {
-					row += ((i & (NATURAL_ONE
-						      << targets[k])) != 0)
-					       << k;
-					// We check the value of the kth bit of j
-					// and set the value of the kth target bit to it
-					if ((j & (NATURAL_ONE << k)) != 0)
-						reg_index |= NATURAL_ONE
-							     << targets[k];
-					else
-						reg_index &= ~(NATURAL_ONE
-							       << targets[k]);
-				}
-				sum = COMPLEX_ADD(
-					sum,
-					COMPLEX_MULT(state_get(state,
-							       reg_index),
-						     gate->matrix[row][j]));
-			}
+			sum = _gate_row(state, gate, targets, num_targets, i);
 		} else {
 			//Copy
-			sum = state_get(state, i);
+			sum = state_get_raw(state, i);
 		}
 		state_set(new_state, i, sum);
-		norm_const += pow(RE(sum), 2) + pow(IM(sum), 2);
+		norm_const += RE(sum) * RE(sum) + IM(sum) * IM(sum);
 	}
+	parallel_end(&region);
 	new_state->norm_const = sqrt(norm_const);
 
 	return 0;
@@ -577,6 +1639,269 @@ static size_t size_state_capsule(void *raw_capsule)
 	return state_mem_size(state);
 }
 
+/* Rows and columns of each tile of a dense density matrix */
+#define DENSITY_TILE 32
+/* Amplitudes of each row of a tile loaded at once */
+#define DENSITY_DEPTH 128
+
+/* Row and column tiles of a pair, counting the upper triangle row by row */
+static inline void _tile_pair(NATURAL_TYPE pair, NATURAL_TYPE num_tiles,
+			      NATURAL_TYPE *ti, NATURAL_TYPE *tj)
+{
+	*ti = 0;
+	while (pair >= num_tiles - *ti) {
+		pair -= num_tiles - *ti;
+		(*ti)++;
+	}
+	*tj = *ti + pair;
+}
+
+/* Load depth amplitudes of count rows of A, from column r0 on, into
+ * buffer */
+static inline void _density_load(struct state_vector *state,
+				 NATURAL_TYPE *row_offset,
+				 NATURAL_TYPE rest_mask, NATURAL_TYPE r0,
+				 NATURAL_TYPE count, NATURAL_TYPE depth,
+				 COMPLEX_TYPE *buffer)
+{
+	NATURAL_TYPE a, r, rest;
+
+	for (r = 0; r < depth; r++) {
+		rest = _bits_deposit(r0 + r, rest_mask);
+		for (a = 0; a < count; a++) {
+			buffer[a * DENSITY_DEPTH + r] =
+				state_get_raw(state, row_offset[a] | rest);
+		}
+	}
+}
+
+/* acc += rows_i rows_j^H, only from the diagonal on if diagonal is set */
+static inline void _density_block(COMPLEX_TYPE *rows_i, COMPLEX_TYPE *rows_j,
+				  NATURAL_TYPE rows, NATURAL_TYPE cols,
+				  NATURAL_TYPE depth, bool diagonal,
+				  COMPLEX_TYPE *acc)
+{
+	NATURAL_TYPE a, b, r;
+	COMPLEX_TYPE sum, *row_i, *row_j;
+
+	for (a = 0; a < rows; a++) {
+		row_i = rows_i + a * DENSITY_DEPTH;
+		for (b = diagonal ? a : 0; b < cols; b++) {
+			row_j = rows_j + b * DENSITY_DEPTH;
+			sum = COMPLEX_ZERO;
+			for (r = 0; r < depth; r++) {
+				sum = COMPLEX_ADD(sum,
+						  COMPLEX_MULT(row_i[r],
+							       conj(row_j[r])));
+			}
+			acc[a * DENSITY_TILE + b] =
+				COMPLEX_ADD(acc[a * DENSITY_TILE + b], sum);
+		}
+	}
+}
+
+/* Normalize a tile of the upper triangle and copy its conjugate transpose
+ * to the lower one, while both are still in cache */
+static inline void _density_store(COMPLEX_TYPE *acc, NATURAL_TYPE rows,
+				  NATURAL_TYPE cols, bool diagonal,
+				  REAL_TYPE norm2, COMPLEX_TYPE *upper,
+				  COMPLEX_TYPE *lower, NATURAL_TYPE dim)
+{
+	NATURAL_TYPE a, b;
+
+	for (a = 0; a < rows; a++) {
+		for (b = diagonal ? a : 0; b < cols; b++) {
+			acc[a * DENSITY_TILE + b] =
+				COMPLEX_DIV_R(acc[a * DENSITY_TILE + b], norm2);
+			upper[a * dim + b] = acc[a * DENSITY_TILE + b];
+		}
+		if (diagonal) {
+			upper[a * dim + a] = COMPLEX_INIT(RE(upper[a * dim + a]), 0);
+		}
+	}
+	// Row by row of the lower tile, so the writes are contiguous
+	for (b = 0; b < cols; b++) {
+		for (a = 0; a < rows && (!diagonal || a < b); a++) {
+			lower[b * dim + a] = conj(acc[a * DENSITY_TILE + b]);
+		}
+	}
+}
+
+/* One pair of tiles of the upper triangle per task.
+ * The reduced matrix is A A^H, where row i of A holds the amplitudes with i
+ * in the qubits of mask, so the rows of both tiles are loaded in blocks of
+ * DENSITY_DEPTH amplitudes and multiplied like a small matrix product. */
+static unsigned char _density_tiles(struct state_vector *state,
+				    NATURAL_TYPE dim, NATURAL_TYPE rest_size,
+				    NATURAL_TYPE *row_offset,
+				    NATURAL_TYPE rest_mask, REAL_TYPE norm2,
+				    COMPLEX_TYPE *rho, int nt)
+{
+	NATURAL_TYPE num_tiles, num_pairs, pair, ti, tj, i0, j0, rows, cols,
+		r0, depth, a, stride;
+	COMPLEX_TYPE *buffers, *rows_i, *rows_j, *acc;
+
+	num_tiles = (dim + DENSITY_TILE - 1) / DENSITY_TILE;
+	num_pairs = num_tiles * (num_tiles + 1) / 2;
+	stride = 2 * DENSITY_TILE * DENSITY_DEPTH + DENSITY_TILE * DENSITY_TILE;
+	buffers = MALLOC_TYPE((size_t)nt * stride, COMPLEX_TYPE);
+	if (buffers == NULL) {
+		return 4;
+	}
+#pragma omp parallel if (nt > 1) num_threads(nt) default(none) \
+	shared(state, dim, rest_size, row_offset, rest_mask, norm2, rho, \
+	       buffers, num_tiles, num_pairs, stride, COMPLEX_ARRAY_SIZE) \
+	private(pair, ti, tj, i0, j0, rows, cols, r0, depth, a, rows_i, \
+		rows_j, acc)
+	{
+		rows_i = buffers + omp_get_thread_num() * stride;
+		rows_j = rows_i + DENSITY_TILE * DENSITY_DEPTH;
+		acc = rows_j + DENSITY_TILE * DENSITY_DEPTH;
+#pragma omp for schedule(runtime)
+		for (pair = 0; pair < num_pairs; pair++) {
+			_tile_pair(pair, num_tiles, &ti, &tj);
+			i0 = ti * DENSITY_TILE;
+			j0 = tj * DENSITY_TILE;
+			rows = dim - i0 < DENSITY_TILE ? dim - i0
+						       : DENSITY_TILE;
+			cols = dim - j0 < DENSITY_TILE ? dim - j0
+						       : DENSITY_TILE;
+			for (a = 0; a < DENSITY_TILE * DENSITY_TILE; a++) {
+				acc[a] = COMPLEX_ZERO;
+			}
+			for (r0 = 0; r0 < rest_size; r0 += depth) {
+				depth = rest_size - r0 < DENSITY_DEPTH
+						? rest_size - r0
+						: DENSITY_DEPTH;
+				_density_load(state, row_offset + i0,
+					      rest_mask, r0, rows, depth,
+					      rows_i);
+				if (ti != tj) {
+					_density_load(state, row_offset + j0,
+						      rest_mask, r0, cols,
+						      depth, rows_j);
+				}
+				_density_block(rows_i,
+					       ti != tj ? rows_j : rows_i, rows,
+					       cols, depth, ti == tj, acc);
+			}
+			_density_store(acc, rows, cols, ti == tj, norm2,
+				       rho + i0 * dim + j0,
+				       rho + j0 * dim + i0, dim);
+		}
+	}
+	free(buffers);
+
+	return 0;
+}
+
+/* rho[i][j] for j >= i when the matrix fits in a single tile: every thread
+ * adds up the outer products of its own columns of A, merged at the end */
+static unsigned char _density_columns(struct state_vector *state,
+				      NATURAL_TYPE dim, NATURAL_TYPE rest_size,
+				      NATURAL_TYPE *row_offset,
+				      NATURAL_TYPE rest_mask,
+				      REAL_TYPE norm2, COMPLEX_TYPE *rho,
+				      int nt)
+{
+	NATURAL_TYPE r, a, b, rest, stride;
+	COMPLEX_TYPE *buffers, *column, *local;
+	int t;
+
+	stride = dim + dim * dim;
+	buffers = CALLOC_TYPE((size_t)nt * stride, COMPLEX_TYPE);
+	if (buffers == NULL) {
+		return 4;
+	}
+#pragma omp parallel if (nt > 1) num_threads(nt) default(none) \
+	shared(state, dim, rest_size, row_offset, rest_mask, buffers, \
+	       stride, COMPLEX_ARRAY_SIZE) \
+	private(r, a, b, rest, column, local)
+	{
+		column = buffers + omp_get_thread_num() * stride;
+		local = column + dim;
+#pragma omp for schedule(runtime)
+		for (r = 0; r < rest_size; r++) {
+			rest = _bits_deposit(r, rest_mask);
+			for (a = 0; a < dim; a++) {
+				column[a] = state_get_raw(state,
+							  row_offset[a] | rest);
+			}
+			for (a = 0; a < dim; a++) {
+				for (b = a; b < dim; b++) {
+					local[a * dim + b] = COMPLEX_ADD(
+						local[a * dim + b],
+						COMPLEX_MULT(column[a],
+							     conj(column[b])));
+				}
+			}
+		}
+	}
+	// The first private matrix adds up the rest of them
+	local = buffers + dim;
+	for (t = 1; t < nt; t++) {
+		column = buffers + t * stride + dim;
+		for (a = 0; a < dim; a++) {
+			for (b = a; b < dim; b++) {
+				local[a * dim + b] = COMPLEX_ADD(
+					local[a * dim + b], column[a * dim + b]);
+			}
+		}
+	}
+	for (a = 0; a < dim; a++) {
+		for (b = a; b < dim; b++) {
+			rho[a * dim + b] =
+				COMPLEX_DIV_R(local[a * dim + b], norm2);
+			rho[b * dim + a] = conj(rho[a * dim + b]);
+		}
+		rho[a * dim + a] = COMPLEX_INIT(RE(rho[a * dim + a]), 0);
+	}
+	free(buffers);
+
+	return 0;
+}
+
+unsigned char density_dense(struct state_vector *state, NATURAL_TYPE mask,
+			    COMPLEX_TYPE *rho, int num_threads)
+{
+	NATURAL_TYPE i, dim, rest_mask, rest_size, work, *row_offset;
+	REAL_TYPE norm2;
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	mask &= state->size - 1;
+	dim = NATURAL_ONE << POPCOUNT(mask);
+	rest_mask = (state->size - 1) & ~mask;
+	rest_size = state->size / dim;
+	row_offset = MALLOC_TYPE(dim, NATURAL_TYPE);
+	if (row_offset == NULL) {
+		return 4;
+	}
+	for (i = 0; i < dim; i++) {
+		row_offset[i] = _bits_deposit(i, mask);
+	}
+
+	// Multiplications needed for the upper triangle. A single tile can not
+	// be shared, so small matrices are split by columns of A instead, with
+	// one private copy of the matrix per thread.
+	norm2 = state->norm_const * state->norm_const;
+	work = dim * (dim + 1) / 2 * rest_size;
+	nt = parallel_begin(&region, num_threads, work);
+	if (nt == 1 || dim > DENSITY_TILE) {
+		exit_code = _density_tiles(state, dim, rest_size, row_offset,
+					   rest_mask, norm2, rho, nt);
+	} else {
+		exit_code = _density_columns(state, dim, rest_size,
+					     row_offset, rest_mask, norm2,
+					     rho, nt);
+	}
+	parallel_end(&region);
+	free(row_offset);
+
+	return exit_code;
+}
+
 struct FMatrix *density_matrix(PyObject *state_capsule)
 {
 	struct FMatrix *dm = NULL;
@@ -25,26 +25,198 @@
 #include "qstate.h"
 #include <Python.h>
 
+struct basis_entry {
+	/* index of the basis state */
+	NATURAL_TYPE index;
+	/* normalized amplitude of the basis state */
+	COMPLEX_TYPE amplitude;
+	/* chances of measuring the basis state */
+	REAL_TYPE prob;
+};
+
 unsigned char join(struct state_vector *r, struct state_vector *s1,
-		   struct state_vector *s2);
+		   struct state_vector *s2, int num_threads);
+
+/** \fn unsigned char join_many(struct state_vector *r, struct state_vector
+ * **states, unsigned int num_states, int num_threads);
+ *  \brief Tensor product of several states in a single write pass.
+ *  \param states The states to join, from the one with the most
+ *  significant qubits to the one with the least significant ones.
+ *  \param num_states Number of states (at least 1).
+ *  \return 0 if ok, or a state_init error code.
+ */
+unsigned char join_many(struct state_vector *r, struct state_vector **states,
+			unsigned int num_states, int num_threads);
+
+/** \fn unsigned char split(struct state_vector *state, NATURAL_TYPE mask,
+ * REAL_TYPE tolerance, struct state_vector *a, struct state_vector *b, bool
+ * *separable, int num_threads);
+ *  \brief Check if a state is the tensor product of the qubits in mask and
+ *  the rest of them, with a rank 1 test of its amplitudes.
+ *  \param mask Qubits of a (neither empty nor every qubit).
+ *  \param tolerance Largest distance allowed between the amplitudes of
+ *  state and the ones of the product.
+ *  \param a Where the state of the qubits in mask is stored, in the same
+ *  order. Only initialized if the state is separable.
+ *  \param b Where the state of the other qubits is stored. Only initialized
+ *  if the state is separable.
+ *  \param separable Whether the state was split or not.
+ *  \return 0 if ok, or a state_init error code.
+ */
+unsigned char split(struct state_vector *state, NATURAL_TYPE mask,
+		    REAL_TYPE tolerance, struct state_vector *a,
+		    struct state_vector *b, bool *separable, int num_threads);
 
 unsigned char measure(struct state_vector *state, bool *result,
 		      unsigned int target, struct state_vector *new_state,
-		      REAL_TYPE roll);
+		      REAL_TYPE roll, int num_threads);
+
+REAL_TYPE probability(struct state_vector *state, unsigned int target_id,
+		      int num_threads);
+
+/** \fn unsigned char marginal_probabilities(struct state_vector *state,
+ * NATURAL_TYPE mask, REAL_TYPE *probs, int num_threads);
+ *  \brief Chances of every outcome when measuring the qubits in mask, in a
+ *  single pass over the state.
+ *  \param probs Array of 2^popcount(mask) elements. Bit j of an outcome is
+ *  the j-th lowest qubit in mask.
+ *  \return 0 if ok, 4 if failed to allocate memory.
+ */
+unsigned char marginal_probabilities(struct state_vector *state,
+				     NATURAL_TYPE mask, REAL_TYPE *probs,
+				     int num_threads);
+
+/** \fn unsigned char joint_probabilities(struct state_vector *state,
+ * unsigned int *ids, unsigned int num_ids, REAL_TYPE *probs, int
+ * num_threads);
+ *  \brief Joint distribution of some qubits in the order they are given.
+ *  \param ids Ids of the qubits (without repetitions).
+ *  \param probs Array of 2^num_ids elements. Bit k of an outcome is the
+ *  value of qubit ids[k].
+ *  \return 0 if ok, 4 if failed to allocate memory.
+ */
+unsigned char joint_probabilities(struct state_vector *state,
+				  unsigned int *ids, unsigned int num_ids,
+				  REAL_TYPE *probs, int num_threads);
 
-REAL_TYPE probability(struct state_vector *state, unsigned int target_id);
+/** \fn unsigned char sample(struct state_vector *state, NATURAL_TYPE mask,
+ * NATURAL_TYPE shots, uint64_t seed, NATURAL_TYPE *outcomes, int
+ * num_threads);
+ *  \brief Draw measurement outcomes of the qubits in mask without
+ *  collapsing the state. The cumulative distribution is built once and
+ *  every shot is a binary search on it.
+ *  \param outcomes Array of shots elements, encoded like in
+ *  marginal_probabilities.
+ *  \return 0 if ok, 4 if failed to allocate memory.
+ */
+unsigned char sample(struct state_vector *state, NATURAL_TYPE mask,
+		     NATURAL_TYPE shots, uint64_t seed, NATURAL_TYPE *outcomes,
+		     int num_threads);
 
-REAL_TYPE get_global_phase(struct state_vector *state);
+/** \fn unsigned char measure_mask(struct state_vector *state, NATURAL_TYPE
+ * mask, REAL_TYPE *rolls, NATURAL_TYPE *outcome, struct state_vector
+ * *new_state, int num_threads);
+ *  \brief Measure all the qubits in mask at once. The joint outcome is
+ *  drawn from the marginal distribution and the surviving amplitudes are
+ *  gathered into new_state in one pass.
+ *  \param rolls One roll in [0, 1) per measured qubit, from the highest
+ *  qubit to the lowest.
+ *  \param outcome Where the results are stored, encoded like in
+ *  marginal_probabilities.
+ *  \return 0 if ok, 4 if failed to allocate memory, or a state_init error
+ *  code. new_state has 0 qubits if every qubit was measured.
+ */
+unsigned char measure_mask(struct state_vector *state, NATURAL_TYPE mask,
+			   REAL_TYPE *rolls, NATURAL_TYPE *outcome,
+			   struct state_vector *new_state, int num_threads);
+
+/** \fn COMPLEX_TYPE pauli_expectation(struct state_vector *state,
+ * NATURAL_TYPE x_mask, NATURAL_TYPE z_mask, int num_threads);
+ *  \brief Expectation value of a Pauli string in a single read-only pass.
+ *  \param x_mask Qubits with an X or a Y.
+ *  \param z_mask Qubits with a Z or a Y.
+ *  \return <state|P|state>.
+ */
+COMPLEX_TYPE pauli_expectation(struct state_vector *state,
+			       NATURAL_TYPE x_mask, NATURAL_TYPE z_mask,
+			       int num_threads);
+
+/** \fn unsigned char measure_mask_inplace(struct state_vector *state,
+ * NATURAL_TYPE mask, REAL_TYPE *rolls, NATURAL_TYPE *outcome, int
+ * num_threads);
+ *  \brief Same as measure_mask, but the rejected amplitudes are cleared
+ *  inside state, whose size does not change. The measured qubits stay in
+ *  the registry with the obtained values.
+ *  \param state Private state.
+ *  \return 0 if ok, 4 if failed to allocate memory, 5 if the outcome had
+ *  no chances of happening. The state is only modified when 0 is returned.
+ */
+unsigned char measure_mask_inplace(struct state_vector *state,
+				   NATURAL_TYPE mask, REAL_TYPE *rolls,
+				   NATURAL_TYPE *outcome, int num_threads);
+
+/** \fn unsigned char reset(struct state_vector *state, NATURAL_TYPE mask,
+ * REAL_TYPE *rolls, NATURAL_TYPE *outcome, int num_threads);
+ *  \brief Measure the qubits in mask like measure_mask and move the
+ *  surviving branch to the one with all of them at |0>, in place and
+ *  without removing any qubit.
+ *  \param state Private state to reset.
+ *  \return 0 if ok, 4 if failed to allocate memory, 5 if the outcome had
+ *  no chances of happening. The state is only modified when 0 is returned.
+ */
+unsigned char reset(struct state_vector *state, NATURAL_TYPE mask,
+		    REAL_TYPE *rolls, NATURAL_TYPE *outcome, int num_threads);
+
+/** \fn REAL_TYPE get_global_phase(struct state_vector *state, int
+ * num_threads);
+ *  \brief Phase of the first non-zero amplitude of state (0 if it is real).
+ *  The result is cached in state, so exclusive access is needed.
+ */
+REAL_TYPE get_global_phase(struct state_vector *state, int num_threads);
+
+/** \fn unsigned char top_k(struct state_vector *state, NATURAL_TYPE k,
+ * REAL_TYPE threshold, struct basis_entry **entries, NATURAL_TYPE
+ * *num_entries, NATURAL_TYPE *count, int num_threads);
+ *  \brief Most probable basis states with chances above threshold, sorted
+ *  by decreasing probability (ties by increasing index).
+ *  \param k Maximum number of entries to return (negative for no limit).
+ *  \param threshold Minimum probability (excluded). Negative to accept
+ *  every basis state.
+ *  \param entries Where the newly allocated array of entries is stored.
+ *  \param num_entries Where the number of entries is stored.
+ *  \param count Where the number of basis states above threshold is
+ *  stored (it can be greater than num_entries).
+ *  \return 0 if ok, 4 if failed to allocate memory.
+ */
+unsigned char top_k(struct state_vector *state, NATURAL_TYPE k,
+		    REAL_TYPE threshold, struct basis_entry **entries,
+		    NATURAL_TYPE *num_entries, NATURAL_TYPE *count,
+		    int num_threads);
+
+/** \fn void get_amplitudes(struct state_vector *state, NATURAL_TYPE *ids,
+ * NATURAL_TYPE start, NATURAL_TYPE step, NATURAL_TYPE count, REAL_TYPE
+ * phase, COMPLEX_TYPE *values, int num_threads);
+ *  \brief Read count normalized amplitudes with their phase rotated by
+ *  -phase in a single pass.
+ *  \param ids Indices to read, or NULL to read start + k * step.
+ *  \param values Where the count amplitudes are stored.
+ */
+void get_amplitudes(struct state_vector *state, NATURAL_TYPE *ids,
+		    NATURAL_TYPE start, NATURAL_TYPE step, NATURAL_TYPE count,
+		    REAL_TYPE phase, COMPLEX_TYPE *values, int num_threads);
 
 unsigned char collapse(struct state_vector *state, unsigned int id, bool value,
-		       REAL_TYPE prob_one, struct state_vector *new_state);
+		       REAL_TYPE prob_one, struct state_vector *new_state,
+		       int num_threads);
+
+bool gate_is_unitary(struct qgate *gate, REAL_TYPE tolerance);
 
 unsigned char apply_gate(struct state_vector *state, struct qgate *gate,
 			 unsigned int *targets, unsigned int num_targets,
 			 unsigned int *controls, unsigned int num_controls,
 			 unsigned int *anticontrols,
 			 unsigned int num_anticontrols,
-			 struct state_vector *new_state);
+			 struct state_vector *new_state, int num_threads);
 
 struct FMatrix *apply_gate_fmat(PyObject *state_capsule, PyObject *gate_capsule,
 				unsigned int *targets, unsigned int num_targets,
@@ -55,4 +227,16 @@ struct FMatrix *apply_gate_fmat(PyObject *state_capsule, PyObject *gate_capsule,
 
 struct FMatrix *density_matrix(PyObject *state_capsule);
 
+/** \fn unsigned char density_dense(struct state_vector *state, NATURAL_TYPE
+ * mask, COMPLEX_TYPE *rho, int num_threads);
+ *  \brief Write the density matrix of the qubits in mask, tracing out the
+ *  rest of them. Only the upper triangle is computed, the lower one is
+ *  copied from it.
+ *  \param mask Qubits to keep (every qubit for the full density matrix).
+ *  \param rho Row major array with room for 4^popcount(mask) values.
+ *  \return 0 if ok, 4 if failed to allocate the thread buffers.
+ */
+unsigned char density_dense(struct state_vector *state, NATURAL_TYPE mask,
+			    COMPLEX_TYPE *rho, int num_threads);
+
 #endif /* QOPS_H_ */
@@ -0,0 +1,686 @@
+/*
+ * Doki: Quantum Computer simulator, using state vectors. QSimov core.
+ * Copyright (C) 2021  Hernán Indíbil de la Cruz Calvo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "platform.h"
+#include "qgate.h"
+#include "qops.h"
+#include "qshard.h"
+#include "qstate.h"
+
+struct _local_transport {
+	/* slice of each rank waiting for its peer to start an exchange */
+	struct state_vector **pending;
+	/* sum being reduced */
+	REAL_TYPE sum;
+	/* ranks that added their value to sum and did not read it yet */
+	unsigned int reducing;
+};
+
+/* Swap the amplitudes of lower whose local_bit is 1 with the ones of upper
+ * whose local_bit is 0 (same remaining bits) */
+static void _local_swap_halves(struct state_vector *lower,
+			       struct state_vector *upper,
+			       unsigned int local_bit, int num_threads)
+{
+	NATURAL_TYPE i, index, half, low, high, bit;
+	COMPLEX_TYPE aux;
+	struct parallel_region region;
+	int nt;
+
+	bit = NATURAL_ONE << local_bit;
+	low = bit - 1;
+	high = ~low;
+	half = lower->size >> 1;
+
+	nt = parallel_begin(&region, num_threads, half);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) firstprivate(lower, upper, bit, low, high, half, \
+				   COMPLEX_ARRAY_SIZE) \
+	private(i, index, aux)
+	for (i = 0; i < half; i++) {
+		index = ((i & high) << 1) + (i & low);
+		aux = state_get_raw(lower, index | bit);
+		state_set(lower, index | bit, state_get_raw(upper, index));
+		state_set(upper, index, aux);
+	}
+	parallel_end(&region);
+}
+
+static bool _local_holds(
+#ifndef _MSC_VER
+			 struct shard_transport *this __attribute__((unused)),
+			 unsigned int rank __attribute__((unused))
+#else
+			 struct shard_transport *this, unsigned int rank
+#endif
+)
+{
+	return true;
+}
+
+/* Both slices are in this process, so the second rank of a pair to start
+ * swaps them directly */
+static unsigned char _local_exchange_begin(struct shard_transport *this,
+					   unsigned int rank,
+					   unsigned int peer, bool upper,
+					   struct state_vector *slice,
+					   unsigned int local_bit,
+					   int num_threads)
+{
+	struct _local_transport *data;
+
+	data = (struct _local_transport *)this->data;
+	if (data->pending[peer] == NULL) {
+		data->pending[rank] = slice;
+	} else if (upper) {
+		_local_swap_halves(data->pending[peer], slice, local_bit,
+				   num_threads);
+	} else {
+		_local_swap_halves(slice, data->pending[peer], local_bit,
+				   num_threads);
+	}
+
+	return 0;
+}
+
+static unsigned char _local_exchange_end(struct shard_transport *this,
+					 unsigned int rank)
+{
+	struct _local_transport *data;
+
+	data = (struct _local_transport *)this->data;
+	data->pending[rank] = NULL;
+
+	return 0;
+}
+
+static void _local_reduce_begin(struct shard_transport *this,
+#ifndef _MSC_VER
+				unsigned int rank __attribute__((unused)),
+#else
+				unsigned int rank,
+#endif
+				REAL_TYPE value)
+{
+	struct _local_transport *data;
+
+	data = (struct _local_transport *)this->data;
+	data->sum += value;
+	data->reducing++;
+}
+
+static REAL_TYPE _local_reduce_end(struct shard_transport *this,
+#ifndef _MSC_VER
+				   unsigned int rank __attribute__((unused))
+#else
+				   unsigned int rank
+#endif
+)
+{
+	struct _local_transport *data;
+	REAL_TYPE sum;
+
+	data = (struct _local_transport *)this->data;
+	sum = data->sum;
+	data->reducing--;
+	if (data->reducing == 0) {
+		data->sum = 0;
+	}
+
+	return sum;
+}
+
+static void _local_destroy(struct shard_transport *this)
+{
+	struct _local_transport *data;
+
+	data = (struct _local_transport *)this->data;
+	free(data->pending);
+	free(data);
+	free(this);
+}
+
+struct shard_transport *shard_transport_local(unsigned int num_ranks)
+{
+	struct shard_transport *transport;
+	struct _local_transport *data;
+
+	transport = MALLOC_TYPE(1, struct shard_transport);
+	data = MALLOC_TYPE(1, struct _local_transport);
+	if (transport == NULL || data == NULL) {
+		free(transport);
+		free(data);
+		return NULL;
+	}
+	data->pending = CALLOC_TYPE(num_ranks, struct state_vector *);
+	if (data->pending == NULL) {
+		free(transport);
+		free(data);
+		return NULL;
+	}
+	data->sum = 0;
+	data->reducing = 0;
+	transport->holds = &_local_holds;
+	transport->exchange_begin = &_local_exchange_begin;
+	transport->exchange_end = &_local_exchange_end;
+	transport->reduce_begin = &_local_reduce_begin;
+	transport->reduce_end = &_local_reduce_end;
+	transport->destroy = &_local_destroy;
+	transport->data = data;
+
+	return transport;
+}
+
+/* Sum of the partial values of the shards held by this process over every
+ * shard */
+static REAL_TYPE _shard_sum(struct shard_state *this,
+			    const REAL_TYPE *partials)
+{
+	unsigned int r;
+	REAL_TYPE sum;
+
+	for (r = 0; r < this->num_shards; r++) {
+		if (this->slices[r] != NULL) {
+			this->transport->reduce_begin(this->transport,
+						      this->ranks[r],
+						      partials[r]);
+		}
+	}
+	sum = 0;
+	for (r = 0; r < this->num_shards; r++) {
+		if (this->slices[r] != NULL) {
+			sum = this->transport->reduce_end(this->transport,
+							  this->ranks[r]);
+		}
+	}
+
+	return sum;
+}
+
+unsigned char shard_init(struct shard_state *this, unsigned int num_qubits,
+			 unsigned int num_global,
+			 struct shard_transport *transport)
+{
+	unsigned int i, r;
+	unsigned char exit_code;
+
+	if (num_qubits > MAX_NUM_QUBITS) {
+		transport->destroy(transport);
+		return 3;
+	}
+	if (num_global >= num_qubits) {
+		transport->destroy(transport);
+		return 6;
+	}
+	this->num_qubits = num_qubits;
+	this->num_global = num_global;
+	this->num_shards = 1u << num_global;
+	this->transport = transport;
+	this->qubit_map = MALLOC_TYPE(num_qubits, unsigned int);
+	this->ranks = MALLOC_TYPE(this->num_shards, unsigned int);
+	this->slices = CALLOC_TYPE(this->num_shards, struct state_vector *);
+	if (this->qubit_map == NULL || this->ranks == NULL ||
+	    this->slices == NULL) {
+		free(this->qubit_map);
+		free(this->ranks);
+		free(this->slices);
+		transport->destroy(transport);
+		return 4;
+	}
+	for (i = 0; i < num_qubits; i++) {
+		this->qubit_map[i] = i;
+	}
+
+	exit_code = 0;
+	for (r = 0; r < this->num_shards; r++) {
+		this->ranks[r] = r;
+		if (!transport->holds(transport, r)) {
+			continue;
+		}
+		this->slices[r] = MALLOC_TYPE(1, struct state_vector);
+		if (this->slices[r] == NULL) {
+			exit_code = 4;
+			break;
+		}
+		exit_code = state_init(this->slices[r], num_qubits - num_global,
+				       true);
+		if (exit_code != 0) {
+			free(this->slices[r]);
+			this->slices[r] = NULL;
+			break;
+		}
+		if (r > 0) {
+			state_set(this->slices[r], 0, COMPLEX_ZERO);
+		}
+	}
+	if (exit_code != 0) {
+		for (r = 0; r < this->num_shards; r++) {
+			if (this->slices[r] != NULL) {
+				state_clear(this->slices[r]);
+				free(this->slices[r]);
+			}
+		}
+		free(this->slices);
+		free(this->ranks);
+		free(this->qubit_map);
+		transport->destroy(transport);
+		return exit_code;
+	}
+	RWLOCK_INIT(this->lock);
+
+	return 0;
+}
+
+void shard_clear(struct shard_state *this)
+{
+	unsigned int r;
+
+	if (this->slices != NULL) {
+		for (r = 0; r < this->num_shards; r++) {
+			if (this->slices[r] != NULL) {
+				state_clear(this->slices[r]);
+				free(this->slices[r]);
+			}
+		}
+		free(this->slices);
+		free(this->ranks);
+		free(this->qubit_map);
+		this->transport->destroy(this->transport);
+		RWLOCK_DESTROY(this->lock);
+	}
+	this->slices = NULL;
+	this->ranks = NULL;
+	this->qubit_map = NULL;
+	this->transport = NULL;
+	this->num_qubits = 0;
+	this->num_global = 0;
+	this->num_shards = 0;
+}
+
+/* Sum of the squared moduli of the amplitudes held by a slice */
+static REAL_TYPE _slice_weight(struct state_vector *slice, int num_threads)
+{
+	NATURAL_TYPE i;
+	REAL_TYPE value;
+	COMPLEX_TYPE val;
+	struct parallel_region region;
+	int nt;
+
+	value = 0;
+	nt = parallel_begin(&region, num_threads, slice->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	reduction(+:value) default(none) \
+	firstprivate(slice, COMPLEX_ARRAY_SIZE) private(i, val)
+	for (i = 0; i < slice->size; i++) {
+		val = state_get(slice, i);
+		value += RE(val) * RE(val) + IM(val) * IM(val);
+	}
+	parallel_end(&region);
+
+	return value;
+}
+
+/* Every slice has to share the same normalization constant */
+static unsigned char _shard_renormalize(struct shard_state *this,
+					int num_threads)
+{
+	unsigned int r;
+	REAL_TYPE *partials, norm_const;
+
+	partials = MALLOC_TYPE(this->num_shards, REAL_TYPE);
+	if (partials == NULL) {
+		return 4;
+	}
+	for (r = 0; r < this->num_shards; r++) {
+		if (this->slices[r] != NULL) {
+			state_renormalize(this->slices[r], num_threads);
+			partials[r] = this->slices[r]->norm_const *
+				      this->slices[r]->norm_const;
+		}
+	}
+	norm_const = sqrt(_shard_sum(this, partials));
+	for (r = 0; r < this->num_shards; r++) {
+		if (this->slices[r] != NULL) {
+			this->slices[r]->norm_const = norm_const;
+		}
+	}
+	free(partials);
+
+	return 0;
+}
+
+/* Swap a global logical qubit with the one at a local physical position,
+ * exchanging half of each slice with the shard that differs in that global
+ * bit */
+static unsigned char _shard_swap(struct shard_state *this, unsigned int qubit,
+				 unsigned int local_pos, int num_threads)
+{
+	unsigned int r, q, num_local, shard_bit;
+	unsigned char exit_code, end_code;
+
+	num_local = this->num_qubits - this->num_global;
+	shard_bit = 1u << (this->qubit_map[qubit] - num_local);
+	exit_code = 0;
+	for (r = 0; r < this->num_shards && exit_code == 0; r++) {
+		if (this->slices[r] != NULL) {
+			exit_code = this->transport->exchange_begin(
+				this->transport, this->ranks[r],
+				this->ranks[r ^ shard_bit],
+				(r & shard_bit) != 0, this->slices[r],
+				local_pos, num_threads);
+		}
+	}
+	for (r = 0; r < this->num_shards; r++) {
+		if (this->slices[r] != NULL) {
+			end_code = this->transport->exchange_end(
+				this->transport, this->ranks[r]);
+			if (exit_code == 0) {
+				exit_code = end_code;
+			}
+		}
+	}
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	for (q = 0; q < this->num_qubits; q++) {
+		if (this->qubit_map[q] == local_pos) {
+			this->qubit_map[q] = this->qubit_map[qubit];
+			break;
+		}
+	}
+	this->qubit_map[qubit] = local_pos;
+
+	return 0;
+}
+
+unsigned char shard_apply_gate(struct shard_state *this, struct qgate *gate,
+			       unsigned int *targets, unsigned int num_targets,
+			       unsigned int *controls,
+			       unsigned int num_controls,
+			       unsigned int *anticontrols,
+			       unsigned int num_anticontrols, int num_threads)
+{
+	unsigned int i, j, r, pos, num_local, num_lcontrols, num_lanti;
+	unsigned int *ptargets, *lcontrols, *lanti, shard_control,
+		shard_anticontrol;
+	bool used;
+	unsigned char exit_code;
+	struct state_vector *new_slice;
+
+	num_local = this->num_qubits - this->num_global;
+	if (num_targets > num_local) {
+		return 7;
+	}
+	exit_code = 0;
+
+	// Bring every global target to a local position not used by the others
+	for (i = 0; i < num_targets; i++) {
+		if (this->qubit_map[targets[i]] < num_local) {
+			continue;
+		}
+		for (pos = 0; pos < num_local; pos++) {
+			used = false;
+			for (j = 0; j < num_targets && !used; j++) {
+				used = this->qubit_map[targets[j]] == pos;
+			}
+			if (!used) {
+				break;
+			}
+		}
+		exit_code = _shard_swap(this, targets[i], pos, num_threads);
+		if (exit_code != 0) {
+			return exit_code;
+		}
+	}
+
+	ptargets = MALLOC_TYPE(num_targets, unsigned int);
+	lcontrols = MALLOC_TYPE(num_controls + 1, unsigned int);
+	lanti = MALLOC_TYPE(num_anticontrols + 1, unsigned int);
+	if (ptargets == NULL || lcontrols == NULL || lanti == NULL) {
+		free(ptargets);
+		free(lcontrols);
+		free(lanti);
+		return 4;
+	}
+	for (i = 0; i < num_targets; i++) {
+		ptargets[i] = this->qubit_map[targets[i]];
+	}
+	// Global controls decide which shards apply the gate
+	num_lcontrols = 0;
+	shard_control = 0;
+	for (i = 0; i < num_controls; i++) {
+		pos = this->qubit_map[controls[i]];
+		if (pos < num_local) {
+			lcontrols[num_lcontrols++] = pos;
+		} else {
+			shard_control |= 1u << (pos - num_local);
+		}
+	}
+	num_lanti = 0;
+	shard_anticontrol = 0;
+	for (i = 0; i < num_anticontrols; i++) {
+		pos = this->qubit_map[anticontrols[i]];
+		if (pos < num_local) {
+			lanti[num_lanti++] = pos;
+		} else {
+			shard_anticontrol |= 1u << (pos - num_local);
+		}
+	}
+
+	exit_code = 0;
+	for (r = 0; r < this->num_shards; r++) {
+		if (this->slices[r] == NULL ||
+		    (r & shard_control) != shard_control ||
+		    (r & shard_anticontrol) != 0) {
+			continue;
+		}
+		new_slice = MALLOC_TYPE(1, struct state_vector);
+		if (new_slice == NULL) {
+			exit_code = 4;
+			break;
+		}
+		exit_code = apply_gate(this->slices[r], gate, ptargets,
+				       num_targets, lcontrols, num_lcontrols,
+				       lanti, num_lanti, new_slice,
+				       num_threads);
+		if (exit_code != 0) {
+			break;
+		}
+		state_clear(this->slices[r]);
+		free(this->slices[r]);
+		this->slices[r] = new_slice;
+	}
+	free(ptargets);
+	free(lcontrols);
+	free(lanti);
+
+	if (exit_code == 0 && !gate->unitary) {
+		exit_code = _shard_renormalize(this, num_threads);
+	}
+
+	return exit_code;
+}
+
+REAL_TYPE shard_probability(struct shard_state *this, unsigned int target_id,
+			    int num_threads)
+{
+	unsigned int r, pos, num_local;
+	REAL_TYPE *partials, value;
+
+	partials = MALLOC_TYPE(this->num_shards, REAL_TYPE);
+	if (partials == NULL) {
+		return NAN;
+	}
+	num_local = this->num_qubits - this->num_global;
+	pos = this->qubit_map[target_id];
+	for (r = 0; r < this->num_shards; r++) {
+		if (this->slices[r] == NULL) {
+			continue;
+		}
+		if (pos < num_local) {
+			partials[r] = probability(this->slices[r], pos,
+						  num_threads);
+		} else if ((r >> (pos - num_local)) & 1) {
+			partials[r] = _slice_weight(this->slices[r],
+						    num_threads);
+		} else {
+			partials[r] = 0;
+		}
+	}
+	value = _shard_sum(this, partials);
+	free(partials);
+
+	return value;
+}
+
+unsigned char shard_measure(struct shard_state *this, unsigned int target_id,
+			    REAL_TYPE roll, bool *result, int num_threads)
+{
+	unsigned int q, r, j, pos, num_local, shard_bit;
+	unsigned char exit_code;
+	REAL_TYPE prob, chances;
+	struct state_vector *new_slice;
+
+	num_local = this->num_qubits - this->num_global;
+	// Collapsing the last local qubit would leave the slices empty, so it
+	// becomes a shard qubit instead
+	if (num_local == 1 && this->num_global > 0 &&
+	    this->qubit_map[target_id] == 0) {
+		for (q = 0; q < this->num_qubits; q++) {
+			if (this->qubit_map[q] == num_local) {
+				break;
+			}
+		}
+		exit_code = _shard_swap(this, q, 0, num_threads);
+		if (exit_code != 0) {
+			return exit_code;
+		}
+	}
+
+	prob = shard_probability(this, target_id, num_threads);
+	if (isnan(prob)) {
+		return 4;
+	}
+	*result = prob > roll;
+	chances = *result ? prob : 1 - prob;
+	pos = this->qubit_map[target_id];
+
+	if (pos >= num_local) {
+		// Only the shards that agree with the result survive
+		shard_bit = 1u << (pos - num_local);
+		j = 0;
+		for (r = 0; r < this->num_shards; r++) {
+			if (((r & shard_bit) != 0) == *result) {
+				if (this->slices[r] != NULL) {
+					this->slices[r]->norm_const *=
+						sqrt(chances);
+				}
+				this->ranks[j] = this->ranks[r];
+				this->slices[j++] = this->slices[r];
+			} else if (this->slices[r] != NULL) {
+				state_clear(this->slices[r]);
+				free(this->slices[r]);
+			}
+		}
+		this->num_shards = j;
+		this->num_global--;
+	} else {
+		for (r = 0; r < this->num_shards; r++) {
+			if (this->slices[r] == NULL) {
+				continue;
+			}
+			new_slice = MALLOC_TYPE(1, struct state_vector);
+			if (new_slice == NULL) {
+				return 4;
+			}
+			exit_code = collapse(this->slices[r], pos, *result,
+					     prob, new_slice, num_threads);
+			if (exit_code != 0) {
+				free(new_slice);
+				return exit_code;
+			}
+			state_clear(this->slices[r]);
+			free(this->slices[r]);
+			this->slices[r] = new_slice;
+		}
+	}
+
+	// Both physical positions and logical ids above the measured qubit
+	// move down by one
+	for (q = 0; q < this->num_qubits; q++) {
+		if (this->qubit_map[q] > pos) {
+			this->qubit_map[q]--;
+		}
+	}
+	for (q = target_id; q + 1 < this->num_qubits; q++) {
+		this->qubit_map[q] = this->qubit_map[q + 1];
+	}
+	this->num_qubits--;
+
+	return 0;
+}
+
+COMPLEX_TYPE shard_get(struct shard_state *this, NATURAL_TYPE index)
+{
+	unsigned int q, num_local;
+	NATURAL_TYPE phys;
+	struct state_vector *slice;
+
+	phys = 0;
+	for (q = 0; q < this->num_qubits; q++) {
+		if ((index >> q) & 1) {
+			phys |= NATURAL_ONE << this->qubit_map[q];
+		}
+	}
+	num_local = this->num_qubits - this->num_global;
+	slice = this->slices[phys >> num_local];
+	if (slice == NULL) {
+		return COMPLEX_NAN;
+	}
+
+	return state_get(slice, phys & ((NATURAL_ONE << num_local) - 1));
+}
+
+unsigned char shard_gather(struct shard_state *this, struct state_vector *dest,
+			   int num_threads)
+{
+	NATURAL_TYPE i;
+	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
+	exit_code = state_init(dest, this->num_qubits, false);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	nt = parallel_begin(&region, num_threads, dest->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) firstprivate(this, dest, COMPLEX_ARRAY_SIZE) private(i)
+	for (i = 0; i < dest->size; i++) {
+		state_set(dest, i, shard_get(this, i));
+	}
+	parallel_end(&region);
+
+	return 0;
+}
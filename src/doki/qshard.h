@@ -0,0 +1,176 @@
+/*
+ * Doki: Quantum Computer simulator, using state vectors. QSimov core.
+ * Copyright (C) 2021  Hernán Indíbil de la Cruz Calvo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** \file qshard.h
+ *  \brief Functions and structures needed to split a quantum state in
+ *  shards that only talk to each other through a transport.
+ *
+ *  The physical index of an amplitude is split in two: the top num_global
+ *  bits select the shard and the rest are the index inside the slice held by
+ *  that shard. Logical qubits are mapped to physical positions, so global
+ *  qubits can be swapped with local ones to keep gates local.
+ *
+ *  Every shard is served by a rank of a shard_transport. Shards only
+ *  interact through the pairwise exchange of half of their slices used to
+ *  swap a global qubit with a local one and through the sums of their
+ *  partial probabilities and norms, so a transport whose ranks live in other
+ *  processes only holds the slices of its own ranks. The one provided here
+ *  serves every rank from the current process, which keeps each slice (and
+ *  the temporary vector a gate needs) small, lets gates controlled by global
+ *  qubits skip whole shards and lets measurements of global qubits drop
+ *  them, but the whole state still has to fit in the memory of one machine.
+ */
+
+#pragma once
+#ifndef QSHARD_H_
+#define QSHARD_H_
+
+#include "platform.h"
+#include "qgate.h"
+#include "qstate.h"
+#include <stdbool.h>
+
+/* Operations are split in begin and end so every rank served by a process
+ * starts them before any of them waits for its peers. */
+struct shard_transport {
+	/* Whether the slice of rank is held by this process */
+	bool (*holds)(struct shard_transport *this, unsigned int rank);
+	/* Start swapping half of the slice of rank with the one of peer, with
+	 * the same remaining bits. The upper shard (the one whose global bit
+	 * is 1) gives its amplitudes whose local_bit is 0 and gets the ones of
+	 * its peer whose local_bit is 1. Returns 0 if ok, 4 if failed to
+	 * allocate memory */
+	unsigned char (*exchange_begin)(struct shard_transport *this,
+					unsigned int rank, unsigned int peer,
+					bool upper, struct state_vector *slice,
+					unsigned int local_bit,
+					int num_threads);
+	/* Wait until the exchange started by rank is done */
+	unsigned char (*exchange_end)(struct shard_transport *this,
+				      unsigned int rank);
+	/* Add the partial value of rank to a sum over every rank */
+	void (*reduce_begin)(struct shard_transport *this, unsigned int rank,
+			     REAL_TYPE value);
+	/* Wait for the sum every rank is adding to and return it */
+	REAL_TYPE (*reduce_end)(struct shard_transport *this,
+				unsigned int rank);
+	/* Free the transport and its data */
+	void (*destroy)(struct shard_transport *this);
+	/* transport specific data */
+	void *data;
+};
+
+struct shard_state {
+	/* number of qubits of the whole system */
+	unsigned int num_qubits;
+	/* number of qubits that select the shard */
+	unsigned int num_global;
+	/* number of shards (2^num_global) */
+	unsigned int num_shards;
+	/* slice of the state held by each shard (NULL if held by another
+	 * process) */
+	struct state_vector **slices;
+	/* transport rank serving each shard */
+	unsigned int *ranks;
+	/* physical position of each logical qubit */
+	unsigned int *qubit_map;
+	/* communication layer between shards */
+	struct shard_transport *transport;
+	/* readers/writer lock protecting the whole registry */
+	RWLOCK_TYPE lock;
+};
+
+/** \fn struct shard_transport *shard_transport_local(unsigned int
+ * num_ranks);
+ *  \brief Transport whose ranks are all served by the current process.
+ *  \param num_ranks Number of ranks.
+ *  \return The transport or NULL if it could not be allocated.
+ */
+struct shard_transport *shard_transport_local(unsigned int num_ranks);
+
+/** \fn unsigned char shard_init(struct shard_state *this, unsigned int
+ * num_qubits, unsigned int num_global, struct shard_transport *transport);
+ *  \brief Initialize a sharded state to |0...0>.
+ *  \param this Pointer to an already allocated shard_state structure.
+ *  \param num_qubits Number of qubits of the system.
+ *  \param num_global Number of qubits used to select the shard.
+ *  \param transport Transport with a rank per shard (owned by the state,
+ *  and destroyed if the initialization fails).
+ *  \return 0 if ok, 1 if failed to allocate a slice vector, 2 if failed to
+ *  allocate any chunk, 3 if num_qubits > MAX_NUM_QUBITS, 4 if failed to
+ *  allocate the shard structures, 6 if there are no local qubits left.
+ */
+unsigned char shard_init(struct shard_state *this, unsigned int num_qubits,
+			 unsigned int num_global,
+			 struct shard_transport *transport);
+
+void shard_clear(struct shard_state *this);
+
+/** \fn unsigned char shard_apply_gate(struct shard_state *this, struct qgate
+ * *gate, unsigned int *targets, unsigned int num_targets, unsigned int
+ * *controls, unsigned int num_controls, unsigned int *anticontrols, unsigned
+ * int num_anticontrols, int num_threads);
+ *  \brief Apply a gate in place. Global targets are swapped with local
+ *  qubits first and global controls are checked per shard.
+ *  \return 0 if ok, 4 if failed to allocate memory, 7 if the gate has more
+ *  targets than local qubits, or an apply_gate or transport error code.
+ */
+unsigned char shard_apply_gate(struct shard_state *this, struct qgate *gate,
+			       unsigned int *targets, unsigned int num_targets,
+			       unsigned int *controls,
+			       unsigned int num_controls,
+			       unsigned int *anticontrols,
+			       unsigned int num_anticontrols, int num_threads);
+
+/** \fn REAL_TYPE shard_probability(struct shard_state *this, unsigned int
+ * target_id, int num_threads);
+ *  \brief Chances of obtaining 1 when measuring a qubit, added up over
+ *  every shard by the transport.
+ *  \return The probability.
+ */
+REAL_TYPE shard_probability(struct shard_state *this, unsigned int target_id,
+			    int num_threads);
+
+/** \fn unsigned char shard_measure(struct shard_state *this, unsigned int
+ * target_id, REAL_TYPE roll, bool *result, int num_threads);
+ *  \brief Measure a qubit and collapse the state in place. Measuring a
+ *  global qubit drops the shards that do not match the result.
+ *  \return 0 if ok, 1 or 2 if failed to allocate a slice, 4 if failed to
+ *  allocate memory.
+ */
+unsigned char shard_measure(struct shard_state *this, unsigned int target_id,
+			    REAL_TYPE roll, bool *result, int num_threads);
+
+/** \fn COMPLEX_TYPE shard_get(struct shard_state *this, NATURAL_TYPE
+ * index);
+ *  \brief Get an amplitude of the whole state.
+ *  \return The amplitude, or COMPLEX_NAN if its slice is held by another
+ *  process.
+ */
+COMPLEX_TYPE shard_get(struct shard_state *this, NATURAL_TYPE index);
+
+/** \fn unsigned char shard_gather(struct shard_state *this, struct
+ * state_vector *dest, int num_threads);
+ *  \brief Copy the whole sharded state into a regular state vector. Every
+ *  slice has to be held by the current process.
+ *  \return 0 if ok, or a state_init error code.
+ */
+unsigned char shard_gather(struct shard_state *this, struct state_vector *dest,
+			   int num_threads);
+
+#endif /* QSHARD_H_ */
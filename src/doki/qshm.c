@@ -0,0 +1,189 @@
+/*
+ * Doki: Quantum Computer simulator, using state vectors. QSimov core.
+ * Copyright (C) 2021  Hernán Indíbil de la Cruz Calvo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "qshm.h"
+#include "platform.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct shm_header {
+	/* SHM_MAGIC once the amplitudes have been written */
+	_Atomic uint64_t magic;
+	/* number of qubits of the stored state */
+	unsigned int num_qubits;
+	/* normalization constant of the stored amplitudes */
+	REAL_TYPE norm_const;
+	/* number of attached processes (0 -> being destroyed) */
+	atomic_uint refcount;
+};
+
+_Static_assert(sizeof(struct shm_header) <= SHM_DATA_OFFSET,
+	       "shm_header does not fit before the amplitudes");
+
+unsigned char shm_segment_create(struct shm_segment *this, const char *name,
+				 unsigned int num_qubits, REAL_TYPE norm_const)
+{
+	struct shm_header *header;
+	int fd;
+
+	this->size = SHM_DATA_OFFSET +
+		     (NATURAL_ONE << num_qubits) * sizeof(COMPLEX_TYPE);
+	this->name = strdup(name);
+	if (this->name == NULL) {
+		return 4;
+	}
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		free(this->name);
+		return errno == EEXIST ? 9 : 10;
+	}
+	if (ftruncate(fd, this->size) != 0) {
+		close(fd);
+		shm_unlink(name);
+		free(this->name);
+		return 10;
+	}
+	this->base = mmap(NULL, this->size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	close(fd);
+	if (this->base == MAP_FAILED) {
+		shm_unlink(name);
+		free(this->name);
+		return 10;
+	}
+	header = (struct shm_header *)this->base;
+	header->num_qubits = num_qubits;
+	header->norm_const = norm_const;
+	atomic_init(&header->refcount, 1);
+	atomic_init(&header->magic, 0);
+
+	return 0;
+}
+
+void shm_segment_publish(struct shm_segment *this)
+{
+	struct shm_header *header;
+
+	header = (struct shm_header *)this->base;
+	atomic_store_explicit(&header->magic, SHM_MAGIC, memory_order_release);
+}
+
+unsigned char shm_segment_attach(struct shm_segment *this, const char *name,
+				 unsigned int *num_qubits,
+				 REAL_TYPE *norm_const)
+{
+	struct shm_header *header;
+	struct stat info;
+	unsigned int refs;
+	int fd;
+
+	this->name = strdup(name);
+	if (this->name == NULL) {
+		return 4;
+	}
+	fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0) {
+		free(this->name);
+		return 10;
+	}
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < SHM_DATA_OFFSET) {
+		close(fd);
+		free(this->name);
+		return 11;
+	}
+	this->size = (size_t)info.st_size;
+	this->base = mmap(NULL, this->size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	close(fd);
+	if (this->base == MAP_FAILED) {
+		free(this->name);
+		return 10;
+	}
+	header = (struct shm_header *)this->base;
+	if (atomic_load_explicit(&header->magic, memory_order_acquire) !=
+		    SHM_MAGIC ||
+	    header->num_qubits > MAX_NUM_QUBITS ||
+	    this->size != SHM_DATA_OFFSET + (NATURAL_ONE << header->num_qubits) *
+						    sizeof(COMPLEX_TYPE)) {
+		munmap(this->base, this->size);
+		free(this->name);
+		return 11;
+	}
+	// A segment whose count already reached 0 can not be brought back
+	refs = atomic_load(&header->refcount);
+	do {
+		if (refs == 0) {
+			munmap(this->base, this->size);
+			free(this->name);
+			return 12;
+		}
+	} while (!atomic_compare_exchange_weak(&header->refcount, &refs,
+					       refs + 1));
+	*num_qubits = header->num_qubits;
+	*norm_const = header->norm_const;
+
+	return 0;
+}
+
+void shm_segment_detach(struct shm_segment *this)
+{
+	struct shm_header *header;
+
+	header = (struct shm_header *)this->base;
+	if (atomic_fetch_sub(&header->refcount, 1) == 1) {
+		shm_unlink(this->name);
+	}
+	munmap(this->base, this->size);
+	free(this->name);
+	this->name = NULL;
+	this->base = NULL;
+	this->size = 0;
+}
+
+#else
+
+unsigned char shm_segment_create(struct shm_segment *this, const char *name,
+				 unsigned int num_qubits, REAL_TYPE norm_const)
+{
+	return 8;
+}
+
+void shm_segment_publish(struct shm_segment *this)
+{
+}
+
+unsigned char shm_segment_attach(struct shm_segment *this, const char *name,
+				 unsigned int *num_qubits,
+				 REAL_TYPE *norm_const)
+{
+	return 8;
+}
+
+void shm_segment_detach(struct shm_segment *this)
+{
+}
+
+#endif
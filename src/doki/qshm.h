@@ -0,0 +1,83 @@
+/*
+ * Doki: Quantum Computer simulator, using state vectors. QSimov core.
+ * Copyright (C) 2021  Hernán Indíbil de la Cruz Calvo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** \file qshm.h
+ *  \brief Named shared memory segments holding the amplitudes of a state.
+ *
+ *  A segment starts with a shm_header followed by the amplitudes. Every
+ *  process attached to the segment holds a reference in the header, and the
+ *  last one to detach removes its name. Only available on POSIX systems.
+ */
+
+#pragma once
+#ifndef QSHM_H_
+#define QSHM_H_
+
+#include "platform.h"
+#include <stddef.h>
+
+#define SHM_MAGIC 0x444F4B4953484D31ULL /* "DOKISHM1" */
+/* Offset of the amplitudes inside the segment */
+#define SHM_DATA_OFFSET 64
+
+struct shm_segment {
+	/* name of the shared memory object */
+	char *name;
+	/* start of the mapped region (a struct shm_header) */
+	void *base;
+	/* size of the mapped region in bytes */
+	size_t size;
+};
+
+/** \fn unsigned char shm_segment_create(struct shm_segment *this, const char
+ * *name, unsigned int num_qubits, REAL_TYPE norm_const);
+ *  \brief Create and map a new segment able to hold 2^num_qubits amplitudes.
+ *  The segment can not be attached until shm_segment_publish is called.
+ *  \return 0 if ok, 4 if failed to allocate memory, 8 if not supported,
+ *  9 if the name is already in use, 10 if the segment could not be created
+ *  or mapped.
+ */
+unsigned char shm_segment_create(struct shm_segment *this, const char *name,
+				 unsigned int num_qubits, REAL_TYPE norm_const);
+
+/** \fn void shm_segment_publish(struct shm_segment *this);
+ *  \brief Allow other processes to attach to a segment once it is filled.
+ */
+void shm_segment_publish(struct shm_segment *this);
+
+/** \fn unsigned char shm_segment_attach(struct shm_segment *this, const char
+ * *name, unsigned int *num_qubits, REAL_TYPE *norm_const);
+ *  \brief Map an existing segment, taking a reference to it.
+ *  \return 0 if ok, 4 if failed to allocate memory, 8 if not supported,
+ *  10 if the segment could not be opened or mapped, 11 if it is not a
+ *  registry (or it is not ready yet), 12 if it is being destroyed.
+ */
+unsigned char shm_segment_attach(struct shm_segment *this, const char *name,
+				 unsigned int *num_qubits,
+				 REAL_TYPE *norm_const);
+
+/** \fn void shm_segment_detach(struct shm_segment *this);
+ *  \brief Unmap a segment, removing its name if no process uses it anymore.
+ */
+void shm_segment_detach(struct shm_segment *this);
+
+/* Pointer to the amplitudes stored in a mapped segment */
+#define shm_segment_data(this) \
+	((COMPLEX_TYPE *)((char *)(this)->base + SHM_DATA_OFFSET))
+
+#endif /* QSHM_H_ */
@@ -41,6 +41,8 @@ unsigned char state_init(struct state_vector *this, unsigned int num_qubits,
 	} else {
 		offset = COMPLEX_ARRAY_SIZE;
 	}
+	this->refcount = 0;
+	this->shared = NULL;
 	this->vector = MALLOC_TYPE(this->num_chunks, COMPLEX_TYPE *);
 	if (this->vector == NULL) {
 		return 1;
@@ -78,40 +80,183 @@ unsigned char state_init(struct state_vector *this, unsigned int num_qubits,
 			free(this->vector[i]);
 		}
 		free(this->vector);
+		this->vector = NULL;
 		return 2;
 	}
 	if (init) {
 		this->vector[0][0] = COMPLEX_ONE;
 	}
+	this->refcount = 1;
+	RWLOCK_INIT(this->lock);
 
 	return 0;
 }
 
 unsigned char state_clone(struct state_vector *dest,
-			  struct state_vector *source)
+			  struct state_vector *source, int num_threads)
 {
 	NATURAL_TYPE i;
 	unsigned char exit_code;
+	struct parallel_region region;
+	int nt;
+
 	exit_code = state_init(dest, source->num_qubits, false);
 	if (exit_code != 0) {
 		return exit_code;
 	}
-#pragma omp parallel for default(none) \
-	shared(source, dest, COMPLEX_ARRAY_SIZE) private(i)
+	nt = parallel_begin(&region, num_threads, source->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) shared(source, dest, COMPLEX_ARRAY_SIZE) private(i)
 	for (i = 0; i < source->size; i++) {
 		state_set(dest, i, state_get(source, i));
 	}
+	parallel_end(&region);
+	return 0;
+}
+
+void state_renormalize(struct state_vector *this, int num_threads)
+{
+	NATURAL_TYPE i;
+	REAL_TYPE norm_const;
+	COMPLEX_TYPE val;
+	struct parallel_region region;
+	int nt;
+
+	norm_const = 0;
+	nt = parallel_begin(&region, num_threads, this->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	reduction(+:norm_const) default(none) \
+	shared(this, COMPLEX_ARRAY_SIZE) private(i, val)
+	for (i = 0; i < this->size; i++) {
+		val = state_get_raw(this, i);
+		norm_const += RE(val) * RE(val) + IM(val) * IM(val);
+	}
+	parallel_end(&region);
+	this->norm_const = sqrt(norm_const);
+}
+
+/* Point a state to the amplitudes of a mapped segment */
+static unsigned char _state_use_segment(struct state_vector *this,
+					struct shm_segment *segment,
+					unsigned int num_qubits,
+					REAL_TYPE norm_const)
+{
+	this->vector = MALLOC_TYPE(1, COMPLEX_TYPE *);
+	if (this->vector == NULL) {
+		return 4;
+	}
+	this->vector[0] = shm_segment_data(segment);
+	this->shared = segment;
+	this->size = NATURAL_ONE << num_qubits;
+	this->num_chunks = 1;
+	this->num_qubits = num_qubits;
+	this->norm_const = norm_const;
+	this->fcarg_init = 0;
+	this->fcarg = -10.0;
+	this->refcount = 1;
+	RWLOCK_INIT(this->lock);
+
+	return 0;
+}
+
+unsigned char state_share(struct state_vector *dest,
+			  struct state_vector *source, const char *name,
+			  int num_threads)
+{
+	NATURAL_TYPE i;
+	unsigned char exit_code;
+	struct shm_segment *segment;
+	struct parallel_region region;
+	int nt;
+
+	// Amplitudes are stored in a single chunk
+	if ((size_t)source->size > COMPLEX_ARRAY_SIZE) {
+		return 3;
+	}
+	segment = MALLOC_TYPE(1, struct shm_segment);
+	if (segment == NULL) {
+		return 4;
+	}
+	exit_code = shm_segment_create(segment, name, source->num_qubits,
+				       source->norm_const);
+	if (exit_code != 0) {
+		free(segment);
+		return exit_code;
+	}
+	exit_code = _state_use_segment(dest, segment, source->num_qubits,
+				       source->norm_const);
+	if (exit_code != 0) {
+		shm_segment_detach(segment);
+		free(segment);
+		return exit_code;
+	}
+	nt = parallel_begin(&region, num_threads, source->size);
+#pragma omp parallel for if (nt > 1) num_threads(nt) schedule(runtime) \
+	default(none) shared(source, dest, COMPLEX_ARRAY_SIZE) private(i)
+	for (i = 0; i < source->size; i++) {
+		state_set(dest, i, state_get_raw(source, i));
+	}
+	parallel_end(&region);
+	shm_segment_publish(segment);
+
 	return 0;
 }
 
+unsigned char state_attach(struct state_vector *dest, const char *name)
+{
+	unsigned int num_qubits;
+	REAL_TYPE norm_const;
+	unsigned char exit_code;
+	struct shm_segment *segment;
+
+	segment = MALLOC_TYPE(1, struct shm_segment);
+	if (segment == NULL) {
+		return 4;
+	}
+	exit_code = shm_segment_attach(segment, name, &num_qubits, &norm_const);
+	if (exit_code != 0) {
+		free(segment);
+		return exit_code;
+	}
+	exit_code = _state_use_segment(dest, segment, num_qubits, norm_const);
+	if (exit_code != 0) {
+		shm_segment_detach(segment);
+		free(segment);
+	}
+
+	return exit_code;
+}
+
+void state_ref(struct state_vector *this)
+{
+	this->refcount++;
+}
+
+void state_unref(struct state_vector *this)
+{
+	if (this->refcount > 1) {
+		this->refcount--;
+		return;
+	}
+	state_clear(this);
+	free(this);
+}
+
 void state_clear(struct state_vector *this)
 {
 	size_t i;
 	if (this->vector != NULL) {
-		for (i = 0; i < this->num_chunks; i++) {
-			free(this->vector[i]);
+		if (this->shared != NULL) {
+			shm_segment_detach(this->shared);
+			free(this->shared);
+			this->shared = NULL;
+		} else {
+			for (i = 0; i < this->num_chunks; i++) {
+				free(this->vector[i]);
+			}
 		}
 		free(this->vector);
+		RWLOCK_DESTROY(this->lock);
 	}
 	this->vector = NULL;
 	this->num_chunks = 0;
@@ -39,6 +39,7 @@
 #define QSTATE_H_
 
 #include "platform.h"
+#include "qshm.h"
 #include <stdbool.h>
 
 struct state_vector {
@@ -56,6 +57,14 @@ struct state_vector {
 	bool fcarg_init;
 	/* first complex argument */
 	REAL_TYPE fcarg;
+	/* number of owners (capsule and running calls). Only modified while
+	 * holding the GIL */
+	unsigned int refcount;
+	/* readers/writer lock protecting the amplitudes, norm_const and fcarg
+	 * while the GIL is released */
+	RWLOCK_TYPE lock;
+	/* shared memory segment holding the amplitudes (NULL if private) */
+	struct shm_segment *shared;
 };
 
 /** \fn unsigned char state_init(struct state_vector *this, unsigned int
@@ -73,11 +82,35 @@ unsigned char state_init(struct state_vector *this, unsigned int num_qubits,
  * state_vector *source); \brief Clone a state vector structure. \param dest
  * Pointer to an already allocated state_vector structure i which the copy will
  * be stored. \param source Pointer to the state_vector structure that has to
- * be cloned. \return 0 if ok, 1 if failed to allocate dest vector, 2 if failed
+ * be cloned. \param num_threads Number of threads to use (-1 for the default).
+ * \return 0 if ok, 1 if failed to allocate dest vector, 2 if failed
  * to allocate any chunk.
  */
 unsigned char state_clone(struct state_vector *dest,
-			  struct state_vector *source);
+			  struct state_vector *source, int num_threads);
+
+/** \fn unsigned char state_share(struct state_vector *dest, struct
+ * state_vector *source, const char *name, int num_threads);
+ *  \brief Copy a state into a new named shared memory segment.
+ *  \param dest Pointer to an already allocated state_vector structure that
+ *  will use the segment.
+ *  \param source Pointer to the state_vector structure that has to be copied.
+ *  \param name Name of the segment.
+ *  \param num_threads Number of threads to use (-1 for the default).
+ *  \return 0 if ok, or a shm_segment_create error code.
+ */
+unsigned char state_share(struct state_vector *dest,
+			  struct state_vector *source, const char *name,
+			  int num_threads);
+
+/** \fn unsigned char state_attach(struct state_vector *dest, const char
+ * *name);
+ *  \brief Use the amplitudes stored in a named shared memory segment.
+ *  \param dest Pointer to an already allocated state_vector structure.
+ *  \param name Name of the segment.
+ *  \return 0 if ok, or a shm_segment_attach error code.
+ */
+unsigned char state_attach(struct state_vector *dest, const char *name);
 
 void state_clear(struct state_vector *this);
 
@@ -85,6 +118,29 @@ void state_clear(struct state_vector *this);
 
 #define state_get(this, i) (COMPLEX_DIV_R((this)->vector[(i) / COMPLEX_ARRAY_SIZE][(i) % COMPLEX_ARRAY_SIZE], (this)->norm_const))
 
+/* Stored amplitude, without dividing it by the normalization constant */
+#define state_get_raw(this, i) ((this)->vector[(i) / COMPLEX_ARRAY_SIZE][(i) % COMPLEX_ARRAY_SIZE])
+
+/** \fn void state_ref(struct state_vector *this);
+ *  \brief Add an owner to the state. Not thread safe (call it with the GIL).
+ *  \param this Pointer to an initialized state_vector structure.
+ */
+void state_ref(struct state_vector *this);
+
+/** \fn void state_unref(struct state_vector *this);
+ *  \brief Remove an owner from the state, clearing and freeing it when none
+ *  are left. Not thread safe (call it with the GIL).
+ *  \param this Pointer to an initialized state_vector structure.
+ */
+void state_unref(struct state_vector *this);
+
+/** \fn void state_renormalize(struct state_vector *this, int num_threads);
+ *  \brief Recompute the normalization constant from the stored amplitudes.
+ *  \param this Pointer to an initialized state_vector structure.
+ *  \param num_threads Number of threads to use (-1 for the default).
+ */
+void state_renormalize(struct state_vector *this, int num_threads);
+
 size_t state_mem_size(struct state_vector *this);
 
 #endif /* QSTATE_H_ */
@@ -54,7 +54,53 @@ def check_partial_trace(num_qubits, verbose):
                              f"with {num_qubits} qubits")
 
 
-def main(min_qubits, max_qubits, verbose):
+def deposit(values, qubits):
+    """Move bit k of each value to the position of qubits[k]."""
+    result = np.zeros_like(values)
+    for k, q in enumerate(qubits):
+        result |= ((values >> k) & 1) << q
+    return result
+
+
+def check_density_dense(num_qubits, num_threads, prng, verbose):
+    """Compare the dense (reduced) density matrix with numpy."""
+    size = 2**num_qubits
+    data = prng.random(size) * np.exp(2j * np.pi * prng.random(size))
+    state = doki.registry_new_data(num_qubits, data / np.linalg.norm(data),
+                                   verbose)
+    ket = doki.registry_get_many(state, range(size), False, num_threads,
+                                 verbose)
+    subsets = [None, [int(prng.integers(num_qubits))],
+               list(range(0, num_qubits, 3)),
+               [int(q) for q in prng.permutation(num_qubits)[
+                   :int(prng.integers(1, num_qubits + 1))]]]
+    for subset in subsets:
+        kept = sorted(subset) if subset is not None \
+            else list(range(num_qubits))
+        rest = [q for q in range(num_qubits) if q not in kept]
+        rows = deposit(np.arange(2**len(kept)), kept)
+        cols = deposit(np.arange(2**len(rest)), rest)
+        amps = ket[rows[:, None] | cols[None, :]]
+        expected = amps @ amps.conj().T
+        rho = doki.registry_density_dense(state, subset, num_threads,
+                                          verbose)
+        if rho.shape != expected.shape \
+                or not np.allclose(rho, expected, rtol=0, atol=1e-12) \
+                or not np.array_equal(rho, rho.conj().T):
+            debug("subset:", subset)
+            debug("expected:", expected)
+            debug("actual:", rho)
+            error("Failed dense density matrix test "
+                  f"with {num_qubits} qubits", fatal=True)
+    try:
+        doki.registry_density_dense(state, [num_qubits], num_threads,
+                                    verbose)
+        error("Qubit out of range accepted", fatal=True)
+    except doki.error:
+        pass
+
+
+def main(min_qubits, max_qubits, num_threads, prng, verbose):
     """Execute all tests."""
     a = t.time()
     for nq in range(min_qubits, max_qubits + 1):
@@ -67,7 +113,14 @@ def main(min_qubits, max_qubits, verbose):
         for nq in range(max(2, min_qubits), max_qubits + 1):
             check_partial_trace(nq, verbose)
         d = t.time()
-    print(f"\tPEACE AND TRANQUILITY: {(b - a) + (d - c)} s")
+    print("\tDense density matrix tests...")
+    e = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        check_density_dense(nq, num_threads, prng, verbose)
+    # Enough tiles to share among the threads
+    check_density_dense(10, num_threads, prng, verbose)
+    f = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {(b - a) + (d - c) + (f - e)} s")
 
 
 if __name__ == "__main__":
@@ -76,11 +129,11 @@ if __name__ == "__main__":
     parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
     parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
     parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
-    # parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
     # parser.add_argument("-i", "--iterations", type=int, required=True, help="how many times the test target has to be executed")
-    # parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
     args = parser.parse_args()
 
     print("Density matrix tests:")
-    init_args(args)
-    main(args.num_qubits, args.max_qubits, args.verbose)
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.num_threads, prng, args.verbose)
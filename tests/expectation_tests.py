@@ -0,0 +1,134 @@
+"""Expectation value tests."""
+import argparse
+import doki as doki
+import numpy as np
+import time as t
+
+from one_gate_tests import U_doki
+from reg_creation_tests import doki_to_np
+from timed_test import debug, error, init_args
+
+
+PAULIS = {
+    "I": np.eye(2),
+    "X": np.array([[0, 1], [1, 0]]),
+    "Y": np.array([[0, -1j], [1j, 0]]),
+    "Z": np.array([[1, 0], [0, -1]]),
+}
+
+
+def random_registry(nq, num_threads, prng, verbose):
+    """Return an entangled registry built with random gates."""
+    x = doki.gate_new(1, PAULIS["X"].tolist(), verbose)
+    reg = doki.registry_new(nq, verbose)
+    for i in range(nq):
+        gate = U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False, verbose)
+        reg = doki.registry_apply(reg, gate, [i], set(), set(), num_threads,
+                                  verbose)
+        if i > 0:
+            reg = doki.registry_apply(reg, x, [i], {i - 1}, set(),
+                                      num_threads, verbose)
+    return reg
+
+
+def random_pauli(nq, prng):
+    """Return a random Pauli string as (label, x_mask, z_mask)."""
+    label = "".join(prng.choice(list(PAULIS), size=nq))
+    x_mask = sum(1 << q for q in range(nq) if label[q] in "XY")
+    z_mask = sum(1 << q for q in range(nq) if label[q] in "ZY")
+    return label, x_mask, z_mask
+
+
+def apply_pauli_np(psi, label):
+    """Return P|psi> for a Pauli string (label[q] acts on qubit q)."""
+    nq = len(label)
+    tensor = psi.reshape([2] * nq)
+    for q, p in enumerate(label):
+        axis = nq - q - 1
+        tensor = np.moveaxis(np.tensordot(PAULIS[p], tensor,
+                                          axes=([1], [axis])), 0, axis)
+    return tensor.reshape(-1)
+
+
+def test_pauli(nq, rtol, atol, num_threads, prng, verbose):
+    """Compare Pauli expectation values with numpy."""
+    reg = random_registry(nq, num_threads, prng, verbose)
+    psi = doki_to_np(reg, nq, verbose)[:, 0]
+    for _ in range(8):
+        label, x_mask, z_mask = random_pauli(nq, prng)
+        coeff = complex(*(prng.random(2) * 2 - 1))
+        obtained = doki.registry_expectation_pauli(reg, x_mask, z_mask, coeff,
+                                                   num_threads, verbose)
+        expected = coeff * (psi.conj() @ apply_pauli_np(psi, label))
+        if not np.allclose(obtained, expected, rtol=rtol, atol=atol):
+            debug("Pauli string:", label)
+            debug("Obtained:", obtained)
+            debug("Expected:", expected)
+            error("Wrong Pauli expectation value", fatal=True)
+    del reg
+
+
+def test_hamiltonian(nq, rtol, atol, num_threads, prng, verbose):
+    """Compare hamiltonian expectation values with the sum of its terms."""
+    reg = random_registry(nq, num_threads, prng, verbose)
+    psi = doki_to_np(reg, nq, verbose)[:, 0]
+    # Few different X masks so that groups have several terms
+    x_choices = [random_pauli(nq, prng)[1] for _ in range(3)]
+    terms = []
+    expected = []
+    for _ in range(4 * nq + 4):
+        label, _, z_mask = random_pauli(nq, prng)
+        x_mask = x_choices[int(prng.integers(0, len(x_choices)))]
+        label = "".join("IZXY"[((x_mask >> q) & 1) * 2 + ((z_mask >> q) & 1)]
+                        for q in range(nq))
+        coeff = float(prng.random() * 2 - 1)
+        terms.append((x_mask, z_mask, coeff))
+        expected.append(coeff * (psi.conj() @ apply_pauli_np(psi, label)))
+    ham = doki.hamiltonian_new(nq, terms, verbose)
+    h_nq, h_terms, h_groups = doki.hamiltonian_info(ham, verbose)
+    if h_nq != nq or h_terms != len(terms) \
+            or h_groups != len(set(x for x, _, _ in terms)):
+        error("Wrong hamiltonian grouping", fatal=True)
+    energy, values = doki.registry_expectation_hamiltonian(reg, ham, True,
+                                                           num_threads,
+                                                           verbose)
+    only_energy, none = doki.registry_expectation_hamiltonian(reg, ham,
+                                                              False,
+                                                              num_threads,
+                                                              verbose)
+    if not np.allclose(values, expected, rtol=rtol, atol=atol) \
+            or not np.allclose(energy, sum(expected), rtol=rtol, atol=atol) \
+            or only_energy != energy or none is not None \
+            or abs(energy.imag) > atol:
+        debug("Obtained:", energy, values)
+        debug("Expected:", sum(expected), expected)
+        error("Wrong hamiltonian expectation value", fatal=True)
+    del reg
+
+
+def main(min_qubits, max_qubits, num_threads, prng, verbose):
+    """Execute all tests."""
+    rtol = 0
+    atol = 1e-12
+    a = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        test_pauli(nq, rtol, atol, num_threads, prng, verbose)
+        test_hamiltonian(nq, rtol, atol, num_threads, prng, verbose)
+    b = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {b - a}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="ExpectationTests",
+                                     description="Checks the expectation values of Pauli strings and hamiltonians")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    args = parser.parse_args()
+
+    print("Expectation value tests:")
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.num_threads, prng,
+         args.verbose)
@@ -0,0 +1,208 @@
+"""Factorized registry tests."""
+import argparse
+import doki as doki
+import numpy as np
+import time as t
+
+from one_gate_tests import U_doki
+from reg_creation_tests import doki_to_np
+from shard_tests import random_unitary
+from timed_test import debug, error, init_args
+
+
+def factor_to_np(freg, nq, verbose):
+    """Return numpy array with the factorized registry's column vector."""
+    return np.transpose(np.array([doki.registry_factor_get(freg, i, verbose)
+                                  for i in range(2**nq)], ndmin=2))
+
+
+def check_equal(freg, reg, nq, num_threads, verbose, msg):
+    """Check that the factorized and regular registries match."""
+    rtol = 0
+    atol = 1e-12
+    f_np = factor_to_np(freg, nq, verbose)
+    r_np = doki_to_np(reg, nq, verbose)
+    g_reg = doki.registry_factor_gather(freg, num_threads, verbose)
+    g_np = doki_to_np(g_reg, nq, verbose)
+    if not np.allclose(f_np, r_np, rtol=rtol, atol=atol) \
+            or not np.allclose(g_np, r_np, rtol=rtol, atol=atol):
+        debug("layout:", doki.registry_factor_layout(freg, verbose))
+        debug("factorized:", f_np)
+        debug("gathered:", g_np)
+        debug("expected:", r_np)
+        error(msg, fatal=True)
+
+
+def random_gate(nq, prng, verbose):
+    """Return a random gate with its targets, controls and anticontrols."""
+    nt = 2 if nq >= 2 and prng.random() < 0.3 else 1
+    qubits = [int(q) for q in prng.permutation(nq)]
+    targets = qubits[:nt]
+    rest = qubits[nt:]
+    controls = set(rest[:int(prng.integers(0, min(1, len(rest)) + 1))])
+    rest = rest[len(controls):]
+    anticontrols = set(rest[:int(prng.integers(0, min(1, len(rest)) + 1))]
+                       if prng.random() < 0.3 else [])
+    if nt == 1:
+        gate = U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False, verbose)
+    else:
+        gate = doki.gate_new(nt, random_unitary(nt, prng).tolist(), verbose)
+    return gate, targets, controls, anticontrols
+
+
+def test_circuit(nq, num_threads, prng, verbose):
+    """Apply random gates to both registries and compare the results."""
+    freg = doki.registry_factor_new(nq, verbose)
+    reg = doki.registry_new(nq, verbose)
+    check_equal(freg, reg, nq, num_threads, verbose, "Error creating registry")
+    for step in range(2 * nq):
+        gate, targets, controls, anticontrols = random_gate(nq, prng, verbose)
+        doki.registry_factor_apply(freg, gate, targets, controls,
+                                   anticontrols, num_threads, verbose)
+        reg = doki.registry_apply(reg, gate, targets, controls, anticontrols,
+                                  num_threads, verbose)
+        check_equal(freg, reg, nq, num_threads, verbose,
+                    f"Error applying gate at step {step}")
+        layout = doki.registry_factor_layout(freg, verbose)
+        if sorted(q for cluster in layout for q in cluster) \
+                != list(range(nq)):
+            debug("layout:", layout)
+            error("Every qubit must be in exactly one cluster", fatal=True)
+    for q in range(nq):
+        f_prob = doki.registry_factor_prob(freg, q, num_threads, verbose)
+        r_prob = doki.registry_prob(reg, q, num_threads, verbose)
+        if not np.allclose(f_prob, r_prob, rtol=0, atol=1e-12):
+            debug("factorized:", f_prob)
+            debug("expected:", r_prob)
+            error("Error calculating probability", fatal=True)
+    for _ in range(3):
+        qubits = [int(q) for q in
+                  prng.permutation(nq)[:int(prng.integers(1, nq + 1))]]
+        rolls = prng.random(len(qubits)).tolist()
+        before = doki_to_np(reg, nq, verbose)[:, 0]
+        results = doki.registry_factor_measure(freg, qubits, rolls,
+                                               num_threads, verbose)
+        # The factorized registry must hold the projection of the state
+        keep = np.array([all(((i >> q) & 1) == r
+                             for q, r in zip(qubits, results))
+                         for i in range(2**nq)])
+        expected = np.where(keep, before, 0)
+        norm = np.linalg.norm(expected)
+        if norm == 0:
+            error("Impossible measurement outcome", fatal=True)
+        expected /= norm
+        after = factor_to_np(freg, nq, verbose)[:, 0]
+        if not np.allclose(abs(np.vdot(expected, after)), 1, rtol=0,
+                           atol=1e-12):
+            debug("qubits:", qubits, "results:", results)
+            debug("factorized:", after)
+            debug("expected:", expected)
+            error("Error measuring qubits", fatal=True)
+        layout = doki.registry_factor_layout(freg, verbose)
+        if any([q] not in layout for q in qubits):
+            debug("layout:", layout)
+            error("Measured qubits were not split", fatal=True)
+        reg = doki.registry_new_data(nq, after, verbose)
+
+
+def test_clusters(nq, num_threads, prng, verbose):
+    """Check that a wide registry only pays for its clusters."""
+    freg = doki.registry_factor_new(nq, verbose)
+    h = U_doki(np.pi / 2, 0, np.pi, False, verbose)
+    x = doki.gate_new(1, [[0, 1], [1, 0]], verbose)
+    # GHZ states of 4 qubits on disjoint groups
+    for base in range(0, nq - 3, 4):
+        doki.registry_factor_apply(freg, h, [base], None, None, num_threads,
+                                   verbose)
+        for q in range(base + 1, base + 4):
+            doki.registry_factor_apply(freg, x, [q], {base}, None,
+                                       num_threads, verbose)
+    layout = doki.registry_factor_layout(freg, verbose)
+    sizes = sorted(len(cluster) for cluster in layout)
+    if sizes != sorted([4] * (nq // 4) + [1] * (nq % 4)):
+        debug("layout:", layout)
+        error("Wrong clusters", fatal=True)
+    if doki.registry_factor_mem(freg, verbose) > 1024 * nq:
+        debug("memory:", doki.registry_factor_mem(freg, verbose))
+        error("Memory is not the sum of the clusters", fatal=True)
+    for q in range(nq):
+        prob = doki.registry_factor_prob(freg, q, num_threads, verbose)
+        if not np.allclose(prob, 0.5 if q < nq - nq % 4 else 0):
+            error("Wrong probability in a wide registry", fatal=True)
+    results = doki.registry_factor_measure(freg, list(range(0, nq - 3, 4)),
+                                           prng.random(nq // 4).tolist(),
+                                           num_threads, verbose)
+    for k, r in enumerate(results):
+        for q in range(4 * k + 1, 4 * k + 4):
+            prob = doki.registry_factor_prob(freg, q, num_threads, verbose)
+            if not np.allclose(prob, 1 if r else 0):
+                error("Measurement did not collapse its cluster",
+                      fatal=True)
+    for args in (([0, 0], None), ([0], {0}), ([nq], None)):
+        try:
+            doki.registry_factor_apply(freg, h, args[0], args[1], None,
+                                       num_threads, verbose)
+            error("Wrong qubits accepted", fatal=True)
+        except doki.error:
+            pass
+
+
+def test_autosplit(num_threads, prng, verbose):
+    """Check that measured clusters are split when they become separable."""
+    h = U_doki(np.pi / 2, 0, np.pi, False, verbose)
+    x = doki.gate_new(1, [[0, 1], [1, 0]], verbose)
+    for tol in (-1, 1e-12):
+        freg = doki.registry_factor_new(5, verbose)
+        doki.registry_factor_autosplit(freg, tol, verbose)
+        # GHZ on 0, 1, 2 and a Bell pair on 3, 4 flipped by qubit 0
+        doki.registry_factor_apply(freg, h, [0], None, None, num_threads,
+                                   verbose)
+        doki.registry_factor_apply(freg, h, [3], None, None, num_threads,
+                                   verbose)
+        for target, control in ((1, 0), (2, 0), (4, 3), (3, 0)):
+            doki.registry_factor_apply(freg, x, [target], {control}, None,
+                                       num_threads, verbose)
+        before = factor_to_np(freg, 5, verbose)[:, 0]
+        result, = doki.registry_factor_measure(freg, [0], [prng.random()],
+                                               num_threads, verbose)
+        keep = np.array([(i & 1) == result for i in range(32)])
+        expected = np.where(keep, before, 0)
+        expected /= np.linalg.norm(expected)
+        after = factor_to_np(freg, 5, verbose)[:, 0]
+        if not np.allclose(abs(np.vdot(expected, after)), 1, rtol=0,
+                           atol=1e-12):
+            debug("factorized:", after)
+            debug("expected:", expected)
+            error("Error measuring with automatic splits", fatal=True)
+        layout = sorted(sorted(cluster) for cluster in
+                        doki.registry_factor_layout(freg, verbose))
+        if tol < 0 and layout != [[0], [1, 2, 3, 4]] \
+                or tol >= 0 and layout != [[0], [1], [2], [3, 4]]:
+            debug("layout:", layout)
+            error("Wrong clusters after measuring", fatal=True)
+
+
+def main(min_qubits, max_qubits, num_threads, prng, verbose):
+    """Execute all tests."""
+    a = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        test_circuit(nq, num_threads, prng, verbose)
+    test_clusters(200, num_threads, prng, verbose)
+    test_autosplit(num_threads, prng, verbose)
+    b = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {b - a}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="FactorTests",
+                                     description="Checks that factorized registries behave like regular ones")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    args = parser.parse_args()
+
+    print("Factorized registry tests:")
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.num_threads, prng, args.verbose)
@@ -0,0 +1,105 @@
+"""Functional matrix product evaluation times."""
+import argparse
+import doki
+import importlib.util
+import numpy as np
+import time as t
+
+from funmatrix_tests import random_matrix
+from timed_test import debug, error, init_args
+
+
+def load_reference(path):
+    """Return a doki module built from another version of the sources."""
+    spec = importlib.util.spec_from_file_location("doki", path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+def product_trees(module, mats_np, verbose):
+    """Return a product of products of the matrices and its partial trace."""
+    mats = [module.funmatrix_create(m.tolist(), verbose) for m in mats_np]
+    fm = module.funmatrix_matmul(module.funmatrix_matmul(mats[0], mats[1],
+                                                         verbose),
+                                 mats[2], verbose)
+    return fm, module.funmatrix_partialtrace(fm, 0, verbose)
+
+
+def by_element(module, fm, size, verbose):
+    """Return numpy array with every element of fm, one by one."""
+    return np.array([[module.funmatrix_get(fm, i, j, verbose)
+                      for j in range(size)] for i in range(size)],
+                    dtype=complex)
+
+
+def main(min_qubits, max_qubits, num_threads, reference, prng, verbose):
+    """Time the evaluation of products element by element and by tiles.
+
+    getitem on a product evaluates its operands by panels too, so the
+    element by element times only show the cost of the old recursive
+    evaluation when they come from a reference build of doki.
+    """
+    names = ("product", "trace")
+    labels = ("reference by element", "reference tiled", "by element",
+              "tiled")
+    times = np.full((2, 4, max_qubits + 1 - min_qubits), np.nan)
+    for num_qubits in range(min_qubits, max_qubits + 1):
+        debug(f"\tChecking time needed with {num_qubits} qubits...")
+        size = 2**num_qubits
+        mats_np = [random_matrix(size, size, prng) for _ in range(3)]
+        expected = mats_np[0] @ mats_np[1] @ mats_np[2]
+        expected = (expected, expected[::2, ::2] + expected[1::2, 1::2])
+        sizes = (size, size // 2)
+        trees = product_trees(doki, mats_np, verbose)
+        if reference is not None:
+            ref_trees = product_trees(reference, mats_np, verbose)
+        for k, fm in enumerate(trees):
+            values = []
+            for mode, module in enumerate((reference, doki)):
+                if module is None:
+                    continue
+                tree = fm if module is doki else ref_trees[k]
+                a = t.time()
+                values.append(by_element(module, tree, sizes[k], verbose))
+                b = t.time()
+                values.append(module.funmatrix_materialize(
+                    tree, None, None, num_threads, verbose))
+                c = t.time()
+                times[k, 2 * mode, num_qubits - min_qubits] = b - a
+                times[k, 2 * mode + 1, num_qubits - min_qubits] = c - b
+            if not all(np.allclose(v, expected[k], rtol=0, atol=1e-9)
+                       for v in values):
+                debug("obtained:", values)
+                debug("expected:", expected[k])
+                error(f"Error evaluating {names[k]} with {num_qubits} "
+                      "qubits", fatal=True)
+    for k in range(2):
+        for mode in range(0 if reference is not None else 2, 4):
+            print(f"\t{names[k].capitalize()} times ({labels[mode]}):",
+                  str(times[k, mode]).replace("\n", "\n\t       "))
+        if reference is not None:
+            for mode in range(2):
+                print(f"\t{names[k].capitalize()} speedup over the "
+                      f"{labels[mode]}:",
+                      times[k, mode].sum() / times[k, 3].sum())
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="FunMatrixBench",
+                                     description="Compares the time needed to evaluate functional matrix products element by element and by tiles")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    parser.add_argument("-r", "--reference", type=str, default=None, help="path to a doki extension module built from older sources, timed element by element as the baseline")
+    args = parser.parse_args()
+
+    print("Functional matrix product times:")
+    prng = init_args(args)
+    reference = None
+    if args.reference is not None:
+        reference = load_reference(args.reference)
+    main(args.num_qubits, args.max_qubits, args.num_threads, reference, prng,
+         args.verbose)
@@ -0,0 +1,503 @@
+"""Functional matrix evaluation tests."""
+import argparse
+import doki
+import numpy as np
+import time as t
+
+from timed_test import debug, error, init_args
+
+
+def random_matrix(rows, cols, prng):
+    """Return a random complex matrix."""
+    return prng.random((rows, cols)) - 0.5 + 1j * (prng.random((rows, cols))
+                                                   - 0.5)
+
+
+def funmatrix_to_np(fm, rows, cols, verbose):
+    """Return numpy array with the chosen elements, one by one."""
+    return np.array([[doki.funmatrix_get(fm, i, j, verbose) for j in cols]
+                     for i in rows], dtype=complex).reshape(len(rows),
+                                                            len(cols))
+
+
+def random_state(num_qubits, prng, verbose):
+    """Return a registry with a random state."""
+    ket = random_matrix(2**num_qubits, 1, prng)[:, 0]
+    return doki.registry_new_data(num_qubits, ket / np.linalg.norm(ket),
+                                  verbose)
+
+
+def build_trees(num_qubits, prng, verbose):
+    """Return a list of named functional matrices of 2^num_qubits rows."""
+    size = 2**num_qubits
+    a_np = random_matrix(size, size, prng)
+    b_np = random_matrix(size, size, prng)
+    g_np = random_matrix(2, 2, prng)
+    a = doki.funmatrix_create(a_np.tolist(), verbose)
+    b = doki.funmatrix_create(b_np.tolist(), verbose)
+    ket = doki.funmatrix_statezero(num_qubits, verbose)
+    g = doki.funmatrix_create(g_np.tolist(), verbose)
+    scalar = complex(*(prng.random(2) - 0.5))
+    trees = [("leaf", a, a_np),
+             ("add", doki.funmatrix_add(a, b, verbose), a_np + b_np),
+             ("sub", doki.funmatrix_sub(a, b, verbose), a_np - b_np),
+             ("scalar", doki.funmatrix_scalar_mul(a, scalar, verbose),
+              scalar * a_np),
+             ("matmul", doki.funmatrix_matmul(a, b, verbose), a_np @ b_np),
+             ("rectangular", doki.funmatrix_matmul(a, ket, verbose),
+              a_np[:, :1]),
+             ("ewmul", doki.funmatrix_ewmul(a, b, verbose), a_np * b_np),
+             ("transpose", doki.funmatrix_transpose(a, verbose), a_np.T),
+             ("dagger", doki.funmatrix_dagger(
+                 doki.funmatrix_matmul(a, b, verbose), verbose),
+              (a_np @ b_np).conj().T),
+             ("identity", doki.funmatrix_identity(num_qubits, verbose),
+              np.eye(size)),
+             ("identities", doki.funmatrix_matmul(
+                 doki.funmatrix_identity(num_qubits, verbose),
+                 doki.funmatrix_matmul(a, doki.funmatrix_identity(
+                     num_qubits, verbose), verbose), verbose), a_np),
+             ("scaled dagger", doki.funmatrix_dagger(
+                 doki.funmatrix_scalar_mul(doki.funmatrix_sub(a, b, verbose),
+                                           scalar, verbose), verbose),
+              np.conj(scalar) * (a_np - b_np).conj().T),
+             ("scaled operands", doki.funmatrix_add(
+                 doki.funmatrix_scalar_mul(a, scalar, verbose),
+                 doki.funmatrix_scalar_mul(b, scalar, verbose), verbose),
+              scalar * (a_np + b_np)),
+             ("hadamard", doki.funmatrix_hadamard(num_qubits, verbose),
+              None),
+             ("statezero", ket, None),
+             ("density", doki.registry_density(
+                 random_state(num_qubits, prng, verbose), verbose), None)]
+    if num_qubits > 1:
+        c_np = random_matrix(size // 2, size // 2, prng)
+        c = doki.funmatrix_create(c_np.tolist(), verbose)
+        left = int(prng.integers(0, num_qubits))
+        right = num_qubits - 1 - left
+        eyekron_np = np.kron(np.kron(np.eye(2**left), g_np),
+                             np.eye(2**right))
+        nested = doki.funmatrix_matmul(
+            doki.funmatrix_dagger(a, verbose),
+            doki.funmatrix_add(doki.funmatrix_kron(g, c, verbose),
+                               doki.funmatrix_eyekron(g, left, right,
+                                                      verbose),
+                               verbose), verbose)
+        rho = doki.registry_density(random_state(num_qubits + 1, prng,
+                                                 verbose), verbose)
+        eye = doki.funmatrix_identity(1, verbose)
+        gates_np = [random_matrix(2, 2, prng) for _ in range(3)]
+        gates = [doki.funmatrix_create(gate.tolist(), verbose)
+                 for gate in gates_np]
+        circuit = doki.funmatrix_identity(num_qubits, verbose)
+        circuit_np = np.eye(size)
+        for k, q in enumerate((left, left, (left + 1) % num_qubits)):
+            step = doki.funmatrix_eyekron(gates[k], q, num_qubits - 1 - q,
+                                          verbose)
+            circuit = doki.funmatrix_matmul(step, circuit, verbose)
+            circuit_np = np.kron(np.kron(np.eye(2**q), gates_np[k]),
+                                 np.eye(2**(num_qubits - 1 - q))) @ circuit_np
+        circuit = doki.funmatrix_dagger(
+            doki.funmatrix_scalar_mul(circuit, scalar, verbose), verbose)
+        circuit_np = np.conj(scalar) * circuit_np.conj().T
+        wrapped = doki.funmatrix_kron(
+            eye, doki.funmatrix_kron(doki.funmatrix_eyekron(g, left, 0,
+                                                            verbose),
+                                     doki.funmatrix_identity(right - 1,
+                                                             verbose),
+                                     verbose), verbose) \
+            if right > 0 else None
+        if wrapped is not None:
+            trees.append(("wrapped", doki.funmatrix_transpose(
+                wrapped, verbose), np.kron(np.eye(2**(left + 1)),
+                                          np.kron(g_np.T,
+                                                  np.eye(2**(right - 1))))))
+        trees += [("kron", doki.funmatrix_kron(g, c, verbose),
+                   np.kron(g_np, c_np)),
+                  ("eyekron", doki.funmatrix_eyekron(g, left, right,
+                                                     verbose),
+                   eyekron_np),
+                  ("nested", nested,
+                   a_np.conj().T @ (np.kron(g_np, c_np) + eyekron_np)),
+                  ("circuit", circuit, circuit_np),
+                  ("partialtrace", doki.funmatrix_partialtrace(
+                      rho, int(prng.integers(0, num_qubits + 1)), verbose),
+                   None)]
+    return trees
+
+
+def check_materialize(num_qubits, num_threads, prng, verbose):
+    """Compare bulk evaluation against element by element evaluation."""
+    size = 2**num_qubits
+    for name, fm, expected in build_trees(num_qubits, prng, verbose):
+        rows, cols = doki.funmatrix_shape(fm, verbose)
+        ranges = [(None, None), (range(rows - 1, -1, -1), range(0, cols, 2)),
+                  (range(int(prng.integers(0, rows)), rows, 3),
+                   range(cols - 1, -1, -2)),
+                  (range(0), None)]
+        for row_range, col_range in ranges:
+            row_ids = range(rows) if row_range is None else row_range
+            col_ids = range(cols) if col_range is None else col_range
+            values = doki.funmatrix_materialize(fm, row_range, col_range,
+                                                num_threads, verbose)
+            by_element = funmatrix_to_np(fm, row_ids, col_ids, verbose)
+            if values.shape != (len(row_ids), len(col_ids)) \
+                    or not np.allclose(values, by_element, rtol=0,
+                                       atol=1e-12):
+                debug("rows:", row_ids, "cols:", col_ids)
+                debug("materialized:", values)
+                debug("by element:", by_element)
+                error(f"Error materializing {name} with {num_qubits} "
+                      "qubits", fatal=True)
+            if expected is not None and not np.allclose(
+                    values, expected[np.ix_(row_ids, col_ids)], rtol=0,
+                    atol=1e-12):
+                debug("materialized:", values)
+                debug("expected:", expected)
+                error(f"Wrong value of {name} with {num_qubits} qubits",
+                      fatal=True)
+    fm = doki.funmatrix_identity(num_qubits, verbose)
+    for row_range, col_range in ((range(size + 1), None),
+                                 (None, range(-1, size)),
+                                 (list(range(size)), None)):
+        try:
+            doki.funmatrix_materialize(fm, row_range, col_range,
+                                       num_threads, verbose)
+            error("Wrong range accepted", fatal=True)
+        except doki.error:
+            pass
+
+
+def check_optimize(num_qubits, num_threads, prng, verbose):
+    """Check that rewritten matrices keep their elements."""
+    for name, fm, _ in build_trees(num_qubits, prng, verbose):
+        opt = doki.funmatrix_optimize(fm, verbose)
+        shape = doki.funmatrix_shape(fm, verbose)
+        values = doki.funmatrix_materialize(fm, None, None, num_threads,
+                                            verbose)
+        opt_values = doki.funmatrix_materialize(opt, None, None, num_threads,
+                                                verbose)
+        rows = [int(i) for i in prng.integers(0, shape[0], 4)]
+        cols = [int(j) for j in prng.integers(0, shape[1], 4)]
+        if doki.funmatrix_shape(opt, verbose) != shape \
+                or not np.allclose(opt_values, values, rtol=0, atol=1e-12) \
+                or not np.allclose(funmatrix_to_np(opt, rows, cols, verbose),
+                                   values[np.ix_(rows, cols)], rtol=0,
+                                   atol=1e-12):
+            debug("optimized:", opt_values)
+            debug("original:", values)
+            error(f"Error optimizing {name} with {num_qubits} qubits",
+                  fatal=True)
+    a = doki.funmatrix_create(random_matrix(2**num_qubits, 2**num_qubits,
+                                            prng).tolist(), verbose)
+    eye = doki.funmatrix_identity(num_qubits, verbose)
+    if doki.funmatrix_mem(doki.funmatrix_matmul(eye, a, verbose), verbose) \
+            != doki.funmatrix_mem(a, verbose):
+        error("Products with the identity were not removed", fatal=True)
+    gate = doki.funmatrix_create(random_matrix(2, 2, prng).tolist(), verbose)
+    step = doki.funmatrix_eyekron(gate, num_qubits - 1, 0, verbose)
+    circuit = doki.funmatrix_matmul(doki.funmatrix_matmul(step, step,
+                                                          verbose),
+                                    step, verbose)
+    fused = doki.funmatrix_eyekron(doki.funmatrix_matmul(
+        doki.funmatrix_matmul(gate, gate, verbose), gate, verbose),
+        num_qubits - 1, 0, verbose)
+    if doki.funmatrix_mem(doki.funmatrix_optimize(circuit, verbose), verbose) \
+            != doki.funmatrix_mem(fused, verbose):
+        error("Gates on the same qubits were not fused", fatal=True)
+
+
+def product_tree(mats, verbose):
+    """Return (M0 M1)(M2 M3) and the trace of its first qubit."""
+    fm = doki.funmatrix_matmul(doki.funmatrix_matmul(mats[0], mats[1],
+                                                     verbose),
+                               doki.funmatrix_matmul(mats[2], mats[3],
+                                                     verbose), verbose)
+    return fm, doki.funmatrix_partialtrace(fm, 0, verbose)
+
+
+def check_cache(num_qubits, num_threads, prng, verbose):
+    """Check that cached matrices keep their elements."""
+    size = 2**num_qubits
+    mats_np = [random_matrix(size, size, prng) for _ in range(4)]
+    mats = [doki.funmatrix_create(m.tolist(), verbose) for m in mats_np]
+    plain, plain_trace = product_tree(mats, verbose)
+    expected = doki.funmatrix_materialize(plain, None, None, num_threads,
+                                          verbose)
+    expected_trace = doki.funmatrix_materialize(plain_trace, None, None,
+                                                num_threads, verbose)
+    rows = [int(i) for i in prng.integers(0, size, 8)]
+    cols = [int(j) for j in prng.integers(0, size, 8)]
+    block = 2**14 + 64
+    for budget in (1 << 20, block, 0):
+        fm, trace = product_tree(mats, verbose)
+        mem = doki.funmatrix_mem(fm, verbose)
+        doki.funmatrix_cache(fm, budget, verbose)
+        for _ in range(2):
+            values = doki.funmatrix_materialize(fm, None, None, num_threads,
+                                                verbose)
+            trace_values = doki.funmatrix_materialize(trace, None, None,
+                                                      num_threads, verbose)
+            by_element = funmatrix_to_np(fm, rows, cols, verbose)
+            if not np.allclose(values, expected, rtol=0, atol=1e-12) \
+                    or not np.allclose(trace_values, expected_trace,
+                                       rtol=0, atol=1e-12) \
+                    or not np.allclose(by_element,
+                                       expected[np.ix_(rows, cols)],
+                                       rtol=0, atol=1e-12):
+                debug("budget:", budget)
+                debug("cached:", values)
+                debug("expected:", expected)
+                error(f"Error evaluating a cached matrix with {num_qubits} "
+                      "qubits", fatal=True)
+        hits, misses, evictions, blocks, used = \
+            doki.funmatrix_cache_stats(fm, verbose)
+        if budget == 0 and (hits, misses, blocks, used) != (0, 0, 0, 0):
+            error("Disabled caches were used", fatal=True)
+        if budget > 0 and (hits == 0 or misses == 0 or blocks == 0
+                           or used > 3 * budget
+                           or doki.funmatrix_mem(fm, verbose) < mem + used):
+            debug("stats:", (hits, misses, evictions, blocks, used))
+            error("Wrong cache statistics", fatal=True)
+        if budget == block and (blocks > 3 or size > 32 and evictions == 0):
+            debug("stats:", (hits, misses, evictions, blocks, used))
+            error("The cache budget was not respected", fatal=True)
+        doki.funmatrix_cache(fm, 0, verbose)
+        if doki.funmatrix_cache_stats(fm, verbose)[3] != 0:
+            error("Disabling the caches kept their blocks", fatal=True)
+
+
+
+def check_compile(num_qubits, num_threads, prng, verbose):
+    """Compare compiled programs against element by element evaluation."""
+    for name, fm, _ in build_trees(num_qubits, prng, verbose):
+        rows, cols = doki.funmatrix_shape(fm, verbose)
+        program = doki.funmatrix_compile(fm, verbose)
+        row_ids, col_ids = np.meshgrid(range(rows), range(cols),
+                                       indexing="ij")
+        row_ids = row_ids.ravel()
+        col_ids = col_ids.ravel()
+        shuffle = prng.permutation(rows * cols)
+        row_ids = np.concatenate((row_ids, row_ids[shuffle]))
+        col_ids = np.concatenate((col_ids, col_ids[shuffle]))
+        expected = funmatrix_to_np(fm, range(rows), range(cols),
+                                   verbose).ravel()
+        expected = np.concatenate((expected, expected[shuffle]))
+        interpreted = doki.funmatrix_eval(fm, row_ids, col_ids, num_threads,
+                                          verbose)
+        # The program keeps the matrix alive
+        del fm
+        compiled = doki.funmatrix_eval(program, row_ids, col_ids,
+                                       num_threads, verbose)
+        if not np.allclose(compiled, expected, rtol=0, atol=1e-12) \
+                or not np.allclose(interpreted, expected, rtol=0,
+                                   atol=1e-12):
+            debug("compiled:", compiled)
+            debug("interpreted:", interpreted)
+            debug("expected:", expected)
+            error(f"Error evaluating compiled {name} with {num_qubits} "
+                  "qubits", fatal=True)
+        for i, j in ((rows, 0), (0, cols), (-1, 0)):
+            try:
+                doki.funmatrix_eval(program, [0, i], [0, j], num_threads,
+                                    verbose)
+                error(f"Element out of bounds accepted by {name}",
+                      fatal=True)
+            except doki.error:
+                pass
+        if len(doki.funmatrix_eval(program, [], [], num_threads,
+                                   verbose)) != 0:
+            error("Error evaluating an empty list", fatal=True)
+
+
+def check_big(num_qubits, num_threads, prng, verbose):
+    """Check a product of products spanning several tiles."""
+    size = 2**num_qubits
+    mats_np = [random_matrix(size, size, prng) for _ in range(3)]
+    mats = [doki.funmatrix_create(m.tolist(), verbose) for m in mats_np]
+    fm = doki.funmatrix_matmul(doki.funmatrix_matmul(mats[0], mats[1],
+                                                     verbose),
+                               doki.funmatrix_dagger(mats[2], verbose),
+                               verbose)
+    expected = mats_np[0] @ mats_np[1] @ mats_np[2].conj().T
+    values = doki.funmatrix_materialize(fm, None, None, num_threads, verbose)
+    if not np.allclose(values, expected, rtol=0, atol=1e-9):
+        debug("materialized:", values)
+        debug("expected:", expected)
+        error(f"Error materializing {num_qubits} qubit product", fatal=True)
+
+
+def random_sparse(rows, cols, density, prng):
+    """Return the CSR arrays of a random sparse matrix and its value."""
+    dense = np.where(prng.random((rows, cols)) < density,
+                     random_matrix(rows, cols, prng), 0)
+    row_ids, col_ids = np.nonzero(dense)
+    indptr = np.searchsorted(row_ids, np.arange(rows + 1))
+    return (indptr, col_ids, dense[row_ids, col_ids]), dense
+
+
+def check_sparse(num_qubits, num_threads, prng, verbose):
+    """Compare sparse matrices and their operations against numpy."""
+    size = 2**num_qubits
+    (indptr, indices, data), dense = random_sparse(size, size, 0.3, prng)
+    csr = doki.funmatrix_csr(size, size, indptr, indices, data, verbose)
+    # Unsorted rows with repeated elements, and 32 bit indices
+    order = np.concatenate([prng.permutation(np.arange(indptr[i],
+                                                       indptr[i + 1]))
+                            for i in range(size)] + [[]]).astype(int)
+    halves = np.repeat(data[order] / 2, 2)
+    counts = np.diff(indptr) * 2
+    unsorted = doki.funmatrix_csr(size, size,
+                                  np.concatenate(([0], np.cumsum(counts))),
+                                  np.repeat(indices[order],
+                                            2).astype(np.int32),
+                                  halves, verbose)
+    row_ids = np.repeat(np.arange(size), np.diff(indptr))
+    shuffle = prng.permutation(len(data))
+    coo = doki.funmatrix_coo(size, size,
+                             np.concatenate((row_ids[shuffle], [0])),
+                             np.concatenate((indices[shuffle], [0])),
+                             np.concatenate((data[shuffle], [1])), verbose)
+    dense_coo = dense.copy()
+    dense_coo[0, 0] += 1
+    # Writable arrays are copied, so changing them later is harmless
+    changed = (indptr.copy(), indices.copy(), data.copy())
+    kept = doki.funmatrix_csr(size, size, *changed, verbose)
+    changed[0][1:] = len(data)
+    changed[1][:] = 4 * size
+    changed[2][:] = 0
+    if not all(array.flags.writeable for array in changed):
+        error("Arrays of the caller made read-only", fatal=True)
+    other_np = random_matrix(size, size, prng)
+    other = doki.funmatrix_create(other_np.tolist(), verbose)
+    trees = [("CSR", csr, dense), ("unsorted CSR", unsorted, dense),
+             ("COO", coo, dense_coo), ("CSR of changed arrays", kept, dense),
+             ("transposed CSR", doki.funmatrix_transpose(csr, verbose),
+              dense.T),
+             ("sparse product",
+              doki.funmatrix_matmul(doki.funmatrix_dagger(csr, verbose),
+                                    other, verbose),
+              dense.conj().T @ other_np),
+             ("sparse by sparse product",
+              doki.funmatrix_matmul(doki.funmatrix_scalar_mul(coo, 2j,
+                                                              verbose),
+                                    csr, verbose),
+              2j * dense_coo @ dense),
+             ("dense by sparse product",
+              doki.funmatrix_matmul(other, unsorted, verbose),
+              other_np @ dense),
+             ("sparse Kronecker product",
+              doki.funmatrix_kron(csr, coo, verbose),
+              np.kron(dense, dense_coo))]
+    if num_qubits > 1:
+        trees.append(("sparse partial trace",
+                      doki.funmatrix_partialtrace(doki.funmatrix_matmul(
+                          csr, other, verbose), 0, verbose),
+                      (dense @ other_np)[::2, ::2]
+                      + (dense @ other_np)[1::2, 1::2]))
+    for name, fm, expected in trees:
+        rows, cols = expected.shape
+        by_element = funmatrix_to_np(fm, range(rows), range(cols), verbose)
+        tiled = doki.funmatrix_materialize(fm, None, None, num_threads,
+                                           verbose)
+        if not np.allclose(by_element, expected, rtol=0, atol=1e-12) \
+                or not np.allclose(tiled, expected, rtol=0, atol=1e-12):
+            debug("by element:", by_element)
+            debug("tiled:", tiled)
+            debug("expected:", expected)
+            error(f"Error evaluating {name} with {num_qubits} qubits",
+                  fatal=True)
+        trace = doki.funmatrix_trace(fm, verbose)
+        if not np.allclose(trace, np.trace(expected), rtol=0, atol=1e-10):
+            debug("trace:", trace, "expected:", np.trace(expected))
+            error(f"Error tracing {name} with {num_qubits} qubits",
+                  fatal=True)
+    # The random matrix can be empty, so the wrong arrays come from X, with
+    # an element in each row
+    indptr, indices, data = np.array([0, 1, 2]), np.array([1, 0]), [1, 1]
+    for args in ((2, 2, indptr[:-1], indices, data),
+                 (2, 2, indptr, indices[:-1], data),
+                 (2, 2, indptr, indices + 2, data),
+                 (2, 2, indptr[::-1], indices, data),
+                 (0, size, [0], [], [])):
+        try:
+            doki.funmatrix_csr(*args, verbose)
+            error("Wrong CSR arrays accepted", fatal=True)
+        except doki.error:
+            pass
+    for args in ((size, size, [size], [0], [1]), (size, size, [0], [-1], [1]),
+                 (size, size, [0, 1], [0], [1])):
+        try:
+            doki.funmatrix_coo(*args, verbose)
+            error("Wrong COO triplets accepted", fatal=True)
+        except doki.error:
+            pass
+
+
+def check_huge_sparse(num_qubits, num_threads, prng, verbose):
+    """Check a sparse Hamiltonian far too big to be stored as dense."""
+    size = 2**num_qubits
+    # Z field on every qubit plus an X coupling on the first one
+    diagonal = np.array([num_qubits - 2 * bin(i).count("1")
+                         for i in range(size)], dtype=complex)
+    row_ids = np.concatenate((np.arange(size), np.arange(size)))
+    col_ids = np.concatenate((np.arange(size), np.arange(size) ^ 1))
+    values = np.concatenate((diagonal, np.full(size, 0.5, dtype=complex)))
+    h = doki.funmatrix_coo(size, size, row_ids, col_ids, values, verbose)
+    indptr = np.arange(0, 2 * size + 1, 2)
+    indices = np.sort(col_ids.reshape(2, size).T, axis=1).ravel()
+    h_csr = doki.funmatrix_csr(size, size, indptr, indices,
+                               np.where(indices == np.repeat(np.arange(size),
+                                                             2),
+                                        np.repeat(diagonal, 2), 0.5),
+                               verbose)
+    if doki.funmatrix_mem(h, verbose) > 64 * size:
+        debug("memory:", doki.funmatrix_mem(h, verbose))
+        error("Sparse matrix memory is not proportional to its nonzeros",
+              fatal=True)
+    square = doki.funmatrix_matmul(h, h_csr, verbose)
+    for i in prng.integers(0, size, 8):
+        for j in (i, i ^ 1, i ^ 2):
+            value = doki.funmatrix_get(square, int(i), int(j), verbose)
+            expected = diagonal[i]**2 + 0.25 if i == j \
+                else (diagonal[i] + diagonal[j]) / 2 if j == i ^ 1 else 0
+            if not np.allclose(value, expected, rtol=0, atol=1e-12):
+                debug("value:", value, "expected:", expected)
+                error(f"Error evaluating huge sparse product at ({i}, {j})",
+                      fatal=True)
+    trace = doki.funmatrix_trace(square, verbose)
+    if not np.allclose(trace, np.sum(diagonal**2) + size / 4, rtol=0,
+                       atol=1e-6):
+        debug("trace:", trace)
+        error("Error tracing huge sparse product", fatal=True)
+
+
+def main(min_qubits, max_qubits, num_threads, prng, verbose):
+    """Execute all tests."""
+    a = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        check_materialize(nq, num_threads, prng, verbose)
+        check_optimize(nq, num_threads, prng, verbose)
+        check_cache(nq, num_threads, prng, verbose)
+        check_compile(nq, num_threads, prng, verbose)
+        check_sparse(nq, num_threads, prng, verbose)
+    check_big(8, num_threads, prng, verbose)
+    check_huge_sparse(20, num_threads, prng, verbose)
+    check_cache(6, num_threads, prng, verbose)
+    b = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {b - a}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="FunMatrixTests",
+                                     description="Checks that functional matrices are evaluated correctly")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    args = parser.parse_args()
+
+    print("Functional matrix tests:")
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.num_threads, prng, args.verbose)
@@ -62,13 +62,128 @@ def test_random_join(nq, rtol, atol, num_threads, prng, verbose):
     del exreg
 
 
+def test_join_many(nq, rtol, atol, num_threads, prng, verbose):
+    """Test joining several registries of different sizes at once."""
+    sizes = []
+    while sum(sizes) < nq:
+        sizes.append(int(prng.integers(1, min(3, nq - sum(sizes)) + 1)))
+    regs = []
+    for size in sizes:
+        data = prng.random(2**size) * np.exp(2j * np.pi * prng.random(2**size))
+        regs.append(doki.registry_new_data(size, data / np.linalg.norm(data),
+                                           verbose))
+    # The same registry can appear more than once
+    regs.append(regs[0])
+    sizes.append(sizes[0])
+    vectors = [doki_to_np(reg, size, verbose)[:, 0]
+               for reg, size in zip(regs, sizes)]
+    expected = vectors[0]
+    sequential = regs[0]
+    for reg, vector in zip(regs[1:], vectors[1:]):
+        expected = np.kron(expected, vector)
+        sequential = doki.registry_join(sequential, reg, num_threads, verbose)
+    res = doki.registry_join_many(regs, num_threads, verbose)
+    total = sum(sizes)
+    if not np.allclose(doki_to_np(res, total, verbose), expected[:, None],
+                       rtol=rtol, atol=atol) \
+            or not np.allclose(doki_to_np(sequential, total, verbose),
+                               expected[:, None], rtol=rtol, atol=atol):
+        error("Failed multiple join comparison", fatal=True)
+    # A small registry with the highest qubits
+    small = doki.registry_join_many([regs[0], res], num_threads, verbose)
+    if not np.allclose(doki_to_np(small, sizes[0] + total, verbose)[:, 0],
+                       np.kron(vectors[0], expected), rtol=rtol, atol=atol):
+        error("Failed join with a small first registry", fatal=True)
+    single = doki.registry_join_many([res], num_threads, verbose)
+    if not np.allclose(doki_to_np(single, total, verbose),
+                       doki_to_np(res, total, verbose), rtol=rtol, atol=atol):
+        error("Failed join of a single registry", fatal=True)
+    try:
+        doki.registry_join_many([], num_threads, verbose)
+        error("Joined an empty list of registries", fatal=True)
+    except doki.error:
+        pass
+
+
+def compact(index, qubits):
+    """Return the bits of index in the positions of qubits (in order)."""
+    return sum(((index >> q) & 1) << k for k, q in enumerate(qubits))
+
+
+def test_try_split(nq, rtol, atol, num_threads, prng, verbose):
+    """Test splitting registries in two separable parts."""
+    if nq < 2:
+        return
+    subset = sorted(int(q) for q in
+                    prng.permutation(nq)[:int(prng.integers(1, nq))])
+    rest = [q for q in range(nq) if q not in subset]
+    parts = []
+    for size in (len(subset), len(rest)):
+        data = prng.random(2**size) * np.exp(2j * np.pi * prng.random(2**size))
+        # Some zeros, so the pivot is not always the first amplitude
+        data[prng.random(2**size) < 0.3] = 0
+        if not data.any():
+            data[-1] = 1
+        parts.append(data / np.linalg.norm(data))
+    state = np.array([parts[0][compact(i, subset)] * parts[1][compact(i, rest)]
+                      for i in range(2**nq)])
+    reg = doki.registry_new_data(nq, state, verbose)
+    res = doki.registry_try_split(reg, subset, 1e-12, num_threads, verbose)
+    if res is None:
+        error("Separable registry was not split", fatal=True)
+    for part, part_reg, size in zip(parts, res, (len(subset), len(rest))):
+        vector = doki_to_np(part_reg, size, verbose)[:, 0]
+        if not np.allclose(np.linalg.norm(vector), 1, rtol=rtol, atol=atol) \
+                or not np.allclose(abs(np.vdot(part, vector)), 1,
+                                   rtol=rtol, atol=atol):
+            error("Wrong part after splitting", fatal=True)
+    a = doki_to_np(res[0], len(subset), verbose)[:, 0]
+    b = doki_to_np(res[1], len(rest), verbose)[:, 0]
+    rebuilt = np.array([a[compact(i, subset)] * b[compact(i, rest)]
+                        for i in range(2**nq)])
+    if not np.allclose(rebuilt, state, rtol=rtol, atol=atol):
+        error("Parts do not rebuild the registry", fatal=True)
+    # Schmidt rank 2, with a small second coefficient
+    others = []
+    for part in parts:
+        other = prng.random(part.size) + 1j * prng.random(part.size)
+        other -= np.vdot(part, other) * part
+        others.append(other / np.linalg.norm(other))
+    other = np.array([others[0][compact(i, subset)]
+                      * others[1][compact(i, rest)] for i in range(2**nq)])
+    reg = doki.registry_new_data(nq, np.cos(1e-4) * state
+                                 + np.sin(1e-4) * other, verbose)
+    if doki.registry_try_split(reg, subset, 1e-9, num_threads,
+                               verbose) is not None:
+        error("Entangled registry was split", fatal=True)
+    if doki.registry_try_split(reg, subset, 0.1, num_threads,
+                               verbose) is None:
+        error("Tolerance was not used", fatal=True)
+    bell = np.zeros(2**nq)
+    bell[0] = bell[-1] = 1 / np.sqrt(2)
+    reg = doki.registry_new_data(nq, bell, verbose)
+    if doki.registry_try_split(reg, subset, 1e-12, num_threads,
+                               verbose) is not None:
+        error("GHZ registry was split", fatal=True)
+    for wrong in ([], list(range(nq))):
+        try:
+            doki.registry_try_split(reg, wrong, 1e-12, num_threads, verbose)
+            error("Split with an empty side", fatal=True)
+        except doki.error:
+            pass
+
+
 def main(min_qubits, max_qubits, num_threads, prng, verbose):
     """Execute all tests."""
     rtol = 0
     atol = 1e-13
     a = t.time()
-    for num_qubits in range(min_qubits, max_qubits):
+    for num_qubits in range(min_qubits, max_qubits + 1):
         test_random_join(num_qubits, rtol, atol, num_threads, prng, verbose)
+        test_join_many(num_qubits, rtol, atol, num_threads, prng, verbose)
+        test_try_split(num_qubits, rtol, atol, num_threads, prng, verbose)
+    # Big enough to be split by several threads
+    test_try_split(14, rtol, atol, num_threads, prng, verbose)
     b = t.time()
     print(f"\tPEACE AND TRANQUILITY: {b - a} s")
 
@@ -6,7 +6,7 @@ import numpy as np
 import scipy.sparse as sparse
 import time as t
 
-from one_gate_tests import apply_np, apply_gate
+from one_gate_tests import apply_np, apply_gate, U_doki
 from reg_creation_tests import gen_reg, doki_to_np
 from timed_test import debug, error, init_args
 
@@ -244,6 +244,121 @@ def check_measure_classic(num_qubits, rtol, atol, num_threads,
     del r_np
 
 
+def entangled_reg(num_qubits, num_threads, prng, verbose):
+    """Return a registry with random U gates chained by CNOTs."""
+    x_d = doki.gate_new(1, [[0, 1], [1, 0]], verbose)
+    r_doki = doki.registry_new(num_qubits, verbose)
+    for i in range(num_qubits):
+        gate = U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False, verbose)
+        r_doki = doki.registry_apply(r_doki, gate, [i], set(), set(),
+                                     num_threads, verbose)
+        if i > 0:
+            r_doki = doki.registry_apply(r_doki, x_d, [i], {i - 1}, set(),
+                                         num_threads, verbose)
+    return r_doki
+
+
+def check_single_pass(num_qubits, rtol, atol, num_threads, iterations, prng,
+                      verbose):
+    """Test that measuring a mask equals measuring its qubits one by one."""
+    r_doki = entangled_reg(num_qubits, num_threads, prng, verbose)
+    for _ in range(iterations):
+        ids = sorted((int(id) for id in prng.permutation(num_qubits)[
+            :int(prng.integers(1, num_qubits + 1))]), reverse=True)
+        mask = sum(1 << id for id in ids)
+        rolls = prng.random(len(ids)).tolist()
+        r_all, mes_all = doki.registry_measure(r_doki, mask, rolls,
+                                               num_threads, verbose)
+        r_one = r_doki
+        mes_one = [None for _ in range(num_qubits)]
+        nq = num_qubits
+        for id, roll in zip(ids, rolls):
+            r_one, mes = doki.registry_measure(r_one, 1 << id, [roll],
+                                               num_threads, verbose)
+            nq -= 1
+            mes_one[num_qubits - id - 1] = mes[nq - id]
+        if mes_all != mes_one or (nq > 0 and not np.allclose(
+                doki_to_np(r_all, nq, verbose),
+                doki_to_np(r_one, nq, verbose), rtol=rtol, atol=atol)):
+            print("Mask:", mask)
+            print("At once:", mes_all)
+            print("One by one:", mes_one)
+            error("Measuring at once differs from one by one", fatal=True)
+
+
+def check_inplace(num_qubits, rtol, atol, num_threads, iterations, prng,
+                  verbose):
+    """Test that measuring in place equals measuring into a new registry."""
+    r_doki = entangled_reg(num_qubits, num_threads, prng, verbose)
+    for _ in range(iterations):
+        ids = prng.permutation(num_qubits)[
+            :int(prng.integers(1, num_qubits + 1))]
+        mask = sum(1 << int(id) for id in ids)
+        rolls = prng.random(len(ids)).tolist()
+        r_new, mes_new = doki.registry_measure(r_doki, mask, rolls,
+                                               num_threads, verbose)
+        r_in = doki.registry_clone(r_doki, num_threads, verbose)
+        mem = doki.registry_mem(r_in, verbose)
+        mes_in = doki.registry_measure_inplace(r_in, mask, rolls,
+                                               num_threads, verbose)
+        expected = np.zeros(2**num_qubits, dtype=complex)
+        obtained = doki_to_np(r_in, num_qubits, verbose)[:, 0]
+        offset = sum(1 << q for q in range(num_qubits)
+                     if mes_in[num_qubits - q - 1])
+        if r_new is None:
+            # Only the global phase of the measured branch is left
+            expected[offset] = obtained[offset] / abs(obtained[offset])
+        else:
+            kept = [q for q in range(num_qubits) if not (mask >> q) & 1]
+            new = doki_to_np(r_new, len(kept), verbose)[:, 0]
+            for j in range(len(new)):
+                expected[offset + sum(((j >> k) & 1) << q
+                                      for k, q in enumerate(kept))] = new[j]
+        if mes_in != mes_new or not np.allclose(obtained, expected,
+                                                rtol=rtol, atol=atol):
+            print("Mask:", mask)
+            print("In place:", mes_in, obtained)
+            print("New registry:", mes_new, expected)
+            error("Measuring in place differs from measuring into a new "
+                  "registry", fatal=True)
+        if doki.registry_mem(r_in, verbose) != mem:
+            error("Registry resized after measuring in place", fatal=True)
+
+
+def check_reset(num_qubits, rtol, atol, num_threads, iterations, prng,
+                verbose):
+    """Test that a reset equals measuring and joining fresh qubits."""
+    r_doki = entangled_reg(num_qubits, num_threads, prng, verbose)
+    for _ in range(iterations):
+        ids = prng.permutation(num_qubits)[
+            :int(prng.integers(1, num_qubits + 1))]
+        mask = sum(1 << int(id) for id in ids)
+        rolls = prng.random(len(ids)).tolist()
+        r_new, mes_new = doki.registry_measure(r_doki, mask, rolls,
+                                               num_threads, verbose)
+        r_res = doki.registry_clone(r_doki, num_threads, verbose)
+        mes_res = doki.registry_reset(r_res, mask, rolls, num_threads,
+                                      verbose)
+        expected = np.zeros(2**num_qubits, dtype=complex)
+        obtained = doki_to_np(r_res, num_qubits, verbose)[:, 0]
+        if r_new is None:
+            # Only the global phase of the measured branch is left
+            expected[0] = obtained[0] / abs(obtained[0])
+        else:
+            kept = [q for q in range(num_qubits) if not (mask >> q) & 1]
+            new = doki_to_np(r_new, len(kept), verbose)[:, 0]
+            for j in range(len(new)):
+                expected[sum(((j >> k) & 1) << q
+                             for k, q in enumerate(kept))] = new[j]
+        if mes_res != mes_new or not np.allclose(obtained, expected,
+                                                 rtol=rtol, atol=atol):
+            print("Mask:", mask)
+            print("Reset:", mes_res, obtained)
+            print("Measure:", mes_new, expected)
+            error("Reset differs from measuring and adding qubits at |0>",
+                  fatal=True)
+
+
 def main(min_qubits, max_qubits, iterations, num_threads, prng, verbose):
     """Execute all tests."""
     rtol = 0
@@ -262,7 +377,18 @@ def main(min_qubits, max_qubits, iterations, num_threads, prng, verbose):
                               iterations, prng, verbose)
     d = t.time()
     gc.collect()
-    print(f"\tPEACE AND TRANQUILITY: {(b - a) + (d - c)} s")
+    print("\tSingle pass tests...")
+    e = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        check_single_pass(nq, rtol, atol, num_threads,
+                          max(1, iterations // 10), prng, verbose)
+        check_inplace(nq, rtol, atol, num_threads,
+                      max(1, iterations // 10), prng, verbose)
+        check_reset(nq, rtol, atol, num_threads, max(1, iterations // 10),
+                    prng, verbose)
+    f = t.time()
+    gc.collect()
+    print(f"\tPEACE AND TRANQUILITY: {(b - a) + (d - c) + (f - e)} s")
 
 
 if __name__ == "__main__":
@@ -102,11 +102,43 @@ def test_gates_static(num_qubits, num_threads, prng, verbose):
         del r1_doki
 
 
+def test_nonunitary(num_qubits, num_threads, prng, verbose):
+    """Apply a projector after a random gate and check renormalization."""
+    rtol = 0
+    atol = 1e-13
+    proj = np.array([[0, 0], [0, 1]], dtype=complex)
+    proj_doki = doki.gate_new(1, proj.tolist(), verbose)
+    for i in range(num_qubits):
+        angles = np.pi * (prng.random(3) * 2 - 1)
+        angles[0] = np.pi / 2
+        r_np = gen_reg(num_qubits)
+        r_doki = doki.registry_new(num_qubits, False)
+        r_np, r_doki = apply_gate(num_qubits, r_np, r_doki,
+                                  U_sparse(*angles, False),
+                                  U_doki(*angles, False, verbose), i,
+                                  num_threads, verbose)
+        r_np, r_doki = apply_gate(num_qubits, r_np, r_doki,
+                                  sparse.csr_matrix(proj), proj_doki, i,
+                                  num_threads, verbose)
+        r_np = r_np / np.linalg.norm(r_np)
+        if not np.allclose(doki_to_np(r_doki, num_qubits, verbose), r_np,
+                           rtol=rtol, atol=atol):
+            debug("i:", i)
+            debug("r_np:", r_np)
+            debug("r_doki:", doki_to_np(r_doki, num_qubits, verbose))
+            error("Error applying non unitary gate", fatal=True)
+        doki.registry_normalize(r_doki, num_threads, verbose)
+        if not np.allclose(doki_to_np(r_doki, num_qubits, verbose), r_np,
+                           rtol=rtol, atol=atol):
+            error("Error renormalizing registry", fatal=True)
+
+
 def main(min_qubits, max_qubits, num_threads, prng, verbose):
     """Execute test_gates_static once for each posible number in range."""
     a = t.time()
     for nq in range(min_qubits, max_qubits + 1):
         test_gates_static(nq, num_threads, prng, verbose)
+        test_nonunitary(nq, num_threads, prng, verbose)
     b = t.time()
 
 
@@ -0,0 +1,91 @@
+"""Parallel configuration tests."""
+import argparse
+import doki as doki
+import numpy as np
+import time as t
+
+from one_gate_tests import U_doki
+from reg_creation_tests import doki_to_np
+from timed_test import debug, error, init_args
+
+
+def run_circuit(nq, gates, num_threads, verbose):
+    """Apply the gates to every qubit of a new registry."""
+    reg = doki.registry_new(nq, verbose)
+    for i in range(nq):
+        aux = doki.registry_apply(reg, gates[i], [i], None, None,
+                                  num_threads, verbose)
+        doki.registry_del(reg, verbose)
+        reg = aux
+    return reg
+
+
+def test_config_roundtrip(verbose):
+    """Check that parallel_config_get returns what was set."""
+    old = doki.parallel_config_get(verbose)
+    for config in [(2, "dynamic", 16, 0), (-1, "guided", 0, 1 << 20),
+                   (4, "auto", 0, 5), (-1, "static", 0, 1 << 12)]:
+        doki.parallel_config_set(*config, verbose)
+        new = doki.parallel_config_get(verbose)
+        if new != config:
+            debug("expected:", config)
+            debug("obtained:", new)
+            error("Parallel configuration mismatch", fatal=True)
+    try:
+        doki.parallel_config_set(-1, "fastest", 0, 0, verbose)
+        error("Unknown schedule accepted", fatal=True)
+    except doki.error:
+        pass
+    doki.parallel_config_set(*old, verbose)
+
+
+def test_serial_threshold(nq, num_threads, prng, verbose):
+    """Check that serial and parallel executions give the same state."""
+    rtol = 0
+    atol = 1e-13
+    old = doki.parallel_config_get(verbose)
+    gates = [U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False, verbose)
+             for _ in range(nq)]
+    results = []
+    for config in [(num_threads, "static", 0, 1 << nq),
+                   (num_threads, "static", 0, 0),
+                   (num_threads, "dynamic", 1, 0),
+                   (num_threads, "guided", 0, 0)]:
+        doki.parallel_config_set(*config, verbose)
+        reg = run_circuit(nq, gates, -1, verbose)
+        results.append((config, doki_to_np(reg, nq, verbose),
+                        doki.registry_prob(reg, 0, -1, verbose)))
+        doki.registry_del(reg, verbose)
+    doki.parallel_config_set(*old, verbose)
+    for config, state, prob in results[1:]:
+        if not np.allclose(state, results[0][1], rtol=rtol, atol=atol) \
+                or not np.allclose(prob, results[0][2], rtol=rtol, atol=atol):
+            debug("config:", config)
+            debug("serial:", results[0][1])
+            debug("parallel:", state)
+            error("Parallel result differs from serial one", fatal=True)
+
+
+def main(min_qubits, max_qubits, num_threads, prng, verbose):
+    """Execute all tests."""
+    a = t.time()
+    test_config_roundtrip(verbose)
+    for nq in range(min_qubits, max_qubits + 1):
+        test_serial_threshold(nq, num_threads, prng, verbose)
+    b = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {b - a}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="ParallelConfigTests",
+                                     description="Checks that the parallel configuration is honoured and does not change the results")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    args = parser.parse_args()
+
+    print("Parallel configuration tests:")
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.num_threads, prng, args.verbose)
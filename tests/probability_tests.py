@@ -41,13 +41,105 @@ def test_probability(nq, rtol, atol, num_threads, verbose):
     del reg
 
 
-def main(min_qubits, max_qubits, num_threads, verbose):
+def marginal_np(probs, nq, qubits, keep_order=False):
+    """Return the chances of each outcome of the specified qubits."""
+    if not keep_order:
+        qubits = sorted(qubits)
+    marginal = np.zeros(2**len(qubits))
+    for i in range(2**nq):
+        outcome = sum(((i >> q) & 1) << j for j, q in enumerate(qubits))
+        marginal[outcome] += probs[i]
+    return marginal
+
+
+def test_probabilities(nq, rtol, atol, num_threads, prng, verbose):
+    """Test the whole distribution of an entangled nq qubits registry."""
+    step = 2 * np.pi / nq
+    x = doki.gate_new(1, [[0, 1], [1, 0]], verbose)
+    reg = doki.registry_new(nq, False)
+    for i in range(nq):
+        reg = doki.registry_apply(reg, Ry_doki(step * i + 0.3, verbose),
+                                  [i], None, None, num_threads, verbose)
+        if i > 0:
+            reg = doki.registry_apply(reg, x, [i], {i - 1}, set(),
+                                      num_threads, verbose)
+    probs = np.abs(doki_to_np(reg, nq, verbose)[:, 0])**2
+    odds = doki.registry_probabilities(reg, None, num_threads, verbose)
+    if odds.dtype != np.float64 or not np.allclose(odds, probs, rtol=rtol,
+                                                   atol=atol):
+        debug("Obtained:", odds)
+        debug("Expected:", probs)
+        error("Failed full distribution check", fatal=True)
+    if nq <= 6:
+        subsets = [prng.permutation([q for q in range(nq) if (s >> q) & 1])
+                   .tolist() for s in range(2**nq)]
+    else:
+        subsets = [prng.permutation(nq)[:int(prng.integers(1, nq + 1))]
+                   .tolist() for _ in range(20)]
+        # Only the top qubits: runs longer than the share of each thread
+        subsets += [[nq - 1], [nq - 1, nq - 2]]
+    for qubits in subsets:
+        odds = doki.registry_probabilities(reg, set(qubits), num_threads,
+                                           verbose)
+        expected = marginal_np(probs, nq, qubits)
+        if not np.allclose(odds, expected, rtol=rtol, atol=atol):
+            debug("Qubits:", qubits)
+            debug("Obtained:", odds)
+            debug("Expected:", expected)
+            error("Failed marginal distribution check", fatal=True)
+        odds = doki.registry_joint_prob(reg, qubits, num_threads, verbose)
+        expected = marginal_np(probs, nq, qubits, keep_order=True)
+        if not np.allclose(odds, expected, rtol=rtol, atol=atol):
+            debug("Qubits:", qubits)
+            debug("Obtained:", odds)
+            debug("Expected:", expected)
+            error("Failed joint distribution check", fatal=True)
+    del reg
+
+
+def test_topk(nq, rtol, atol, num_threads, prng, verbose):
+    """Test the most probable basis states of a registry with ties."""
+    size = 2**nq
+    # Few magnitudes and phases multiple of pi/2, so ties are exact
+    levels = np.array([0, 1, 2, 3, 5])
+    data = levels[prng.integers(0, len(levels), size)] \
+        * np.array([1, -1, 1j, -1j])[prng.integers(0, 4, size)]
+    data[0] = 5
+    reg = doki.registry_new_data(nq, data / np.linalg.norm(data), verbose)
+    amps = doki_to_np(reg, nq, verbose)[:, 0]
+    probs = amps.real**2 + amps.imag**2
+    order = np.lexsort((np.arange(size), -probs))
+    cuts = [(level + 0.5)**2 / np.sum(np.abs(data)**2) for level in levels]
+    for k in sorted({0, 1, 5, size // 2, size, size + 3, -1}):
+        for threshold in [None] + cuts:
+            ids, values, odds, count = doki.registry_topk(reg, k, threshold,
+                                                          num_threads,
+                                                          verbose)
+            above = order if threshold is None \
+                else order[probs[order] > threshold]
+            expected = above if k == -1 else above[:k]
+            if ids.dtype != np.int64 or not np.array_equal(ids, expected) \
+                    or count != len(above) \
+                    or not np.allclose(values, amps[expected], rtol=rtol,
+                                       atol=atol) \
+                    or not np.allclose(odds, probs[expected], rtol=rtol,
+                                       atol=atol):
+                debug("k:", k, "threshold:", threshold)
+                debug("Obtained:", ids, count)
+                debug("Expected:", expected, len(above))
+                error("Failed top-k check", fatal=True)
+    del reg
+
+
+def main(min_qubits, max_qubits, num_threads, prng, verbose):
     """Execute all tests."""
     rtol = 0
     atol = 1e-13
     a = t.time()
     for nq in range(min_qubits, max_qubits + 1):
         test_probability(nq, rtol, atol, num_threads, verbose)
+        test_probabilities(nq, rtol, atol, num_threads, prng, verbose)
+        test_topk(nq, rtol, atol, num_threads, prng, verbose)
     b = t.time()
     print(f"\tPEACE AND TRANQUILITY: {b - a}")
 
@@ -60,9 +152,10 @@ if __name__ == "__main__":
     parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
     parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
     # parser.add_argument("-i", "--iterations", type=int, required=True, help="how many times the test target has to be executed")
-    # parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
     args = parser.parse_args()
 
     print("Probability method tests:")
     prng = init_args(args)
-    main(args.num_qubits, args.max_qubits, args.num_threads, args.verbose)
+    main(args.num_qubits, args.max_qubits, args.num_threads, prng,
+         args.verbose)
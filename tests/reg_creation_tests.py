@@ -23,9 +23,8 @@ def gen_reg(nq, with_data=False):
 
 def doki_to_np(r_doki, num_qubits, verbose, canonical=False):
     """Return numpy array with r_doki's column vector."""
-    return np.transpose(np.array([doki.registry_get(r_doki, i, canonical,
-                                                    verbose)
-                                  for i in range(2**num_qubits)], ndmin=2))
+    return doki.registry_get_many(r_doki, range(2**num_qubits), canonical,
+                                  -1, verbose).reshape(-1, 1)
 
 
 def check_generation(num_qubits, verbose, with_data=False, with_lists=False):
@@ -44,6 +43,41 @@ def check_generation(num_qubits, verbose, with_data=False, with_lists=False):
         error("Error comparing results of two qubit gate", fatal=True)
 
 
+def check_get_many(num_qubits, first, verbose):
+    """Compare registry_get_many with registry_get, index by index."""
+    size = 2**num_qubits
+    data = np.random.rand(size) * np.exp(2j * np.pi * np.random.rand(size))
+    data[:first] = 0
+    data = data / np.linalg.norm(data)
+    r_doki = doki.registry_new_data(num_qubits, data, verbose)
+    ids = list(np.random.permutation(size)[:size // 2 + 1])
+    # The phase cache is filled by the first canonical read
+    for canonical in (True, False):
+        for num_threads in (1, -1):
+            expected = [doki.registry_get(r_doki, i, canonical, verbose)
+                        for i in range(size)]
+            for indices in (range(size), range(size - 1, -1, -2), ids, []):
+                obtained = doki.registry_get_many(r_doki, indices,
+                                                  canonical, num_threads,
+                                                  verbose)
+                if obtained.dtype != complex or not np.array_equal(
+                        obtained, [expected[i] for i in indices]):
+                    error("Error comparing registry_get_many with "
+                          "registry_get", fatal=True)
+    r_doki = doki.registry_new_data(num_qubits, data, verbose)
+    if not np.array_equal(doki_to_np(r_doki, num_qubits, verbose, True),
+                          doki_to_np(r_doki, num_qubits, verbose, True)) \
+            or abs(doki_to_np(r_doki, num_qubits, verbose,
+                              True)[first, 0].imag) > 1e-15:
+        error("Wrong global phase", fatal=True)
+    for indices in (range(size + 1), range(-1, size), [size], [-1]):
+        try:
+            doki.registry_get_many(r_doki, indices, False, -1, verbose)
+            error("Index out of range accepted", fatal=True)
+        except doki.error:
+            pass
+
+
 def check_range(min_qubits, max_qubits, verbose, with_data=False, with_lists=False):
     """Call check_generation for the specified range of qubits."""
     for nq in range(min_qubits, max_qubits + 1):
@@ -64,7 +98,14 @@ def main(min_qubits, max_qubits, verbose):
     e = t.time()
     res = check_range(min_qubits, max_qubits, verbose, with_data=True)
     f = t.time()
-    print(f"\tPEACE AND TRANQUILITY: {(b - a) + (d - c) + (f - e)}")
+    print("\tBulk read tests...")
+    g = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        check_get_many(nq, 2**nq // 2, verbose)
+    # First non-zero amplitude outside the first block of the phase search
+    check_get_many(17, 70000, verbose)
+    h = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {(b - a) + (d - c) + (f - e) + (h - g)}")
 
 
 if __name__ == "__main__":
@@ -0,0 +1,86 @@
+"""Sampling tests."""
+import argparse
+import doki as doki
+import numpy as np
+import time as t
+
+from one_gate_tests import U_doki
+from reg_creation_tests import doki_to_np
+from timed_test import debug, error, init_args
+
+
+def random_registry(nq, num_threads, prng, verbose):
+    """Return a registry with random gates and a few zero amplitudes."""
+    reg = doki.registry_new(nq, verbose)
+    for i in range(nq - 1):
+        gate = U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False, verbose)
+        aux = doki.registry_apply(reg, gate, [i], None, None, num_threads,
+                                  verbose)
+        doki.registry_del(reg, verbose)
+        reg = aux
+    return reg
+
+
+def expected_marginal(reg, nq, qubits, verbose):
+    """Return the chances of each outcome of the specified qubits."""
+    probs = np.abs(doki_to_np(reg, nq, verbose)[:, 0])**2
+    marginal = np.zeros(2**len(qubits))
+    for i in range(2**nq):
+        outcome = sum(((i >> q) & 1) << j for j, q in enumerate(qubits))
+        marginal[outcome] += probs[i]
+    return marginal
+
+
+def test_sample(nq, shots, num_threads, prng, verbose):
+    """Compare the frequencies of the samples with the probabilities."""
+    reg = random_registry(nq, num_threads, prng, verbose)
+    for _ in range(4):
+        qubits = sorted(int(q) for q in prng.permutation(nq)[
+            :int(prng.integers(1, nq + 1))])
+        mask = sum(1 << q for q in qubits)
+        seed = int(prng.integers(2**63))
+        samples = doki.registry_sample(reg, mask, shots, seed, num_threads,
+                                       verbose)
+        if samples.shape != (shots,) or samples.dtype != np.int64:
+            error("Wrong sample array", fatal=True)
+        serial = doki.registry_sample(reg, mask, shots, seed, 1, verbose)
+        if not np.array_equal(samples, serial):
+            error("Samples depend on the number of threads", fatal=True)
+        marginal = expected_marginal(reg, nq, qubits, verbose)
+        freqs = np.bincount(samples, minlength=len(marginal)) / shots
+        sigma = np.sqrt(np.clip(marginal * (1 - marginal), 0, None) / shots)
+        if len(freqs) != len(marginal) \
+                or np.any(freqs[marginal == 0] != 0) \
+                or np.any(np.abs(freqs - marginal) > 6 * sigma + 3 / shots):
+            debug("qubits:", qubits)
+            debug("frequencies:", freqs)
+            debug("expected:", marginal)
+            error("Sample frequencies do not match the probabilities",
+                  fatal=True)
+    doki.registry_del(reg, verbose)
+
+
+def main(min_qubits, max_qubits, shots, num_threads, prng, verbose):
+    """Execute all tests."""
+    a = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        test_sample(nq, shots, num_threads, prng, verbose)
+    b = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {b - a}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="SampleTests",
+                                     description="Checks that samples follow the measurement probabilities")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-i", "--shots", type=int, default=100000, help="the number of samples to draw")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    args = parser.parse_args()
+
+    print("Sample tests:")
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.shots, args.num_threads,
+         prng, args.verbose)
@@ -0,0 +1,156 @@
+"""Sharded registry tests."""
+import argparse
+import doki as doki
+import numpy as np
+import time as t
+
+from one_gate_tests import U_doki
+from reg_creation_tests import doki_to_np
+from timed_test import debug, error, init_args
+
+
+def random_unitary(nq, prng):
+    """Return a random unitary matrix of nq qubits."""
+    size = 2**nq
+    m = prng.random((size, size)) + 1j * prng.random((size, size))
+    q, r = np.linalg.qr(m)
+    return q * (np.diag(r) / np.abs(np.diag(r)))
+
+
+def shard_to_np(sreg, nq, verbose):
+    """Return numpy array with the sharded registry's column vector."""
+    return np.transpose(np.array([doki.registry_shard_get(sreg, i, verbose)
+                                  for i in range(2**nq)], ndmin=2))
+
+
+def check_equal(sreg, reg, nq, num_threads, verbose, msg):
+    """Check that the sharded and regular registries match."""
+    rtol = 0
+    atol = 1e-12
+    d_np = shard_to_np(sreg, nq, verbose)
+    r_np = doki_to_np(reg, nq, verbose)
+    g_reg = doki.registry_shard_gather(sreg, num_threads, verbose)
+    g_np = doki_to_np(g_reg, nq, verbose)
+    if not np.allclose(d_np, r_np, rtol=rtol, atol=atol) \
+            or not np.allclose(g_np, r_np, rtol=rtol, atol=atol):
+        debug("layout:", doki.registry_shard_layout(sreg, verbose))
+        debug("shard:", d_np)
+        debug("gathered:", g_np)
+        debug("expected:", r_np)
+        error(msg, fatal=True)
+
+
+def test_circuit(nq, num_global, num_threads, prng, verbose):
+    """Apply random gates to both registries and compare the results."""
+    sreg = doki.registry_shard_new(nq, num_global, verbose)
+    reg = doki.registry_new(nq, verbose)
+    proj = doki.gate_new(1, [[1, 0], [0, 0.5]], verbose)
+    for step in range(4 * nq):
+        nt = 1
+        if nq - num_global >= 2 and prng.random() < 0.3:
+            nt = 2
+        qubits = [int(q) for q in prng.permutation(nq)]
+        targets = qubits[:nt]
+        rest = qubits[nt:]
+        controls = set(rest[:int(prng.integers(0, min(2, len(rest)) + 1))])
+        rest = rest[len(controls):]
+        anticontrols = set(rest[:int(prng.integers(0, min(1, len(rest))
+                                                    + 1))])
+        if nt == 1 and prng.random() < 0.1:
+            gate = proj
+        elif nt == 1:
+            gate = U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False,
+                          verbose)
+        else:
+            gate = doki.gate_new(nt, random_unitary(nt, prng).tolist(),
+                                 verbose)
+        doki.registry_shard_apply(sreg, gate, targets, controls,
+                                  anticontrols, num_threads, verbose)
+        reg = doki.registry_apply(reg, gate, targets, controls,
+                                  anticontrols, num_threads,
+                                  verbose)
+        check_equal(sreg, reg, nq, num_threads, verbose,
+                    f"Error applying gate at step {step}")
+    for q in range(nq):
+        d_prob = doki.registry_shard_prob(sreg, q, num_threads, verbose)
+        r_prob = doki.registry_prob(reg, q, num_threads, verbose)
+        if not np.allclose(d_prob, r_prob, rtol=0, atol=1e-12):
+            debug("shard:", d_prob)
+            debug("expected:", r_prob)
+            error("Error calculating probability", fatal=True)
+    while nq > 1:
+        q = int(prng.integers(0, nq))
+        roll = prng.random()
+        d_res = doki.registry_shard_measure(sreg, q, roll, num_threads,
+                                            verbose)
+        reg, r_res = doki.registry_measure(reg, 1 << q, [roll], num_threads,
+                                           verbose)
+        nq -= 1
+        if d_res != r_res[nq - q]:
+            error("Different measurement outcome", fatal=True)
+        check_equal(sreg, reg, nq, num_threads, verbose,
+                    f"Error measuring qubit {q}")
+    # Ids are checked against the qubits left after the measurements
+    x = doki.gate_new(1, [[0, 1], [1, 0]], verbose)
+    for call in (lambda: doki.registry_shard_apply(sreg, x, [1], None, None,
+                                                   num_threads, verbose),
+                 lambda: doki.registry_shard_prob(sreg, 1, num_threads,
+                                                  verbose),
+                 lambda: doki.registry_shard_get(sreg, 2, verbose)):
+        try:
+            call()
+            error("Measured qubit accepted", fatal=True)
+        except doki.error:
+            pass
+    doki.registry_shard_measure(sreg, 0, prng.random(), num_threads, verbose)
+    for call in (lambda: doki.registry_shard_prob(sreg, 0, num_threads,
+                                                  verbose),
+                 lambda: doki.registry_shard_gather(sreg, num_threads,
+                                                    verbose),
+                 lambda: doki.registry_shard_layout(sreg, verbose)):
+        try:
+            call()
+            error("Registry without qubits accepted", fatal=True)
+        except doki.error:
+            pass
+
+
+def test_swaps(nq, num_threads, verbose):
+    """Check that global targets end up in local positions."""
+    sreg = doki.registry_shard_new(nq, nq - 1, verbose)
+    x = doki.gate_new(1, [[0, 1], [1, 0]], verbose)
+    doki.registry_shard_apply(sreg, x, [nq - 1], None, None, num_threads,
+                              verbose)
+    shards, layout = doki.registry_shard_layout(sreg, verbose)
+    if shards != 2**(nq - 1) or layout[nq - 1] != 0 or layout[0] != nq - 1:
+        debug("layout:", shards, layout)
+        error("Global target was not swapped", fatal=True)
+    if not np.allclose(doki.registry_shard_get(sreg, 1 << (nq - 1), verbose),
+                       1):
+        error("Wrong value after swapping qubits", fatal=True)
+
+
+def main(min_qubits, max_qubits, num_threads, prng, verbose):
+    """Execute all tests."""
+    a = t.time()
+    for nq in range(max(min_qubits, 2), max_qubits + 1):
+        test_swaps(nq, num_threads, verbose)
+        for num_global in range(nq):
+            test_circuit(nq, num_global, num_threads, prng, verbose)
+    b = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {b - a}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="ShardTests",
+                                     description="Checks that sharded registries behave like regular ones")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    args = parser.parse_args()
+
+    print("Sharded registry tests:")
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.num_threads, prng, args.verbose)
@@ -0,0 +1,134 @@
+"""Shared memory registry tests."""
+import argparse
+import doki as doki
+import multiprocessing as mp
+import numpy as np
+import os
+import time as t
+
+from one_gate_tests import U_doki
+from reg_creation_tests import doki_to_np
+from timed_test import debug, error, init_args
+
+
+def random_registry(nq, num_threads, prng, verbose):
+    """Return a registry with random gates applied to every qubit."""
+    reg = doki.registry_new(nq, verbose)
+    for i in range(nq):
+        gate = U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False, verbose)
+        aux = doki.registry_apply(reg, gate, [i], None, None, num_threads,
+                                  verbose)
+        doki.registry_del(reg, verbose)
+        reg = aux
+    return reg
+
+
+def read_shared(name, nq, num_threads, verbose):
+    """Attach to a shared registry from another process and read it."""
+    reg = doki.registry_attach(name, verbose)
+    state = doki_to_np(reg, nq, verbose)
+    probs = [doki.registry_prob(reg, i, num_threads, verbose)
+             for i in range(nq)]
+    doki.registry_del(reg, verbose)
+    return state, probs
+
+
+def segment_exists(name, verbose):
+    """Check whether a segment can still be attached."""
+    try:
+        doki.registry_del(doki.registry_attach(name, verbose), verbose)
+    except doki.error:
+        return False
+    return True
+
+
+def test_share(nq, workers, num_threads, prng, verbose):
+    """Read a shared registry from several processes."""
+    rtol = 0
+    atol = 1e-13
+    name = f"/doki_test_{os.getpid()}_{nq}"
+    reg = random_registry(nq, num_threads, prng, verbose)
+    shared = doki.registry_share(reg, name, num_threads, verbose)
+    expected = doki_to_np(reg, nq, verbose)
+    expected_probs = [doki.registry_prob(reg, i, num_threads, verbose)
+                      for i in range(nq)]
+    if not np.allclose(doki_to_np(shared, nq, verbose), expected,
+                       rtol=rtol, atol=atol):
+        error("Shared copy differs from the source registry", fatal=True)
+    try:
+        doki.registry_share(reg, name, num_threads, verbose)
+        error("Name clash not detected", fatal=True)
+    except doki.error:
+        pass
+    ctx = mp.get_context("spawn")
+    with ctx.Pool(workers) as pool:
+        results = pool.starmap(read_shared, [(name, nq, num_threads, verbose)
+                                             for _ in range(workers)])
+    for state, probs in results:
+        if not np.allclose(state, expected, rtol=rtol, atol=atol) \
+                or not np.allclose(probs, expected_probs, rtol=rtol,
+                                   atol=atol):
+            debug("obtained:", state, probs)
+            debug("expected:", expected, expected_probs)
+            error("Other process read a different registry", fatal=True)
+    attached = doki.registry_attach(name, verbose)
+    applied = doki.registry_apply(attached, U_doki(np.pi, 0, np.pi, False,
+                                                   verbose),
+                                  [0], None, None, num_threads, verbose)
+    if np.allclose(doki_to_np(applied, nq, verbose),
+                   doki_to_np(attached, nq, verbose)):
+        error("Gate did not create a private copy", fatal=True)
+    if not np.allclose(doki_to_np(attached, nq, verbose), expected,
+                       rtol=rtol, atol=atol):
+        error("Applying a gate modified the shared registry", fatal=True)
+    try:
+        doki.registry_normalize(attached, num_threads, verbose)
+        error("Shared registry normalized in place", fatal=True)
+    except doki.error:
+        pass
+    try:
+        doki.registry_measure_inplace(attached, 1, [0.5], num_threads, verbose)
+        error("Shared registry measured in place", fatal=True)
+    except doki.error:
+        pass
+    try:
+        doki.registry_reset(attached, 1, [0.5], num_threads, verbose)
+        error("Shared registry reset", fatal=True)
+    except doki.error:
+        pass
+    doki.registry_del(shared, verbose)
+    if not segment_exists(name, verbose):
+        error("Segment removed while still attached", fatal=True)
+    doki.registry_del(attached, verbose)
+    if segment_exists(name, verbose):
+        error("Segment not removed after the last detach", fatal=True)
+    doki.registry_del(reg, verbose)
+
+
+def main(min_qubits, max_qubits, workers, num_threads, prng, verbose):
+    """Execute all tests."""
+    if os.name == "nt":
+        print("\tShared memory registries are not supported on Windows")
+        return
+    a = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        test_share(nq, workers, num_threads, prng, verbose)
+    b = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {b - a}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="SharedMemoryTests",
+                                     description="Checks that registries can be read from several processes")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-w", "--workers", type=int, default=2, help="the number of processes to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    args = parser.parse_args()
+
+    print("Shared memory tests:")
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.workers, args.num_threads,
+         prng, args.verbose)
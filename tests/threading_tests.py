@@ -0,0 +1,109 @@
+"""Concurrent use of registries from Python threads."""
+import argparse
+import doki as doki
+import numpy as np
+import time as t
+
+from concurrent.futures import ThreadPoolExecutor
+from one_gate_tests import U_doki
+from reg_creation_tests import doki_to_np
+from timed_test import debug, error, init_args
+
+
+def run_circuit(nq, gates, num_threads, verbose):
+    """Apply the gates to every qubit of a new registry and measure it."""
+    reg = doki.registry_new(nq, verbose)
+    for i in range(nq):
+        aux = doki.registry_apply(reg, gates[i], [i], None, None,
+                                  num_threads, verbose)
+        doki.registry_del(reg, verbose)
+        reg = aux
+    probs = [doki.registry_prob(reg, i, num_threads, verbose)
+             for i in range(nq)]
+    one = doki.registry_new(1, verbose)
+    joined = doki.registry_join(reg, one, num_threads, verbose)
+    _, mes = doki.registry_measure(joined, 1 | (1 << nq), [0.5, 0.5],
+                                   num_threads, verbose)
+    state = doki_to_np(reg, nq, verbose)
+    doki.registry_del(reg, verbose)
+    return state, probs, mes
+
+
+def test_independent(nq, workers, num_threads, prng, verbose):
+    """Run independent registries from a thread pool."""
+    rtol = 0
+    atol = 1e-13
+    circuits = [[U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False, verbose)
+                 for _ in range(nq)] for _ in range(2 * workers)]
+    expected = [run_circuit(nq, c, num_threads, verbose) for c in circuits]
+    with ThreadPoolExecutor(max_workers=workers) as pool:
+        obtained = list(pool.map(lambda c: run_circuit(nq, c, num_threads,
+                                                       verbose), circuits))
+    for exp, obt in zip(expected, obtained):
+        if not np.allclose(exp[0], obt[0], rtol=rtol, atol=atol) \
+                or not np.allclose(exp[1], obt[1], rtol=rtol, atol=atol) \
+                or exp[2] != obt[2]:
+            debug("expected:", exp)
+            debug("obtained:", obt)
+            error("Threaded execution differs from sequential one",
+                  fatal=True)
+
+
+def test_shared(nq, workers, num_threads, prng, verbose):
+    """Use the same registry from several threads at once."""
+    rtol = 0
+    atol = 1e-13
+    gate = U_doki(*(np.pi * (prng.random(3) * 2 - 1)), False, verbose)
+    reg = doki.registry_new(nq, verbose)
+    for i in range(nq):
+        reg = doki.registry_apply(reg, gate, [i], None, None, num_threads,
+                                  verbose)
+    expected = doki_to_np(reg, nq, verbose)
+    expected_can = np.array([doki.registry_get(reg, i, True, verbose)
+                             for i in range(2**nq)])
+
+    def work(k):
+        if k % 3 == 0:
+            doki.registry_normalize(reg, num_threads, verbose)
+            return expected, doki_to_np(reg, nq, verbose)
+        elif k % 3 == 1:
+            aux = doki.registry_clone(reg, num_threads, verbose)
+            return expected, doki_to_np(aux, nq, verbose)
+        return expected_can, np.array([doki.registry_get(reg, i, True,
+                                                         verbose)
+                                       for i in range(2**nq)])
+
+    with ThreadPoolExecutor(max_workers=workers) as pool:
+        results = list(pool.map(work, range(6 * workers)))
+    for exp, res in results:
+        if not np.allclose(res, exp, rtol=rtol, atol=atol):
+            debug("expected:", exp)
+            debug("obtained:", res)
+            error("Concurrent use of a registry changed it", fatal=True)
+    doki.registry_del(reg, verbose)
+
+
+def main(min_qubits, max_qubits, workers, num_threads, prng, verbose):
+    """Execute all tests."""
+    a = t.time()
+    for nq in range(min_qubits, max_qubits + 1):
+        test_independent(nq, workers, num_threads, prng, verbose)
+        test_shared(nq, workers, num_threads, prng, verbose)
+    b = t.time()
+    print(f"\tPEACE AND TRANQUILITY: {b - a}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog="ThreadingTests",
+                                     description="Checks that registries can be used from several Python threads")
+    parser.add_argument("-v", "--verbose", action="store_true", default=False, help="whether to print extra information or not")
+    parser.add_argument("-n", "--num_qubits", type=int, required=True, help="the starting number of qubits to use")
+    parser.add_argument("-m", "--max_qubits", type=int, default=None, help="the max number of qubits to use")
+    parser.add_argument("-w", "--workers", type=int, default=4, help="the number of Python threads to use")
+    parser.add_argument("-t", "--num_threads", type=int, default=None, help="the number of OpenMP threads to use")
+    parser.add_argument("-s", "--seed", type=int, default=None, help="sets the seed to use")
+    args = parser.parse_args()
+
+    print("Threading tests:")
+    prng = init_args(args)
+    main(args.num_qubits, args.max_qubits, args.workers, args.num_threads, prng, args.verbose)